@@ -0,0 +1,411 @@
+/* In-process Y86-64 assembler */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "isa.h"
+#include "asm.h"
+
+/* Longest label or instruction name */
+#define MAXNAME 256
+
+/* Kinds of token */
+typedef enum { T_END, T_NAME, T_REG, T_NUM, T_PUNCT, T_ERR } tok_t;
+
+/* Assembler state.  The source is read twice: the first pass checks
+   syntax and finds the address of each label, and the second writes
+   the code into memory */
+typedef struct {
+    mem_t m;
+    int pass;
+    bool_t report_error;
+    bool_t error;
+    /* Current line */
+    const char *line;
+    int lineno;
+    const char *p;          /* Next character to scan */
+    /* Current token */
+    tok_t tok;
+    char name[MAXNAME];
+    word_t val;             /* Number or register ID */
+    char punct;
+    /* Labels.  Sorted by name after the first pass */
+    symbol_t syms;
+    int nsyms;
+    int maxsyms;
+    word_t addr;            /* Address of next instruction */
+    int byte_cnt;
+} asm_rec, *asm_t;
+
+/* Report error on current line, in the words yas uses.  A token yas
+   could not scan is an invalid line whatever was expected.  Always
+   returns FALSE */
+static bool_t asm_error(asm_t a, char *msg)
+{
+    if (a->tok == T_ERR)
+	msg = "Invalid line";
+    if (a->report_error) {
+	int len = strcspn(a->line, "\n");
+	fprintf(stderr, "Error on line %d: %s\n", a->lineno, msg);
+	fprintf(stderr, "Line %d, Byte 0x%.4llx: %.*s\n",
+		a->lineno, a->addr, len, a->line);
+    }
+    a->error = TRUE;
+    return FALSE;
+}
+
+static bool_t name_char(char c)
+{
+    return isalnum((int)c) || c == '_' || c == '.';
+}
+
+/* Scan next token of current line */
+static void next_token(asm_t a)
+{
+    const char *p = a->p;
+    int len = 0;
+    /* As in yas, '$' before an immediate is optional */
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '$')
+	p++;
+    if (*p == '\0' || *p == '\n' || *p == '#' ||
+	(p[0] == '/' && (p[1] == '/' || p[1] == '*'))) {
+	a->tok = T_END;
+    } else if (*p == '%') {
+	a->name[len++] = *p++;
+	while (isalnum((int)*p) && len < MAXNAME-1)
+	    a->name[len++] = *p++;
+	a->name[len] = '\0';
+	a->val = find_register(a->name);
+	a->tok = a->val == REG_ERR ? T_ERR : T_REG;
+    } else if (isdigit((int)*p) || (*p == '-' && isdigit((int)p[1]))) {
+	bool_t neg = *p == '-';
+	bool_t hex;
+	char *end;
+	if (neg)
+	    p++;
+	hex = p[0] == '0' && (p[1] == 'x' || p[1] == 'X');
+	if (hex)
+	    a->val = (word_t) strtoull(p+2, &end, 16);
+	else
+	    a->val = (word_t) strtoull(p, &end, 10);
+	if (neg)
+	    a->val = -a->val;
+	/* "0x" needs digits */
+	a->tok = name_char(*end) || (hex && end == p+2) ? T_ERR : T_NUM;
+	p = end;
+    } else if (isalpha((int)*p) || *p == '_' || *p == '.') {
+	while (name_char(*p) && len < MAXNAME-1)
+	    a->name[len++] = *p++;
+	a->name[len] = '\0';
+	a->tok = name_char(*p) ? T_ERR : T_NAME;
+    } else if (*p == '(' || *p == ')' || *p == ':' || *p == ',') {
+	a->punct = *p++;
+	a->tok = T_PUNCT;
+    } else {
+	a->tok = T_ERR;
+    }
+    a->p = p;
+}
+
+static void add_label(asm_t a, char *name)
+{
+    if (a->nsyms == a->maxsyms) {
+	a->maxsyms = a->maxsyms ? 2 * a->maxsyms : 16;
+	a->syms = (symbol_t) realloc(a->syms, a->maxsyms * sizeof(symbol_rec));
+    }
+    a->syms[a->nsyms].addr = a->addr;
+    a->syms[a->nsyms].name = strdup(name);
+    a->nsyms++;
+}
+
+static int name_compare(const void *a, const void *b)
+{
+    return strcmp(((symbol_t) a)->name, ((symbol_t) b)->name);
+}
+
+static int addr_compare(const void *a, const void *b)
+{
+    symbol_t sa = (symbol_t) a;
+    symbol_t sb = (symbol_t) b;
+    if (sa->addr != sb->addr)
+	return sa->addr < sb->addr ? -1 : 1;
+    return strcmp(sa->name, sb->name);
+}
+
+/* Get number or label value, and move past it.  Labels are only
+   known on the second pass, and read as 0 before then */
+static bool_t get_value(asm_t a, word_t *valp)
+{
+    if (a->tok == T_NUM) {
+	*valp = a->val;
+    } else if (a->tok == T_NAME) {
+	symbol_rec key;
+	symbol_t sym;
+	*valp = 0;
+	if (a->pass == 2) {
+	    key.name = a->name;
+	    sym = (symbol_t) bsearch(&key, a->syms, a->nsyms,
+				     sizeof(symbol_rec), name_compare);
+	    if (!sym)
+		return asm_error(a, "Can't find label");
+	    *valp = sym->addr;
+	}
+    } else {
+	return asm_error(a, "Number Expected");
+    }
+    next_token(a);
+    return TRUE;
+}
+
+static bool_t get_reg(asm_t a, byte_t *regp)
+{
+    if (a->tok != T_REG)
+	return asm_error(a, "Expecting Register ID");
+    *regp = (byte_t) a->val;
+    next_token(a);
+    return TRUE;
+}
+
+static bool_t get_punct(asm_t a, char c)
+{
+    char msg[20];
+    if (a->tok != T_PUNCT || a->punct != c) {
+	if (c == ',')
+	    strcpy(msg, "Expecting Comma");
+	else
+	    sprintf(msg, "Expecting '%c'", c);
+	return asm_error(a, msg);
+    }
+    next_token(a);
+    return TRUE;
+}
+
+/* Put register in high or low half of byte */
+static void put_reg(byte_t *b, int hi, byte_t reg)
+{
+    if (hi)
+	*b = (*b & 0x0F) | (reg << 4);
+    else
+	*b = (*b & 0xF0) | (reg & 0xF);
+}
+
+/* Put low len bytes of val at b, little-endian */
+static void put_bytes(byte_t *b, int len, word_t val)
+{
+    int i;
+    for (i = 0; i < len; i++) {
+	b[i] = val & 0xFF;
+	val >>= 8;
+    }
+}
+
+/* Parse argument of type arg and encode it in code */
+static bool_t get_arg(asm_t a, arg_t arg, int pos, int hi, byte_t *code)
+{
+    byte_t reg = REG_NONE;
+    word_t val = 0;
+    switch (arg) {
+    case R_ARG:
+	if (!get_reg(a, &reg))
+	    return FALSE;
+	put_reg(&code[pos], hi, reg);
+	break;
+    case I_ARG:
+	if (!get_value(a, &val))
+	    return FALSE;
+	put_bytes(&code[pos], hi, val);
+	break;
+    case M_ARG:
+	/* Displacement is optional */
+	if (a->tok == T_NUM || a->tok == T_NAME)
+	    if (!get_value(a, &val))
+		return FALSE;
+	if (!get_punct(a, '(') || !get_reg(a, &reg) || !get_punct(a, ')'))
+	    return FALSE;
+	put_reg(&code[pos], hi, reg);
+	put_bytes(&code[pos+1], 8, val);
+	break;
+    default:
+	break;
+    }
+    return TRUE;
+}
+
+/* Assemble instruction or directive named name, whose first operand
+   is the current token.  labeled says whether a label came before it */
+static bool_t do_instr(asm_t a, char *name, bool_t labeled)
+{
+    byte_t code[MAX_INSTR_LEN];
+    instr_ptr instr;
+    word_t val;
+    int i;
+
+    if (!strcmp(name, ".pos") || !strcmp(name, ".align")) {
+	/* Operand must be a number, so that the first pass knows it */
+	bool_t pos = name[1] == 'p';
+	if (a->tok != T_NUM)
+	    return asm_error(a, pos ? "Invalid Address" : "Invalid Alignment");
+	val = a->val;
+	next_token(a);
+	if (pos) {
+	    a->addr = val;
+	} else {
+	    if (val <= 0)
+		return asm_error(a, "Invalid Alignment");
+	    a->addr = (a->addr + val - 1) / val * val;
+	}
+	return a->tok == T_END || asm_error(a, "Expecting end of line");
+    }
+
+    instr = find_instr(name);
+    /* Table entries with no bytes are not real instructions */
+    if (!instr || instr->bytes == 0)
+	/* yas takes an unknown name at the start of a line for a label */
+	return asm_error(a, labeled ? "Bad Instruction" : "Missing Colon");
+    memset(code, 0, sizeof(code));
+    code[0] = instr->code;
+    /* Unused register fields are F */
+    if (instr->arg1 == R_ARG || instr->arg1 == M_ARG ||
+	instr->arg2 == R_ARG || instr->arg2 == M_ARG)
+	code[1] = HPACK(REG_NONE, REG_NONE);
+    if (instr->arg1 != NO_ARG &&
+	!get_arg(a, instr->arg1, instr->arg1pos, instr->arg1hi, code))
+	return FALSE;
+    if (instr->arg2 != NO_ARG &&
+	(!get_punct(a, ',') ||
+	 !get_arg(a, instr->arg2, instr->arg2pos, instr->arg2hi, code)))
+	return FALSE;
+    if (a->tok != T_END)
+	return asm_error(a, "Expecting end of line");
+
+    if (a->pass == 2) {
+	for (i = 0; i < instr->bytes; i++) {
+	    word_t pos = a->addr + i;
+	    if ((unsigned long long) pos >= (unsigned long long) a->m->len)
+		return asm_error(a, "Invalid Address");
+	    write_page(a->m, pos >> MEM_PAGE_BITS)->
+		data[pos & MEM_PAGE_MASK] = code[i];
+	}
+	a->byte_cnt += instr->bytes;
+    }
+    a->addr += instr->bytes;
+    return TRUE;
+}
+
+/* Assemble current line */
+static bool_t do_line(asm_t a)
+{
+    char name[MAXNAME];
+    bool_t labeled = FALSE;
+
+    next_token(a);
+    if (a->tok == T_END)
+	return TRUE;
+    if (a->tok != T_NAME)
+	return asm_error(a, "Bad Instruction");
+    strcpy(name, a->name);
+    next_token(a);
+    if (a->tok == T_PUNCT && a->punct == ':') {
+	if (a->pass == 1)
+	    add_label(a, name);
+	labeled = TRUE;
+	next_token(a);
+	if (a->tok == T_END)
+	    return TRUE;
+	if (a->tok != T_NAME)
+	    return asm_error(a, "Bad Instruction");
+	strcpy(name, a->name);
+	next_token(a);
+    }
+    return do_instr(a, name, labeled);
+}
+
+int assemble(mem_t m, const char *src, image_t img, int report_error)
+{
+    asm_rec a;
+    const char *next;
+    int i;
+
+    memset(&a, 0, sizeof(a));
+    a.m = m;
+    a.report_error = report_error;
+    /* Writes by assembler are not tracked */
+    m->base = 0;
+    if (img) {
+	img->entry = 0;
+	img->nsyms = 0;
+	img->syms = NULL;
+    }
+
+    for (a.pass = 1; a.pass <= 2 && !a.error; a.pass++) {
+	if (a.pass == 2) {
+	    qsort(a.syms, a.nsyms, sizeof(symbol_rec), name_compare);
+	    for (i = 1; i < a.nsyms; i++)
+		if (!strcmp(a.syms[i-1].name, a.syms[i].name)) {
+		    if (report_error)
+			fprintf(stderr, "Error: Label '%s' defined twice\n",
+				a.syms[i].name);
+		    a.error = TRUE;
+		}
+	    if (a.error)
+		break;
+	}
+	a.addr = 0;
+	a.lineno = 0;
+	for (a.line = src; *a.line; a.line = next) {
+	    next = strchr(a.line, '\n');
+	    next = next ? next + 1 : a.line + strlen(a.line);
+	    a.lineno++;
+	    a.p = a.line;
+	    do_line(&a);
+	}
+    }
+    icache_flush(m);
+
+    if (img && !a.error) {
+	qsort(a.syms, a.nsyms, sizeof(symbol_rec), addr_compare);
+	img->syms = a.syms;
+	img->nsyms = a.nsyms;
+    } else {
+	for (i = 0; i < a.nsyms; i++)
+	    free((void *) a.syms[i].name);
+	free((void *) a.syms);
+    }
+    return a.error ? 0 : a.byte_cnt;
+}
+
+int assemble_file(mem_t m, FILE *infile, image_t img, int report_error)
+{
+    size_t max = 1<<16;
+    size_t size = 0;
+    size_t n;
+    char *buf = (char *) malloc(max);
+    int byte_cnt;
+    while ((n = fread(buf + size, 1, max - size - 1, infile)) > 0) {
+	size += n;
+	if (size == max - 1) {
+	    max *= 2;
+	    buf = (char *) realloc(buf, max);
+	}
+    }
+    buf[size] = '\0';
+    byte_cnt = assemble(m, buf, img, report_error);
+    free((void *) buf);
+    return byte_cnt;
+}
+
+bool_t is_source_file(char *fname)
+{
+    size_t len = strlen(fname);
+    return len > 3 && !strcmp(fname + len - 3, ".ys");
+}
+
+int load_program(mem_t m, FILE *infile, char *fname, image_t img,
+		 int report_error)
+{
+    if (fname && is_source_file(fname))
+	return assemble_file(m, infile, img, report_error);
+    return load_image(m, infile, img, report_error);
+}
@@ -0,0 +1,28 @@
+/* In-process Y86-64 assembler */
+
+/*
+ * Accepts the same source language as yas: one instruction or
+ * directive per line, optionally preceded by a label.  Comments run
+ * from #, // or a C comment opener to the end of the line.  Directives
+ * are .pos, .align, .byte, .word, .long and .quad.  Immediates and
+ * displacements may be numbers or labels.  The program is written
+ * straight into a simulator memory, so no .yo file or yas process is
+ * needed.
+ */
+
+/* Assemble source text src into memory m.  If img is non-NULL, set
+   entry point to 0 and symbols to the labels defined in src.
+   Return number of bytes written, or 0 if there was an error */
+int assemble(mem_t m, const char *src, image_t img, int report_error);
+
+/* Same, reading source text from infile */
+int assemble_file(mem_t m, FILE *infile, image_t img, int report_error);
+
+/* Is fname a Y86-64 source file (.ys)? */
+bool_t is_source_file(char *fname);
+
+/* Load program from infile, assembling it if fname names a source
+   file and otherwise loading it as with load_image.  fname may be NULL
+   when infile has no name.  Return number of bytes read */
+int load_program(mem_t m, FILE *infile, char *fname, image_t img,
+		 int report_error);
@@ -0,0 +1,263 @@
+/* Running many Y86-64 programs in one process */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "isa.h"
+#include "batch.h"
+#include "asm.h"
+
+/* Jobs [head, tail) not yet started by one worker */
+typedef struct {
+    pthread_mutex_t lock;
+    int head;
+    int tail;
+} deque_rec, *deque_t;
+
+typedef struct {
+    batch_job_t jobs;
+    deque_t deques;
+    int nthreads;
+    batch_fun_t fun;
+    void *arg;
+} pool_rec, *pool_t;
+
+typedef struct {
+    pool_t pool;
+    int id;
+} worker_rec, *worker_t;
+
+static bool_t has_suffix(char *name, char *suffix)
+{
+    int n = strlen(name);
+    int k = strlen(suffix);
+    return n > k && !strcmp(name + n - k, suffix);
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char **) a, *(char **) b);
+}
+
+/* Append name to growing array */
+static void add_name(char ***namesp, int *countp, int *sizep, char *name)
+{
+    if (*countp == *sizep) {
+	*sizep = *sizep ? 2 * *sizep : 64;
+	*namesp = (char **) realloc(*namesp, *sizep * sizeof(char *));
+    }
+    (*namesp)[(*countp)++] = name;
+}
+
+int batch_collect(int nnames, char *names[], batch_job_t *jobsp)
+{
+    char **files = NULL;
+    int count = 0, size = 0;
+    batch_job_t jobs;
+    int i;
+
+    for (i = 0; i < nnames; i++) {
+	struct stat sb;
+	DIR *dir;
+	struct dirent *de;
+	int first = count;
+	if (stat(names[i], &sb) || !S_ISDIR(sb.st_mode) ||
+	    !(dir = opendir(names[i]))) {
+	    add_name(&files, &count, &size, strdup(names[i]));
+	    continue;
+	}
+	while ((de = readdir(dir)) != NULL) {
+	    char *path;
+	    if (!has_suffix(de->d_name, ".yo") && !has_suffix(de->d_name, ".ybo") &&
+		!has_suffix(de->d_name, ".ys"))
+		continue;
+	    path = (char *) malloc(strlen(names[i]) + strlen(de->d_name) + 2);
+	    sprintf(path, "%s/%s", names[i], de->d_name);
+	    add_name(&files, &count, &size, path);
+	}
+	closedir(dir);
+	/* Directory order is arbitrary */
+	qsort(files + first, count - first, sizeof(char *), compare_names);
+    }
+
+    jobs = (batch_job_t) calloc(count ? count : 1, sizeof(batch_job_rec));
+    for (i = 0; i < count; i++) {
+	jobs[i].name = files[i];
+	jobs[i].status = STAT_AOK;
+    }
+    free((void *) files);
+    *jobsp = jobs;
+    return count;
+}
+
+void batch_free(batch_job_t jobs, int njobs)
+{
+    int i;
+    for (i = 0; i < njobs; i++)
+	free((void *) jobs[i].name);
+    free((void *) jobs);
+}
+
+int batch_default_threads()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int) n : 1;
+}
+
+bool_t batch_load(state_ptr s, char *name)
+{
+    image_rec img;
+    FILE *f = fopen(name, "r");
+    int ok;
+    if (!f)
+	return FALSE;
+    ok = load_program(s->m, f, name, &img, 0);
+    fclose(f);
+    if (!ok)
+	return FALSE;
+    s->pc = img.entry;
+    free_image(&img);
+    return TRUE;
+}
+
+/* Take job from front of own deque.  Return -1 if empty */
+static int take_own(deque_t d)
+{
+    int j = -1;
+    pthread_mutex_lock(&d->lock);
+    if (d->head < d->tail)
+	j = d->head++;
+    pthread_mutex_unlock(&d->lock);
+    return j;
+}
+
+/* Take job from back of another deque.  Return -1 if empty */
+static int steal(deque_t d)
+{
+    int j = -1;
+    pthread_mutex_lock(&d->lock);
+    if (d->head < d->tail)
+	j = --d->tail;
+    pthread_mutex_unlock(&d->lock);
+    return j;
+}
+
+static void *worker(void *arg)
+{
+    worker_t w = (worker_t) arg;
+    pool_t p = w->pool;
+    int j, i;
+    for (;;) {
+	j = take_own(&p->deques[w->id]);
+	/* Look for work elsewhere, starting with next worker */
+	for (i = 1; j < 0 && i < p->nthreads; i++)
+	    j = steal(&p->deques[(w->id + i) % p->nthreads]);
+	if (j < 0)
+	    break;
+	p->fun(&p->jobs[j], p->arg);
+    }
+    return NULL;
+}
+
+void batch_run(batch_job_t jobs, int njobs, int nthreads,
+	       batch_fun_t fun, void *arg)
+{
+    pool_rec pool;
+    worker_t workers;
+    pthread_t *threads;
+    int i;
+
+    if (nthreads > njobs)
+	nthreads = njobs;
+    if (nthreads < 1)
+	nthreads = 1;
+    pool.jobs = jobs;
+    pool.nthreads = nthreads;
+    pool.fun = fun;
+    pool.arg = arg;
+    pool.deques = (deque_t) malloc(nthreads * sizeof(deque_rec));
+    workers = (worker_t) malloc(nthreads * sizeof(worker_rec));
+    threads = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+
+    /* Give each worker a contiguous share of the jobs */
+    for (i = 0; i < nthreads; i++) {
+	pthread_mutex_init(&pool.deques[i].lock, NULL);
+	pool.deques[i].head = (long) njobs * i / nthreads;
+	pool.deques[i].tail = (long) njobs * (i + 1) / nthreads;
+	workers[i].pool = &pool;
+	workers[i].id = i;
+    }
+    /* Calling thread acts as worker 0 */
+    for (i = 1; i < nthreads; i++)
+	pthread_create(&threads[i], NULL, worker, &workers[i]);
+    worker(&workers[0]);
+    for (i = 1; i < nthreads; i++)
+	pthread_join(threads[i], NULL);
+
+    for (i = 0; i < nthreads; i++)
+	pthread_mutex_destroy(&pool.deques[i].lock);
+    free((void *) pool.deques);
+    free((void *) workers);
+    free((void *) threads);
+}
+
+void batch_report(FILE *outfile, batch_job_t jobs, int njobs, double secs)
+{
+    int counts[STAT_PIP+1];
+    int errors = 0;
+    word_t instr = 0, cycles = 0;
+    int width = 4;
+    bool_t timed = FALSE;
+    int i;
+
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < njobs; i++) {
+	if (strlen(jobs[i].name) > (size_t) width)
+	    width = strlen(jobs[i].name);
+	if (jobs[i].cycles > 0)
+	    timed = TRUE;
+    }
+
+    /* Cycle columns only for simulators with a timing model */
+    fprintf(outfile, "%-*s  %-6s %12s", width, "File", "Status", "Instructions");
+    if (timed)
+	fprintf(outfile, " %12s %6s", "Cycles", "CPI");
+    fprintf(outfile, "\n");
+    for (i = 0; i < njobs; i++) {
+	batch_job_t j = &jobs[i];
+	if (!j->loaded) {
+	    fprintf(outfile, "%-*s  LOAD\n", width, j->name);
+	    errors++;
+	    continue;
+	}
+	counts[j->status]++;
+	instr += j->instructions;
+	cycles += j->cycles;
+	fprintf(outfile, "%-*s  %-6s %12lld", width, j->name,
+		stat_name(j->status), j->instructions);
+	if (!timed)
+	    fprintf(outfile, "\n");
+	else if (j->cycles > 0 && j->instructions > 0)
+	    fprintf(outfile, " %12lld %6.2f\n", j->cycles,
+		    (double) j->cycles / j->instructions);
+	else
+	    fprintf(outfile, " %12s %6s\n", "-", "-");
+    }
+
+    fprintf(outfile, "\n%d programs:", njobs);
+    for (i = STAT_AOK; i <= STAT_PIP; i++)
+	if (counts[i])
+	    fprintf(outfile, " %d %s", counts[i], stat_name((stat_t) i));
+    if (errors)
+	fprintf(outfile, " %d LOAD", errors);
+    fprintf(outfile, "\nInstructions: %lld\n", instr);
+    if (cycles > 0)
+	fprintf(outfile, "Cycles:       %lld (CPI %.2f)\n", cycles,
+		instr > 0 ? (double) cycles / instr : 0.0);
+    fprintf(outfile, "Time:         %.3f s\n", secs);
+}
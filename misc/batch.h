@@ -0,0 +1,40 @@
+/* Running many Y86-64 programs in one process */
+
+/*
+ * A batch is an array of jobs, one per object file.  batch_run hands
+ * them to a pool of worker threads.  Each worker owns a deque of jobs,
+ * taking work from its front and, when empty, stealing from the back
+ * of another worker's deque.  The function run for each job must only
+ * touch state reachable from the job and its own locals.
+ */
+
+typedef struct {
+    char *name;
+    bool_t loaded;         /* FALSE if file could not be loaded */
+    stat_t status;
+    word_t instructions;
+    word_t cycles;         /* 0 when the simulator has no timing model */
+} batch_job_rec, *batch_job_t;
+
+/* Simulate one job, filling in its results */
+typedef void (*batch_fun_t)(batch_job_t job, void *arg);
+
+/* Build job list from file names, replacing each directory by the
+   .yo, .ybo and .ys files it contains.  Set *jobsp and return job count */
+int batch_collect(int nnames, char *names[], batch_job_t *jobsp);
+void batch_free(batch_job_t jobs, int njobs);
+
+/* Number of threads to use when not specified */
+int batch_default_threads();
+
+/* Run fun on every job using nthreads threads */
+void batch_run(batch_job_t jobs, int njobs, int nthreads,
+	       batch_fun_t fun, void *arg);
+
+/* Print table of results, one line per job, then totals.  Cycles and
+   CPI are shown only when some job has a cycle count */
+void batch_report(FILE *outfile, batch_job_t jobs, int njobs, double secs);
+
+/* Load object or image file into state and set its PC.
+   Return FALSE if that fails */
+bool_t batch_load(state_ptr s, char *name);
@@ -0,0 +1,524 @@
+/* Basic block translation engine for Y86-64 ISA simulator */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "isa.h"
+#include "block.h"
+#include "jit.h"
+
+/* Number of buckets in block hash table.  Must be power of 2 */
+#define BLOCK_HASH 1024
+
+typedef struct block_rec {
+    word_t pc;       /* Address of first instruction */
+    int ninstr;      /* Number of instructions in block */
+    int nops;        /* Number of operations */
+    int count;       /* Times executed before compilation */
+    jit_fn native;   /* Compiled code, if any */
+    struct block_rec *hnext;    /* Next block in hash bucket */
+    struct block_rec *succ[2];  /* Chained successors (taken, not taken) */
+    bop_rec ops[];
+} block_rec, *block_ptr;
+
+/* Merge newly translated operation into previous one when possible */
+static bool_t fuse(bop_ptr prev, bop_ptr op)
+{
+    if (prev->op == B_SUBQ && (op->op == B_JXX || op->op == B_JMP)) {
+	prev->op = B_SUBQ_JXX;
+	prev->fun = op->fun;
+	prev->valc = op->valc;
+    } else if (prev->op == B_IRMOVQ && op->op == B_ADDQ) {
+	prev->op = B_IRMOVQ_ADDQ;
+	prev->ra2 = op->ra;
+	prev->rb2 = op->rb;
+    } else if (prev->op == B_MRMOVQ &&
+	       (op->op == B_ADDQ || op->op == B_SUBQ ||
+		op->op == B_ANDQ || op->op == B_XORQ)) {
+	prev->op = B_MRMOVQ_ALU;
+	prev->fun = op->fun;
+	prev->ra2 = op->ra;
+	prev->rb2 = op->rb;
+    } else
+	return FALSE;
+    prev->valp = op->valp;
+    return TRUE;
+}
+
+/* Mark operations whose condition codes can be seen: at an exit from
+   the block, or by a conditional operation, before another operation
+   sets them.  Only those need to compute them */
+static void cc_liveness(bop_ptr ops, int nops)
+{
+    bool_t live = TRUE;
+    int i;
+    for (i = nops-1; i >= 0; i--) {
+	switch (ops[i].op) {
+	case B_ADDQ:
+	case B_SUBQ:
+	case B_ANDQ:
+	case B_XORQ:
+	case B_IADDQ:
+	case B_IRMOVQ_ADDQ:
+	    ops[i].setcc = live;
+	    live = FALSE;
+	    break;
+	case B_MRMOVQ_ALU:
+	    /* Load can exit before codes are set */
+	    ops[i].setcc = live;
+	    live = TRUE;
+	    break;
+	case B_SUBQ_JXX:
+	case B_ALU:
+	    ops[i].setcc = TRUE;
+	    live = FALSE;
+	    break;
+	case B_RRMOVQ:
+	case B_IRMOVQ:
+	    ops[i].setcc = FALSE;
+	    break;
+	default:
+	    ops[i].setcc = FALSE;
+	    live = TRUE;
+	    break;
+	}
+    }
+}
+
+/* Translate block starting at pc */
+static block_ptr translate(mem_t m, word_t pc)
+{
+    bop_rec ops[MAX_BLOCK+1];
+    int nops = 0;
+    int n = 0;
+    bool_t done = FALSE;
+    block_ptr b;
+
+    while (!done) {
+	dinstr_rec d;
+	bop_ptr op = &ops[nops];
+	op->idx = n;
+	op->pc = op->valp = pc;
+	if (n == MAX_BLOCK) {
+	    op->op = B_FALL;
+	    nops++;
+	    break;
+	}
+	if (!decode_instr(m, pc, &d) || !d.legal) {
+	    op->op = B_SLOW;
+	    nops++;
+	    break;
+	}
+	op->fun = d.ifun;
+	op->ra = d.ra;
+	op->rb = d.rb;
+	op->valc = d.valc;
+	op->valp = d.valp;
+	switch (d.icode) {
+	case I_NOP:
+	    n++;
+	    pc = d.valp;
+	    continue;
+	case I_HALT:
+	    op->op = B_HALT;
+	    done = TRUE;
+	    break;
+	case I_RRMOVQ:
+	    op->op = d.ifun == C_YES ? B_RRMOVQ : B_CMOVXX;
+	    break;
+	case I_IRMOVQ:
+	    op->op = B_IRMOVQ;
+	    break;
+	case I_RMMOVQ:
+	    op->op = B_RMMOVQ;
+	    break;
+	case I_MRMOVQ:
+	    op->op = B_MRMOVQ;
+	    break;
+	case I_ALU:
+	    switch (d.ifun) {
+	    case A_ADD: op->op = B_ADDQ; break;
+	    case A_SUB: op->op = B_SUBQ; break;
+	    case A_AND: op->op = B_ANDQ; break;
+	    case A_XOR: op->op = B_XORQ; break;
+	    default:    op->op = B_ALU; break;
+	    }
+	    break;
+	case I_IADDQ:
+	    op->op = B_IADDQ;
+	    break;
+	case I_PUSHQ:
+	    op->op = B_PUSHQ;
+	    break;
+	case I_POPQ:
+	    op->op = B_POPQ;
+	    break;
+	case I_JMP:
+	    op->op = d.ifun == C_YES ? B_JMP : B_JXX;
+	    done = TRUE;
+	    break;
+	case I_CALL:
+	    op->op = B_CALL;
+	    done = TRUE;
+	    break;
+	case I_RET:
+	    op->op = B_RET;
+	    done = TRUE;
+	    break;
+	default:
+	    /* Not legal.  Already handled above */
+	    op->op = B_SLOW;
+	    done = TRUE;
+	    break;
+	}
+	n++;
+	pc = d.valp;
+	if (!(nops > 0 && fuse(&ops[nops-1], op)))
+	    nops++;
+    }
+
+    cc_liveness(ops, nops);
+    b = (block_ptr) malloc(sizeof(block_rec) + nops * sizeof(bop_rec));
+    b->pc = ops[0].pc;
+    b->ninstr = n;
+    b->nops = nops;
+    b->count = 0;
+    b->native = NULL;
+    b->hnext = NULL;
+    b->succ[0] = b->succ[1] = NULL;
+    memcpy(b->ops, ops, nops * sizeof(bop_rec));
+    return b;
+}
+
+/* Find block starting at pc, translating it if necessary */
+static block_ptr find_block(block_ptr *table, mem_t m, word_t pc)
+{
+    block_ptr *bucket = &table[pc & (BLOCK_HASH-1)];
+    block_ptr b;
+    for (b = *bucket; b; b = b->hnext)
+	if (b->pc == pc)
+	    return b;
+    b = translate(m, pc);
+    b->hnext = *bucket;
+    *bucket = b;
+    return b;
+}
+
+/* Discard all translated blocks */
+static void flush_blocks(block_ptr *table)
+{
+    int i;
+    for (i = 0; i < BLOCK_HASH; i++) {
+	block_ptr b = table[i];
+	while (b) {
+	    block_ptr next = b->hnext;
+	    free((void *) b);
+	    b = next;
+	}
+	table[i] = NULL;
+    }
+}
+
+/* Defer condition codes of ALU operation op, as step_state does */
+#define SET_CC(o, a, b) (cc.op = (o), cc.argA = (a), cc.argB = (b))
+
+/* Run translated blocks, compiling frequently executed ones when j is
+   non-NULL */
+static stat_t run_engine(state_ptr s, word_t max_steps, word_t *stepsp,
+			 FILE *error_file, jit_t j)
+{
+    mem_t m = s->m;
+    block_ptr *table = (block_ptr *) calloc(BLOCK_HASH, sizeof(block_ptr));
+    unsigned version = m->code_version;
+    unsigned data_version = m->data_version;
+    word_t reg[REG_NONE+1]; /* reg[REG_NONE] always holds 0 */
+    word_t pc = s->pc;
+    lazy_cc_rec cc = s->cc;
+    word_t steps = 0;
+    stat_t e = STAT_AOK;
+    block_ptr b;
+    block_ptr prev = NULL;  /* Block just executed, if it can chain */
+    int slot = 0;           /* Which successor of prev to use */
+    bop_ptr op;
+    word_t val, argA, argB, addr;
+    jit_ctx_rec ctx;
+
+    memcpy(reg, s->r->regs, sizeof(reg));
+    /* Native code keeps current page between calls */
+    ctx.vpn = -1;
+    ctx.page = NULL;
+    ctx.wvpn = -1;
+
+    while (e == STAT_AOK && steps < max_steps) {
+	if (m->code_version != version) {
+	    /* Code has been modified */
+	    flush_blocks(table);
+	    jit_flush(j);
+	    version = m->code_version;
+	    prev = NULL;
+	}
+	if (prev && prev->succ[slot] && prev->succ[slot]->pc == pc)
+	    b = prev->succ[slot];
+	else {
+	    b = find_block(table, m, pc);
+	    if (prev)
+		prev->succ[slot] = b;
+	}
+	prev = NULL;
+
+	if (b->ninstr == 0 || steps + b->ninstr > max_steps)
+	    goto single;
+
+	if (j && !b->native && b->count < JIT_HOT && ++b->count == JIT_HOT)
+	    b->native = jit_compile(j, b->ops, b->nops, b->ninstr);
+	if (b->native) {
+	    if (m->data_version != data_version) {
+		/* Page held by native code may have been copied */
+		ctx.vpn = -1;
+		ctx.wvpn = -1;
+		data_version = m->data_version;
+	    }
+	    ctx.reg = reg;
+	    ctx.m = m;
+	    ctx.budget = max_steps - steps;
+	    ctx.cc = lazy_cc_get(&cc);
+	    switch (b->native(&ctx)) {
+	    case J_TAKEN:
+		slot = 0;
+		prev = b;
+		break;
+	    case J_NOT_TAKEN:
+		slot = 1;
+		prev = b;
+		break;
+	    case J_HALT:
+		e = STAT_HLT;
+		break;
+	    }
+	    steps += ctx.steps;
+	    pc = ctx.pc;
+	    lazy_cc_load(&cc, (cc_t) ctx.cc);
+	    if (prev || e != STAT_AOK)
+		goto next;
+	    /* Instruction at pc must be executed by step_state */
+	    goto single;
+	}
+
+	for (op = b->ops; ; op++) {
+	    switch (op->op) {
+	    case B_RRMOVQ:
+		reg[op->rb] = reg[op->ra];
+		continue;
+	    case B_CMOVXX:
+		if (lazy_cond_holds(&cc, op->fun))
+		    reg[op->rb] = reg[op->ra];
+		continue;
+	    case B_IRMOVQ:
+		reg[op->rb] = op->valc;
+		continue;
+	    case B_RMMOVQ:
+		if (!set_word_val(m, op->valc + reg[op->rb], reg[op->ra]))
+		    goto fault;
+		if (m->code_version != version)
+		    goto modified;
+		continue;
+	    case B_MRMOVQ:
+		if (!get_word_val(m, op->valc + reg[op->rb], &val))
+		    goto fault;
+		reg[op->ra] = val;
+		continue;
+	    case B_ADDQ:
+		argA = reg[op->ra];
+		argB = reg[op->rb];
+		if (op->setcc)
+		    SET_CC(A_ADD, argA, argB);
+		reg[op->rb] = argA + argB;
+		reg[REG_NONE] = 0;
+		continue;
+	    case B_SUBQ:
+		argA = reg[op->ra];
+		argB = reg[op->rb];
+		if (op->setcc)
+		    SET_CC(A_SUB, argA, argB);
+		reg[op->rb] = argB - argA;
+		reg[REG_NONE] = 0;
+		continue;
+	    case B_ANDQ:
+		argA = reg[op->ra];
+		argB = reg[op->rb];
+		if (op->setcc)
+		    SET_CC(A_AND, argA, argB);
+		reg[op->rb] = argA & argB;
+		reg[REG_NONE] = 0;
+		continue;
+	    case B_XORQ:
+		argA = reg[op->ra];
+		argB = reg[op->rb];
+		if (op->setcc)
+		    SET_CC(A_XOR, argA, argB);
+		reg[op->rb] = argA ^ argB;
+		reg[REG_NONE] = 0;
+		continue;
+	    case B_ALU:
+		argA = reg[op->ra];
+		argB = reg[op->rb];
+		lazy_cc_set(&cc, op->fun, argA, argB);
+		reg[op->rb] = compute_alu(op->fun, argA, argB);
+		reg[REG_NONE] = 0;
+		continue;
+	    case B_IADDQ:
+		argB = reg[op->rb];
+		if (op->setcc)
+		    SET_CC(A_ADD, op->valc, argB);
+		reg[op->rb] = argB + op->valc;
+		continue;
+	    case B_PUSHQ:
+		addr = reg[REG_RSP] - 8;
+		if (!set_word_val(m, addr, reg[op->ra]))
+		    goto fault;
+		reg[REG_RSP] = addr;
+		if (m->code_version != version)
+		    goto modified;
+		continue;
+	    case B_POPQ:
+		addr = reg[REG_RSP];
+		if (!get_word_val(m, addr, &val))
+		    goto fault;
+		reg[REG_RSP] = addr + 8;
+		reg[op->ra] = val;
+		continue;
+	    case B_IRMOVQ_ADDQ:
+		reg[op->rb] = op->valc;
+		argA = reg[op->ra2];
+		argB = reg[op->rb2];
+		if (op->setcc)
+		    SET_CC(A_ADD, argA, argB);
+		reg[op->rb2] = argA + argB;
+		reg[REG_NONE] = 0;
+		continue;
+	    case B_MRMOVQ_ALU:
+		if (!get_word_val(m, op->valc + reg[op->rb], &val))
+		    goto fault;
+		reg[op->ra] = val;
+		argA = reg[op->ra2];
+		argB = reg[op->rb2];
+		if (op->setcc)
+		    SET_CC(op->fun, argA, argB);
+		reg[op->rb2] = compute_alu(op->fun, argA, argB);
+		reg[REG_NONE] = 0;
+		continue;
+
+	    case B_JMP:
+		pc = op->valc;
+		slot = 0;
+		break;
+	    case B_JXX:
+		if (lazy_cond_holds(&cc, op->fun)) {
+		    pc = op->valc;
+		    slot = 0;
+		} else {
+		    pc = op->valp;
+		    slot = 1;
+		}
+		break;
+	    case B_SUBQ_JXX:
+		argA = reg[op->ra];
+		argB = reg[op->rb];
+		SET_CC(A_SUB, argA, argB);
+		reg[op->rb] = argB - argA;
+		reg[REG_NONE] = 0;
+		if (lazy_cond_holds(&cc, op->fun)) {
+		    pc = op->valc;
+		    slot = 0;
+		} else {
+		    pc = op->valp;
+		    slot = 1;
+		}
+		break;
+	    case B_CALL:
+		addr = reg[REG_RSP] - 8;
+		if (!set_word_val(m, addr, op->valp))
+		    goto fault;
+		reg[REG_RSP] = addr;
+		pc = op->valc;
+		slot = 0;
+		break;
+	    case B_RET:
+		addr = reg[REG_RSP];
+		if (!get_word_val(m, addr, &val))
+		    goto fault;
+		reg[REG_RSP] = addr + 8;
+		pc = val;
+		slot = 0;
+		break;
+	    case B_FALL:
+		pc = op->pc;
+		slot = 1;
+		break;
+	    case B_HALT:
+		pc = op->pc;
+		e = STAT_HLT;
+		break;
+	    case B_SLOW:
+		/* Next pass finds block at pc with no instructions */
+		pc = op->pc;
+		steps += b->ninstr;
+		goto next;
+	    }
+	    break;
+	}
+	/* Completed block */
+	steps += b->ninstr;
+	prev = b;
+	goto next;
+
+    modified:
+	/* Store changed code.  Stop block after this operation */
+	steps += op->idx + 1;
+	pc = op->valp;
+	goto next;
+
+    fault:
+	/* Operation made no changes.  Rerun instruction to report error */
+	steps += op->idx;
+	pc = op->pc;
+
+    single:
+	s->pc = pc;
+	s->cc = cc;
+	memcpy(s->r->regs, reg, sizeof(reg));
+	e = step_state(s, error_file);
+	steps++;
+	pc = s->pc;
+	cc = s->cc;
+	memcpy(reg, s->r->regs, sizeof(reg));
+
+    next:
+	;
+    }
+
+    s->pc = pc;
+    s->cc = cc;
+    memcpy(s->r->regs, reg, sizeof(reg));
+    flush_blocks(table);
+    free((void *) table);
+    jit_flush(j);
+    if (stepsp)
+	*stepsp = steps;
+    return e;
+}
+
+stat_t run_blocks(state_ptr s, word_t max_steps, word_t *stepsp,
+		  FILE *error_file)
+{
+    return run_engine(s, max_steps, stepsp, error_file, NULL);
+}
+
+stat_t run_blocks_jit(state_ptr s, word_t max_steps, word_t *stepsp,
+		      FILE *error_file)
+{
+    jit_t j = new_jit();
+    stat_t e = run_engine(s, max_steps, stepsp, error_file, j);
+    free_jit(j);
+    return e;
+}
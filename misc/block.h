@@ -0,0 +1,52 @@
+/* Basic block translation engine for Y86-64 ISA simulator */
+
+/*
+ * Straight-line runs of instructions ending in a jXX, call, ret or
+ * halt are translated once into arrays of specialized operations,
+ * with common instruction pairs fused into single operations.
+ * Blocks are chained to their successors so that loops run without
+ * going back through the block lookup.
+ */
+
+/* Maximum number of instructions in a block */
+#define MAX_BLOCK 64
+
+/* Specialized operations */
+typedef enum {
+    /* Operations within a block */
+    B_RRMOVQ, B_CMOVXX, B_IRMOVQ, B_RMMOVQ, B_MRMOVQ,
+    B_ADDQ, B_SUBQ, B_ANDQ, B_XORQ, B_ALU, B_IADDQ,
+    B_PUSHQ, B_POPQ,
+    /* Fused instruction pairs */
+    B_IRMOVQ_ADDQ, B_MRMOVQ_ALU,
+    /* Operations that end a block */
+    B_JMP, B_JXX, B_SUBQ_JXX, B_CALL, B_RET, B_HALT,
+    B_FALL,  /* Block reached MAX_BLOCK instructions */
+    B_SLOW   /* Instruction must be executed by step_state */
+} bop_t;
+
+/* Translated operation */
+typedef struct {
+    byte_t op;
+    byte_t fun;   /* ALU function or branch condition */
+    byte_t ra;
+    byte_t rb;
+    byte_t ra2;   /* Registers of second instruction in fused pair */
+    byte_t rb2;
+    byte_t setcc; /* Condition codes set here can be seen */
+    byte_t idx;   /* Position of first instruction within block */
+    word_t valc;
+    word_t pc;    /* Address of first instruction */
+    word_t valp;  /* Address following last instruction */
+} bop_rec, *bop_ptr;
+
+/* Execute up to max_steps instructions using translated blocks.
+   Gives same result as repeated calls to step_state.
+   Set *stepsp to number of instructions executed.  Return status. */
+stat_t run_blocks(state_ptr s, word_t max_steps, word_t *stepsp,
+		  FILE *error_file);
+
+/* Same as run_blocks, but compile frequently executed blocks into
+   native code when the host supports it */
+stat_t run_blocks_jit(state_ptr s, word_t max_steps, word_t *stepsp,
+		      FILE *error_file);
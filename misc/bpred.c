@@ -0,0 +1,209 @@
+/* Branch predictors for the pipeline simulator */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "isa.h"
+#include "bpred.h"
+
+/* Saturating 2-bit counters predict taken from this value up */
+#define CTR_TAKEN 2
+#define CTR_MAX 3
+
+/* Tables a predictor uses */
+#define T_BIMODAL 1
+#define T_GSHARE  2
+#define T_CHOICE  4
+
+/* What each kind of predictor does */
+typedef struct {
+    char *name;
+    int tables;
+    bool_t (*predict)(bpred_t bp, word_t pc, word_t target, word_t hist);
+    void (*update)(bpred_t bp, word_t pc, word_t hist, bool_t taken);
+} bpred_kind_rec, *bpred_kind_ptr;
+
+struct bpred_rec {
+    bpred_kind_ptr kind;
+    int bits;
+    word_t mask;
+    /* Tables not used are NULL */
+    byte_t *bimodal;    /* Indexed by pc */
+    byte_t *gshare;     /* Indexed by pc xor history */
+    byte_t *choice;     /* Indexed by pc.  Prefer gshare from CTR_TAKEN up */
+    word_t history;     /* Outcomes of resolved jumps, newest in bit 0 */
+    word_t branches;
+    word_t mispredicts;
+};
+
+static void count(byte_t *ctr, bool_t up)
+{
+    if (up && *ctr < CTR_MAX)
+	(*ctr)++;
+    else if (!up && *ctr > 0)
+	(*ctr)--;
+}
+
+static bool_t taken_predict(bpred_t bp, word_t pc, word_t target, word_t hist)
+{
+    return TRUE;
+}
+
+static bool_t btfn_predict(bpred_t bp, word_t pc, word_t target, word_t hist)
+{
+    return target <= pc;
+}
+
+static bool_t bimodal_predict(bpred_t bp, word_t pc, word_t target, word_t hist)
+{
+    return bp->bimodal[pc & bp->mask] >= CTR_TAKEN;
+}
+
+static void bimodal_update(bpred_t bp, word_t pc, word_t hist, bool_t taken)
+{
+    count(&bp->bimodal[pc & bp->mask], taken);
+}
+
+static bool_t gshare_predict(bpred_t bp, word_t pc, word_t target, word_t hist)
+{
+    return bp->gshare[(pc ^ hist) & bp->mask] >= CTR_TAKEN;
+}
+
+static void gshare_update(bpred_t bp, word_t pc, word_t hist, bool_t taken)
+{
+    count(&bp->gshare[(pc ^ hist) & bp->mask], taken);
+}
+
+static bool_t tournament_predict(bpred_t bp, word_t pc, word_t target,
+				 word_t hist)
+{
+    if (bp->choice[pc & bp->mask] >= CTR_TAKEN)
+	return gshare_predict(bp, pc, target, hist);
+    return bimodal_predict(bp, pc, target, hist);
+}
+
+static void tournament_update(bpred_t bp, word_t pc, word_t hist, bool_t taken)
+{
+    bool_t b = bimodal_predict(bp, pc, 0, hist);
+    bool_t g = gshare_predict(bp, pc, 0, hist);
+    /* Move choice toward whichever was right, when they differ */
+    if (b != g)
+	count(&bp->choice[pc & bp->mask], g == taken);
+    bimodal_update(bp, pc, hist, taken);
+    gshare_update(bp, pc, hist, taken);
+}
+
+static bpred_kind_rec kinds[] = {
+    {"taken", 0, taken_predict, NULL},
+    {"btfn", 0, btfn_predict, NULL},
+    {"bimodal", T_BIMODAL, bimodal_predict, bimodal_update},
+    {"gshare", T_GSHARE, gshare_predict, gshare_update},
+    {"tournament", T_BIMODAL | T_GSHARE | T_CHOICE,
+     tournament_predict, tournament_update},
+    {NULL, 0, NULL, NULL}
+};
+
+static byte_t *new_table(int size, byte_t init)
+{
+    byte_t *t = (byte_t *) malloc(size);
+    memset(t, init, size);
+    return t;
+}
+
+bpred_t new_bpred(char *spec)
+{
+    bpred_t bp;
+    bpred_kind_ptr k;
+    char *colon = strchr(spec, ':');
+    int len = colon ? colon - spec : strlen(spec);
+    int bits = colon ? atoi(colon + 1) : BPRED_BITS;
+    int size;
+
+    for (k = kinds; k->name; k++)
+	if ((int) strlen(k->name) == len && strncmp(k->name, spec, len) == 0)
+	    break;
+    if (!k->name || bits < 1 || bits > BPRED_MAX_BITS)
+	return NULL;
+    bp = (bpred_t) calloc(1, sizeof(struct bpred_rec));
+    bp->kind = k;
+    bp->bits = bits;
+    bp->mask = ((word_t) 1 << bits) - 1;
+    size = 1 << bits;
+    /* Counters start weakly taken, as the static default predicts.
+       Tournament starts out trusting bimodal, which learns faster */
+    if (k->tables & T_BIMODAL)
+	bp->bimodal = new_table(size, CTR_TAKEN);
+    if (k->tables & T_GSHARE)
+	bp->gshare = new_table(size, CTR_TAKEN);
+    if (k->tables & T_CHOICE)
+	bp->choice = new_table(size, CTR_TAKEN - 1);
+    return bp;
+}
+
+static byte_t *copy_table(byte_t *t, int size)
+{
+    byte_t *c;
+    if (!t)
+	return NULL;
+    c = (byte_t *) malloc(size);
+    memcpy(c, t, size);
+    return c;
+}
+
+bpred_t copy_bpred(bpred_t bp)
+{
+    bpred_t c = (bpred_t) malloc(sizeof(struct bpred_rec));
+    int size = 1 << bp->bits;
+    *c = *bp;
+    c->bimodal = copy_table(bp->bimodal, size);
+    c->gshare = copy_table(bp->gshare, size);
+    c->choice = copy_table(bp->choice, size);
+    return c;
+}
+
+void free_bpred(bpred_t bp)
+{
+    free((void *) bp->bimodal);
+    free((void *) bp->gshare);
+    free((void *) bp->choice);
+    free((void *) bp);
+}
+
+bool_t bpred_predict(bpred_t bp, word_t pc, word_t target, word_t *hist)
+{
+    *hist = bp->history;
+    return bp->kind->predict(bp, pc, target, bp->history);
+}
+
+void bpred_update(bpred_t bp, word_t pc, word_t target, word_t hist,
+		  bool_t predicted, bool_t taken)
+{
+    bp->branches++;
+    if (predicted != taken)
+	bp->mispredicts++;
+    if (bp->kind->update)
+	bp->kind->update(bp, pc, hist, taken);
+    bp->history = ((bp->history << 1) | (taken ? 1 : 0)) & bp->mask;
+}
+
+word_t bpred_branches(bpred_t bp)
+{
+    return bp->branches;
+}
+
+word_t bpred_mispredicts(bpred_t bp)
+{
+    return bp->mispredicts;
+}
+
+void bpred_report(bpred_t bp, FILE *outfile)
+{
+    fprintf(outfile, "Branch predictor: %s", bp->kind->name);
+    if (bp->kind->tables)
+	fprintf(outfile, ", %lld entries", bp->mask + 1);
+    fprintf(outfile, "\n%lld conditional jumps, %lld mispredicted (%.1f%% correct)\n",
+	    bp->branches, bp->mispredicts,
+	    bp->branches > 0 ?
+	    100.0 * (bp->branches - bp->mispredicts) / bp->branches : 100.0);
+}
@@ -0,0 +1,49 @@
+/* Branch predictors for the pipeline simulator */
+
+/*
+ * Fetch asks the predictor whether a conditional jump will be taken,
+ * and the jump carries the answer down the pipe.  When execute finds
+ * the real outcome it tells the predictor, which counts the outcomes
+ * it got right and trains its tables.
+ *
+ * Predictors are chosen by name, with an optional log2 of the number
+ * of table entries, as in "gshare:12":
+ *   taken       Always taken (the PIPE default)
+ *   btfn        Backward taken, forward not taken
+ *   bimodal     2-bit counters indexed by address
+ *   gshare      2-bit counters indexed by address xor global history
+ *   tournament  bimodal and gshare, with 2-bit counters choosing one
+ *
+ * Prediction has no side effects, since a stalled fetch asks again
+ * for the same jump.  Dynamic predictors hand back the global history
+ * they used, and take it again when updated, so a jump trains the
+ * entries that predicted it even if other jumps resolved in between.
+ */
+
+typedef struct bpred_rec *bpred_t;
+
+/* Default and largest log2 of table entries */
+#define BPRED_BITS 10
+#define BPRED_MAX_BITS 24
+
+/* Create predictor described by spec.  Return NULL if the name is
+   unknown or the size out of range */
+bpred_t new_bpred(char *spec);
+/* Copy of predictor, with its tables and history */
+bpred_t copy_bpred(bpred_t bp);
+void free_bpred(bpred_t bp);
+
+/* Predict whether conditional jump at pc to target is taken.  Sets
+   *hist to the history to pass to bpred_update */
+bool_t bpred_predict(bpred_t bp, word_t pc, word_t target, word_t *hist);
+
+/* Record outcome of jump predicted with history hist */
+void bpred_update(bpred_t bp, word_t pc, word_t target, word_t hist,
+		  bool_t predicted, bool_t taken);
+
+/* Conditional jumps resolved, and how many were mispredicted */
+word_t bpred_branches(bpred_t bp);
+word_t bpred_mispredicts(bpred_t bp);
+
+/* Print name and size of predictor, and its accuracy */
+void bpred_report(bpred_t bp, FILE *outfile);
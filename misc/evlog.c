@@ -0,0 +1,141 @@
+/* Binary event logs for the pipeline simulator */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "isa.h"
+#include "evlog.h"
+
+/* Bytes in one binary record */
+#define EV_RECORD 26
+
+struct evlog_rec {
+    event_ptr ring;
+    word_t count;       /* Events ever added */
+    int mask;           /* Ring size - 1 */
+};
+
+evlog_t new_evlog(int size)
+{
+    evlog_t l = (evlog_t) malloc(sizeof(struct evlog_rec));
+    int n = 1;
+    while (n < size)
+	n *= 2;
+    l->ring = (event_ptr) malloc(n * sizeof(event_rec));
+    l->count = 0;
+    l->mask = n - 1;
+    return l;
+}
+
+void free_evlog(evlog_t l)
+{
+    free((void *) l->ring);
+    free((void *) l);
+}
+
+void evlog_put(evlog_t l, event_ptr e)
+{
+    l->ring[l->count++ & l->mask] = *e;
+}
+
+/* Append little-endian word to buffer */
+static byte_t *put_word(byte_t *p, word_t val)
+{
+    int i;
+    for (i = 0; i < 8; i++) {
+	p[i] = (byte_t) val & 0xFF;
+	val >>= 8;
+    }
+    return p + 8;
+}
+
+static word_t get_word(byte_t *p)
+{
+    word_t val = 0;
+    int i;
+    for (i = 7; i >= 0; i--)
+	val = (val << 8) | p[i];
+    return val;
+}
+
+void evlog_write(evlog_t l, FILE *file)
+{
+    byte_t buf[EV_RECORD];
+    word_t first = l->count > l->mask ? l->count - l->mask - 1 : 0;
+    word_t i;
+    memcpy(buf, EVLOG_MAGIC, 8);
+    put_word(buf + 8, EVLOG_VERSION);
+    fwrite(buf, 1, 16, file);
+    for (i = first; i < l->count; i++) {
+	event_ptr e = &l->ring[i & l->mask];
+	byte_t *p = buf;
+	*p++ = e->kind;
+	*p++ = e->arg;
+	p = put_word(p, e->a);
+	p = put_word(p, e->b);
+	put_word(p, e->c);
+	fwrite(buf, 1, EV_RECORD, file);
+    }
+}
+
+void print_event(FILE *outfile, event_ptr e)
+{
+    switch (e->kind) {
+    case EV_CYCLE:
+	fprintf(outfile, "\nCycle %lld. CC=%s, Stat=%s\n",
+		e->a, cc_name((cc_t) e->b), stat_name((stat_t) e->arg));
+	break;
+    case EV_FETCH:
+	fprintf(outfile, "\tFetch: f_pc = 0x%llx, f_instr = %s\n",
+		e->a, iname(e->arg));
+	break;
+    case EV_BRANCH:
+	fprintf(outfile, "\tExecute: instr = %s, cc = %s, branch %staken\n",
+		iname(e->arg), cc_name((cc_t) e->a), e->b ? "" : "not ");
+	break;
+    case EV_ALU:
+	fprintf(outfile, "\tExecute: ALU: %c 0x%llx 0x%llx --> 0x%llx\n",
+		e->arg, e->a, e->b, e->c);
+	break;
+    case EV_CC:
+	fprintf(outfile, "\tExecute: New cc=%s\n", cc_name((cc_t) e->a));
+	break;
+    case EV_MEM_READ:
+	fprintf(outfile, "\tMemory: Read 0x%llx from 0x%llx\n", e->a, e->b);
+	break;
+    case EV_MEM_WRITE:
+	fprintf(outfile, "\tWrote 0x%llx to address 0x%llx\n", e->a, e->b);
+	break;
+    case EV_MEM_ERROR:
+	fprintf(outfile, "\tCouldn't write to address 0x%llx\n", e->b);
+	break;
+    case EV_REG_WRITE:
+	fprintf(outfile, "\tWriteback: Wrote 0x%llx to register %s\n",
+		e->a, reg_name((reg_id_t) e->arg));
+	break;
+    default:
+	fprintf(outfile, "\tUnknown event %d\n", e->kind);
+	break;
+    }
+}
+
+bool_t evlog_print(FILE *file, FILE *outfile)
+{
+    byte_t buf[EV_RECORD];
+    byte_t v[8];
+    event_rec e;
+    put_word(v, EVLOG_VERSION);
+    if (fread(buf, 1, 16, file) != 16 ||
+	memcmp(buf, EVLOG_MAGIC, 8) || memcmp(buf + 8, v, 8))
+	return FALSE;
+    while (fread(buf, 1, EV_RECORD, file) == EV_RECORD) {
+	e.kind = buf[0];
+	e.arg = buf[1];
+	e.a = get_word(buf + 2);
+	e.b = get_word(buf + 10);
+	e.c = get_word(buf + 18);
+	print_event(outfile, &e);
+    }
+    return TRUE;
+}
@@ -0,0 +1,57 @@
+/* Binary event logs for the pipeline simulator */
+
+/*
+ * An event log keeps the most recent events of a run in a ring of
+ * fixed-size binary records.  Recording an event only stores numbers:
+ * instruction and register names, and all other text, are produced
+ * when the log is printed after the run, by print_event or yevlog.
+ *
+ * Binary event files start with the 8-byte magic number EVLOG_MAGIC
+ * and an 8-byte version.  Each record is then:
+ *   kind     1 byte: EV_* value
+ *   arg      1 byte
+ *   a, b, c  8 bytes each
+ * All multi-byte values are little-endian.
+ */
+
+#define EVLOG_MAGIC "\177Y86EVL"
+#define EVLOG_VERSION 1
+
+/* Kinds of event, with the meaning of their fields */
+typedef enum {
+    EV_CYCLE,      /* a: cycle, b: condition codes, arg: status */
+    EV_FETCH,      /* a: pc, arg: instruction byte */
+    EV_BRANCH,     /* arg: instruction byte, a: condition codes, b: taken */
+    EV_ALU,        /* arg: operator character, c = a op b */
+    EV_CC,         /* a: new condition codes */
+    EV_MEM_READ,   /* a: value, b: address */
+    EV_MEM_WRITE,  /* a: value, b: address */
+    EV_MEM_ERROR,  /* b: address that could not be written */
+    EV_REG_WRITE,  /* a: value, arg: register */
+    EV_NKINDS
+} ev_kind_t;
+
+typedef struct {
+    word_t a, b, c;
+    byte_t kind;
+    byte_t arg;
+} event_rec, *event_ptr;
+
+typedef struct evlog_rec *evlog_t;
+
+/* Create log keeping the last size events, rounded up to power of 2 */
+evlog_t new_evlog(int size);
+void free_evlog(evlog_t l);
+
+/* Add event, replacing the oldest one if the log is full */
+void evlog_put(evlog_t l, event_ptr e);
+
+/* Write events in log to file, oldest first */
+void evlog_write(evlog_t l, FILE *file);
+
+/* Print event as text, in the same form as the simulator's own log */
+void print_event(FILE *outfile, event_ptr e);
+
+/* Print events from binary file.  Return FALSE if the file does not
+   start with a valid header */
+bool_t evlog_print(FILE *file, FILE *outfile);
@@ -4,6 +4,12 @@
 #include <string.h>
 #include "isa.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define HAVE_MMAP
+#endif
+
 /* Bytes Per Line = Block size of memory */
 #define BPL 32
 
@@ -55,70 +61,131 @@ int reg_valid(reg_id_t id)
   return id >= 0 && id < REG_NONE && reg_table[id].id == id;
 }
 
+/* Sorted by name, so that find_instr can use binary search.
+   For immediates and allocation directives, arg1hi indicates number
+   of bytes.  pop2 is just a hack to make the I_POP2 code have an
+   associated name */
 instr_t instruction_set[] = 
 {
-    {"nop",    HPACK(I_NOP, F_NONE), 1, NO_ARG, 0, 0, NO_ARG, 0, 0 },
-    {"halt",   HPACK(I_HALT, F_NONE), 1, NO_ARG, 0, 0, NO_ARG, 0, 0 },
-    {"rrmovq", HPACK(I_RRMOVQ, F_NONE), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
-    /* Conditional move instructions are variants of RRMOVQ */
-    {"cmovle", HPACK(I_RRMOVQ, C_LE), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
-    {"cmovl", HPACK(I_RRMOVQ, C_L), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
+    {".byte",  0x00, 1, I_ARG, 0, 1, NO_ARG, 0, 0 },
+    {".long",  0x00, 4, I_ARG, 0, 4, NO_ARG, 0, 0 },
+    {".quad",  0x00, 8, I_ARG, 0, 8, NO_ARG, 0, 0 },
+    {".word",  0x00, 2, I_ARG, 0, 2, NO_ARG, 0, 0 },
+    {"addq",   HPACK(I_ALU, A_ADD), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
+    {"andq",   HPACK(I_ALU, A_AND), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
+    {"call",   HPACK(I_CALL, F_NONE),    9, I_ARG, 1, 8, NO_ARG, 0, 0 },
     {"cmove", HPACK(I_RRMOVQ, C_E), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
-    {"cmovne", HPACK(I_RRMOVQ, C_NE), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
-    {"cmovge", HPACK(I_RRMOVQ, C_GE), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
     {"cmovg", HPACK(I_RRMOVQ, C_G), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
-    /* arg1hi indicates number of bytes */
+    {"cmovge", HPACK(I_RRMOVQ, C_GE), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
+    {"cmovl", HPACK(I_RRMOVQ, C_L), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
+    {"cmovle", HPACK(I_RRMOVQ, C_LE), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
+    {"cmovne", HPACK(I_RRMOVQ, C_NE), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
+    {"halt",   HPACK(I_HALT, F_NONE), 1, NO_ARG, 0, 0, NO_ARG, 0, 0 },
+    {"iaddq",  HPACK(I_IADDQ, F_NONE), 10, I_ARG, 2, 8, R_ARG, 1, 0 },
     {"irmovq", HPACK(I_IRMOVQ, F_NONE), 10, I_ARG, 2, 8, R_ARG, 1, 0 },
-    {"rmmovq", HPACK(I_RMMOVQ, F_NONE), 10, R_ARG, 1, 1, M_ARG, 1, 0 },
-    {"mrmovq", HPACK(I_MRMOVQ, F_NONE), 10, M_ARG, 1, 0, R_ARG, 1, 1 },
-    {"addq",   HPACK(I_ALU, A_ADD), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
-    {"subq",   HPACK(I_ALU, A_SUB), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
-    {"andq",   HPACK(I_ALU, A_AND), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
-    {"xorq",   HPACK(I_ALU, A_XOR), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
-    /* arg1hi indicates number of bytes */
-    {"jmp",    HPACK(I_JMP, C_YES), 9, I_ARG, 1, 8, NO_ARG, 0, 0 },
-    {"jle",    HPACK(I_JMP, C_LE), 9, I_ARG, 1, 8, NO_ARG, 0, 0 },
-    {"jl",     HPACK(I_JMP, C_L), 9, I_ARG, 1, 8, NO_ARG, 0, 0 },
     {"je",     HPACK(I_JMP, C_E), 9, I_ARG, 1, 8, NO_ARG, 0, 0 },
-    {"jne",    HPACK(I_JMP, C_NE), 9, I_ARG, 1, 8, NO_ARG, 0, 0 },
-    {"jge",    HPACK(I_JMP, C_GE), 9, I_ARG, 1, 8, NO_ARG, 0, 0 },
     {"jg",     HPACK(I_JMP, C_G), 9, I_ARG, 1, 8, NO_ARG, 0, 0 },
-    {"call",   HPACK(I_CALL, F_NONE),    9, I_ARG, 1, 8, NO_ARG, 0, 0 },
-    {"ret",    HPACK(I_RET, F_NONE), 1, NO_ARG, 0, 0, NO_ARG, 0, 0 },
-    {"pushq",  HPACK(I_PUSHQ, F_NONE) , 2, R_ARG, 1, 1, NO_ARG, 0, 0 },
-    {"popq",   HPACK(I_POPQ, F_NONE) ,  2, R_ARG, 1, 1, NO_ARG, 0, 0 },
-    {"iaddq",  HPACK(I_IADDQ, F_NONE), 10, I_ARG, 2, 8, R_ARG, 1, 0 },
-    /* this is just a hack to make the I_POP2 code have an associated name */
+    {"jge",    HPACK(I_JMP, C_GE), 9, I_ARG, 1, 8, NO_ARG, 0, 0 },
+    {"jl",     HPACK(I_JMP, C_L), 9, I_ARG, 1, 8, NO_ARG, 0, 0 },
+    {"jle",    HPACK(I_JMP, C_LE), 9, I_ARG, 1, 8, NO_ARG, 0, 0 },
+    {"jmp",    HPACK(I_JMP, C_YES), 9, I_ARG, 1, 8, NO_ARG, 0, 0 },
+    {"jne",    HPACK(I_JMP, C_NE), 9, I_ARG, 1, 8, NO_ARG, 0, 0 },
+    {"mrmovq", HPACK(I_MRMOVQ, F_NONE), 10, M_ARG, 1, 0, R_ARG, 1, 1 },
+    {"nop",    HPACK(I_NOP, F_NONE), 1, NO_ARG, 0, 0, NO_ARG, 0, 0 },
     {"pop2",   HPACK(I_POP2, F_NONE) , 0, NO_ARG, 0, 0, NO_ARG, 0, 0 },
-
-    /* For allocation instructions, arg1hi indicates number of bytes */
-    {".byte",  0x00, 1, I_ARG, 0, 1, NO_ARG, 0, 0 },
-    {".word",  0x00, 2, I_ARG, 0, 2, NO_ARG, 0, 0 },
-    {".long",  0x00, 4, I_ARG, 0, 4, NO_ARG, 0, 0 },
-    {".quad",  0x00, 8, I_ARG, 0, 8, NO_ARG, 0, 0 },
+    {"popq",   HPACK(I_POPQ, F_NONE) ,  2, R_ARG, 1, 1, NO_ARG, 0, 0 },
+    {"pushq",  HPACK(I_PUSHQ, F_NONE) , 2, R_ARG, 1, 1, NO_ARG, 0, 0 },
+    {"ret",    HPACK(I_RET, F_NONE), 1, NO_ARG, 0, 0, NO_ARG, 0, 0 },
+    {"rmmovq", HPACK(I_RMMOVQ, F_NONE), 10, R_ARG, 1, 1, M_ARG, 1, 0 },
+    {"rrmovq", HPACK(I_RRMOVQ, F_NONE), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
+    {"subq",   HPACK(I_ALU, A_SUB), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
+    {"xorq",   HPACK(I_ALU, A_XOR), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
     {NULL,     0   , 0, NO_ARG, 0, 0, NO_ARG, 0, 0 }
 };
 
 instr_t invalid_instr =
     {"XXX",     0   , 0, NO_ARG, 0, 0, NO_ARG, 0, 0 };
 
+/* Decode table.  Built by the preprocessor, so it is fixed at compile
+   time and shared by all threads */
+
+/* Entry for opcode byte HPACK(ic, fn) of a valid instruction */
+#define OPC(name, ic, fn, len, regids, valc, sa, sb, de, dm) \
+    { name, ic, fn, len, TRUE, (name) != NULL, regids, valc, sa, sb, de, dm }
+
+/* All function codes of instruction ic.  Those with no name have no
+   mnemonic.  Only SEQ rejects them */
+#define OPC_ROW(ic, n0, n1, n2, n3, n4, n5, n6, ...) \
+    OPC(n0, ic, 0, __VA_ARGS__), OPC(n1, ic, 1, __VA_ARGS__), \
+    OPC(n2, ic, 2, __VA_ARGS__), OPC(n3, ic, 3, __VA_ARGS__), \
+    OPC(n4, ic, 4, __VA_ARGS__), OPC(n5, ic, 5, __VA_ARGS__), \
+    OPC(n6, ic, 6, __VA_ARGS__), OPC(NULL, ic, 7, __VA_ARGS__), \
+    OPC(NULL, ic, 8, __VA_ARGS__), OPC(NULL, ic, 9, __VA_ARGS__), \
+    OPC(NULL, ic, 10, __VA_ARGS__), OPC(NULL, ic, 11, __VA_ARGS__), \
+    OPC(NULL, ic, 12, __VA_ARGS__), OPC(NULL, ic, 13, __VA_ARGS__), \
+    OPC(NULL, ic, 14, __VA_ARGS__), OPC(NULL, ic, 15, __VA_ARGS__)
+
+/* Entry for opcode byte of an invalid instruction */
+#define BAD(name, ic, fn) \
+    { name, ic, fn, 1, FALSE, FALSE, FALSE, FALSE, \
+      REG_NONE, REG_NONE, REG_NONE, REG_NONE }
+
+#define BAD_ROW(ic, n0) \
+    BAD(n0, ic, 0), BAD(NULL, ic, 1), BAD(NULL, ic, 2), BAD(NULL, ic, 3), \
+    BAD(NULL, ic, 4), BAD(NULL, ic, 5), BAD(NULL, ic, 6), BAD(NULL, ic, 7), \
+    BAD(NULL, ic, 8), BAD(NULL, ic, 9), BAD(NULL, ic, 10), BAD(NULL, ic, 11), \
+    BAD(NULL, ic, 12), BAD(NULL, ic, 13), BAD(NULL, ic, 14), BAD(NULL, ic, 15)
+
+const opcode_rec opcode_table[256] =
+{
+    OPC_ROW(I_HALT, "halt", NULL, NULL, NULL, NULL, NULL, NULL,
+	    1, FALSE, FALSE, REG_NONE, REG_NONE, REG_NONE, REG_NONE),
+    OPC_ROW(I_NOP, "nop", NULL, NULL, NULL, NULL, NULL, NULL,
+	    1, FALSE, FALSE, REG_NONE, REG_NONE, REG_NONE, REG_NONE),
+    OPC_ROW(I_RRMOVQ, "rrmovq", "cmovle", "cmovl", "cmove", "cmovne",
+	    "cmovge", "cmovg",
+	    2, TRUE, FALSE, OP_RA, REG_NONE, OP_RB, REG_NONE),
+    OPC_ROW(I_IRMOVQ, "irmovq", NULL, NULL, NULL, NULL, NULL, NULL,
+	    10, TRUE, TRUE, REG_NONE, REG_NONE, OP_RB, REG_NONE),
+    OPC_ROW(I_RMMOVQ, "rmmovq", NULL, NULL, NULL, NULL, NULL, NULL,
+	    10, TRUE, TRUE, OP_RA, OP_RB, REG_NONE, REG_NONE),
+    OPC_ROW(I_MRMOVQ, "mrmovq", NULL, NULL, NULL, NULL, NULL, NULL,
+	    10, TRUE, TRUE, REG_NONE, OP_RB, REG_NONE, OP_RA),
+    OPC_ROW(I_ALU, "addq", "subq", "andq", "xorq", NULL, NULL, NULL,
+	    2, TRUE, FALSE, OP_RA, OP_RB, OP_RB, REG_NONE),
+    OPC_ROW(I_JMP, "jmp", "jle", "jl", "je", "jne", "jge", "jg",
+	    9, FALSE, TRUE, REG_NONE, REG_NONE, REG_NONE, REG_NONE),
+    OPC_ROW(I_CALL, "call", NULL, NULL, NULL, NULL, NULL, NULL,
+	    9, FALSE, TRUE, REG_NONE, REG_RSP, REG_RSP, REG_NONE),
+    OPC_ROW(I_RET, "ret", NULL, NULL, NULL, NULL, NULL, NULL,
+	    1, FALSE, FALSE, REG_RSP, REG_RSP, REG_RSP, REG_NONE),
+    OPC_ROW(I_PUSHQ, "pushq", NULL, NULL, NULL, NULL, NULL, NULL,
+	    2, TRUE, FALSE, OP_RA, REG_RSP, REG_RSP, REG_NONE),
+    OPC_ROW(I_POPQ, "popq", NULL, NULL, NULL, NULL, NULL, NULL,
+	    2, TRUE, FALSE, REG_RSP, REG_RSP, REG_RSP, OP_RA),
+    OPC_ROW(I_IADDQ, "iaddq", NULL, NULL, NULL, NULL, NULL, NULL,
+	    10, TRUE, TRUE, REG_NONE, OP_RB, OP_RB, REG_NONE),
+    BAD_ROW(I_POP2, "pop2"),
+    BAD_ROW(0xE, NULL),
+    BAD_ROW(0xF, NULL)
+};
+
+static int instr_compare(const void *name, const void *instr)
+{
+    return strcmp((char *) name, ((instr_ptr) instr)->name);
+}
+
 instr_ptr find_instr(char *name)
 {
-    int i;
-    for (i = 0; instruction_set[i].name; i++)
-	if (strcmp(instruction_set[i].name,name) == 0)
-	    return &instruction_set[i];
-    return NULL;
+    int n = sizeof(instruction_set) / sizeof(instr_t) - 1;
+    return (instr_ptr) bsearch(name, instruction_set, n, sizeof(instr_t),
+			       instr_compare);
 }
 
 /* Return name of instruction given its encoding */
 char *iname(int instr) {
-    int i;
-    for (i = 0; instruction_set[i].name; i++) {
-	if (instr == instruction_set[i].code)
-	    return instruction_set[i].name;
-    }
-    return "<bad>";
+    char *name = opcode_table[instr & 0xFF].name;
+    return name ? name : "<bad>";
 }
 
 
@@ -128,51 +195,378 @@ instr_ptr bad_instr()
 }
 
 
-mem_t init_mem(int len)
+/* Unaligned little-endian word access */
+static word_t load_word(byte_t *p)
+{
+    word_t val;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    int i;
+    val = 0;
+    for (i = 7; i >= 0; i--)
+	val = (val << 8) | p[i];
+#else
+    memcpy(&val, p, 8);
+#endif
+    return val;
+}
+
+static void store_word(byte_t *p, word_t val)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    int i;
+    for (i = 0; i < 8; i++) {
+	p[i] = (byte_t) val & 0xFF;
+	val >>= 8;
+    }
+#else
+    memcpy(p, &val, 8);
+#endif
+}
+
+/* Can word at pos be accessed?  Negative addresses compare as huge */
+#define WORD_OK(m, pos) ((unsigned long long) (pos) < (unsigned long long) (m)->wend)
+/* Is byte at pos in range? */
+#define BYTE_OK(m, pos) ((unsigned long long) (pos) < (unsigned long long) (m)->len)
+
+/* Find page, checking TLB first */
+#define GET_PAGE(m, vpn, alloc) \
+    ((m)->tlb_vpn == (vpn) ? (m)->tlb_page : find_page((m), (vpn), (alloc)))
+
+/* Initial number of buckets in page table.  Must be power of 2 */
+#define PAGE_HASH 64
+
+/* Image file mapped into memory */
+struct map_rec {
+    void *base;
+    size_t len;
+    int pages;      /* Number of page_bufs holding parts of file */
+};
+
+/* Data of page allocated with its page_buf follows it */
+#define BUF_DATA(buf) ((byte_t *) ((buf) + 1))
+
+mem_t init_mem(word_t len)
 {
 
     mem_t result = (mem_t) malloc(sizeof(mem_rec));
     len = ((len+BPL-1)/BPL)*BPL;
     result->len = len;
-    result->contents = (byte_t *) calloc(len, 1);
+    result->wend = len >= 8 ? len - 7 : 0;
+    result->nbuckets = PAGE_HASH;
+    result->table = (page_t *) calloc(PAGE_HASH, sizeof(page_t));
+    result->npages = 0;
+    result->tlb_vpn = -1;
+    result->tlb_page = NULL;
+    result->data_version = 0;
+    result->base = 0;
+    result->dirty_pages = NULL;
+    result->icache = NULL;
+    result->icache_lo = 0;
+    result->icache_hi = 0;
+    result->code_version = 0;
     return result;
 }
 
+/* Double number of buckets in page table */
+static void grow_table(mem_t m)
+{
+    int nb = 2 * m->nbuckets;
+    page_t *table = (page_t *) calloc(nb, sizeof(page_t));
+    int i;
+    for (i = 0; i < m->nbuckets; i++) {
+	page_t p = m->table[i];
+	while (p) {
+	    page_t next = p->next;
+	    p->next = table[p->vpn & (nb-1)];
+	    table[p->vpn & (nb-1)] = p;
+	    p = next;
+	}
+    }
+    free((void *) m->table);
+    m->table = table;
+    m->nbuckets = nb;
+}
+
+/* Allocate zeroed page data */
+static page_buf_t new_buf()
+{
+    return (page_buf_t) calloc(1, sizeof(page_buf_rec) + MEM_PAGE_SIZE);
+}
+
+/* Drop reference to page data */
+static void release_buf(page_buf_t buf)
+{
+    struct map_rec *map = buf->map;
+    if (--buf->refs > 0)
+	return;
+    if (map && --map->pages == 0) {
+#ifdef HAVE_MMAP
+	munmap(map->base, map->len);
+#endif
+	free((void *) map);
+    }
+    free((void *) buf);
+}
+
+/* Add page vpn, which must not already be present, holding data from buf */
+static page_t add_page(mem_t m, word_t vpn, byte_t *data, page_buf_t buf)
+{
+    page_t p = (page_t) malloc(sizeof(page_rec));
+    if (m->npages >= 2 * m->nbuckets)
+	grow_table(m);
+    p->vpn = vpn;
+    p->data = data;
+    p->buf = buf;
+    buf->refs++;
+    p->code_map = NULL;
+    p->dirty_next = NULL;
+    p->dirty = FALSE;
+    p->all_dirty = FALSE;
+    memset(p->dirty_map, 0, sizeof(p->dirty_map));
+    p->next = m->table[vpn & (m->nbuckets-1)];
+    m->table[vpn & (m->nbuckets-1)] = p;
+    m->npages++;
+    return p;
+}
+
+page_t find_page(mem_t m, word_t vpn, bool_t alloc)
+{
+    page_t p;
+    for (p = m->table[vpn & (m->nbuckets-1)]; p; p = p->next)
+	if (p->vpn == vpn)
+	    break;
+    if (!p) {
+	if (!alloc)
+	    return NULL;
+	page_buf_t buf = new_buf();
+	p = add_page(m, vpn, BUF_DATA(buf), buf);
+    }
+    m->tlb_vpn = vpn;
+    m->tlb_page = p;
+    return p;
+}
+
+page_t write_page(mem_t m, word_t vpn)
+{
+    page_t p = GET_PAGE(m, vpn, TRUE);
+    if (p->buf->refs > 1) {
+	/* Copy on write */
+	page_buf_t buf = new_buf();
+	memcpy(BUF_DATA(buf), p->data, MEM_PAGE_SIZE);
+	release_buf(p->buf);
+	buf->refs = 1;
+	p->buf = buf;
+	p->data = BUF_DATA(buf);
+	m->data_version++;
+    }
+    return p;
+}
+
+/* Free all pages */
+static void free_pages(mem_t m)
+{
+    int i;
+    for (i = 0; i < m->nbuckets; i++) {
+	page_t p = m->table[i];
+	while (p) {
+	    page_t next = p->next;
+	    release_buf(p->buf);
+	    free((void *) p->code_map);
+	    free((void *) p);
+	    p = next;
+	}
+	m->table[i] = NULL;
+    }
+    m->npages = 0;
+    m->tlb_vpn = -1;
+    m->tlb_page = NULL;
+    m->base = 0;
+    m->dirty_pages = NULL;
+    m->data_version++;
+}
+
+/* Put page on list of written pages */
+#define LIST_DIRTY(m, p) \
+    if (!(p)->dirty) { \
+	(p)->dirty = TRUE; \
+	(p)->dirty_next = (m)->dirty_pages; \
+	(m)->dirty_pages = (p); \
+    }
+
+/* Record write of len bytes at offset off of page p.
+   Write must not extend past end of page */
+static void mark_dirty(mem_t m, page_t p, word_t off, int len)
+{
+    word_t w = off >> 3;
+    word_t last = (off + len - 1) >> 3;
+    LIST_DIRTY(m, p);
+    for (; w <= last; w++)
+	p->dirty_map[w >> 3] |= 1 << (w & 0x7);
+}
+
+void dirty_page(mem_t m, page_t p)
+{
+    LIST_DIRTY(m, p);
+    p->all_dirty = TRUE;
+}
+
+/* Forget writes.  Memory contents become the new base */
+static void clear_dirty(mem_t m)
+{
+    page_t p = m->dirty_pages;
+    while (p) {
+	page_t next = p->dirty_next;
+	p->dirty = FALSE;
+	p->all_dirty = FALSE;
+	p->dirty_next = NULL;
+	memset(p->dirty_map, 0, sizeof(p->dirty_map));
+	p = next;
+    }
+    m->dirty_pages = NULL;
+}
+
+/* Allocate new base.  Unique across all memories */
+static unsigned long long new_base()
+{
+    static unsigned long long next_base = 0;
+    return __atomic_add_fetch(&next_base, 1, __ATOMIC_RELAXED);
+}
+
 void clear_mem(mem_t m)
 {
-    memset(m->contents, 0, m->len);
+    free_pages(m);
+    icache_flush(m);
 }
 
 void free_mem(mem_t m)
 {
-    free((void *) m->contents);
+    free_pages(m);
+    free((void *) m->table);
+    free((void *) m->icache);
     free((void *) m);
 }
 
 mem_t copy_mem(mem_t oldm)
 {
     mem_t newm = init_mem(oldm->len);
-    memcpy(newm->contents, oldm->contents, oldm->len);
+    int i;
+    /* Other memories sharing the old base no longer match once the
+       written pages are cleared, so start a new base */
+    if (!oldm->base || oldm->dirty_pages) {
+	clear_dirty(oldm);
+	oldm->base = new_base();
+    }
+    newm->base = oldm->base;
+    for (i = 0; i < oldm->nbuckets; i++) {
+	page_t p;
+	for (p = oldm->table[i]; p; p = p->next)
+	    add_page(newm, p->vpn, p->data, p->buf);
+    }
     return newm;
 }
 
+mem_t clone_mem(mem_t oldm)
+{
+    mem_t newm = init_mem(oldm->len);
+    int i;
+    for (i = 0; i < oldm->nbuckets; i++) {
+	page_t p;
+	for (p = oldm->table[i]; p; p = p->next)
+	    memcpy(find_page(newm, p->vpn, TRUE)->data, p->data,
+		   MEM_PAGE_SIZE);
+    }
+    return newm;
+}
+
+static int vpn_compare(const void *a, const void *b)
+{
+    word_t va = *(const word_t *) a;
+    word_t vb = *(const word_t *) b;
+    return va < vb ? -1 : va > vb;
+}
+
+/* Add numbers of pages allocated in m to vpns, starting at n.
+   Only include written pages if written is set.  Return new count */
+static int list_pages(mem_t m, word_t *vpns, int n, bool_t written)
+{
+    int i;
+    if (written) {
+	page_t p;
+	for (p = m->dirty_pages; p; p = p->dirty_next)
+	    vpns[n++] = p->vpn;
+	return n;
+    }
+    for (i = 0; i < m->nbuckets; i++) {
+	page_t p;
+	for (p = m->table[i]; p; p = p->next)
+	    vpns[n++] = p->vpn;
+    }
+    return n;
+}
+
+/* Get sorted list of pages allocated (or written, if written is set)
+   in either memory.  Set *np to number of pages.  Caller must free list */
+static word_t *union_pages(mem_t oldm, mem_t newm, bool_t written, int *np)
+{
+    word_t *vpns = (word_t *) malloc((oldm->npages + newm->npages + 1)
+				     * sizeof(word_t));
+    int n = list_pages(newm, vpns, list_pages(oldm, vpns, 0, written),
+		       written);
+    int i, j;
+    qsort(vpns, n, sizeof(word_t), vpn_compare);
+    /* Remove duplicates */
+    for (i = 0, j = 0; i < n; i++)
+	if (j == 0 || vpns[j-1] != vpns[i])
+	    vpns[j++] = vpns[i];
+    *np = j;
+    return vpns;
+}
+
 bool_t diff_mem(mem_t oldm, mem_t newm, FILE *outfile)
 {
     word_t pos;
-    int len = oldm->len;
+    word_t len = oldm->len;
     bool_t diff = FALSE;
+    word_t *vpns;
+    int n, i;
+    /* Memories with the same base can only differ in written words.
+       Otherwise, only allocated pages can differ */
+    bool_t written = oldm->base != 0 && oldm->base == newm->base;
     if (newm->len < len)
 	len = newm->len;
-    for (pos = 0; (!diff || outfile) && pos < len; pos += 8) {
-        word_t ov = 0;  word_t nv = 0;
-	get_word_val(oldm, pos, &ov);
-	get_word_val(newm, pos, &nv);
-	if (nv != ov) {
-	    diff = TRUE;
-	    if (outfile)
-		fprintf(outfile, "0x%.4llx:\t0x%.16llx\t0x%.16llx\n", pos, ov, nv);
+    vpns = union_pages(oldm, newm, written, &n);
+    for (i = 0; (!diff || outfile) && i < n; i++) {
+	page_t op = find_page(oldm, vpns[i], FALSE);
+	page_t np = find_page(newm, vpns[i], FALSE);
+	word_t base = vpns[i] << MEM_PAGE_BITS;
+	bool_t all = !written || (op && op->all_dirty) || (np && np->all_dirty);
+	word_t w;
+	for (w = 0; (!diff || outfile) && w < MEM_PAGE_SIZE/8; w++) {
+	    word_t ov, nv;
+	    if (!all) {
+		byte_t bits = (op ? op->dirty_map[w >> 3] : 0) |
+		    (np ? np->dirty_map[w >> 3] : 0);
+		if (!bits) {
+		    /* Skip group of 8 words */
+		    w |= 0x7;
+		    continue;
+		}
+		if (!(bits & (1 << (w & 0x7))))
+		    continue;
+	    }
+	    pos = base + 8*w;
+	    if (pos >= len)
+		break;
+	    ov = op ? load_word(op->data + (pos - base)) : 0;
+	    nv = np ? load_word(np->data + (pos - base)) : 0;
+	    if (nv != ov) {
+		diff = TRUE;
+		if (outfile)
+		    fprintf(outfile, "0x%.4llx:\t0x%.16llx\t0x%.16llx\n", pos, ov, nv);
+	    }
 	}
     }
+    free((void *) vpns);
     return diff;
 }
 
@@ -186,17 +580,42 @@ int hex2dig(char c)
 	return c - 'a' + 10;
 }
 
+/* Add symbol with name of length len to img */
+static void add_symbol(image_t img, int *maxp, word_t addr, char *name, int len)
+{
+    if (img->nsyms == *maxp) {
+	*maxp = *maxp ? 2 * *maxp : 16;
+	img->syms = (symbol_t) realloc(img->syms, *maxp * sizeof(symbol_rec));
+    }
+    img->syms[img->nsyms].addr = addr;
+    img->syms[img->nsyms].name = (char *) malloc(len + 1);
+    memcpy(img->syms[img->nsyms].name, name, len);
+    img->syms[img->nsyms].name[len] = '\0';
+    img->nsyms++;
+}
+
+static int symbol_compare(const void *a, const void *b)
+{
+    symbol_t sa = (symbol_t) a;
+    symbol_t sb = (symbol_t) b;
+    if (sa->addr != sb->addr)
+	return sa->addr < sb->addr ? -1 : 1;
+    return strcmp(sa->name, sb->name);
+}
+
 #define LINELEN 4096
-int load_mem(mem_t m, FILE *infile, int report_error)
+static int load_yo(mem_t m, FILE *infile, image_t img, int report_error)
 {
     /* Read contents of .yo file */
     char buf[LINELEN];
     char c, ch, cl;
     int byte_cnt = 0;
     int lineno = 0;
+    int maxsyms = 0;
     word_t bytepos = 0; 
     while (fgets(buf, LINELEN, infile)) {
 	int cpos = 0;
+	char *src;
 	lineno++;
 	/* Skip white space */
 	while (isspace((int)buf[cpos]))
@@ -230,11 +649,25 @@ int load_mem(mem_t m, FILE *infile, int report_error)
 	while (isspace((int)buf[cpos]))
 	    cpos++;
 
+	/* Label in source listing names this address */
+	if (img && (src = strchr(buf, '|')) != NULL) {
+	    int len = 0;
+	    src++;
+	    while (isspace((int)*src))
+		src++;
+	    if (isalpha((int)*src) || *src == '_' || *src == '.')
+		while (isalnum((int)src[len]) || src[len] == '_' ||
+		       src[len] == '.')
+		    len++;
+	    if (len > 0 && src[len] == ':')
+		add_symbol(img, &maxsyms, bytepos, src, len);
+	}
+
 	/* Get code */
 	while (isxdigit((int)(ch=buf[cpos++])) && 
 	       isxdigit((int)(cl=buf[cpos++]))) {
 	    byte_t byte = 0;
-	    if (bytepos >= m->len) {
+	    if (!BYTE_OK(m, bytepos)) {
 		if (report_error) {
 		    fprintf(stderr,
 			    "Error reading file. Invalid address. 0x%llx\n",
@@ -244,56 +677,566 @@ int load_mem(mem_t m, FILE *infile, int report_error)
 		return 0;
 	    }
 	    byte = hex2dig(ch)*16+hex2dig(cl);
-	    m->contents[bytepos++] = byte;
+	    write_page(m, bytepos >> MEM_PAGE_BITS)->
+		data[bytepos & MEM_PAGE_MASK] = byte;
+	    bytepos++;
 	    byte_cnt++;
 	}
     }
+    icache_flush(m);
     return byte_cnt;
 }
 
+/* Read rest of file into malloc'd buffer.  Set *sizep to its size */
+static byte_t *read_file(FILE *infile, size_t *sizep)
+{
+    size_t max = 1<<16;
+    size_t size = 0;
+    size_t n;
+    byte_t *buf = (byte_t *) malloc(max);
+    while ((n = fread(buf + size, 1, max - size, infile)) > 0) {
+	size += n;
+	if (size == max) {
+	    max *= 2;
+	    buf = (byte_t *) realloc(buf, max);
+	}
+    }
+    *sizep = size;
+    return buf;
+}
+
+/* Words in image header */
+#define IMG_HEADER 6
+
+static int load_bin(mem_t m, FILE *infile, image_t img, int report_error)
+{
+    byte_t *buf = NULL;
+    size_t size = 0;
+    struct map_rec *map = NULL;
+    word_t nsegs, nsyms, strsize, symoff, stroff;
+    word_t i;
+    int byte_cnt = 0;
+    char *err = NULL;
+#ifdef HAVE_MMAP
+    struct stat st;
+    int fd = fileno(infile);
+    /* Map whole file privately, so that pages can be used directly
+       as simulator memory and writes do not reach the file */
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+	void *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE, fd, 0);
+	if (base != MAP_FAILED) {
+	    buf = (byte_t *) base;
+	    size = st.st_size;
+	    map = (struct map_rec *) malloc(sizeof(struct map_rec));
+	    map->base = base;
+	    map->len = size;
+	    map->pages = 0;
+	}
+    }
+#endif
+    if (!buf)
+	buf = read_file(infile, &size);
+
+    if (size < 8*IMG_HEADER || memcmp(buf, IMG_MAGIC, 8) ||
+	load_word(buf+8) != IMG_VERSION) {
+	err = "Bad header";
+	goto done;
+    }
+    nsegs = load_word(buf+24);
+    nsyms = load_word(buf+32);
+    strsize = load_word(buf+40);
+    /* Check table sizes before computing offsets, to avoid overflow */
+    if ((unsigned long long) nsegs > size / 24 ||
+	(unsigned long long) nsyms > size / 16 ||
+	(unsigned long long) strsize > size) {
+	err = "Bad table size";
+	goto done;
+    }
+    symoff = 8*IMG_HEADER + 24*nsegs;
+    stroff = symoff + 16*nsyms;
+    if ((unsigned long long) (stroff + strsize) > size ||
+	(strsize > 0 && buf[stroff + strsize - 1] != '\0')) {
+	err = "Bad table size";
+	goto done;
+    }
+
+    for (i = 0; i < nsegs; i++) {
+	byte_t *seg = buf + 8*IMG_HEADER + 24*i;
+	word_t addr = load_word(seg);
+	word_t len = load_word(seg+8);
+	word_t off = load_word(seg+16);
+	word_t pos;
+	if (len == 0)
+	    continue;
+	if ((unsigned long long) off > size ||
+	    (unsigned long long) len > size - off) {
+	    err = "Segment past end of file";
+	    goto done;
+	}
+	if (!BYTE_OK(m, addr) || !BYTE_OK(m, addr+len-1)) {
+	    if (report_error)
+		fprintf(stderr,
+			"Error reading image. Invalid address. 0x%llx\n",
+			addr);
+	    byte_cnt = 0;
+	    goto done;
+	}
+	/* Map or copy one page at a time */
+	for (pos = addr; pos < addr + len; ) {
+	    word_t vpn = pos >> MEM_PAGE_BITS;
+	    word_t poff = pos & MEM_PAGE_MASK;
+	    word_t n = MEM_PAGE_SIZE - poff;
+	    byte_t *src = buf + off + (pos - addr);
+	    if (n > addr + len - pos)
+		n = addr + len - pos;
+	    if (map && n == MEM_PAGE_SIZE &&
+		((size_t) src & MEM_PAGE_MASK) == 0 &&
+		!find_page(m, vpn, FALSE)) {
+		page_buf_t pb = (page_buf_t) malloc(sizeof(page_buf_rec));
+		pb->refs = 0;
+		pb->map = map;
+		map->pages++;
+		add_page(m, vpn, src, pb);
+	    } else
+		memcpy(write_page(m, vpn)->data + poff, src, n);
+	    pos += n;
+	}
+	byte_cnt += len;
+    }
+
+    if (img) {
+	img->entry = load_word(buf+16);
+	img->nsyms = 0;
+	img->syms = (symbol_t) malloc((nsyms + 1) * sizeof(symbol_rec));
+	for (i = 0; i < nsyms; i++) {
+	    byte_t *sym = buf + symoff + 16*i;
+	    word_t name = load_word(sym+8);
+	    if ((unsigned long long) name >= strsize) {
+		err = "Bad symbol";
+		goto done;
+	    }
+	    img->syms[i].addr = load_word(sym);
+	    img->syms[i].name = strdup((char *) buf + stroff + name);
+	    img->nsyms++;
+	}
+	qsort(img->syms, img->nsyms, sizeof(symbol_rec), symbol_compare);
+    }
+
+ done:
+    if (err) {
+	if (report_error)
+	    fprintf(stderr, "Error reading image. %s\n", err);
+	byte_cnt = 0;
+    }
+    /* Mapping stays until no page uses it */
+    if (map) {
+	if (map->pages == 0) {
+#ifdef HAVE_MMAP
+	    munmap(buf, size);
+#endif
+	    free((void *) map);
+	}
+    } else
+	free((void *) buf);
+    icache_flush(m);
+    return byte_cnt;
+}
+
+int load_image(mem_t m, FILE *infile, image_t img, int report_error)
+{
+    int c = getc(infile);
+    int byte_cnt;
+    /* Writes by loader are not tracked */
+    m->base = 0;
+    if (img) {
+	img->entry = 0;
+	img->nsyms = 0;
+	img->syms = NULL;
+    }
+    if (c == EOF)
+	return 0;
+    ungetc(c, infile);
+    if (c == IMG_MAGIC[0])
+	return load_bin(m, infile, img, report_error);
+    byte_cnt = load_yo(m, infile, img, report_error);
+    if (img)
+	qsort(img->syms, img->nsyms, sizeof(symbol_rec), symbol_compare);
+    return byte_cnt;
+}
+
+int load_mem(mem_t m, FILE *infile, int report_error)
+{
+    return load_image(m, infile, NULL, report_error);
+}
+
+void free_image(image_t img)
+{
+    int i;
+    for (i = 0; i < img->nsyms; i++)
+	free((void *) img->syms[i].name);
+    free((void *) img->syms);
+    img->nsyms = 0;
+    img->syms = NULL;
+}
+
+/* Get byte at pos, reading unallocated pages as 0 */
+static byte_t page_byte(mem_t m, word_t pos)
+{
+    page_t p = GET_PAGE(m, pos >> MEM_PAGE_BITS, FALSE);
+    return p ? p->data[pos & MEM_PAGE_MASK] : 0;
+}
+
+static void put_word(FILE *outfile, word_t val)
+{
+    byte_t b[8];
+    store_word(b, val);
+    fwrite(b, 1, 8, outfile);
+}
+
+/* Does segment of len bytes at addr cover some page completely? */
+#define COVERS_PAGE(addr, len) \
+    ((((addr) + MEM_PAGE_MASK) & ~MEM_PAGE_MASK) + MEM_PAGE_SIZE \
+     <= (addr) + (len))
+
+bool_t save_image(mem_t m, image_t img, FILE *outfile)
+{
+    word_t *vpns = (word_t *) malloc((m->npages + 1) * sizeof(word_t));
+    int n = list_pages(m, vpns, 0, FALSE);
+    /* Segments: address, size, file offset */
+    word_t *segs = (word_t *) malloc(3 * (n + 1) * sizeof(word_t));
+    int nsegs = 0;
+    int nsyms = img ? img->nsyms : 0;
+    word_t strsize = 0;
+    word_t off, pos;
+    int i, j;
+
+    /* Each run of consecutive pages, less zero bytes at either end,
+       becomes a segment.  Keep at least one byte, so that a program
+       of zeros still loads */
+    qsort(vpns, n, sizeof(word_t), vpn_compare);
+    for (i = 0; i < n; i = j) {
+	word_t lo, hi;
+	for (j = i + 1; j < n && vpns[j] == vpns[j-1] + 1; j++)
+	    ;
+	lo = vpns[i] << MEM_PAGE_BITS;
+	hi = (vpns[j-1] + 1) << MEM_PAGE_BITS;
+	while (lo < hi - 1 && page_byte(m, lo) == 0)
+	    lo++;
+	/* Keep last page whole in multi-page segments that can be
+	   mapped */
+	if (j - i == 1 || !COVERS_PAGE(lo, hi - lo))
+	    while (hi > lo + 1 && page_byte(m, hi-1) == 0)
+		hi--;
+	segs[3*nsegs] = lo;
+	segs[3*nsegs+1] = hi - lo;
+	nsegs++;
+    }
+
+    for (i = 0; i < nsyms; i++)
+	strsize += strlen(img->syms[i].name) + 1;
+    off = 8*IMG_HEADER + 24*nsegs + 16*nsyms + strsize;
+    for (i = 0; i < nsegs; i++) {
+	word_t addr = segs[3*i];
+	word_t len = segs[3*i+1];
+	/* Align data with its address, so that pages can be mapped */
+	if (COVERS_PAGE(addr, len))
+	    off += (addr - off) & MEM_PAGE_MASK;
+	segs[3*i+2] = off;
+	off += len;
+    }
+
+    fwrite(IMG_MAGIC, 1, 8, outfile);
+    put_word(outfile, IMG_VERSION);
+    put_word(outfile, img ? img->entry : 0);
+    put_word(outfile, nsegs);
+    put_word(outfile, nsyms);
+    put_word(outfile, strsize);
+    for (i = 0; i < 3*nsegs; i++)
+	put_word(outfile, segs[i]);
+    for (i = 0, off = 0; i < nsyms; i++) {
+	put_word(outfile, img->syms[i].addr);
+	put_word(outfile, off);
+	off += strlen(img->syms[i].name) + 1;
+    }
+    for (i = 0; i < nsyms; i++)
+	fwrite(img->syms[i].name, 1, strlen(img->syms[i].name) + 1, outfile);
+    off = 8*IMG_HEADER + 24*nsegs + 16*nsyms + strsize;
+    for (i = 0; i < nsegs; i++) {
+	word_t addr = segs[3*i];
+	word_t end = addr + segs[3*i+1];
+	for (; off < segs[3*i+2]; off++)
+	    putc(0, outfile);
+	for (pos = addr; pos < end; ) {
+	    word_t n = MEM_PAGE_SIZE - (pos & MEM_PAGE_MASK);
+	    if (n > end - pos)
+		n = end - pos;
+	    fwrite(GET_PAGE(m, pos >> MEM_PAGE_BITS, FALSE)->data +
+		   (pos & MEM_PAGE_MASK), 1, n, outfile);
+	    pos += n;
+	}
+	off += end - addr;
+    }
+    free((void *) vpns);
+    free((void *) segs);
+    return !ferror(outfile);
+}
+
 bool_t get_byte_val(mem_t m, word_t pos, byte_t *dest)
 {
-    if (pos < 0 || pos >= m->len)
+    page_t p;
+    if (!BYTE_OK(m, pos))
 	return FALSE;
-    *dest = m->contents[pos];
+    p = GET_PAGE(m, pos >> MEM_PAGE_BITS, FALSE);
+    *dest = p ? p->data[pos & MEM_PAGE_MASK] : 0;
     return TRUE;
 }
 
 bool_t get_word_val(mem_t m, word_t pos, word_t *dest)
 {
-    int i;
-    word_t val;
-    if (pos < 0 || pos + 8 > m->len)
+    word_t off = pos & MEM_PAGE_MASK;
+    page_t p;
+    if (!WORD_OK(m, pos))
 	return FALSE;
-    val = 0;
-    for (i = 0; i < 8; i++) {
-	word_t b =  m->contents[pos+i] & 0xFF;
-	val = val | (b <<(8*i));
+    if (off > MEM_PAGE_SIZE - 8) {
+	/* Word spans two pages */
+	int i;
+	word_t val = 0;
+	for (i = 7; i >= 0; i--) {
+	    byte_t b = 0;
+	    get_byte_val(m, pos+i, &b);
+	    val = (val << 8) | b;
+	}
+	*dest = val;
+	return TRUE;
     }
-    *dest = val;
+    p = GET_PAGE(m, pos >> MEM_PAGE_BITS, FALSE);
+    *dest = p ? load_word(p->data + off) : 0;
     return TRUE;
 }
 
 bool_t set_byte_val(mem_t m, word_t pos, byte_t val)
 {
-    if (pos < 0 || pos >= m->len)
+    page_t p;
+    if (!BYTE_OK(m, pos))
 	return FALSE;
-    m->contents[pos] = val;
+    if (pos < m->icache_hi && pos >= m->icache_lo)
+	icache_invalidate(m, pos, 1);
+    p = write_page(m, pos >> MEM_PAGE_BITS);
+    p->data[pos & MEM_PAGE_MASK] = val;
+    mark_dirty(m, p, pos & MEM_PAGE_MASK, 1);
     return TRUE;
 }
 
 bool_t set_word_val(mem_t m, word_t pos, word_t val)
 {
-    int i;
-    if (pos < 0 || pos + 8 > m->len)
+    word_t off = pos & MEM_PAGE_MASK;
+    page_t p;
+    if (!WORD_OK(m, pos))
 	return FALSE;
-    for (i = 0; i < 8; i++) {
-	m->contents[pos+i] = (byte_t) val & 0xFF;
-	val >>= 8;
+    if (pos < m->icache_hi && pos + 8 > m->icache_lo)
+	icache_invalidate(m, pos, 8);
+    if (off > MEM_PAGE_SIZE - 8) {
+	/* Word spans two pages */
+	int i;
+	for (i = 0; i < 8; i++) {
+	    set_byte_val(m, pos+i, (byte_t) val & 0xFF);
+	    val >>= 8;
+	}
+	return TRUE;
     }
+    p = write_page(m, pos >> MEM_PAGE_BITS);
+    store_word(p->data + off, val);
+    mark_dirty(m, p, off, 8);
     return TRUE;
 }
 
+dinstr_ptr icache_lookup(mem_t m, word_t pc)
+{
+    dinstr_ptr d;
+    if (!m->icache)
+	return NULL;
+    d = &m->icache[pc & (ICACHE_SIZE-1)];
+    if (d->valid && d->pc == pc)
+	return d;
+    return NULL;
+}
+
+/* Can decoded instruction execute without raising STAT_INS? */
+static bool_t instr_legal(dinstr_ptr d)
+{
+    switch (d->icode) {
+    case I_HALT:
+    case I_NOP:
+    case I_ALU:
+    case I_JMP:
+    case I_CALL:
+    case I_RET:
+	return TRUE;
+    case I_RRMOVQ:
+	return reg_valid(d->ra) && reg_valid(d->rb);
+    case I_IRMOVQ:
+    case I_IADDQ:
+	return reg_valid(d->rb);
+    case I_RMMOVQ:
+    case I_MRMOVQ:
+    case I_PUSHQ:
+    case I_POPQ:
+	return reg_valid(d->ra);
+    default:
+	return FALSE;
+    }
+}
+
+/* Fetch instruction bytes at pc without using the cache.
+   Flags indicate which parts of the instruction could be read */
+static void fetch_instr(mem_t m, word_t pc, dinstr_ptr d,
+			bool_t *ok0, bool_t *ok1, bool_t *okc)
+{
+    byte_t buf[MAX_INSTR_LEN];
+    byte_t *p;
+    word_t off = pc & MEM_PAGE_MASK;
+    byte_t byte0;
+    byte_t byte1;
+    const opcode_rec *op;
+    word_t ftpc = pc;  /* Fall-through PC */
+
+    d->pc = pc;
+    d->ra = REG_NONE;
+    d->rb = REG_NONE;
+    d->valc = 0;
+    *ok1 = *okc = TRUE;
+
+    *ok0 = BYTE_OK(m, pc);
+    if (!*ok0)
+	return;
+    if (off <= MEM_PAGE_SIZE - MAX_INSTR_LEN) {
+	/* Whole instruction lies within one page */
+	page_t pg = GET_PAGE(m, pc >> MEM_PAGE_BITS, FALSE);
+	if (pg)
+	    p = pg->data + off;
+	else {
+	    memset(buf, 0, MAX_INSTR_LEN);
+	    p = buf;
+	}
+    } else {
+	/* Bytes beyond end of memory read as 0 */
+	int i;
+	for (i = 0; i < MAX_INSTR_LEN; i++)
+	    if (!get_byte_val(m, pc+i, &buf[i]))
+		buf[i] = 0;
+	p = buf;
+    }
+    byte0 = p[0];
+    ftpc++;
+
+    op = &opcode_table[byte0];
+    d->icode = op->icode;
+    d->ifun = op->ifun;
+
+    if (op->regids) {
+	*ok1 = ftpc < m->len;
+	byte1 = p[1];
+	ftpc++;
+	d->ra = HI4(byte1);
+	d->rb = LO4(byte1);
+    }
+
+    if (op->valc) {
+	*okc = WORD_OK(m, ftpc);
+	if (*okc)
+	    d->valc = load_word(p + (ftpc - pc));
+	ftpc += 8;
+    }
+    d->valp = ftpc;
+}
+
+bool_t decode_instr(mem_t m, word_t pc, dinstr_ptr d)
+{
+    bool_t ok0, ok1, okc;
+    dinstr_ptr cd = icache_lookup(m, pc);
+    if (cd) {
+	*d = *cd;
+	return TRUE;
+    }
+    fetch_instr(m, pc, d, &ok0, &ok1, &okc);
+    if (!(ok0 && ok1 && okc))
+	return FALSE;
+    icache_insert(m, d);
+    d->legal = instr_legal(d);
+    return TRUE;
+}
+
+void icache_insert(mem_t m, dinstr_ptr d)
+{
+    dinstr_ptr slot;
+    word_t pos;
+    if (!m->icache)
+	m->icache = (dinstr_ptr) calloc(ICACHE_SIZE, sizeof(dinstr_rec));
+    if (m->icache_lo >= m->icache_hi) {
+	/* Cache is empty */
+	m->icache_lo = d->pc;
+	m->icache_hi = d->valp;
+    }
+    if (d->pc < m->icache_lo)
+	m->icache_lo = d->pc;
+    if (d->valp > m->icache_hi)
+	m->icache_hi = d->valp;
+    for (pos = d->pc; pos < d->valp; pos++) {
+	page_t p = GET_PAGE(m, pos >> MEM_PAGE_BITS, TRUE);
+	word_t off = pos & MEM_PAGE_MASK;
+	if (!p->code_map)
+	    p->code_map = (byte_t *) calloc(MEM_PAGE_SIZE/8, 1);
+	p->code_map[off/8] |= 1 << (off%8);
+    }
+    slot = &m->icache[d->pc & (ICACHE_SIZE-1)];
+    *slot = *d;
+    slot->legal = instr_legal(d);
+    slot->valid = TRUE;
+}
+
+void icache_invalidate(mem_t m, word_t pos, int len)
+{
+    word_t pc;
+    bool_t is_code = FALSE;
+    if (!m->icache)
+	return;
+    for (pc = pos; pc < pos + len; pc++) {
+	page_t p = GET_PAGE(m, pc >> MEM_PAGE_BITS, FALSE);
+	word_t off = pc & MEM_PAGE_MASK;
+	if (p && p->code_map && (p->code_map[off/8] & (1 << (off%8)))) {
+	    is_code = TRUE;
+	    p->code_map[off/8] &= ~(1 << (off%8));
+	}
+    }
+    if (!is_code)
+	return;
+    /* Any instruction starting up to MAX_INSTR_LEN-1 bytes earlier
+       could overlap the written bytes */
+    for (pc = pos - (MAX_INSTR_LEN-1); pc < pos + len; pc++) {
+	dinstr_ptr d = &m->icache[pc & (ICACHE_SIZE-1)];
+	if (d->valid && d->pc == pc && d->valp > pos)
+	    d->valid = FALSE;
+    }
+    m->code_version++;
+}
+
+void icache_flush(mem_t m)
+{
+    if (m->icache) {
+	int i;
+	memset(m->icache, 0, ICACHE_SIZE * sizeof(dinstr_rec));
+	for (i = 0; i < m->nbuckets; i++) {
+	    page_t p;
+	    for (p = m->table[i]; p; p = p->next)
+		if (p->code_map)
+		    memset(p->code_map, 0, MEM_PAGE_SIZE/8);
+	}
+    }
+    m->icache_lo = m->icache_hi = 0;
+    m->code_version++;
+}
+
 void dump_memory(FILE *outfile, mem_t m, word_t pos, int len)
 {
     int i, j;
@@ -317,69 +1260,66 @@ void dump_memory(FILE *outfile, mem_t m, word_t pos, int len)
     }
 }
 
-mem_t init_reg()
+regfile_t init_reg()
 {
-    return init_mem(128);
+    return (regfile_t) calloc(1, sizeof(regfile_rec));
 }
 
-void free_reg(mem_t r)
+void free_reg(regfile_t r)
 {
-    free_mem(r);
+    free((void *) r);
 }
 
-mem_t copy_reg(mem_t oldr)
+void clear_reg(regfile_t r)
 {
-    return copy_mem(oldr);
+    memset(r->regs, 0, sizeof(r->regs));
 }
 
-bool_t diff_reg(mem_t oldr, mem_t newr, FILE *outfile)
+regfile_t copy_reg(regfile_t oldr)
 {
-    word_t pos;
-    int len = oldr->len;
+    regfile_t newr = init_reg();
+    memcpy(newr->regs, oldr->regs, sizeof(oldr->regs));
+    return newr;
+}
+
+bool_t diff_reg(regfile_t oldr, regfile_t newr, FILE *outfile)
+{
+    reg_id_t id;
     bool_t diff = FALSE;
-    if (newr->len < len)
-	len = newr->len;
-    for (pos = 0; (!diff || outfile) && pos < len; pos += 8) {
-        word_t ov = 0;
-        word_t nv = 0;
-	get_word_val(oldr, pos, &ov);
-	get_word_val(newr, pos, &nv);
+    for (id = 0; (!diff || outfile) && id < REG_NONE; id++) {
+        word_t ov = oldr->regs[id];
+        word_t nv = newr->regs[id];
 	if (nv != ov) {
 	    diff = TRUE;
 	    if (outfile)
 		fprintf(outfile, "%s:\t0x%.16llx\t0x%.16llx\n",
-			reg_table[pos/8].name, ov, nv);
+			reg_table[id].name, ov, nv);
 	}
     }
     return diff;
 }
 
-word_t get_reg_val(mem_t r, reg_id_t id)
+word_t get_reg_val(regfile_t r, reg_id_t id)
 {
-    word_t val = 0;
     if (id >= REG_NONE)
-		return 0;
-    get_word_val(r,id*8, &val);
-    return val;
+	return 0;
+    return r->regs[id];
 }
 
-void set_reg_val(mem_t r, reg_id_t id, word_t val)
+void set_reg_val(regfile_t r, reg_id_t id, word_t val)
 {
-    if (id < REG_NONE) {
-		set_word_val(r,id*8,val);
-    }
+    if (id < REG_NONE)
+	r->regs[id] = val;
 }
      
-void dump_reg(FILE *outfile, mem_t r) {
+void dump_reg(FILE *outfile, regfile_t r) {
     reg_id_t id;
     for (id = 0; reg_valid(id); id++) {
 	fprintf(outfile, "   %s  ", reg_table[id].name);
     }
     fprintf(outfile, "\n");
     for (id = 0; reg_valid(id); id++) {
-	word_t val = 0;
-	get_word_val(r, id*8, &val);
-	fprintf(outfile, " %llx", val);
+	fprintf(outfile, " %llx", r->regs[id]);
     }
     fprintf(outfile, "\n");
 }
@@ -484,13 +1424,13 @@ char *stat_name(stat_t e)
 
 /**************** Implementation of ISA model ************************/
 
-state_ptr new_state(int memlen)
+state_ptr new_state(word_t memlen)
 {
     state_ptr result = (state_ptr) malloc(sizeof(state_rec));
     result->pc = 0;
     result->r = init_reg();
     result->m = init_mem(memlen);
-    result->cc = DEFAULT_CC;
+    lazy_cc_load(&result->cc, DEFAULT_CC);
     return result;
 }
 
@@ -512,6 +1452,8 @@ state_ptr copy_state(state_ptr s) {
 
 bool_t diff_state(state_ptr olds, state_ptr news, FILE *outfile) {
     bool_t diff = FALSE;
+    cc_t occ = lazy_cc_get(&olds->cc);
+    cc_t ncc = lazy_cc_get(&news->cc);
 
     if (olds->pc != news->pc) {
 	diff = TRUE;
@@ -519,10 +1461,10 @@ bool_t diff_state(state_ptr olds, state_ptr news, FILE *outfile) {
 	    fprintf(outfile, "pc:\t0x%.16llx\t0x%.16llx\n", olds->pc, news->pc);
 	}
     }
-    if (olds->cc != news->cc) {
+    if (occ != ncc) {
 	diff = TRUE;
 	if (outfile) {
-	    fprintf(outfile, "cc:\t%s\t%s\n", cc_name(olds->cc), cc_name(news->cc));
+	    fprintf(outfile, "cc:\t%s\t%s\n", cc_name(occ), cc_name(ncc));
 	}
     }
     if (diff_reg(olds->r, news->r, outfile))
@@ -569,56 +1511,114 @@ bool_t cond_holds(cc_t cc, cond_t bcond) {
     return jump;
 }
 
+void lazy_cc_set(lazy_cc_t l, alu_t op, word_t argA, word_t argB)
+{
+    if (op >= A_NONE) {
+	/* Not a real operation.  Cannot be told apart from A_NONE */
+	lazy_cc_load(l, compute_cc(op, argA, argB));
+	return;
+    }
+    l->op = op;
+    l->argA = argA;
+    l->argB = argB;
+}
+
+void lazy_cc_load(lazy_cc_t l, cc_t cc)
+{
+    l->op = A_NONE;
+    l->cc = cc;
+}
+
+cc_t lazy_cc_get(lazy_cc_t l)
+{
+    if (l->op != A_NONE) {
+	l->cc = compute_cc(l->op, l->argA, l->argB);
+	l->op = A_NONE;
+    }
+    return l->cc;
+}
+
+/* Evaluate condition for codes set by comparing x with y */
+static bool_t compare_holds(word_t x, word_t y, cond_t bcond)
+{
+    switch(bcond) {
+    case C_YES:
+	return TRUE;
+    case C_LE:
+	return x <= y;
+    case C_L:
+	return x < y;
+    case C_E:
+	return x == y;
+    case C_NE:
+	return x != y;
+    case C_GE:
+	return x >= y;
+    case C_G:
+	return x > y;
+    default:
+	return FALSE;
+    }
+}
+
+bool_t lazy_cond_holds(lazy_cc_t l, cond_t bcond)
+{
+    switch (l->op) {
+    case A_SUB:
+	/* S^O and Z after argB-argA are exactly argB < argA and
+	   argB == argA */
+	return compare_holds(l->argB, l->argA, bcond);
+    case A_AND:
+	/* No overflow, so conditions only depend on the result */
+	return compare_holds(l->argA & l->argB, 0, bcond);
+    case A_XOR:
+	return compare_holds(l->argA ^ l->argB, 0, bcond);
+    default:
+	return cond_holds(lazy_cc_get(l), bcond);
+    }
+}
+
 
 /* Execute single instruction.  Return status. */
 stat_t step_state(state_ptr s, FILE *error_file)
 {
     word_t argA, argB;
     byte_t byte0 = 0;
-    byte_t byte1 = 0;
     itype_t hi0;
     alu_t  lo0;
     reg_id_t hi1 = REG_NONE;
     reg_id_t lo1 = REG_NONE;
     bool_t ok1 = TRUE;
     word_t cval = 0;
-    word_t okc = TRUE;
+    bool_t okc = TRUE;
     word_t val, dval;
-    bool_t need_regids;
-    bool_t need_imm;
-    word_t ftpc = s->pc;  /* Fall-through PC */
-
-    if (!get_byte_val(s->m, ftpc, &byte0)) {
-	if (error_file)
-	    fprintf(error_file,
-		    "PC = 0x%llx, Invalid instruction address\n", s->pc);
-	return STAT_ADR;
-    }
-    ftpc++;
-
-    hi0 = HI4(byte0);
-    lo0 = LO4(byte0);
-
-    need_regids =
-	(hi0 == I_RRMOVQ || hi0 == I_ALU || hi0 == I_PUSHQ ||
-	 hi0 == I_POPQ || hi0 == I_IRMOVQ || hi0 == I_RMMOVQ ||
-	 hi0 == I_MRMOVQ || hi0 == I_IADDQ);
-
-    if (need_regids) {
-	ok1 = get_byte_val(s->m, ftpc, &byte1);
-	ftpc++;
-	hi1 = HI4(byte1);
-	lo1 = LO4(byte1);
+    word_t ftpc;  /* Fall-through PC */
+    dinstr_rec dr;
+    dinstr_ptr d = icache_lookup(s->m, s->pc);
+
+    if (!d) {
+	/* Not decoded before */
+	bool_t ok0;
+	d = &dr;
+	fetch_instr(s->m, s->pc, d, &ok0, &ok1, &okc);
+	if (!ok0) {
+	    if (error_file)
+		fprintf(error_file,
+			"PC = 0x%llx, Invalid instruction address\n", s->pc);
+	    return STAT_ADR;
+	}
+	/* Only cache instructions that were fetched completely */
+	if (ok1 && okc)
+	    icache_insert(s->m, d);
     }
 
-    need_imm =
-	(hi0 == I_IRMOVQ || hi0 == I_RMMOVQ || hi0 == I_MRMOVQ ||
-	 hi0 == I_JMP || hi0 == I_CALL || hi0 == I_IADDQ);
-
-    if (need_imm) {
-	okc = get_word_val(s->m, ftpc, &cval);
-	ftpc += 8;
-    }
+    hi0 = d->icode;
+    lo0 = d->ifun;
+    byte0 = HPACK(hi0, lo0);
+    hi1 = d->ra;
+    lo1 = d->rb;
+    cval = d->valc;
+    ftpc = d->valp;
 
     switch (hi0) {
     case I_NOP:
@@ -649,7 +1649,7 @@ stat_t step_state(state_ptr s, FILE *error_file)
 	    return STAT_INS;
 	}
 	val = get_reg_val(s->r, hi1);
-	if (cond_holds(s->cc, lo0))
+	if (lazy_cond_holds(&s->cc, lo0))
 	  set_reg_val(s->r, lo1, val);
 	s->pc = ftpc;
 	break;
@@ -747,7 +1747,7 @@ stat_t step_state(state_ptr s, FILE *error_file)
 	argB = get_reg_val(s->r, lo1);
 	val = compute_alu(lo0, argA, argB);
 	set_reg_val(s->r, lo1, val);
-	s->cc = compute_cc(lo0, argA, argB);
+	lazy_cc_set(&s->cc, lo0, argA, argB);
 	s->pc = ftpc;
 	break;
     case I_JMP:
@@ -763,7 +1763,7 @@ stat_t step_state(state_ptr s, FILE *error_file)
 			"PC = 0x%llx, Invalid instruction address\n", s->pc);
 	    return STAT_ADR;
 	}
-	if (cond_holds(s->cc, lo0))
+	if (lazy_cond_holds(&s->cc, lo0))
 	    s->pc = cval;
 	else
 	    s->pc = ftpc;
@@ -877,7 +1877,7 @@ stat_t step_state(state_ptr s, FILE *error_file)
 	argB = get_reg_val(s->r, lo1);
 	val = argB + cval;
 	set_reg_val(s->r, lo1, val);
-	s->cc = compute_cc(A_ADD, cval, argB);
+	lazy_cc_set(&s->cc, A_ADD, cval, argB);
 	s->pc = ftpc;
 	break;
     default:
@@ -888,3 +1888,161 @@ stat_t step_state(state_ptr s, FILE *error_file)
     }
     return STAT_AOK;
 }
+
+
+/*
+ * Threaded interpreter.  Instructions found in the predecoded
+ * instruction cache are executed by handlers that jump directly to
+ * one another, with the register file and condition codes held in
+ * local variables.  Anything out of the ordinary (uncached or illegal
+ * instruction, memory fault) is passed to step_state, which also
+ * fills the cache.
+ */
+stat_t run_state(state_ptr s, word_t max_steps, word_t *stepsp,
+		 FILE *error_file)
+{
+#ifdef __GNUC__
+    static void *dispatch[16] = {
+	&&do_halt, &&do_nop, &&do_rrmovq, &&do_irmovq,
+	&&do_rmmovq, &&do_mrmovq, &&do_alu, &&do_jmp,
+	&&do_call, &&do_ret, &&do_pushq, &&do_popq,
+	&&do_iaddq, &&slow, &&slow, &&slow
+    };
+    mem_t m = s->m;
+    word_t reg[REG_NONE+1]; /* reg[REG_NONE] always holds 0 */
+    word_t pc = s->pc;
+    cc_t cc = lazy_cc_get(&s->cc);
+    word_t steps = 0;
+    stat_t e = STAT_AOK;
+    dinstr_ptr d;
+    word_t val, addr;
+
+    memcpy(reg, s->r->regs, sizeof(reg));
+
+#define NEXT							\
+    do {							\
+	if (steps >= max_steps)					\
+	    goto done;						\
+	d = &m->icache[pc & (ICACHE_SIZE-1)];			\
+	if (!d->valid || d->pc != pc || !d->legal)		\
+	    goto slow;						\
+	steps++;						\
+	goto *dispatch[d->icode];				\
+    } while (0)
+
+    if (max_steps <= 0)
+	goto done;
+    if (!m->icache)
+	goto slow;
+    NEXT;
+
+ do_halt:
+    e = STAT_HLT;
+    goto done;
+ do_nop:
+    pc = d->valp;
+    NEXT;
+ do_rrmovq:
+    if (cond_holds(cc, d->ifun))
+	reg[d->rb] = reg[d->ra];
+    pc = d->valp;
+    NEXT;
+ do_irmovq:
+    reg[d->rb] = d->valc;
+    pc = d->valp;
+    NEXT;
+ do_rmmovq:
+    if (!set_word_val(m, d->valc + reg[d->rb], reg[d->ra]))
+	goto fault;
+    pc = d->valp;
+    NEXT;
+ do_mrmovq:
+    if (!get_word_val(m, d->valc + reg[d->rb], &val))
+	goto fault;
+    reg[d->ra] = val;
+    pc = d->valp;
+    NEXT;
+ do_alu:
+    val = compute_alu(d->ifun, reg[d->ra], reg[d->rb]);
+    cc = compute_cc(d->ifun, reg[d->ra], reg[d->rb]);
+    reg[d->rb] = val;
+    reg[REG_NONE] = 0;
+    pc = d->valp;
+    NEXT;
+ do_jmp:
+    pc = cond_holds(cc, d->ifun) ? d->valc : d->valp;
+    NEXT;
+ do_call:
+    addr = reg[REG_RSP] - 8;
+    if (!set_word_val(m, addr, d->valp))
+	goto fault;
+    reg[REG_RSP] = addr;
+    pc = d->valc;
+    NEXT;
+ do_ret:
+    addr = reg[REG_RSP];
+    if (!get_word_val(m, addr, &val))
+	goto fault;
+    reg[REG_RSP] = addr + 8;
+    pc = val;
+    NEXT;
+ do_pushq:
+    val = reg[d->ra];
+    addr = reg[REG_RSP] - 8;
+    if (!set_word_val(m, addr, val))
+	goto fault;
+    reg[REG_RSP] = addr;
+    pc = d->valp;
+    NEXT;
+ do_popq:
+    addr = reg[REG_RSP];
+    if (!get_word_val(m, addr, &val))
+	goto fault;
+    reg[REG_RSP] = addr + 8;
+    reg[d->ra] = val;
+    pc = d->valp;
+    NEXT;
+ do_iaddq:
+    val = reg[d->rb];
+    cc = compute_cc(A_ADD, d->valc, val);
+    reg[d->rb] = val + d->valc;
+    pc = d->valp;
+    NEXT;
+
+ fault:
+    /* Handler made no changes.  Rerun instruction to report error */
+    steps--;
+ slow:
+    s->pc = pc;
+    lazy_cc_load(&s->cc, cc);
+    memcpy(s->r->regs, reg, sizeof(reg));
+    e = step_state(s, error_file);
+    steps++;
+    pc = s->pc;
+    cc = lazy_cc_get(&s->cc);
+    memcpy(reg, s->r->regs, sizeof(reg));
+    if (e != STAT_AOK)
+	goto done;
+    NEXT;
+#undef NEXT
+
+ done:
+    s->pc = pc;
+    lazy_cc_load(&s->cc, cc);
+    memcpy(s->r->regs, reg, sizeof(reg));
+    if (stepsp)
+	*stepsp = steps;
+    return e;
+#else
+    /* No computed goto.  Fall back to stepping */
+    word_t steps = 0;
+    stat_t e = STAT_AOK;
+    while (steps < max_steps && e == STAT_AOK) {
+	e = step_state(s, error_file);
+	steps++;
+    }
+    if (stepsp)
+	*stepsp = steps;
+    return e;
+#endif
+}
@@ -80,6 +80,34 @@ typedef struct {
 
 instr_ptr find_instr(char *name);
 
+/* Register roles in opcode_rec.  Other values name a fixed register */
+#define OP_RA 0x10   /* Register in high half of register byte */
+#define OP_RB 0x11   /* Register in low half of register byte */
+
+/* Register ID filling role, given fields ra and rb of register byte */
+#define OP_REG(role, ra, rb) \
+  ((role) == OP_RA ? (ra) : (role) == OP_RB ? (rb) : (role))
+
+/* How to decode an instruction, given its first byte */
+typedef struct {
+  char *name;      /* Mnemonic, or NULL if no instruction has this byte */
+  unsigned char icode;
+  unsigned char ifun;
+  int len;         /* Bytes in encoding */
+  bool_t valid;    /* icode is an instruction.  As in the ISA simulator,
+		      function codes are not checked */
+  bool_t ifun_valid;  /* Function code is defined too, as SEQ checks */
+  bool_t regids;   /* Has register byte */
+  bool_t valc;     /* Has constant word, after register byte if any */
+  unsigned char srca;   /* Register roles, for the pipeline */
+  unsigned char srcb;
+  unsigned char deste;
+  unsigned char destm;
+} opcode_rec, *opcode_ptr;
+
+/* Indexed by first byte of instruction */
+extern const opcode_rec opcode_table[256];
+
 /* Return invalid instruction for error handling purposes */
 instr_ptr bad_instr();
 
@@ -88,27 +116,114 @@ typedef unsigned char byte_t;
 typedef long long int word_t;
 typedef long long unsigned uword_t;
 
-/* Represent a memory as an array of bytes */
+/* Longest instruction encoding */
+#define MAX_INSTR_LEN 10
+
+/* Predecoded instruction, as cached by step_state */
 typedef struct {
-  int len;
+  bool_t valid;
+  word_t pc;    /* Address of instruction */
+  byte_t icode;
+  byte_t ifun;
+  byte_t ra;
+  byte_t rb;
+  word_t valc;
+  word_t valp;  /* Address of next sequential instruction */
+  bool_t legal; /* Register fields valid, so cannot raise STAT_INS */
+} dinstr_rec, *dinstr_ptr;
+
+/* Number of entries in predecoded instruction cache.  Must be power of 2 */
+#define ICACHE_SIZE 1024
+
+/* Memory is stored as pages that are allocated when first written */
+#define MEM_PAGE_BITS 12
+#define MEM_PAGE_SIZE (1<<MEM_PAGE_BITS)
+#define MEM_PAGE_MASK (MEM_PAGE_SIZE-1)
+
+/* Page data.  Copies of a memory share data until one of them
+   writes to the page */
+typedef struct {
+  int refs;                 /* Number of pages using data */
+  struct map_rec *map;      /* Mapped image file holding data, or NULL */
+} page_buf_rec, *page_buf_t;
+
+typedef struct page_rec {
+  word_t vpn;               /* Page number: address >> MEM_PAGE_BITS */
+  struct page_rec *next;    /* Next page in hash bucket */
+  byte_t *data;             /* MEM_PAGE_SIZE bytes */
+  page_buf_t buf;           /* Holder of data */
+  /* One bit per byte, set if byte is part of decoded code.
+     NULL until code is decoded from the page */
+  byte_t *code_map;
+  /* Writes since memory's base was set */
+  struct page_rec *dirty_next;  /* Next page in list of written pages */
+  bool_t dirty;                 /* Page is on list of written pages */
+  bool_t all_dirty;             /* Any word of page may have been written */
+  byte_t dirty_map[MEM_PAGE_SIZE/64];  /* One bit per aligned word */
+} page_rec, *page_t;
+
+/* Represent a memory as a sparse set of pages.  Bytes in pages that
+   have not been allocated read as 0 */
+typedef struct {
+  word_t len;        /* Addresses 0 .. len-1 are valid */
   word_t maxaddr;
-  byte_t *contents;
+  word_t wend;       /* Words can be accessed at addresses below wend */
+  page_t *table;     /* Hash table of allocated pages, indexed by vpn */
+  int nbuckets;      /* Size of table.  Power of 2 */
+  int npages;        /* Number of allocated pages */
+  /* Single-entry TLB: most recently used page */
+  word_t tlb_vpn;
+  page_t tlb_page;
+  /* Incremented whenever the data of a page moves */
+  unsigned data_version;
+  /* Write tracking.  Memories with the same nonzero base held the
+     same contents when base was set, and can differ only in words
+     marked in their written pages.  0 if contents changed untracked */
+  unsigned long long base;
+  page_t dirty_pages;
+  /* Predecoded instructions, indexed by PC.  NULL until first used */
+  dinstr_ptr icache;
+  /* Range of addresses covered by cached instructions */
+  word_t icache_lo;
+  word_t icache_hi;
+  /* Incremented whenever decoded code is overwritten or flushed */
+  unsigned code_version;
 } mem_rec, *mem_t;
 
 /* Create a memory with len bytes */
-mem_t init_mem(int len);
+mem_t init_mem(word_t len);
 void free_mem(mem_t m);
 
+/* Find page number vpn.  If it has not been allocated, allocate it
+   when alloc is set and otherwise return NULL */
+page_t find_page(mem_t m, word_t vpn, bool_t alloc);
+
+/* Find page number vpn for writing, allocating it if necessary.
+   If its data is shared with another memory, make a private copy */
+page_t write_page(mem_t m, word_t vpn);
+
+/* Record that any word of page p may have been written */
+void dirty_page(mem_t m, page_t p);
+
 /* Set contents of memory to 0 */
 void clear_mem(mem_t m);
 
-/* Make a copy of a memory */
+/* Make a copy of a memory.  Pages are shared until written, so this
+   takes time proportional to the number of pages but copies no data.
+   Sets base of both memories, so that they can be compared by looking
+   only at words written since */
 mem_t copy_mem(mem_t oldm);
+/* Make a copy that shares no pages with the original, so that the two
+   can be used by different threads */
+mem_t clone_mem(mem_t oldm);
 /* Print the differences between two memories */
 bool_t diff_mem(mem_t oldm, mem_t newm, FILE *outfile);
 
 /* How big should the memory be? */
-#ifdef BIG_MEM
+#if defined(FULL_MEM)
+/* All nonnegative addresses */
+#define MEM_SIZE 0x7fffffffffffffe0LL
+#elif defined(BIG_MEM)
 #define MEM_SIZE (1<<16)
 #else
 #define MEM_SIZE (1<<13)
@@ -116,9 +231,48 @@ bool_t diff_mem(mem_t oldm, mem_t newm, FILE *outfile);
 
 /*** In the following functions, a return value of 1 means success ***/
 
-/* Load memory from .yo file.  Return number of bytes read */
+/* Load memory from .yo file or binary image.
+   Return number of bytes read */
 int load_mem(mem_t m, FILE *infile, int report_error);
 
+/*
+ * Binary program images.  All fields are little-endian 8-byte words.
+ * Header: magic, version, entry, nsegs, nsyms, strsize
+ * Then nsegs segments: addr, size, file offset of data
+ * Then nsyms symbols: addr, offset of name in string table
+ * Then string table of strsize bytes, followed by segment data.
+ * When a segment's file offset equals its address modulo the page
+ * size, pages it covers completely are mapped from the file rather
+ * than copied.
+ */
+#define IMG_MAGIC "\177Y86IMG"
+#define IMG_VERSION 1
+
+typedef struct {
+  word_t addr;
+  char *name;
+} symbol_rec, *symbol_t;
+
+/* Information about a loaded program */
+typedef struct {
+  word_t entry;     /* Initial PC */
+  int nsyms;
+  symbol_t syms;    /* Sorted by address */
+} image_rec, *image_t;
+
+/* Load memory from .yo file or binary image.  If img is non-NULL,
+   set entry point and symbols from the file.  For .yo files the entry
+   point is 0 and symbols are the labels in the source listing.
+   Return number of bytes read */
+int load_image(mem_t m, FILE *infile, image_t img, int report_error);
+
+/* Write allocated contents of memory as binary image with entry point
+   and symbols from img.  Return TRUE if successful */
+bool_t save_image(mem_t m, image_t img, FILE *outfile);
+
+/* Free symbols held by img */
+void free_image(image_t img);
+
 /* Get byte from memory */
 bool_t get_byte_val(mem_t m, word_t pos, byte_t *dest);
 
@@ -134,20 +288,44 @@ bool_t set_word_val(mem_t m, word_t pos, word_t val);
 /* Print contents of memory */
 void dump_memory(FILE *outfile, mem_t m, word_t pos, int cnt);
 
+/* Find predecoded instruction at pc.  Return NULL if not cached */
+dinstr_ptr icache_lookup(mem_t m, word_t pc);
+
+/* Fetch and decode instruction at pc, going through the cache.
+   Return FALSE if the instruction bytes could not all be read */
+bool_t decode_instr(mem_t m, word_t pc, dinstr_ptr d);
+
+/* Save decoded instruction in cache */
+void icache_insert(mem_t m, dinstr_ptr d);
+
+/* Discard cached instructions overlapping bytes pos..pos+len-1
+   and bump code_version if there were any */
+void icache_invalidate(mem_t m, word_t pos, int len);
+
+/* Discard all cached instructions */
+void icache_flush(mem_t m);
+
 /********** Implementation of Register File *************/
 
-mem_t init_reg();
-void free_reg();
+/* Register file, indexed by register ID.  regs[REG_NONE] always holds 0 */
+typedef struct {
+  word_t regs[REG_NONE+1];
+} regfile_rec, *regfile_t;
+
+regfile_t init_reg();
+void free_reg(regfile_t r);
+/* Set all registers to 0 */
+void clear_reg(regfile_t r);
 
 /* Make a copy of a register file */
-mem_t copy_reg(mem_t oldr);
+regfile_t copy_reg(regfile_t oldr);
 /* Print the differences between two register files */
-bool_t diff_reg(mem_t oldr, mem_t newr, FILE *outfile);
+bool_t diff_reg(regfile_t oldr, regfile_t newr, FILE *outfile);
 
 
-word_t get_reg_val(mem_t r, reg_id_t id);
-void set_reg_val(mem_t r, reg_id_t id, word_t val);
-void dump_reg(FILE *outfile, mem_t r);
+word_t get_reg_val(regfile_t r, reg_id_t id);
+void set_reg_val(regfile_t r, reg_id_t id, word_t val);
+void dump_reg(FILE *outfile, regfile_t r);
 
 
 
@@ -172,6 +350,27 @@ cc_t compute_cc(alu_t op, word_t arg1, word_t arg2);
 /* Generated printed form of condition code */
 char *cc_name(cc_t c);
 
+/* Condition codes with deferred evaluation.  If op is A_NONE the codes
+   are held in cc.  Otherwise they are those compute_cc would produce
+   for op applied to argA and argB, and are only computed when read */
+typedef struct {
+  alu_t op;
+  word_t argA;
+  word_t argB;
+  cc_t cc;
+} lazy_cc_rec, *lazy_cc_t;
+
+#define LAZY_CC(c) { A_NONE, 0, 0, (c) }
+
+/* Record ALU operation that sets condition codes */
+void lazy_cc_set(lazy_cc_t l, alu_t op, word_t argA, word_t argB);
+/* Set condition codes to known value */
+void lazy_cc_load(lazy_cc_t l, cc_t cc);
+/* Get condition codes, computing them if necessary */
+cc_t lazy_cc_get(lazy_cc_t l);
+/* Same as cond_holds, but evaluates only what the condition needs */
+bool_t lazy_cond_holds(lazy_cc_t l, cond_t bcond);
+
 /* **************** Status types *******************/
 
 typedef enum 
@@ -184,12 +383,12 @@ char *stat_name(stat_t e);
 
 typedef struct {
   word_t pc;
-  mem_t r;
+  regfile_t r;
   mem_t m;
-  cc_t cc;
+  lazy_cc_rec cc;
 } state_rec, *state_ptr;
 
-state_ptr new_state(int memlen);
+state_ptr new_state(word_t memlen);
 void free_state(state_ptr s);
 
 state_ptr copy_state(state_ptr s);
@@ -201,3 +400,9 @@ bool_t cond_holds(cc_t cc, cond_t bcond);
 /* Execute single instruction.  Return status. */
 stat_t step_state(state_ptr s, FILE *error_file);
 
+/* Execute up to max_steps instructions with the threaded interpreter.
+   Gives same result as repeated calls to step_state.
+   Set *stepsp to number of instructions executed.  Return status. */
+stat_t run_state(state_ptr s, word_t max_steps, word_t *stepsp,
+		 FILE *error_file);
+
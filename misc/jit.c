@@ -0,0 +1,620 @@
+/* Native x86-64 code generation for translated blocks */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include "isa.h"
+#include "block.h"
+#include "jit.h"
+
+#if defined(__x86_64__)
+
+#include <sys/mman.h>
+
+/* Size of code buffer */
+#define JIT_BUF_SIZE (1<<22)
+/* Upper bounds on code generated for each operation and for each block */
+#define JIT_OP_MAX 512
+#define JIT_BLOCK_MAX 512
+/* Maximum number of exits to step_state and of page lookups in a block */
+#define MAX_STUBS (3*(MAX_BLOCK+1))
+#define MAX_MISSES (MAX_BLOCK+1)
+
+/* Host registers */
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+       R8, R9, R10, R11, R12, R13, R14, R15 };
+
+/* Host registers holding simulator state while native code runs */
+#define HREG    RBX   /* Register file */
+#define HCTX    RBP   /* jit_ctx */
+#define HPAGE   R12   /* Data of current page */
+#define HCC     R13   /* Condition codes */
+#define HVPN    R14   /* Number of current page */
+#define HM      R15   /* mem_t */
+#define HBUDGET R10   /* Maximum number of instructions */
+#define HSTEPS  R11   /* Instructions executed */
+
+/* x86 condition codes for jcc */
+#define X_C  0x2
+#define X_NC 0x3
+#define X_E  0x4
+#define X_NE 0x5
+#define X_BE 0x6
+#define X_A  0x7
+#define X_GE 0xD
+#define X_G  0xF
+#define X_ALWAYS -1
+
+struct jit_rec {
+    byte_t *buf;
+    size_t used;
+    byte_t *cp;         /* Where next code byte goes */
+    byte_t *epilogue;   /* Epilogue of block being compiled */
+    /* Exits to step_state, emitted after the body of the block */
+    int nstubs;
+    struct {
+	byte_t *at;     /* Displacement of jump to stub */
+	word_t pc;
+	int idx;
+    } stubs[MAX_STUBS];
+    /* Calls to jit_page, emitted after the body of the block */
+    int nmisses;
+    struct {
+	byte_t *at;     /* Displacement of jump to call */
+	byte_t *back;   /* Where to continue once page is found */
+	bool_t write;
+	bop_ptr op;
+    } misses[MAX_MISSES];
+};
+
+jit_t new_jit()
+{
+    jit_t j;
+    void *buf = mmap(NULL, JIT_BUF_SIZE, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED)
+	return NULL;
+    j = (jit_t) calloc(1, sizeof(struct jit_rec));
+    j->buf = (byte_t *) buf;
+    j->used = 0;
+    return j;
+}
+
+void free_jit(jit_t j)
+{
+    if (!j)
+	return;
+    munmap(j->buf, JIT_BUF_SIZE);
+    free((void *) j);
+}
+
+void jit_flush(jit_t j)
+{
+    if (j)
+	j->used = 0;
+}
+
+static void emit1(jit_t j, int b)
+{
+    *j->cp++ = (byte_t) b;
+}
+
+static void emit4(jit_t j, int v)
+{
+    memcpy(j->cp, &v, 4);
+    j->cp += 4;
+}
+
+static void emit_bytes(jit_t j, const byte_t *b, int n)
+{
+    memcpy(j->cp, b, n);
+    j->cp += n;
+}
+
+static bool_t fits32(word_t v)
+{
+    return v == (word_t) (int) v;
+}
+
+/* 64-bit op between reg and [base+disp] */
+static void emit_mem(jit_t j, int op, int reg, int base, int disp)
+{
+    emit1(j, 0x48 | ((reg >> 3) << 2) | (base >> 3));
+    emit1(j, op);
+    emit1(j, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP)
+	emit1(j, 0x24);
+    emit4(j, disp);
+}
+
+/* 64-bit op between register rm and register reg */
+static void emit_rr(jit_t j, int op, int rm, int reg)
+{
+    emit1(j, 0x48 | ((reg >> 3) << 2) | (rm >> 3));
+    emit1(j, op);
+    emit1(j, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* 64-bit op between reg and [HPAGE+rdx] */
+static void emit_memidx(jit_t j, int op, int reg)
+{
+    emit1(j, 0x49 | ((reg >> 3) << 2));
+    emit1(j, op);
+    emit1(j, ((reg & 7) << 3) | 0x4);
+    emit1(j, 0x14);
+}
+
+/* 64-bit shift right of reg by constant */
+static void emit_shri(jit_t j, int reg, int n)
+{
+    emit1(j, 0x48 | (reg >> 3));
+    emit1(j, 0xC1);
+    emit1(j, 0xE8 | (reg & 7));
+    emit1(j, n);
+}
+
+/* Load constant into register.  Does not change flags */
+static void emit_movi(jit_t j, int reg, word_t v)
+{
+    if (fits32(v)) {
+	emit1(j, 0x48 | (reg >> 3));
+	emit1(j, 0xC7);
+	emit1(j, 0xC0 | (reg & 7));
+	emit4(j, (int) v);
+    } else {
+	emit1(j, 0x48 | (reg >> 3));
+	emit1(j, 0xB8 | (reg & 7));
+	memcpy(j->cp, &v, 8);
+	j->cp += 8;
+    }
+}
+
+/* Add constant to register.  Uses rcx for large constants */
+static void emit_addi(jit_t j, int reg, word_t v)
+{
+    if (v == 0)
+	return;
+    if (fits32(v)) {
+	emit1(j, 0x48 | (reg >> 3));
+	emit1(j, 0x81);
+	emit1(j, 0xC0 | (reg & 7));
+	emit4(j, (int) v);
+    } else {
+	emit_movi(j, RCX, v);
+	emit_rr(j, 0x01, reg, RCX);
+    }
+}
+
+static void emit_push(jit_t j, int reg)
+{
+    if (reg >= 8)
+	emit1(j, 0x41);
+    emit1(j, 0x50 | (reg & 7));
+}
+
+static void emit_pop(jit_t j, int reg)
+{
+    if (reg >= 8)
+	emit1(j, 0x41);
+    emit1(j, 0x58 | (reg & 7));
+}
+
+/* Emit jump with displacement to be filled in by patch */
+static byte_t *emit_jcc(jit_t j, int cond)
+{
+    if (cond == X_ALWAYS)
+	emit1(j, 0xE9);
+    else {
+	emit1(j, 0x0F);
+	emit1(j, 0x80 | cond);
+    }
+    emit4(j, 0);
+    return j->cp - 4;
+}
+
+static void patch(byte_t *at, byte_t *target)
+{
+    int disp = (int) (target - (at + 4));
+    memcpy(at, &disp, 4);
+}
+
+/* Access Y86 register.  Register F holds 0 and ignores writes */
+static void load_reg(jit_t j, int hreg, int yreg)
+{
+    emit_mem(j, 0x8B, hreg, HREG, 8*yreg);
+}
+
+static void store_reg(jit_t j, int hreg, int yreg)
+{
+    if (yreg != REG_NONE)
+	emit_mem(j, 0x89, hreg, HREG, 8*yreg);
+}
+
+/* Pack host flags into Y86 condition codes in HCC */
+static void emit_pack_cc(jit_t j)
+{
+    static const byte_t code[] = {
+	0x0F, 0x94, 0xC0,        /* setz al */
+	0x0F, 0x98, 0xC1,        /* sets cl */
+	0x0F, 0x90, 0xC2,        /* seto dl */
+	0x0F, 0xB6, 0xC0,        /* movzx eax,al */
+	0x0F, 0xB6, 0xC9,        /* movzx ecx,cl */
+	0x0F, 0xB6, 0xD2,        /* movzx edx,dl */
+	0x8D, 0x0C, 0x4A,        /* lea ecx,[rdx+rcx*2] */
+	0x44, 0x8D, 0x2C, 0x81   /* lea r13d,[rcx+rax*4] */
+    };
+    emit_bytes(j, code, sizeof(code));
+}
+
+/* Set carry flag when condition holds */
+static void emit_cond(jit_t j, int fun)
+{
+    static const byte_t bt[] = { 0x44, 0x0F, 0xA3, 0xE8 }; /* bt eax,r13d */
+    int mask = 0;
+    int c;
+    for (c = 0; c < 8; c++)
+	if (cond_holds((cc_t) c, (cond_t) fun))
+	    mask |= 1 << c;
+    emit1(j, 0xB8);
+    emit4(j, mask);
+    emit_bytes(j, bt, sizeof(bt));
+}
+
+/* Leave native code with next PC in rax */
+static void emit_exit_rax(jit_t j, int nsteps, int code)
+{
+    emit_mem(j, 0x89, RAX, HCTX, offsetof(jit_ctx_rec, pc));
+    emit_addi(j, HSTEPS, nsteps);
+    emit1(j, 0xB8);
+    emit4(j, code);
+    patch(emit_jcc(j, X_ALWAYS), j->epilogue);
+}
+
+static void emit_exit(jit_t j, word_t pc, int nsteps, int code)
+{
+    emit_movi(j, RAX, pc);
+    emit_exit_rax(j, nsteps, code);
+}
+
+/* Continue at target after completing block.  Branches back to the
+   start of the block stay in native code while budget allows */
+static void emit_goto(jit_t j, word_t target, int code,
+		      bop_ptr ops, int ninstr, byte_t *body)
+{
+    if (target == ops[0].pc) {
+	emit_addi(j, HSTEPS, ninstr);
+	emit_mem(j, 0x8D, RAX, HSTEPS, ninstr);   /* lea rax,[r11+ninstr] */
+	emit_rr(j, 0x39, RAX, HBUDGET);
+	patch(emit_jcc(j, X_BE), body);
+	emit_exit(j, target, 0, code);
+    } else
+	emit_exit(j, target, ninstr, code);
+}
+
+/* Jump to step_state exit for op when cond holds */
+static void emit_slow(jit_t j, int cond, bop_ptr op)
+{
+    int i = j->nstubs++;
+    j->stubs[i].at = emit_jcc(j, cond);
+    j->stubs[i].pc = op->pc;
+    j->stubs[i].idx = op->idx;
+}
+
+/* Called from native code when address is not in the current page,
+   or is written but the current page has not been marked as written.
+   Return data of page holding addr if words at all offsets of the
+   page can be accessed, otherwise NULL */
+static byte_t *jit_page(mem_t m, word_t addr, int write)
+{
+    unsigned long long vpn = (unsigned long long) addr >> MEM_PAGE_BITS;
+    page_t p;
+    if (vpn >= (unsigned long long) (m->len >> MEM_PAGE_BITS))
+	return NULL;
+    if (!write)
+	p = find_page(m, (word_t) vpn, FALSE);
+    else {
+	/* Stores are not tracked word by word */
+	p = write_page(m, (word_t) vpn);
+	dirty_page(m, p);
+    }
+    return p ? p->data : NULL;
+}
+
+/* Set rdx to offset within current page of word at address in rax.
+   Switch pages if necessary.  For writes, exit if word could hold
+   decoded code */
+static void emit_access(jit_t j, bop_ptr op, bool_t write)
+{
+    byte_t *ok;
+    int i = j->nmisses++;
+    emit_rr(j, 0x89, RCX, RAX);
+    emit_shri(j, RCX, MEM_PAGE_BITS);
+    if (write)
+	emit_mem(j, 0x3B, RCX, HCTX, offsetof(jit_ctx_rec, wvpn));
+    else
+	emit_rr(j, 0x39, RCX, HVPN);
+    j->misses[i].at = emit_jcc(j, X_NE);
+    j->misses[i].back = j->cp;
+    j->misses[i].write = write;
+    j->misses[i].op = op;
+    /* Words spanning pages are left to step_state */
+    emit1(j, 0x89);      /* mov edx,eax */
+    emit1(j, 0xC2);
+    emit1(j, 0x81);      /* and edx,MEM_PAGE_MASK */
+    emit1(j, 0xE2);
+    emit4(j, MEM_PAGE_MASK);
+    emit1(j, 0x81);      /* cmp edx,MEM_PAGE_SIZE-8 */
+    emit1(j, 0xFA);
+    emit4(j, MEM_PAGE_SIZE-8);
+    emit_slow(j, X_A, op);
+    if (write) {
+	emit_mem(j, 0x3B, RAX, HM, offsetof(mem_rec, icache_hi));
+	ok = emit_jcc(j, X_GE);
+	emit_mem(j, 0x8D, RCX, RAX, 8);
+	emit_mem(j, 0x3B, RCX, HM, offsetof(mem_rec, icache_lo));
+	emit_slow(j, X_G, op);
+	patch(ok, j->cp);
+    }
+}
+
+/* Look up page for access i.  Caller-saved registers are preserved,
+   and the stack is 16-byte aligned at the call */
+static void emit_miss(jit_t j, int i)
+{
+    static const byte_t call_rax[] = { 0xFF, 0xD0 };
+    patch(j->misses[i].at, j->cp);
+    emit_push(j, HBUDGET);
+    emit_push(j, HSTEPS);
+    emit_push(j, RAX);
+    emit_rr(j, 0x89, RDI, HM);
+    emit_rr(j, 0x89, RSI, RAX);
+    emit1(j, 0xBA);
+    emit4(j, j->misses[i].write);
+    emit_movi(j, RAX, (word_t) jit_page);
+    emit_bytes(j, call_rax, sizeof(call_rax));
+    emit_rr(j, 0x89, RCX, RAX);
+    emit_pop(j, RAX);
+    emit_pop(j, HSTEPS);
+    emit_pop(j, HBUDGET);
+    emit_rr(j, 0x85, RCX, RCX);
+    emit_slow(j, X_E, j->misses[i].op);
+    emit_rr(j, 0x89, HPAGE, RCX);
+    emit_rr(j, 0x89, HVPN, RAX);
+    emit_shri(j, HVPN, MEM_PAGE_BITS);
+    if (j->misses[i].write)
+	emit_mem(j, 0x89, HVPN, HCTX, offsetof(jit_ctx_rec, wvpn));
+    else {
+	emit_mem(j, 0xC7, 0, HCTX, offsetof(jit_ctx_rec, wvpn));
+	emit4(j, -1);
+    }
+    patch(emit_jcc(j, X_ALWAYS), j->misses[i].back);
+}
+
+/* rax = reg[rb] + valc */
+static void emit_addr(jit_t j, int rb, word_t valc)
+{
+    load_reg(j, RAX, rb);
+    emit_addi(j, RAX, valc);
+}
+
+/* reg[rb] = reg[rb] OP reg[ra] */
+static void emit_alu(jit_t j, int fun, int ra, int rb, bool_t pack)
+{
+    static const int alu_op[] = { 0x01, 0x29, 0x21, 0x31 };
+    load_reg(j, RAX, rb);
+    load_reg(j, RCX, ra);
+    emit_rr(j, alu_op[fun], RAX, RCX);
+    store_reg(j, RAX, rb);
+    if (pack)
+	emit_pack_cc(j);
+}
+
+/* Condition codes are packed into HCC only where translate found
+   they can be seen */
+static void emit_op(jit_t j, bop_ptr op, bop_ptr ops, int ninstr, byte_t *body)
+{
+    bool_t pack = op->setcc;
+    byte_t *skip;
+    switch (op->op) {
+    case B_RRMOVQ:
+	load_reg(j, RAX, op->ra);
+	store_reg(j, RAX, op->rb);
+	break;
+    case B_CMOVXX:
+	emit_cond(j, op->fun);
+	skip = emit_jcc(j, X_NC);
+	load_reg(j, RAX, op->ra);
+	store_reg(j, RAX, op->rb);
+	patch(skip, j->cp);
+	break;
+    case B_IRMOVQ:
+	emit_movi(j, RAX, op->valc);
+	store_reg(j, RAX, op->rb);
+	break;
+    case B_RMMOVQ:
+	emit_addr(j, op->rb, op->valc);
+	emit_access(j, op, TRUE);
+	load_reg(j, RCX, op->ra);
+	emit_memidx(j, 0x89, RCX);
+	break;
+    case B_MRMOVQ:
+	emit_addr(j, op->rb, op->valc);
+	emit_access(j, op, FALSE);
+	emit_memidx(j, 0x8B, RCX);
+	store_reg(j, RCX, op->ra);
+	break;
+    case B_ADDQ:
+    case B_SUBQ:
+    case B_ANDQ:
+    case B_XORQ:
+	emit_alu(j, op->fun, op->ra, op->rb, pack);
+	break;
+    case B_IADDQ:
+	load_reg(j, RAX, op->rb);
+	emit_movi(j, RCX, op->valc);
+	emit_rr(j, 0x01, RAX, RCX);
+	store_reg(j, RAX, op->rb);
+	if (pack)
+	    emit_pack_cc(j);
+	break;
+    case B_PUSHQ:
+	load_reg(j, RAX, REG_RSP);
+	emit_addi(j, RAX, -8);
+	emit_access(j, op, TRUE);
+	load_reg(j, RCX, op->ra);
+	emit_memidx(j, 0x89, RCX);
+	store_reg(j, RAX, REG_RSP);
+	break;
+    case B_POPQ:
+	load_reg(j, RAX, REG_RSP);
+	emit_access(j, op, FALSE);
+	emit_memidx(j, 0x8B, RCX);
+	emit_addi(j, RAX, 8);
+	store_reg(j, RAX, REG_RSP);
+	store_reg(j, RCX, op->ra);
+	break;
+    case B_IRMOVQ_ADDQ:
+	emit_movi(j, RAX, op->valc);
+	store_reg(j, RAX, op->rb);
+	emit_alu(j, A_ADD, op->ra2, op->rb2, pack);
+	break;
+    case B_MRMOVQ_ALU:
+	emit_addr(j, op->rb, op->valc);
+	emit_access(j, op, FALSE);
+	emit_memidx(j, 0x8B, RCX);
+	store_reg(j, RCX, op->ra);
+	emit_alu(j, op->fun, op->ra2, op->rb2, pack);
+	break;
+
+    case B_JMP:
+	emit_goto(j, op->valc, J_TAKEN, ops, ninstr, body);
+	break;
+    case B_SUBQ_JXX:
+	emit_alu(j, A_SUB, op->ra, op->rb, TRUE);
+	/* Fall through */
+    case B_JXX:
+	emit_cond(j, op->fun);
+	skip = emit_jcc(j, X_NC);
+	emit_goto(j, op->valc, J_TAKEN, ops, ninstr, body);
+	patch(skip, j->cp);
+	emit_goto(j, op->valp, J_NOT_TAKEN, ops, ninstr, body);
+	break;
+    case B_CALL:
+	load_reg(j, RAX, REG_RSP);
+	emit_addi(j, RAX, -8);
+	emit_access(j, op, TRUE);
+	emit_movi(j, RCX, op->valp);
+	emit_memidx(j, 0x89, RCX);
+	store_reg(j, RAX, REG_RSP);
+	emit_goto(j, op->valc, J_TAKEN, ops, ninstr, body);
+	break;
+    case B_RET:
+	load_reg(j, RAX, REG_RSP);
+	emit_access(j, op, FALSE);
+	emit_memidx(j, 0x8B, RCX);
+	emit_addi(j, RAX, 8);
+	store_reg(j, RAX, REG_RSP);
+	emit_rr(j, 0x89, RAX, RCX);
+	emit_exit_rax(j, ninstr, J_TAKEN);
+	break;
+    case B_HALT:
+	emit_exit(j, op->pc, op->idx + 1, J_HALT);
+	break;
+    case B_FALL:
+	emit_exit(j, op->pc, ninstr, J_NOT_TAKEN);
+	break;
+    case B_SLOW:
+	/* Engine finds block at pc with no instructions */
+	emit_exit(j, op->pc, ninstr, J_NOT_TAKEN);
+	break;
+    }
+}
+
+jit_fn jit_compile(jit_t j, bop_ptr ops, int nops, int ninstr)
+{
+    byte_t *start, *body;
+    int i;
+
+    if (!j || j->used + nops * JIT_OP_MAX + JIT_BLOCK_MAX > JIT_BUF_SIZE)
+	return NULL;
+    for (i = 0; i < nops; i++)
+	if (ops[i].op == B_ALU)
+	    return NULL;
+    if (mprotect(j->buf, JIT_BUF_SIZE, PROT_READ | PROT_WRITE) < 0)
+	return NULL;
+    j->cp = j->buf + j->used;
+    j->nstubs = 0;
+    j->nmisses = 0;
+
+    /* Epilogue */
+    j->epilogue = j->cp;
+    emit_mem(j, 0x89, HSTEPS, HCTX, offsetof(jit_ctx_rec, steps));
+    emit_mem(j, 0x89, HCC, HCTX, offsetof(jit_ctx_rec, cc));
+    emit_mem(j, 0x89, HPAGE, HCTX, offsetof(jit_ctx_rec, page));
+    emit_mem(j, 0x89, HVPN, HCTX, offsetof(jit_ctx_rec, vpn));
+    emit_pop(j, R15);
+    emit_pop(j, R14);
+    emit_pop(j, R13);
+    emit_pop(j, R12);
+    emit_pop(j, RBP);
+    emit_pop(j, RBX);
+    emit1(j, 0xC3);
+
+    /* Prologue */
+    start = j->cp;
+    emit_push(j, RBX);
+    emit_push(j, RBP);
+    emit_push(j, R12);
+    emit_push(j, R13);
+    emit_push(j, R14);
+    emit_push(j, R15);
+    emit_rr(j, 0x89, HCTX, RDI);
+    emit_mem(j, 0x8B, HREG, HCTX, offsetof(jit_ctx_rec, reg));
+    emit_mem(j, 0x8B, HM, HCTX, offsetof(jit_ctx_rec, m));
+    emit_mem(j, 0x8B, HPAGE, HCTX, offsetof(jit_ctx_rec, page));
+    emit_mem(j, 0x8B, HVPN, HCTX, offsetof(jit_ctx_rec, vpn));
+    emit_mem(j, 0x8B, HBUDGET, HCTX, offsetof(jit_ctx_rec, budget));
+    emit_mem(j, 0x8B, HCC, HCTX, offsetof(jit_ctx_rec, cc));
+    emit_rr(j, 0x31, HSTEPS, HSTEPS);
+
+    body = j->cp;
+    for (i = 0; i < nops; i++)
+	emit_op(j, &ops[i], ops, ninstr, body);
+
+    /* Page lookups, then exits for instructions that must be executed
+       by step_state */
+    for (i = 0; i < j->nmisses; i++)
+	emit_miss(j, i);
+    for (i = 0; i < j->nstubs; i++) {
+	patch(j->stubs[i].at, j->cp);
+	emit_exit(j, j->stubs[i].pc, j->stubs[i].idx, J_SLOW);
+    }
+
+    j->used = ((j->cp - j->buf) + 15) & ~15;
+    if (mprotect(j->buf, JIT_BUF_SIZE, PROT_READ | PROT_EXEC) < 0)
+	return NULL;
+    return (jit_fn) start;
+}
+
+#else /* !__x86_64__ */
+
+jit_t new_jit()
+{
+    return NULL;
+}
+
+void free_jit(jit_t j)
+{
+}
+
+void jit_flush(jit_t j)
+{
+}
+
+jit_fn jit_compile(jit_t j, bop_ptr ops, int nops, int ninstr)
+{
+    return NULL;
+}
+
+#endif
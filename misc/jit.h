@@ -0,0 +1,48 @@
+/* Native x86-64 code generation for translated blocks */
+
+/*
+ * Blocks that the block engine finds executing frequently are compiled
+ * into native x86-64 code in an mmap'd buffer.  While native code
+ * runs, the register file, condition codes and the current memory
+ * page stay in host registers.  Faults, accesses spanning pages and
+ * stores that could modify decoded code exit to the engine, which
+ * finishes the instruction with step_state.
+ * On other hosts jit_compile always fails and blocks are interpreted.
+ */
+
+/* State passed between block engine and native code */
+typedef struct {
+  word_t *reg;        /* Register file.  reg[REG_NONE] holds 0 */
+  mem_t m;            /* Memory */
+  word_t vpn;         /* Page most recently accessed by native code, */
+  byte_t *page;       /* and its data.  In and out */
+  word_t wvpn;        /* vpn if page has been marked as written, else -1 */
+  word_t budget;      /* Maximum number of instructions to execute */
+  word_t cc;          /* Condition codes, in and out */
+  word_t pc;          /* Next PC, out */
+  word_t steps;       /* Number of instructions executed, out */
+} jit_ctx_rec, *jit_ctx;
+
+/* Reasons for leaving native code.  J_TAKEN and J_NOT_TAKEN select
+   the successor of the block */
+typedef enum { J_TAKEN, J_NOT_TAKEN, J_SLOW, J_HALT } jit_exit_t;
+
+/* Compiled block.  Returns a jit_exit_t */
+typedef int (*jit_fn)(jit_ctx ctx);
+
+/* Number of times a block executes before it is compiled */
+#define JIT_HOT 16
+
+/* Buffer holding compiled code */
+typedef struct jit_rec *jit_t;
+
+/* Create code buffer.  Return NULL if native code is not supported */
+jit_t new_jit();
+void free_jit(jit_t j);
+
+/* Compile block of nops operations holding ninstr instructions.
+   Return NULL if the block cannot be compiled */
+jit_fn jit_compile(jit_t j, bop_ptr ops, int nops, int ninstr);
+
+/* Discard all compiled code */
+void jit_flush(jit_t j);
@@ -0,0 +1,317 @@
+/* Pipeline traces: the cycles each instruction spent in each stage */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "isa.h"
+#include "pipetrace.h"
+
+/* Bytes in one binary record */
+#define PT_RECORD 36
+
+/* Most instructions in flight.  Each stage holds one, and a
+   discarded fetch can linger one cycle */
+#define PT_INFLIGHT 16
+
+static char *stage_names[PT_STAGES] = {"F", "D", "E", "M", "W"};
+
+struct pipetrace_rec {
+    FILE *file;
+    pt_instr_rec inflight[PT_INFLIGHT];
+    bool_t used[PT_INFLIGHT];
+    word_t cycle;       /* Last cycle recorded */
+};
+
+/* Append little-endian value of n bytes to buffer */
+static byte_t *put_bytes(byte_t *p, word_t val, int n)
+{
+    int i;
+    for (i = 0; i < n; i++) {
+	p[i] = (byte_t) val & 0xFF;
+	val >>= 8;
+    }
+    return p + n;
+}
+
+static word_t get_bytes(byte_t *p, int n)
+{
+    word_t val = 0;
+    int i;
+    for (i = n - 1; i >= 0; i--)
+	val = (val << 8) | p[i];
+    return val;
+}
+
+/* Offset of cycle from start of instruction, as stored in a record */
+static word_t offset(pt_instr_ptr r, word_t cycle)
+{
+    if (cycle < 0)
+	return PT_NEVER;
+    return cycle - r->enter[0] < PT_NEVER ? cycle - r->enter[0] : PT_NEVER - 1;
+}
+
+static void write_record(pipetrace_t t, pt_instr_ptr r)
+{
+    byte_t buf[PT_RECORD];
+    byte_t *p = buf;
+    int s;
+    *p++ = r->fate;
+    *p++ = r->instr;
+    p = put_bytes(p, r->seq, 8);
+    p = put_bytes(p, r->pc, 8);
+    p = put_bytes(p, r->enter[0], 8);
+    for (s = 1; s < PT_STAGES; s++)
+	p = put_bytes(p, offset(r, r->enter[s]), 2);
+    put_bytes(p, offset(r, r->end), 2);
+    fwrite(buf, 1, PT_RECORD, t->file);
+}
+
+pipetrace_t new_pipetrace(FILE *file)
+{
+    pipetrace_t t = (pipetrace_t) calloc(1, sizeof(struct pipetrace_rec));
+    byte_t head[16];
+    t->file = file;
+    memcpy(head, PIPETRACE_MAGIC, 8);
+    put_bytes(head + 8, PIPETRACE_VERSION, 8);
+    fwrite(head, 1, 16, file);
+    return t;
+}
+
+void free_pipetrace(pipetrace_t t)
+{
+    int i;
+    for (i = 0; i < PT_INFLIGHT; i++)
+	if (t->used[i]) {
+	    pt_instr_ptr r = &t->inflight[i];
+	    r->end = t->cycle + 1;
+	    /* Instruction in W has done its work */
+	    r->fate = r->enter[PT_STAGES-1] >= 0 ? PT_RETIRED : PT_UNFINISHED;
+	    write_record(t, r);
+	}
+    fflush(t->file);
+    free((void *) t);
+}
+
+void pipetrace_cycle(pipetrace_t t, word_t cycle, word_t seq[PT_STAGES],
+		     word_t pc, byte_t instr)
+{
+    bool_t seen[PT_INFLIGHT];
+    int s, i;
+    memset(seen, 0, sizeof(seen));
+    t->cycle = cycle;
+    for (s = 0; s < PT_STAGES; s++) {
+	pt_instr_ptr r;
+	int free_slot = -1;
+	if (seq[s] == 0)
+	    continue;
+	for (i = 0; i < PT_INFLIGHT; i++) {
+	    if (t->used[i] && t->inflight[i].seq == seq[s])
+		break;
+	    if (!t->used[i] && free_slot < 0)
+		free_slot = i;
+	}
+	if (i == PT_INFLIGHT) {
+	    if (free_slot < 0)
+		continue;
+	    i = free_slot;
+	    r = &t->inflight[i];
+	    t->used[i] = TRUE;
+	    r->seq = seq[s];
+	    r->pc = 0;
+	    r->instr = HPACK(I_NOP, F_NONE);
+	    r->enter[0] = r->enter[1] = r->enter[2] = r->enter[3] =
+		r->enter[4] = -1;
+	}
+	r = &t->inflight[i];
+	seen[i] = TRUE;
+	if (r->enter[s] < 0)
+	    r->enter[s] = cycle;
+	if (s == 0) {
+	    r->pc = pc;
+	    r->instr = instr;
+	} else if (r->enter[0] < 0)
+	    /* In flight when tracing began */
+	    r->enter[0] = cycle;
+    }
+    /* Instructions no longer in any stage have left */
+    for (i = 0; i < PT_INFLIGHT; i++)
+	if (t->used[i] && !seen[i]) {
+	    pt_instr_ptr r = &t->inflight[i];
+	    r->end = cycle;
+	    r->fate = r->enter[PT_STAGES-1] >= 0 ? PT_RETIRED : PT_SQUASHED;
+	    write_record(t, r);
+	    t->used[i] = FALSE;
+	}
+}
+
+static int seq_compare(const void *a, const void *b)
+{
+    word_t sa = ((pt_instr_ptr) a)->seq;
+    word_t sb = ((pt_instr_ptr) b)->seq;
+    return sa < sb ? -1 : sa > sb ? 1 : 0;
+}
+
+int pipetrace_read(FILE *file, pt_instr_ptr *recs)
+{
+    byte_t buf[PT_RECORD];
+    byte_t v[8];
+    int n = 0, size = 1024;
+    pt_instr_ptr r;
+    put_bytes(v, PIPETRACE_VERSION, 8);
+    if (fread(buf, 1, 16, file) != 16 ||
+	memcmp(buf, PIPETRACE_MAGIC, 8) || memcmp(buf + 8, v, 8))
+	return -1;
+    r = (pt_instr_ptr) malloc(size * sizeof(pt_instr_rec));
+    while (fread(buf, 1, PT_RECORD, file) == PT_RECORD) {
+	pt_instr_ptr e;
+	word_t off;
+	int s;
+	if (n == size) {
+	    size *= 2;
+	    r = (pt_instr_ptr) realloc(r, size * sizeof(pt_instr_rec));
+	}
+	e = &r[n++];
+	e->fate = buf[0];
+	e->instr = buf[1];
+	e->seq = get_bytes(buf + 2, 8);
+	e->pc = get_bytes(buf + 10, 8);
+	e->enter[0] = get_bytes(buf + 18, 8);
+	for (s = 1; s < PT_STAGES; s++) {
+	    off = get_bytes(buf + 26 + 2 * (s - 1), 2);
+	    e->enter[s] = off == PT_NEVER ? -1 : e->enter[0] + off;
+	}
+	e->end = e->enter[0] + get_bytes(buf + 34, 2);
+    }
+    qsort(r, n, sizeof(pt_instr_rec), seq_compare);
+    *recs = r;
+    return n;
+}
+
+/* Cycle stage s of r ends: when the next stage it reached begins, or
+   when it left the pipeline */
+static word_t stage_end(pt_instr_ptr r, int s)
+{
+    int t;
+    for (t = s + 1; t < PT_STAGES; t++)
+	if (r->enter[t] >= 0)
+	    return r->enter[t];
+    return r->end;
+}
+
+/* Konata commands must be in cycle order, so they are collected and
+   sorted first */
+typedef enum { K_START, K_STAGE, K_END } kcmd_t;
+
+typedef struct {
+    word_t cycle;
+    int rec;
+    kcmd_t cmd;
+    int stage;
+} kevent_rec, *kevent_ptr;
+
+static int kevent_compare(const void *a, const void *b)
+{
+    kevent_ptr ka = (kevent_ptr) a;
+    kevent_ptr kb = (kevent_ptr) b;
+    if (ka->cycle != kb->cycle)
+	return ka->cycle < kb->cycle ? -1 : 1;
+    if (ka->rec != kb->rec)
+	return ka->rec - kb->rec;
+    if (ka->cmd != kb->cmd)
+	return (int) ka->cmd - (int) kb->cmd;
+    return ka->stage - kb->stage;
+}
+
+void pipetrace_konata(pt_instr_ptr recs, int n, FILE *outfile)
+{
+    kevent_ptr ev = (kevent_ptr) malloc((n * (PT_STAGES + 2) + 1) *
+					 sizeof(kevent_rec));
+    int nev = 0, i, s;
+    word_t cycle, retired = 0;
+
+    for (i = 0; i < n; i++) {
+	kevent_ptr e = &ev[nev++];
+	e->cycle = recs[i].enter[0];
+	e->rec = i;
+	e->cmd = K_START;
+	e->stage = 0;
+	for (s = 0; s < PT_STAGES; s++)
+	    if (recs[i].enter[s] >= 0) {
+		e = &ev[nev++];
+		e->cycle = recs[i].enter[s];
+		e->rec = i;
+		e->cmd = K_STAGE;
+		e->stage = s;
+	    }
+	e = &ev[nev++];
+	e->cycle = recs[i].end;
+	e->rec = i;
+	e->cmd = K_END;
+	e->stage = 0;
+    }
+    qsort(ev, nev, sizeof(kevent_rec), kevent_compare);
+
+    fprintf(outfile, "Kanata\t0004\n");
+    cycle = nev > 0 ? ev[0].cycle : 0;
+    fprintf(outfile, "C=\t%lld\n", cycle);
+    for (i = 0; i < nev; i++) {
+	kevent_ptr e = &ev[i];
+	pt_instr_ptr r = &recs[e->rec];
+	int last = -1;
+	if (e->cycle != cycle) {
+	    fprintf(outfile, "C\t%lld\n", e->cycle - cycle);
+	    cycle = e->cycle;
+	}
+	/* Stage in progress when this event happens */
+	for (s = 0; s < PT_STAGES; s++)
+	    if (r->enter[s] >= 0 && r->enter[s] < e->cycle)
+		last = s;
+	switch (e->cmd) {
+	case K_START:
+	    fprintf(outfile, "I\t%d\t%lld\t0\n", e->rec, r->seq);
+	    fprintf(outfile, "L\t%d\t0\t0x%.3llx: %s\n",
+		    e->rec, r->pc, iname(r->instr));
+	    break;
+	case K_STAGE:
+	    if (last >= 0)
+		fprintf(outfile, "E\t%d\t0\t%s\n", e->rec, stage_names[last]);
+	    fprintf(outfile, "S\t%d\t0\t%s\n", e->rec, stage_names[e->stage]);
+	    break;
+	case K_END:
+	    if (last >= 0)
+		fprintf(outfile, "E\t%d\t0\t%s\n", e->rec, stage_names[last]);
+	    fprintf(outfile, "R\t%d\t%lld\t%d\n", e->rec,
+		    r->fate == PT_RETIRED ? retired++ : 0,
+		    r->fate == PT_RETIRED ? 0 : 1);
+	    break;
+	}
+    }
+    free((void *) ev);
+}
+
+void pipetrace_chrome(pt_instr_ptr recs, int n, FILE *outfile)
+{
+    int i, s;
+    fprintf(outfile, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (s = 0; s < PT_STAGES; s++)
+	fprintf(outfile, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,"
+		"\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n", s, stage_names[s]);
+    for (i = 0; i < n; i++) {
+	pt_instr_ptr r = &recs[i];
+	for (s = 0; s < PT_STAGES; s++) {
+	    if (r->enter[s] < 0)
+		continue;
+	    fprintf(outfile, "{\"name\":\"0x%.3llx: %s\",\"cat\":\"%s\","
+		    "\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%lld,\"dur\":%lld,"
+		    "\"args\":{\"seq\":%lld}},\n",
+		    r->pc, iname(r->instr),
+		    r->fate == PT_RETIRED ? "retired" :
+		    r->fate == PT_SQUASHED ? "squashed" : "unfinished",
+		    s, r->enter[s], stage_end(r, s) - r->enter[s], r->seq);
+	}
+    }
+    /* JSON arrays may not end with a comma */
+    fprintf(outfile, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,"
+	    "\"args\":{\"name\":\"Y86-64 pipeline\"}}\n]}\n");
+}
@@ -0,0 +1,73 @@
+/* Pipeline traces: the cycles each instruction spent in each stage */
+
+/*
+ * A pipeline simulator numbers each instruction it fetches, carries
+ * the number down the pipe registers, and at the end of each cycle
+ * reports which instruction is in each stage (0 for a bubble).  When
+ * an instruction leaves the pipeline, one record is written giving
+ * the cycle it entered each stage, the cycle it left, and whether it
+ * retired or was squashed.  A stage held for more than one cycle was
+ * stalled; an instruction squashed before W was on a wrong path.
+ *
+ * Binary pipeline trace files start with the 8-byte magic number
+ * PIPETRACE_MAGIC and an 8-byte version.  Each record is then:
+ *   fate     1 byte: PT_RETIRED, PT_SQUASHED or PT_UNFINISHED
+ *   instr    1 byte: first byte of instruction
+ *   seq      8 bytes: number of instruction in fetch order
+ *   pc       8 bytes
+ *   start    8 bytes: cycle instruction was fetched
+ *   enter    2 bytes for each of D, E, M and W: cycles after start
+ *            that the stage was entered, or PT_NEVER
+ *   end      2 bytes: cycles after start that the instruction left
+ * All multi-byte values are little-endian.  Records are in the order
+ * instructions left the pipeline.
+ */
+
+#define PIPETRACE_MAGIC "\177Y86PIP"
+#define PIPETRACE_VERSION 1
+
+/* Stages F, D, E, M and W */
+#define PT_STAGES 5
+
+/* What became of an instruction */
+#define PT_RETIRED    0
+#define PT_SQUASHED   1
+#define PT_UNFINISHED 2  /* Still in pipeline when simulation stopped */
+
+/* Stage offset of a stage never entered */
+#define PT_NEVER 0xFFFF
+
+typedef struct {
+    word_t seq;
+    word_t pc;
+    byte_t instr;
+    byte_t fate;
+    word_t enter[PT_STAGES];  /* Cycle each stage was entered, or -1 */
+    word_t end;               /* First cycle no longer in pipeline */
+} pt_instr_rec, *pt_instr_ptr;
+
+typedef struct pipetrace_rec *pipetrace_t;
+
+/* Start trace, writing header to file */
+pipetrace_t new_pipetrace(FILE *file);
+/* Write records for instructions still in the pipeline and free
+   trace.  Does not close file */
+void free_pipetrace(pipetrace_t t);
+
+/* Record contents of pipeline at end of cycle.  seq gives the
+   instruction in each stage, or 0 for a bubble, and pc and instr
+   describe the one in F */
+void pipetrace_cycle(pipetrace_t t, word_t cycle, word_t seq[PT_STAGES],
+		     word_t pc, byte_t instr);
+
+/* Read all records of binary trace, sorted by seq.  Return number of
+   records, or -1 if the file does not start with a valid header */
+int pipetrace_read(FILE *file, pt_instr_ptr *recs);
+
+/* Write records in the Kanata log format of the Konata pipeline
+   viewer */
+void pipetrace_konata(pt_instr_ptr recs, int n, FILE *outfile);
+
+/* Write records as Chrome trace event JSON, one row per stage, with
+   one cycle shown as one microsecond */
+void pipetrace_chrome(pt_instr_ptr recs, int n, FILE *outfile);
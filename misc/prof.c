@@ -0,0 +1,409 @@
+/* Execution profiles of Y86-64 programs */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "isa.h"
+#include "prof.h"
+
+/* Counts for one instruction address */
+typedef struct {
+    word_t pc;
+    bool_t used;
+    byte_t instr;
+    word_t count;
+    word_t cycles;
+    word_t taken;
+    word_t not_taken;
+    word_t lost[STALL_NCAUSES];
+} pc_rec, *pc_ptr;
+
+/* Calling context: a function reached through a chain of calls.
+   Node 0 is the function where execution started */
+typedef struct {
+    word_t func;        /* Address of function */
+    int parent;
+    int child;          /* First callee, or -1 */
+    int sibling;        /* Next callee of parent, or -1 */
+    word_t count;       /* Instructions retired in this context */
+    word_t cycles;
+} node_rec, *node_ptr;
+
+struct prof_rec {
+    image_t img;
+    /* Open hash table of addresses.  Size is power of 2 */
+    pc_ptr pcs;
+    int npcs;
+    int pc_size;
+    /* Calling context tree */
+    node_ptr nodes;
+    int nnodes;
+    int node_size;
+    int cur;            /* Context of most recent instruction */
+    /* Most recent instruction.  Its effect on control flow is only
+       known once the next one retires */
+    bool_t started;
+    word_t last_pc;
+    byte_t last_instr;
+    word_t last_cycle;
+    word_t total_count;
+    word_t total_cycles;
+    word_t total_lost[STALL_NCAUSES];
+};
+
+static char *stall_names[STALL_NCAUSES] = {
+    "Load/use", "Mispredict", "Return", "D-cache", "Drain"
+};
+
+char *stall_name(stall_t cause)
+{
+    return cause >= 0 && cause < STALL_NCAUSES ? stall_names[cause] : "None";
+}
+
+#define PC_HASH(pc, size) \
+    ((int) (((uword_t) (pc) * 0x9E3779B97F4A7C15ULL) >> 40) & ((size) - 1))
+
+static pc_ptr find_pc(prof_t p, word_t pc)
+{
+    int i = PC_HASH(pc, p->pc_size);
+    while (p->pcs[i].used && p->pcs[i].pc != pc)
+	i = (i + 1) & (p->pc_size - 1);
+    return &p->pcs[i];
+}
+
+static void grow_pcs(prof_t p)
+{
+    pc_ptr old = p->pcs;
+    int old_size = p->pc_size;
+    int i;
+    p->pc_size *= 2;
+    p->pcs = (pc_ptr) calloc(p->pc_size, sizeof(pc_rec));
+    for (i = 0; i < old_size; i++)
+	if (old[i].used)
+	    *find_pc(p, old[i].pc) = old[i];
+    free((void *) old);
+}
+
+static int new_node(prof_t p, word_t func, int parent)
+{
+    node_ptr n;
+    if (p->nnodes == p->node_size) {
+	p->node_size *= 2;
+	p->nodes = (node_ptr) realloc(p->nodes, p->node_size * sizeof(node_rec));
+    }
+    n = &p->nodes[p->nnodes];
+    n->func = func;
+    n->parent = parent;
+    n->child = -1;
+    n->sibling = -1;
+    n->count = 0;
+    n->cycles = 0;
+    if (parent >= 0) {
+	n->sibling = p->nodes[parent].child;
+	p->nodes[parent].child = p->nnodes;
+    }
+    return p->nnodes++;
+}
+
+prof_t new_prof(image_t img)
+{
+    prof_t p = (prof_t) calloc(1, sizeof(struct prof_rec));
+    p->img = img;
+    p->pc_size = 1024;
+    p->pcs = (pc_ptr) calloc(p->pc_size, sizeof(pc_rec));
+    p->node_size = 64;
+    p->nodes = (node_ptr) malloc(p->node_size * sizeof(node_rec));
+    return p;
+}
+
+void free_prof(prof_t p)
+{
+    free((void *) p->pcs);
+    free((void *) p->nodes);
+    free((void *) p);
+}
+
+/* Apply effect of most recent instruction, now that next_pc is known */
+static void finish_last(prof_t p, word_t next_pc)
+{
+    const opcode_rec *op = &opcode_table[p->last_instr];
+    int c;
+    switch (op->icode) {
+    case I_JMP:
+	if (op->ifun != C_YES) {
+	    pc_ptr e = find_pc(p, p->last_pc);
+	    if (next_pc == p->last_pc + op->len)
+		e->not_taken++;
+	    else
+		e->taken++;
+	}
+	break;
+    case I_CALL:
+	for (c = p->nodes[p->cur].child; c >= 0; c = p->nodes[c].sibling)
+	    if (p->nodes[c].func == next_pc)
+		break;
+	p->cur = c >= 0 ? c : new_node(p, next_pc, p->cur);
+	break;
+    case I_RET:
+	/* Return from the starting function stays there */
+	if (p->cur > 0)
+	    p->cur = p->nodes[p->cur].parent;
+	break;
+    default:
+	break;
+    }
+}
+
+/* Find entry for pc, adding it if needed */
+static pc_ptr add_pc(prof_t p, word_t pc)
+{
+    pc_ptr e;
+    if (2 * (p->npcs + 1) > p->pc_size)
+	grow_pcs(p);
+    e = find_pc(p, pc);
+    if (!e->used) {
+	e->used = TRUE;
+	e->pc = pc;
+	p->npcs++;
+    }
+    return e;
+}
+
+void prof_retire(prof_t p, word_t pc, byte_t instr, word_t cycle)
+{
+    word_t cycles;
+    pc_ptr e;
+    if (p->started)
+	finish_last(p, pc);
+    else {
+	new_node(p, pc, -1);
+	p->started = TRUE;
+    }
+    cycles = cycle - p->last_cycle;
+    e = add_pc(p, pc);
+    e->instr = instr;
+    e->count++;
+    e->cycles += cycles;
+    p->nodes[p->cur].count++;
+    p->nodes[p->cur].cycles += cycles;
+    p->total_count++;
+    p->total_cycles += cycles;
+    p->last_pc = pc;
+    p->last_instr = instr;
+    p->last_cycle = cycle;
+}
+
+void prof_stall(prof_t p, word_t pc, byte_t instr, stall_t cause)
+{
+    pc_ptr e = add_pc(p, pc);
+    e->instr = instr;
+    e->lost[cause]++;
+    p->total_lost[cause]++;
+}
+
+/* Find symbol at address, or NULL */
+static char *symbol_at(prof_t p, word_t addr)
+{
+    int lo = 0, hi;
+    if (!p->img)
+	return NULL;
+    hi = p->img->nsyms;
+    /* First symbol with address >= addr */
+    while (lo < hi) {
+	int mid = (lo + hi) / 2;
+	if (p->img->syms[mid].addr < addr)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    if (lo < p->img->nsyms && p->img->syms[lo].addr == addr)
+	return p->img->syms[lo].name;
+    return NULL;
+}
+
+/* Print operand of type arg, from register byte regids and constant
+   word valc */
+static int print_arg(char *buf, arg_t arg, int hi, const opcode_rec *op,
+		     byte_t regids, word_t valc)
+{
+    reg_id_t reg = hi ? HI4(regids) : LO4(regids);
+    switch (arg) {
+    case R_ARG:
+	return sprintf(buf, "%s", reg_name(reg));
+    case I_ARG:
+	/* Immediate data, or jump target */
+	return sprintf(buf, op->regids ? "$%lld" : "0x%llx", valc);
+    case M_ARG:
+	if (reg == REG_NONE)
+	    return sprintf(buf, "0x%llx", valc);
+	return sprintf(buf, "%lld(%s)", valc, reg_name(reg));
+    default:
+	return 0;
+    }
+}
+
+/* Disassemble instruction at pc into buf */
+static void disassemble(mem_t m, word_t pc, char *buf)
+{
+    byte_t instr = 0;
+    byte_t regids = HPACK(REG_NONE, REG_NONE);
+    word_t valc = 0;
+    const opcode_rec *op;
+    instr_ptr in;
+    int n;
+
+    get_byte_val(m, pc, &instr);
+    op = &opcode_table[instr];
+    in = op->name ? find_instr(op->name) : NULL;
+    if (!in || in->bytes == 0) {
+	sprintf(buf, ".byte 0x%.2x", instr);
+	return;
+    }
+    if (op->regids)
+	get_byte_val(m, pc + 1, &regids);
+    if (op->valc)
+	get_word_val(m, pc + 1 + op->regids, &valc);
+    n = sprintf(buf, "%s", op->name);
+    if (in->arg1 != NO_ARG) {
+	n += sprintf(buf + n, " ");
+	n += print_arg(buf + n, in->arg1, in->arg1hi, op, regids, valc);
+    }
+    if (in->arg2 != NO_ARG) {
+	n += sprintf(buf + n, ", ");
+	n += print_arg(buf + n, in->arg2, in->arg2hi, op, regids, valc);
+    }
+}
+
+static int pc_compare(const void *a, const void *b)
+{
+    word_t pa = ((pc_ptr) a)->pc;
+    word_t pb = ((pc_ptr) b)->pc;
+    return pa < pb ? -1 : pa > pb ? 1 : 0;
+}
+
+void prof_listing(prof_t p, mem_t m, FILE *outfile)
+{
+    pc_ptr sorted = (pc_ptr) malloc((p->npcs + 1) * sizeof(pc_rec));
+    word_t next = -1;
+    int i, n = 0;
+    char buf[128];
+
+    for (i = 0; i < p->pc_size; i++)
+	if (p->pcs[i].used)
+	    sorted[n++] = p->pcs[i];
+    qsort(sorted, n, sizeof(pc_rec), pc_compare);
+
+    fprintf(outfile, "%lld instructions, %lld cycles\n\n",
+	    p->total_count, p->total_cycles);
+    fprintf(outfile, "%10s %10s %6s %9s %9s  %s\n",
+	    "Count", "Cycles", "Cyc%", "Taken", "Not", "Instruction");
+    for (i = 0; i < n; i++) {
+	pc_ptr e = &sorted[i];
+	const opcode_rec *op = &opcode_table[e->instr];
+	char *label = symbol_at(p, e->pc);
+	if (i > 0 && e->pc != next)
+	    fprintf(outfile, "%50s...\n", "");
+	if (label)
+	    fprintf(outfile, "%50s%s:\n", "", label);
+	fprintf(outfile, "%10lld %10lld %5.1f%% ", e->count, e->cycles,
+		p->total_cycles > 0 ? 100.0 * e->cycles / p->total_cycles : 0.0);
+	if (op->icode == I_JMP && op->ifun != C_YES)
+	    fprintf(outfile, "%9lld %9lld  ", e->taken, e->not_taken);
+	else
+	    fprintf(outfile, "%9s %9s  ", "", "");
+	disassemble(m, e->pc, buf);
+	fprintf(outfile, "0x%.3llx: %s\n", e->pc, buf);
+	next = e->pc + op->len;
+    }
+    free((void *) sorted);
+}
+
+void prof_cpi_stack(prof_t p, mem_t m, FILE *outfile)
+{
+    pc_ptr sorted = (pc_ptr) malloc((p->npcs + 1) * sizeof(pc_rec));
+    word_t lost = 0;
+    int i, c, n = 0;
+    char buf[128];
+
+    for (c = 0; c < STALL_NCAUSES; c++)
+	lost += p->total_lost[c];
+    for (i = 0; i < p->pc_size; i++) {
+	pc_ptr e = &p->pcs[i];
+	if (!e->used)
+	    continue;
+	for (c = 0; c < STALL_NCAUSES; c++)
+	    if (e->lost[c] > 0)
+		break;
+	if (c < STALL_NCAUSES)
+	    sorted[n++] = *e;
+    }
+    qsort(sorted, n, sizeof(pc_rec), pc_compare);
+
+    fprintf(outfile, "%lld cycles lost in %lld instructions\n\n",
+	    lost, p->total_count);
+    fprintf(outfile, "%10s", "Count");
+    for (c = 0; c < STALL_NCAUSES; c++)
+	fprintf(outfile, " %10s", stall_names[c]);
+    fprintf(outfile, "  %s\n", "Instruction");
+    for (i = 0; i < n; i++) {
+	pc_ptr e = &sorted[i];
+	char *label = symbol_at(p, e->pc);
+	if (label)
+	    fprintf(outfile, "%67s%s:\n", "", label);
+	fprintf(outfile, "%10lld", e->count);
+	for (c = 0; c < STALL_NCAUSES; c++)
+	    fprintf(outfile, " %10lld", e->lost[c]);
+	disassemble(m, e->pc, buf);
+	fprintf(outfile, "  0x%.3llx: %s\n", e->pc, buf);
+    }
+    fprintf(outfile, "%10lld", p->total_count);
+    for (c = 0; c < STALL_NCAUSES; c++)
+	fprintf(outfile, " %10lld", p->total_lost[c]);
+    fprintf(outfile, "  %s\n", "Total");
+    free((void *) sorted);
+}
+
+static void print_func(prof_t p, word_t func, FILE *outfile)
+{
+    char *name = symbol_at(p, func);
+    if (name)
+	fprintf(outfile, "%s", name);
+    else
+	fprintf(outfile, "0x%llx", func);
+}
+
+void prof_folded(prof_t p, FILE *outfile)
+{
+    int *path;
+    int node = 0, depth = 0;
+    int i;
+    if (p->nnodes == 0)
+	return;
+    path = (int *) malloc(p->nnodes * sizeof(int));
+    /* Walk tree depth first, keeping chain from root in path */
+    for (;;) {
+	path[depth] = node;
+	if (p->nodes[node].cycles > 0) {
+	    for (i = 0; i <= depth; i++) {
+		if (i > 0)
+		    fputc(';', outfile);
+		print_func(p, p->nodes[path[i]].func, outfile);
+	    }
+	    fprintf(outfile, " %lld\n", p->nodes[node].cycles);
+	}
+	if (p->nodes[node].child >= 0) {
+	    node = p->nodes[node].child;
+	    depth++;
+	    continue;
+	}
+	while (depth > 0 && p->nodes[node].sibling < 0) {
+	    node = p->nodes[node].parent;
+	    depth--;
+	}
+	if (depth == 0)
+	    break;
+	node = p->nodes[node].sibling;
+    }
+    free((void *) path);
+}
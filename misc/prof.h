@@ -0,0 +1,56 @@
+/* Execution profiles of Y86-64 programs */
+
+/*
+ * A profile counts how often the instruction at each address retired,
+ * how many cycles it was charged with and, for conditional jumps, how
+ * often they were taken.  It also follows call and ret to build a tree
+ * of calling contexts, and charges each instruction to the chain of
+ * functions active when it retired.  The tree is written as folded
+ * stacks, one line per chain with its cycle count, which is the input
+ * format of flame graph tools.
+ *
+ * Pipeline simulators also report the cycles lost to bubbles, with the
+ * instruction that caused each one, giving a CPI stack per address.
+ */
+
+typedef struct prof_rec *prof_t;
+
+/* Causes of cycles in which a pipeline retires no instruction */
+typedef enum {
+    STALL_NONE = -1,
+    STALL_LOAD_USE,    /* Load/use hazard */
+    STALL_MISPREDICT,  /* Mispredicted conditional jump */
+    STALL_RET,         /* Waiting for return address */
+    STALL_DCACHE,      /* Data cache miss */
+    STALL_DRAIN,       /* Draining after an exception */
+    STALL_NCAUSES
+} stall_t;
+
+/* Short name of cause */
+char *stall_name(stall_t cause);
+
+/* Start profile.  Functions are named by the symbols in img, which may
+   be NULL.  The symbols must last until the profile is freed */
+prof_t new_prof(image_t img);
+void free_prof(prof_t p);
+
+/* Record instruction retired at pc with first byte instr.  cycle is
+   the number of cycles simulated so far, and the instruction is
+   charged with the cycles since the previous one retired.  Simulators
+   without timing pass the instruction count */
+void prof_retire(prof_t p, word_t pc, byte_t instr, word_t cycle);
+
+/* Record cycle lost to cause, charging it to the instruction at pc
+   with first byte instr */
+void prof_stall(prof_t p, word_t pc, byte_t instr, stall_t cause);
+
+/* Write cycles lost to each cause in total, and for each instruction
+   that caused any, reading the code from m */
+void prof_cpi_stack(prof_t p, mem_t m, FILE *outfile);
+
+/* Write executed instructions in address order, with their counts,
+   reading the code from m */
+void prof_listing(prof_t p, mem_t m, FILE *outfile);
+
+/* Write cycles for each chain of calls in folded stack format */
+void prof_folded(prof_t p, FILE *outfile);
@@ -0,0 +1,90 @@
+/* Lock-free queue between two threads */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "isa.h"
+#include "spsc.h"
+
+/* Keep each side's indices on its own cache line */
+#define LINE 64
+
+struct spsc_rec {
+    /* Written only by producer */
+    _Alignas(LINE) atomic_size_t tail;  /* Next slot to fill */
+    size_t head_seen;                   /* Last head read by producer */
+    atomic_int closed;
+    /* Written only by consumer */
+    _Alignas(LINE) atomic_size_t head;  /* Next slot to empty */
+    size_t tail_seen;                   /* Last tail read by consumer */
+    /* Fixed at creation */
+    _Alignas(LINE) size_t size;
+    size_t mask;
+    byte_t *slots;
+};
+
+spsc_t new_spsc(size_t size, size_t count)
+{
+    spsc_t q = (spsc_t) aligned_alloc(LINE, sizeof(struct spsc_rec));
+    size_t n = 1;
+    while (n < count)
+	n *= 2;
+    atomic_init(&q->tail, 0);
+    q->head_seen = 0;
+    atomic_init(&q->closed, 0);
+    atomic_init(&q->head, 0);
+    q->tail_seen = 0;
+    q->size = size;
+    q->mask = n - 1;
+    q->slots = (byte_t *) malloc(n * size);
+    return q;
+}
+
+void free_spsc(spsc_t q)
+{
+    free((void *) q->slots);
+    free((void *) q);
+}
+
+bool_t spsc_put(spsc_t q, const void *item)
+{
+    size_t t = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    /* Only look at the consumer's index when the queue seems full */
+    if (t - q->head_seen > q->mask) {
+	q->head_seen = atomic_load_explicit(&q->head, memory_order_acquire);
+	if (t - q->head_seen > q->mask)
+	    return FALSE;
+    }
+    memcpy(q->slots + (t & q->mask) * q->size, item, q->size);
+    atomic_store_explicit(&q->tail, t + 1, memory_order_release);
+    return TRUE;
+}
+
+void spsc_close(spsc_t q)
+{
+    atomic_store_explicit(&q->closed, 1, memory_order_release);
+}
+
+bool_t spsc_get(spsc_t q, void *item)
+{
+    size_t h = atomic_load_explicit(&q->head, memory_order_relaxed);
+    if (h == q->tail_seen) {
+	q->tail_seen = atomic_load_explicit(&q->tail, memory_order_acquire);
+	if (h == q->tail_seen)
+	    return FALSE;
+    }
+    memcpy(item, q->slots + (h & q->mask) * q->size, q->size);
+    atomic_store_explicit(&q->head, h + 1, memory_order_release);
+    return TRUE;
+}
+
+bool_t spsc_done(spsc_t q)
+{
+    /* Items put before closing are visible once closed is */
+    if (!atomic_load_explicit(&q->closed, memory_order_acquire))
+	return FALSE;
+    return atomic_load_explicit(&q->head, memory_order_relaxed) ==
+	atomic_load_explicit(&q->tail, memory_order_relaxed);
+}
@@ -0,0 +1,25 @@
+/* Lock-free queue between two threads */
+
+/*
+ * An SPSC queue passes fixed-size items from exactly one producer
+ * thread to exactly one consumer thread.  Neither side ever blocks or
+ * takes a lock: spsc_put fails when the queue is full and spsc_get
+ * fails when it is empty, and the caller decides whether to spin, yield
+ * or give up.  The producer calls spsc_close after its last item.
+ */
+
+typedef struct spsc_rec *spsc_t;
+
+/* Create queue holding up to count items of size bytes.
+   Count is rounded up to a power of two */
+spsc_t new_spsc(size_t size, size_t count);
+void free_spsc(spsc_t q);
+
+/* Producer side.  Return FALSE if queue is full */
+bool_t spsc_put(spsc_t q, const void *item);
+void spsc_close(spsc_t q);
+
+/* Consumer side.  Return FALSE if queue is empty */
+bool_t spsc_get(spsc_t q, void *item);
+/* TRUE once queue is closed and every item has been taken */
+bool_t spsc_done(spsc_t q);
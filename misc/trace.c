@@ -0,0 +1,253 @@
+/* Execution traces for Y86-64 ISA simulator */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "isa.h"
+#include "trace.h"
+
+/* Size of output buffer */
+#define TRACE_BUF (1<<16)
+
+/* Longest binary record */
+#define MAX_RECORD (2 + MAX_INSTR_LEN + 8 + 9*MAX_REG_WRITES + 16 + 2)
+
+struct trace_rec {
+    FILE *file;
+    bool_t write;
+    word_t next_pc;   /* Where record without TR_PC starts */
+    int used;
+    byte_t buf[TRACE_BUF];
+};
+
+stat_t step_retire(state_ptr s, retire_ptr r, FILE *error_file)
+{
+    word_t old[REG_NONE+1];
+    cc_t occ = lazy_cc_get(&s->cc);
+    dinstr_rec d;
+    bool_t store = FALSE;
+    word_t addr = 0;
+    int i;
+    stat_t e;
+
+    memcpy(old, s->r->regs, sizeof(old));
+    r->pc = s->pc;
+    r->len = 0;
+    if (decode_instr(s->m, s->pc, &d)) {
+	r->len = d.valp - d.pc;
+	for (i = 0; i < r->len; i++)
+	    get_byte_val(s->m, s->pc + i, &r->instr[i]);
+	/* Find address of word that may be written */
+	switch (d.icode) {
+	case I_RMMOVQ:
+	    store = TRUE;
+	    addr = d.valc + old[d.rb];
+	    break;
+	case I_PUSHQ:
+	case I_CALL:
+	    store = TRUE;
+	    addr = old[REG_RSP] - 8;
+	    break;
+	default:
+	    break;
+	}
+    }
+    r->mem_old = 0;
+    if (store)
+	get_word_val(s->m, addr, &r->mem_old);
+
+    e = step_state(s, error_file);
+
+    r->status = e;
+    r->nregs = 0;
+    for (i = 0; i < REG_NONE; i++)
+	if (s->r->regs[i] != old[i] && r->nregs < MAX_REG_WRITES) {
+	    r->reg_id[r->nregs] = (reg_id_t) i;
+	    r->reg_val[r->nregs] = s->r->regs[i];
+	    r->reg_old[r->nregs] = old[i];
+	    r->nregs++;
+	}
+    r->mem_write = store && e == STAT_AOK;
+    r->mem_addr = addr;
+    r->mem_val = 0;
+    if (r->mem_write)
+	get_word_val(s->m, addr, &r->mem_val);
+    r->cc = lazy_cc_get(&s->cc);
+    r->cc_old = occ;
+    r->cc_changed = r->cc != occ;
+    return e;
+}
+
+void print_retire(FILE *outfile, retire_ptr r)
+{
+    int i;
+    bool_t more;
+    fprintf(outfile, "0x%.3llx: ", r->pc);
+    for (i = 0; i < MAX_INSTR_LEN; i++) {
+	if (i < r->len)
+	    fprintf(outfile, "%.2x", r->instr[i]);
+	else
+	    fprintf(outfile, "  ");
+    }
+    more = r->nregs > 0 || r->mem_write || r->cc_changed ||
+	r->status != STAT_AOK;
+    fprintf(outfile, more ? " | %-6s" : " | %s",
+	    r->len > 0 ? iname(r->instr[0]) : "----");
+    for (i = 0; i < r->nregs; i++)
+	fprintf(outfile, " %s=0x%.16llx", reg_name(r->reg_id[i]), r->reg_val[i]);
+    if (r->mem_write)
+	fprintf(outfile, " M[0x%.4llx]=0x%.16llx", r->mem_addr, r->mem_val);
+    if (r->cc_changed)
+	fprintf(outfile, " CC %s", cc_name(r->cc));
+    if (r->status != STAT_AOK)
+	fprintf(outfile, " Status '%s'", stat_name(r->status));
+    fprintf(outfile, "\n");
+}
+
+static void flush_trace(trace_t t)
+{
+    fwrite(t->buf, 1, t->used, t->file);
+    t->used = 0;
+}
+
+/* Append little-endian word to buffer */
+static byte_t *put_word(byte_t *p, word_t val)
+{
+    int i;
+    for (i = 0; i < 8; i++) {
+	p[i] = (byte_t) val & 0xFF;
+	val >>= 8;
+    }
+    return p + 8;
+}
+
+trace_t new_trace(FILE *file, bool_t write)
+{
+    trace_t t = (trace_t) malloc(sizeof(struct trace_rec));
+    byte_t head[16];
+    t->file = file;
+    t->write = write;
+    t->next_pc = -1;
+    t->used = 0;
+    if (write) {
+	memcpy(head, TRACE_MAGIC, 8);
+	put_word(head + 8, TRACE_VERSION);
+	fwrite(head, 1, 16, file);
+    } else {
+	byte_t v[8];
+	put_word(v, TRACE_VERSION);
+	if (fread(head, 1, 16, file) != 16 ||
+	    memcmp(head, TRACE_MAGIC, 8) || memcmp(head + 8, v, 8)) {
+	    free((void *) t);
+	    return NULL;
+	}
+    }
+    return t;
+}
+
+void free_trace(trace_t t)
+{
+    if (t->write) {
+	flush_trace(t);
+	fflush(t->file);
+    }
+    free((void *) t);
+}
+
+void trace_put(trace_t t, retire_ptr r)
+{
+    byte_t *p;
+    int i;
+    byte_t flags = r->nregs;
+    if (t->used > TRACE_BUF - MAX_RECORD)
+	flush_trace(t);
+    if (r->mem_write)
+	flags |= TR_MEM;
+    if (r->pc != t->next_pc)
+	flags |= TR_PC;
+    if (r->cc_changed)
+	flags |= TR_CC;
+    if (r->status != STAT_AOK)
+	flags |= TR_STAT;
+    p = t->buf + t->used;
+    *p++ = flags;
+    *p++ = r->len;
+    memcpy(p, r->instr, r->len);
+    p += r->len;
+    if (flags & TR_PC)
+	p = put_word(p, r->pc);
+    for (i = 0; i < r->nregs; i++) {
+	*p++ = r->reg_id[i];
+	p = put_word(p, r->reg_val[i]);
+    }
+    if (flags & TR_MEM) {
+	p = put_word(p, r->mem_addr);
+	p = put_word(p, r->mem_val);
+    }
+    if (flags & TR_CC)
+	*p++ = r->cc;
+    if (flags & TR_STAT)
+	*p++ = r->status;
+    t->used = p - t->buf;
+    t->next_pc = r->pc + r->len;
+}
+
+/* Read little-endian word.  Return FALSE at end of file */
+static bool_t get_word(FILE *file, word_t *dest)
+{
+    byte_t b[8];
+    word_t val = 0;
+    int i;
+    if (fread(b, 1, 8, file) != 8)
+	return FALSE;
+    for (i = 7; i >= 0; i--)
+	val = (val << 8) | b[i];
+    *dest = val;
+    return TRUE;
+}
+
+bool_t trace_get(trace_t t, retire_ptr r)
+{
+    int flags = getc(t->file);
+    int len = getc(t->file);
+    int i;
+    if (flags == EOF || len == EOF || len > MAX_INSTR_LEN)
+	return FALSE;
+    r->len = len;
+    if (fread(r->instr, 1, len, t->file) != (size_t) len)
+	return FALSE;
+    r->pc = t->next_pc;
+    if ((flags & TR_PC) && !get_word(t->file, &r->pc))
+	return FALSE;
+    r->nregs = flags & TR_NREGS;
+    for (i = 0; i < r->nregs; i++) {
+	int id = getc(t->file);
+	if (id == EOF || !get_word(t->file, &r->reg_val[i]))
+	    return FALSE;
+	r->reg_id[i] = (reg_id_t) id;
+    }
+    r->mem_write = (flags & TR_MEM) != 0;
+    r->mem_addr = 0;
+    r->mem_val = 0;
+    if (r->mem_write && !(get_word(t->file, &r->mem_addr) &&
+			  get_word(t->file, &r->mem_val)))
+	return FALSE;
+    r->cc_changed = (flags & TR_CC) != 0;
+    r->cc = 0;
+    if (r->cc_changed) {
+	int c = getc(t->file);
+	if (c == EOF)
+	    return FALSE;
+	r->cc = c;
+    }
+    r->status = STAT_AOK;
+    if (flags & TR_STAT) {
+	int c = getc(t->file);
+	if (c == EOF)
+	    return FALSE;
+	r->status = (stat_t) c;
+    }
+    t->next_pc = r->pc + r->len;
+    return TRUE;
+}
@@ -0,0 +1,75 @@
+/* Execution traces for Y86-64 ISA simulator */
+
+/*
+ * A trace is a stream of records, one per retired instruction, giving
+ * its address, its bytes, and the registers, memory word and condition
+ * codes it changed.  Together with the initial memory image, the
+ * records are enough to reconstruct the state after any step.
+ *
+ * Binary trace files start with the 8-byte magic number TRACE_MAGIC and
+ * an 8-byte version.  Each record is then:
+ *   flags    1 byte: TR_* bits, with number of register writes in
+ *            the low two bits
+ *   len      1 byte: instruction length
+ *   instr    len bytes
+ *   pc       8 bytes, if TR_PC.  Otherwise pc follows on from the
+ *            previous record
+ *   regs     1-byte register id and 8-byte value for each write
+ *   mem      8-byte address and 8-byte value, if TR_MEM
+ *   cc       1 byte, if TR_CC
+ *   status   1 byte, if TR_STAT.  Otherwise status is AOK
+ * All multi-byte values are little-endian.
+ */
+
+#define TRACE_MAGIC "\177Y86TRC"
+#define TRACE_VERSION 1
+
+/* Flags in binary records */
+#define TR_NREGS 0x03
+#define TR_MEM   0x04
+#define TR_PC    0x08
+#define TR_CC    0x10
+#define TR_STAT  0x20
+
+/* Most registers written by one instruction */
+#define MAX_REG_WRITES 2
+
+/* Retired instruction */
+typedef struct {
+    word_t pc;
+    int len;                       /* 0 if instruction could not be fetched */
+    byte_t instr[MAX_INSTR_LEN];
+    stat_t status;
+    int nregs;
+    reg_id_t reg_id[MAX_REG_WRITES];
+    word_t reg_val[MAX_REG_WRITES];
+    word_t reg_old[MAX_REG_WRITES];  /* Values before the write */
+    bool_t mem_write;
+    word_t mem_addr;
+    word_t mem_val;
+    word_t mem_old;
+    bool_t cc_changed;
+    cc_t cc;
+    cc_t cc_old;
+} retire_rec, *retire_ptr;
+
+/* Execute single instruction like step_state, describing it in r.
+   The old values in r are not part of binary traces */
+stat_t step_retire(state_ptr s, retire_ptr r, FILE *error_file);
+
+/* Print one-line description of retired instruction */
+void print_retire(FILE *outfile, retire_ptr r);
+
+/* Binary trace file, with buffered output */
+typedef struct trace_rec *trace_t;
+
+/* Start trace.  When writing, write header to outfile.  When reading,
+   check header and return NULL if it is not valid */
+trace_t new_trace(FILE *file, bool_t write);
+/* Flush output and free trace.  Does not close file */
+void free_trace(trace_t t);
+
+/* Add record to trace */
+void trace_put(trace_t t, retire_ptr r);
+/* Read next record.  Return FALSE at end of trace */
+bool_t trace_get(trace_t t, retire_ptr r);
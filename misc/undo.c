@@ -0,0 +1,130 @@
+/* Undo log for reverse execution in Y86-64 ISA simulator */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "isa.h"
+#include "trace.h"
+#include "undo.h"
+
+/* Flags in entries.  Low bits give number of registers written */
+#define UNDO_NREGS 0x03
+#define UNDO_MEM   0x04
+
+typedef struct {
+    word_t pc;
+    word_t mem_addr;
+    word_t mem_old;
+    word_t reg_old[MAX_REG_WRITES];
+    byte_t reg_id[MAX_REG_WRITES];
+    byte_t flags;
+    byte_t cc_old;
+} undo_entry;
+
+struct undo_rec {
+    word_t size;
+    word_t head;      /* Index of next entry to write */
+    word_t count;
+    undo_entry *log;
+};
+
+undo_t new_undo(word_t size)
+{
+    undo_t u;
+    if (size < 1)
+	size = 1;
+    if ((uword_t) size > SIZE_MAX / sizeof(undo_entry))
+	return NULL;
+    u = (undo_t) malloc(sizeof(struct undo_rec));
+    if (!u)
+	return NULL;
+    u->size = size;
+    u->head = 0;
+    u->count = 0;
+    u->log = (undo_entry *) malloc(size * sizeof(undo_entry));
+    if (!u->log) {
+	free((void *) u);
+	return NULL;
+    }
+    return u;
+}
+
+void free_undo(undo_t u)
+{
+    free((void *) u->log);
+    free((void *) u);
+}
+
+word_t undo_depth(undo_t u)
+{
+    return u->count;
+}
+
+void undo_record(undo_t u, retire_ptr r)
+{
+    undo_entry *ue = &u->log[u->head];
+    int i;
+    ue->pc = r->pc;
+    ue->flags = r->nregs;
+    for (i = 0; i < r->nregs; i++) {
+	ue->reg_id[i] = r->reg_id[i];
+	ue->reg_old[i] = r->reg_old[i];
+    }
+    if (r->mem_write) {
+	ue->flags |= UNDO_MEM;
+	ue->mem_addr = r->mem_addr;
+	ue->mem_old = r->mem_old;
+    }
+    ue->cc_old = r->cc_old;
+    if (++u->head == u->size)
+	u->head = 0;
+    if (u->count < u->size)
+	u->count++;
+}
+
+stat_t step_record(state_ptr s, undo_t u, FILE *error_file)
+{
+    retire_rec r;
+    stat_t e = step_retire(s, &r, error_file);
+    undo_record(u, &r);
+    return e;
+}
+
+/* Remove newest entry and restore the values it holds */
+static void undo_one(state_ptr s, undo_t u)
+{
+    undo_entry *ue;
+    int i;
+    u->head = u->head == 0 ? u->size - 1 : u->head - 1;
+    u->count--;
+    ue = &u->log[u->head];
+    for (i = 0; i < (ue->flags & UNDO_NREGS); i++)
+	set_reg_val(s->r, (reg_id_t) ue->reg_id[i], ue->reg_old[i]);
+    if (ue->flags & UNDO_MEM)
+	set_word_val(s->m, ue->mem_addr, ue->mem_old);
+    lazy_cc_load(&s->cc, ue->cc_old);
+    s->pc = ue->pc;
+}
+
+word_t step_back(state_ptr s, undo_t u, word_t n)
+{
+    word_t done = 0;
+    while (done < n && u->count > 0) {
+	undo_one(s, u);
+	done++;
+    }
+    return done;
+}
+
+word_t run_back(state_ptr s, undo_t u, word_t pc)
+{
+    word_t i, idx = u->head;
+    /* Find newest entry for pc before changing anything */
+    for (i = 0; i < u->count; i++) {
+	idx = idx == 0 ? u->size - 1 : idx - 1;
+	if (u->log[idx].pc == pc)
+	    return step_back(s, u, i + 1);
+    }
+    return -1;
+}
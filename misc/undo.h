@@ -0,0 +1,32 @@
+/* Undo log for reverse execution in Y86-64 ISA simulator */
+
+/*
+ * The log holds, for each recorded instruction, the PC it started at
+ * and the old values of the registers, memory word and condition codes
+ * it overwrote.  Entries are fixed size and kept in a ring, so once
+ * the log is full each new entry replaces the oldest one.
+ */
+
+typedef struct undo_rec *undo_t;
+
+/* Create log holding the last size instructions.  Return NULL if
+   there is not enough memory */
+undo_t new_undo(word_t size);
+void free_undo(undo_t u);
+
+/* Number of instructions that can be undone */
+word_t undo_depth(undo_t u);
+
+/* Record instruction described by r, as produced by step_retire */
+void undo_record(undo_t u, retire_ptr r);
+
+/* Execute single instruction like step_state, recording it in u */
+stat_t step_record(state_ptr s, undo_t u, FILE *error_file);
+
+/* Undo up to n instructions.  Return number undone */
+word_t step_back(state_ptr s, undo_t u, word_t n);
+
+/* Undo instructions until reaching one that started at pc.
+   Return number undone, or -1 if pc is not in the log.
+   State is unchanged in that case */
+word_t run_back(state_ptr s, undo_t u, word_t pc);
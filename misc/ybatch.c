@@ -0,0 +1,89 @@
+/* Run many Y86-64 programs with the instruction set simulator */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "isa.h"
+#include "block.h"
+#include "batch.h"
+
+typedef struct {
+    word_t max_steps;
+    bool_t blocks;
+    bool_t native;
+} options_rec, *options_t;
+
+void usage(char *pname)
+{
+    printf("Usage: %s [-bj] [-t threads] [-n max_steps] file|dir ...\n",
+	   pname);
+    printf("   -b     Use basic block translation\n");
+    printf("   -j     Use blocks compiled to native code\n");
+    printf("   -t n   Number of threads (default one per CPU)\n");
+    printf("   -n n   Limit each program to n steps (default 10000)\n");
+    printf("   Directories are replaced by the .yo, .ybo and .ys files they contain\n");
+    exit(0);
+}
+
+static void run_job(batch_job_t job, void *arg)
+{
+    options_t opt = (options_t) arg;
+    state_ptr s = new_state(MEM_SIZE);
+    word_t steps = 0;
+    job->loaded = batch_load(s, job->name);
+    if (job->loaded) {
+	if (opt->native)
+	    job->status = run_blocks_jit(s, opt->max_steps, &steps, NULL);
+	else if (opt->blocks)
+	    job->status = run_blocks(s, opt->max_steps, &steps, NULL);
+	else
+	    job->status = run_state(s, opt->max_steps, &steps, NULL);
+	job->instructions = steps;
+    }
+    free_state(s);
+}
+
+int main(int argc, char *argv[])
+{
+    options_rec opt;
+    int nthreads = batch_default_threads();
+    batch_job_t jobs;
+    int njobs;
+    struct timespec start, finish;
+    int c;
+
+    opt.max_steps = 10000;
+    opt.blocks = FALSE;
+    opt.native = FALSE;
+    while ((c = getopt(argc, argv, "bjt:n:")) != -1) {
+	switch (c) {
+	case 'b':
+	    opt.blocks = TRUE;
+	    break;
+	case 'j':
+	    opt.native = TRUE;
+	    break;
+	case 't':
+	    nthreads = atoi(optarg);
+	    break;
+	case 'n':
+	    opt.max_steps = atoll(optarg);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (optind == argc)
+	usage(argv[0]);
+
+    njobs = batch_collect(argc - optind, argv + optind, &jobs);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    batch_run(jobs, njobs, nthreads, run_job, &opt);
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    batch_report(stdout, jobs, njobs, (finish.tv_sec - start.tv_sec) +
+		 (finish.tv_nsec - start.tv_nsec) / 1e9);
+    batch_free(jobs, njobs);
+    return 0;
+}
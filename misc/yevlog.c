@@ -0,0 +1,27 @@
+/* Print binary event log written by psim -E */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "isa.h"
+#include "evlog.h"
+
+int main(int argc, char *argv[])
+{
+    FILE *file;
+    if (argc != 2) {
+	printf("Usage: %s event_file\n", argv[0]);
+	exit(0);
+    }
+    file = fopen(argv[1], "rb");
+    if (!file) {
+	fprintf(stderr, "Can't open event file '%s'\n", argv[1]);
+	exit(1);
+    }
+    if (!evlog_print(file, stdout)) {
+	fprintf(stderr, "'%s' is not an event log\n", argv[1]);
+	exit(1);
+    }
+    fclose(file);
+    return 0;
+}
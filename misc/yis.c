@@ -2,63 +2,235 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
 
 #include "isa.h"
+#include "asm.h"
+#include "block.h"
+#include "trace.h"
+#include "undo.h"
+#include "prof.h"
+
+/* Instructions recorded for -p */
+#define UNDO_SIZE (1<<20)
 
 void usage(char *pname)
 {
-    printf("Usage: %s code_file [max_steps]\n", pname);
+    printf("Usage: %s [-fbjB] [-v n] [-o trace_file] [-r n] [-p pc] [-P file] [-F file]\n"
+	   "       code_file [max_steps]\n", pname);
+    printf("   -f     Fast mode: threaded interpreter, no per-step report\n");
+    printf("   -b     Fast mode: basic block translation, no per-step report\n");
+    printf("   -j     Fast mode: blocks compiled to native code, no per-step report\n");
+    printf("   -v n   Per-step report: 0 none (default), 1 retired instructions, 2 changes\n");
+    printf("   -o f   Write binary trace of retired instructions to f\n");
+    printf("   -B     Benchmark: run to halt or max_steps (default no limit),\n");
+    printf("          then report instructions, time, MIPS and peak memory\n");
+    printf("   -r n   After stopping, step back n instructions\n");
+    printf("   -p pc  After stopping, run back to last instruction at pc\n");
+    printf("          (-r and -p record every step, so disable fast modes)\n");
+    printf("   -P f   Write profile to f: count per instruction and branch outcomes\n");
+    printf("   -F f   Write call stacks to f in folded format, for flame graphs\n");
+    printf("          (-P and -F follow every step, so disable fast modes)\n");
     exit(0);
 }
 
 int main(int argc, char *argv[])
 {
     FILE *code_file;
-    int max_steps = 10000;
+    word_t max_steps = 10000;
+    bool_t fast = FALSE;
+    bool_t blocks = FALSE;
+    bool_t native = FALSE;
+    bool_t bench = FALSE;
+    struct timespec start, finish;
+    int verbosity = 0;
+    FILE *trace_file = NULL;
+    trace_t trace = NULL;
+    undo_t undo = NULL;
+    word_t back_steps = 0;
+    word_t back_pc = 0;
+    bool_t use_back_pc = FALSE;
+    FILE *prof_file = NULL;
+    FILE *folded_file = NULL;
+    prof_t prof = NULL;
+    int c;
 
     state_ptr s = new_state(MEM_SIZE);
-    mem_t saver = copy_reg(s->r);
+    regfile_t saver = copy_reg(s->r);
     mem_t savem;
-    int step = 0;
+    word_t step = 0;
+    image_rec img;
 
     stat_t e = STAT_AOK;
 
-    if (argc < 2 || argc > 3)
+    while ((c = getopt(argc, argv, "fbjBv:o:r:p:P:F:")) != -1) {
+	switch (c) {
+	case 'f':
+	    fast = TRUE;
+	    break;
+	case 'b':
+	    blocks = TRUE;
+	    break;
+	case 'j':
+	    native = TRUE;
+	    break;
+	case 'B':
+	    bench = TRUE;
+	    break;
+	case 'v':
+	    verbosity = atoi(optarg);
+	    if (verbosity < 0 || verbosity > 2)
+		usage(argv[0]);
+	    break;
+	case 'o':
+	    trace_file = fopen(optarg, "wb");
+	    if (!trace_file) {
+		fprintf(stderr, "Can't open trace file '%s'\n", optarg);
+		exit(1);
+	    }
+	    break;
+	case 'r':
+	    back_steps = atoll(optarg);
+	    break;
+	case 'p':
+	    back_pc = strtoll(optarg, NULL, 0);
+	    use_back_pc = TRUE;
+	    break;
+	case 'P':
+	    prof_file = fopen(optarg, "w");
+	    if (!prof_file) {
+		fprintf(stderr, "Can't open profile file '%s'\n", optarg);
+		exit(1);
+	    }
+	    break;
+	case 'F':
+	    folded_file = fopen(optarg, "w");
+	    if (!folded_file) {
+		fprintf(stderr, "Can't open profile file '%s'\n", optarg);
+		exit(1);
+	    }
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+
+    if (argc - optind < 1 || argc - optind > 2)
 	usage(argv[0]);
-    code_file = fopen(argv[1], "r");
+    code_file = fopen(argv[optind], "r");
     if (!code_file) {
-	fprintf(stderr, "Can't open code file '%s'\n", argv[1]);
+	fprintf(stderr, "Can't open code file '%s'\n", argv[optind]);
 	exit(1);
     }
 
-    if (!load_mem(s->m, code_file, 1)) {
+    if (!load_program(s->m, code_file, argv[optind], &img, 1)) {
 	printf("Exiting\n");
 	return 1;
     }
+    s->pc = img.entry;
 
     savem = copy_mem(s->m);
   
-    if (argc > 2)
-	max_steps = atoi(argv[2]);
-
-    for (step = 0; step < max_steps && e == STAT_AOK; step++) {
-        /* Execute one instruction at a time */
-        e = step_state(s, stdout);
-
-        printf("-------- Step %d --------\n", step + 1);
-        printf("PC = 0x%llx, Status '%s', CC %s\n",
-	        s->pc, stat_name(e), cc_name(s->cc));
-        printf("Changes to registers:\n");
-        diff_reg(saver, s->r, stdout);
-
-        printf("\nChanges to memory:\n");
-        diff_mem(savem, s->m, stdout);
-        printf("\n");
+    if (argc - optind > 1)
+	max_steps = atoll(argv[optind+1]);
+    else if (bench)
+	max_steps = LLONG_MAX;
+
+    if (bench)
+	verbosity = 0;
+
+    if (back_steps > 0 || use_back_pc) {
+	word_t size = use_back_pc && back_steps < UNDO_SIZE ?
+	    UNDO_SIZE : back_steps;
+	/* No more steps than the run takes can be undone */
+	if (size > max_steps)
+	    size = max_steps;
+	undo = new_undo(size);
+	if (!undo) {
+	    fprintf(stderr, "Not enough memory to undo %lld steps\n", size);
+	    exit(1);
+	}
+	fast = blocks = native = FALSE;
+    }
+
+    if (prof_file || folded_file) {
+	/* Symbols name the functions */
+	prof = new_prof(&img);
+	fast = blocks = native = FALSE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (fast || blocks || native || (verbosity == 0 && !trace_file && !undo && !prof)) {
+	/* Run to completion, reporting only the final state */
+	word_t steps = 0;
+	if (native)
+	    e = run_blocks_jit(s, max_steps, &steps, stdout);
+	else if (blocks)
+	    e = run_blocks(s, max_steps, &steps, stdout);
+	else
+	    e = run_state(s, max_steps, &steps, stdout);
+	step = steps;
+    } else {
+	if (trace_file)
+	    trace = new_trace(trace_file, TRUE);
+	for (step = 0; step < max_steps && e == STAT_AOK; step++) {
+	    retire_rec r;
+            /* Execute one instruction at a time */
+            e = step_retire(s, &r, stdout);
+	    if (undo)
+		undo_record(undo, &r);
+	    if (prof && r.len > 0)
+		prof_retire(prof, r.pc, r.instr[0], step + 1);
+	    if (trace)
+		trace_put(trace, &r);
+	    if (verbosity == 1)
+		print_retire(stdout, &r);
+	    if (verbosity < 2)
+		continue;
+
+            printf("-------- Step %lld --------\n", step + 1);
+            printf("PC = 0x%llx, Status '%s', CC %s\n",
+		   s->pc, stat_name(e), cc_name(lazy_cc_get(&s->cc)));
+            printf("Changes to registers:\n");
+            diff_reg(saver, s->r, stdout);
+
+            printf("\nChanges to memory:\n");
+            diff_mem(savem, s->m, stdout);
+            printf("\n");
+	}
+	if (trace) {
+	    free_trace(trace);
+	    fclose(trace_file);
+	}
     }
 	
 
-    printf("Stopped in %d steps at PC = 0x%llx.  Status '%s', CC %s\n",
-	   step, s->pc, stat_name(e), cc_name(s->cc));
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+
+    if (undo) {
+	word_t back = 0;
+	if (use_back_pc) {
+	    back = run_back(s, undo, back_pc);
+	    if (back < 0) {
+		printf("PC 0x%llx not among last %lld steps\n",
+		       back_pc, undo_depth(undo));
+		back = 0;
+	    }
+	}
+	back += step_back(s, undo, back_steps);
+	if (back > 0) {
+	    printf("Stepped back %lld steps\n", back);
+	    step -= back;
+	    e = STAT_AOK;
+	}
+	free_undo(undo);
+    }
+
+    printf("Stopped in %lld steps at PC = 0x%llx.  Status '%s', CC %s\n",
+	   step, s->pc, stat_name(e), cc_name(lazy_cc_get(&s->cc)));
 
     printf("Changes to registers:\n");
     diff_reg(saver, s->r, stdout);
@@ -66,6 +238,36 @@ int main(int argc, char *argv[])
     printf("\nChanges to memory:\n");
     diff_mem(savem, s->m, stdout);
 
+    if (bench) {
+	struct rusage ru;
+	long rss;
+	double secs = (finish.tv_sec - start.tv_sec) +
+	    (finish.tv_nsec - start.tv_nsec) / 1e9;
+	getrusage(RUSAGE_SELF, &ru);
+	rss = ru.ru_maxrss;
+#ifdef __APPLE__
+	/* Reported in bytes rather than kilobytes */
+	rss /= 1024;
+#endif
+	printf("\nInstructions: %lld\n", step);
+	printf("Time:         %.3f s\n", secs);
+	printf("MIPS:         %.1f\n", secs > 0 ? step / secs / 1e6 : 0.0);
+	printf("Peak RSS:     %ld KB\n", rss);
+    }
+
+    if (prof) {
+	if (prof_file) {
+	    prof_listing(prof, savem, prof_file);
+	    fclose(prof_file);
+	}
+	if (folded_file) {
+	    prof_folded(prof, folded_file);
+	    fclose(folded_file);
+	}
+	free_prof(prof);
+    }
+
+    free_image(&img);
     free_state(s);
     free_reg(saver);
     free_mem(savem);
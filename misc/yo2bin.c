@@ -0,0 +1,92 @@
+/* Convert Y86-64 object or source file to binary image */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "isa.h"
+#include "asm.h"
+
+void usage(char *pname)
+{
+    printf("Usage: %s [-e entry] [-o outfile] code_file\n", pname);
+    printf("   -e entry    Entry point: address or label (default 0)\n");
+    printf("   -o outfile  Output file (default code_file with .ybo suffix)\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *code_file, *out_file;
+    char *entry_name = NULL;
+    char *out_name = NULL;
+    image_rec img;
+    mem_t m = init_mem(MEM_SIZE);
+    int c;
+
+    while ((c = getopt(argc, argv, "e:o:")) != -1) {
+	switch (c) {
+	case 'e':
+	    entry_name = optarg;
+	    break;
+	case 'o':
+	    out_name = optarg;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (argc - optind != 1)
+	usage(argv[0]);
+
+    code_file = fopen(argv[optind], "r");
+    if (!code_file) {
+	fprintf(stderr, "Can't open code file '%s'\n", argv[optind]);
+	exit(1);
+    }
+    if (!load_program(m, code_file, argv[optind], &img, 1)) {
+	printf("Exiting\n");
+	return 1;
+    }
+    fclose(code_file);
+
+    if (entry_name) {
+	char *end;
+	int i;
+	img.entry = strtoll(entry_name, &end, 0);
+	if (*end != '\0') {
+	    /* Not a number.  Look for label */
+	    for (i = 0; i < img.nsyms; i++)
+		if (!strcmp(img.syms[i].name, entry_name))
+		    break;
+	    if (i == img.nsyms) {
+		fprintf(stderr, "Unknown entry point '%s'\n", entry_name);
+		exit(1);
+	    }
+	    img.entry = img.syms[i].addr;
+	}
+    }
+
+    if (!out_name) {
+	/* Replace .yo or .ys suffix */
+	char *dot = strrchr(argv[optind], '.');
+	int len = dot ? dot - argv[optind] : strlen(argv[optind]);
+	out_name = (char *) malloc(len + 5);
+	memcpy(out_name, argv[optind], len);
+	strcpy(out_name + len, ".ybo");
+    }
+    out_file = fopen(out_name, "wb");
+    if (!out_file) {
+	fprintf(stderr, "Can't open output file '%s'\n", out_name);
+	exit(1);
+    }
+    if (!save_image(m, &img, out_file) || fclose(out_file)) {
+	fprintf(stderr, "Error writing '%s'\n", out_name);
+	exit(1);
+    }
+
+    free_image(&img);
+    free_mem(m);
+    return 0;
+}
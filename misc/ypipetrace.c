@@ -0,0 +1,54 @@
+/* Export pipeline trace written by psim -x to a pipeline viewer */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "isa.h"
+#include "pipetrace.h"
+
+void usage(char *pname)
+{
+    printf("Usage: %s [-c] trace_file\n", pname);
+    printf("   Write trace in Kanata format, for the Konata viewer\n");
+    printf("   -c     Write Chrome trace event JSON instead\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *file;
+    bool_t chrome = FALSE;
+    pt_instr_ptr recs;
+    int n, c;
+
+    while ((c = getopt(argc, argv, "c")) != -1) {
+	switch (c) {
+	case 'c':
+	    chrome = TRUE;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (argc - optind != 1)
+	usage(argv[0]);
+
+    file = fopen(argv[optind], "rb");
+    if (!file) {
+	fprintf(stderr, "Can't open trace file '%s'\n", argv[optind]);
+	exit(1);
+    }
+    n = pipetrace_read(file, &recs);
+    fclose(file);
+    if (n < 0) {
+	fprintf(stderr, "'%s' is not a pipeline trace\n", argv[optind]);
+	exit(1);
+    }
+    if (chrome)
+	pipetrace_chrome(recs, n, stdout);
+    else
+	pipetrace_konata(recs, n, stdout);
+    free((void *) recs);
+    return 0;
+}
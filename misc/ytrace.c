@@ -0,0 +1,34 @@
+/* Print binary trace of retired instructions written by yis -o */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "isa.h"
+#include "trace.h"
+
+int main(int argc, char *argv[])
+{
+    FILE *file;
+    trace_t t;
+    retire_rec r;
+    if (argc != 2) {
+	printf("Usage: %s trace_file\n", argv[0]);
+	exit(0);
+    }
+    file = fopen(argv[1], "rb");
+    if (!file) {
+	fprintf(stderr, "Can't open trace file '%s'\n", argv[1]);
+	exit(1);
+    }
+    t = new_trace(file, FALSE);
+    if (!t) {
+	fprintf(stderr, "'%s' is not a trace\n", argv[1]);
+	exit(1);
+    }
+    /* Same lines as yis -v 1 */
+    while (trace_get(t, &r))
+	print_retire(stdout, &r);
+    free_trace(t);
+    fclose(file);
+    return 0;
+}
@@ -33,28 +33,6 @@ typedef unsigned long long int mem_addr_t;
 typedef unsigned char byte_t;
 typedef long long int word_t;
 
-/* Globals set by command line args */
-int verbosity_cache = 0; /* print trace if set */
-int s = 0;               /* set index bits */
-int b = 0;               /* block offset bits */
-int E = 0;               /* associativity */
-
-/* Derived from command line args */
-int S; /* number of sets */
-int B; /* block size (bytes) */
-unsigned long long counter;
-/* Counters used to record cache statistics in printSummary().
-   test-cache uses these numbers to verify correctness of the cache. */
-
-//Increment when a miss occurs
-int miss_count = 0;
-
-//Increment when a hit occurs
-int hit_count = 0;
-
-//Increment when an eviction occurs
-int eviction_count = 0;
-
 /* 
  * A possible hierarchy for the cache. The helper functions defined below
  * are based on this cache structure.
@@ -73,12 +51,27 @@ typedef struct cache_set
     cache_line_t *lines;
 } cache_set_t;
 
-typedef struct cache
+/* All state of one cache, so that each simulator can have its own */
+struct cache_rec
 {
-    cache_set_t *sets;
-} cache_t;
+    int verbosity; /* print trace if set */
+    int s;         /* set index bits */
+    int b;         /* block offset bits */
+    int E;         /* associativity */
+
+    /* Derived from arguments */
+    int S; /* number of sets */
+    int B; /* block size (bytes) */
+    unsigned long long counter;
+
+    /* Counters used to record cache statistics in printSummary().
+       test-cache uses these numbers to verify correctness of the cache. */
+    int miss_count;     /* Increment when a miss occurs */
+    int hit_count;      /* Increment when a hit occurs */
+    int eviction_count; /* Increment when an eviction occurs */
 
-cache_t cache;
+    cache_set_t *sets;
+};
 /* TODO: add more globals, structs, macros if necessary */
 
 /* 
@@ -88,65 +81,75 @@ cache_t cache;
  * The code provided here shows you how to initialize a cache structure
  * defined above. It's not complete and feel free to modify/add code.
  */
-void initCache(int s_in, int b_in, int E_in)
+cache_t initCache(int s_in, int b_in, int E_in)
 {
+    cache_t c = (cache_t)calloc(1, sizeof(struct cache_rec));
     /* see csim for the meaning of each argument */
-    s = s_in;
-    b = b_in;
-    E = E_in;
-    S = (unsigned int)pow(2, s);
-    B = (unsigned int)pow(2, b);
+    c->s = s_in;
+    c->b = b_in;
+    c->E = E_in;
+    c->S = (unsigned int)pow(2, c->s);
+    c->B = (unsigned int)pow(2, c->b);
 
     int i, j;
-    cache.sets = (cache_set_t *)calloc(S, sizeof(cache_set_t));
-    for (i = 0; i < S; i++)
+    c->sets = (cache_set_t *)calloc(c->S, sizeof(cache_set_t));
+    for (i = 0; i < c->S; i++)
     {
-        cache.sets[i].lines = (cache_line_t *)calloc(E, sizeof(cache_line_t));
-        for (j = 0; j < E; j++)
+        c->sets[i].lines = (cache_line_t *)calloc(c->E, sizeof(cache_line_t));
+        for (j = 0; j < c->E; j++)
         {
-            cache.sets[i].lines[j].valid = 0;
-            cache.sets[i].lines[j].tag = 0;
-            cache.sets[i].lines[j].lru = 0;
-            cache.sets[i].lines[j].data = calloc(B, sizeof(byte_t));
+            c->sets[i].lines[j].valid = 0;
+            c->sets[i].lines[j].tag = 0;
+            c->sets[i].lines[j].lru = 0;
+            c->sets[i].lines[j].data = calloc(c->B, sizeof(byte_t));
         }
     }
     /* TODO: add more code for initialization */
-    counter = 0;
+    c->counter = 0;
+    return c;
+}
+
+void setCacheVerbosity(cache_t c, int verbosity)
+{
+    c->verbosity = verbosity;
 }
 
-int get_block_size()
+int get_block_size(cache_t c)
 {
-    return B;
+    return c->B;
 }
 
-word_t get_block_address(word_t pos)
+word_t get_block_address(cache_t c, word_t pos)
 {
-    return pos & (~(B - 1));
+    return pos & (~(c->B - 1));
 }
 
 /* 
  * Free allocated memory. Feel free to modify it
  */
-void freeCache()
+void freeCache(cache_t c)
 {
-    int i;
-    for (i = 0; i < S; i++)
+    int i, j;
+    for (i = 0; i < c->S; i++)
     {
-        free(cache.sets[i].lines);
+        for (j = 0; j < c->E; j++)
+            free(c->sets[i].lines[j].data);
+        free(c->sets[i].lines);
     }
-    free(cache.sets);
+    free(c->sets);
+    free(c);
 }
 
-unsigned long long get_set(word_t addr)
+unsigned long long get_set(cache_t c, word_t addr)
 {
     unsigned long long address = (unsigned long long)addr;
-    return (address >> b) << (64 - s) >> (64 - s);
+    return (address >> c->b) & (c->S - 1);
 }
 
-unsigned long long get_tag(word_t addr)
+unsigned long long get_tag(cache_t c, word_t addr)
 {
     unsigned long long address = (unsigned long long)addr;
-    return (address >> b) >> s;
+    return (address >> c->b) >> c->s;
 }
 
 /* TODO: attempts to retrieve a line of data stored in your cache
@@ -154,15 +157,15 @@ unsigned long long get_tag(word_t addr)
  * On hit, return the cache line holding the address
  * On miss, returns NULL
  */
-cache_line_t *get_line(word_t addr)
+cache_line_t *get_line(cache_t c, word_t addr)
 {
-    unsigned long long set = get_set(addr); //get set bits
-    unsigned long long tag = get_tag(addr); //get tag bits
-    for (int i = 0; i < E; i++)
+    unsigned long long set = get_set(c, addr); //get set bits
+    unsigned long long tag = get_tag(c, addr); //get tag bits
+    for (int i = 0; i < c->E; i++)
     {
-        if (cache.sets[set].lines[i].valid == 1 && cache.sets[set].lines[i].tag == tag)
+        if (c->sets[set].lines[i].valid == 1 && c->sets[set].lines[i].tag == tag)
         {
-            return &cache.sets[set].lines[i];
+            return &c->sets[set].lines[i];
         }
     }
     return NULL;
@@ -172,22 +175,22 @@ cache_line_t *get_line(word_t addr)
  * Select the line to fill with the new cache line
  * Return the cache line selected to filled in by addr
  */
-cache_line_t *select_line(word_t addr) //write?
+cache_line_t *select_line(cache_t c, word_t addr) //write?
 {
-    unsigned long long set = get_set(addr);
-    for (int j = 0; j < E; j++) //find empty line
+    unsigned long long set = get_set(c, addr);
+    for (int j = 0; j < c->E; j++) //find empty line
     {
-        if (cache.sets[set].lines[j].valid == 0)
+        if (c->sets[set].lines[j].valid == 0)
         {
-            return &cache.sets[set].lines[j];
+            return &c->sets[set].lines[j];
         }
     }
-    cache_line_t *min = &cache.sets[set].lines[0];
-    for (int i = 0; i < E; i++) //cant find empty space, get LRU
+    cache_line_t *min = &c->sets[set].lines[0];
+    for (int i = 0; i < c->E; i++) //cant find empty space, get LRU
     {
-        if (cache.sets[set].lines[i].lru < min->lru)
+        if (c->sets[set].lines[i].lru < min->lru)
         {
-            min = &cache.sets[set].lines[i];
+            min = &c->sets[set].lines[i];
         }
     }
     return min;
@@ -197,18 +200,18 @@ cache_line_t *select_line(word_t addr) //write?
  * Check if the address is hit in the cache, updating hit and miss data. 
  * Return True if pos hits in the cache.
  */
-bool check_hit(word_t pos)
+bool check_hit(cache_t c, word_t pos)
 {
-    if (get_line(pos) != NULL) //hit valid=1 && tag=tag
+    if (get_line(c, pos) != NULL) //hit valid=1 && tag=tag
     {
-        hit_count++;
-        counter++;
-        get_line(pos)->lru = counter;
+        c->hit_count++;
+        c->counter++;
+        get_line(c, pos)->lru = c->counter;
         return true;
     }
     else //valid = 0
     {
-        miss_count++;
+        c->miss_count++;
         return false;
     }
 }
@@ -219,112 +222,83 @@ bool check_hit(word_t pos)
  * If block is not NULL, copy the data from block into the cache line. 
  * Return True if a line was evicted.
  */
-bool handle_miss(word_t pos, void *block, word_t *evicted_pos, void *evicted_block)
+bool handle_miss(cache_t c, word_t pos, void *block, word_t *evicted_pos, void *evicted_block)
 {
-    cache_line_t *targetline = select_line(pos);
-    counter++;
-    targetline->lru = counter;
-    if (targetline->valid == 1 && (((targetline->tag = get_tag(pos) && targetline->tag != 0)) || targetline->tag == 0))
+    cache_line_t *targetline = select_line(c, pos);
+    unsigned long long set = get_set(c, pos);
+    bool evicted = false;
+    if (targetline->valid == 1)
     {
-        eviction_count++;
+        c->eviction_count++;
+        evicted = true;
+        if (evicted_pos != NULL)
+            *evicted_pos = (word_t)(((targetline->tag << c->s) | set) << c->b);
+        if (evicted_block != NULL)
+            memcpy(evicted_block, targetline->data, c->B);
     }
-    targetline->tag = get_tag(pos);
+    c->counter++;
+    targetline->lru = c->counter;
+    targetline->tag = get_tag(c, pos);
     targetline->valid = 1;
     if (block != NULL)
     {
-        memcpy(targetline->data, block, sizeof(byte_t));
+        memcpy(targetline->data, block, c->B);
     }
-    return false;
-    // if (evicted_block != NULL && evicted_pos != NULL)
-    // {
-    //     memcpy(evicted_block, targetline->data, B);
-    //     memcpy(evicted_pos, (word_t *)((tag << (s + b)) + (s << b)), B);
-    // targetline->valid = 1;
-    // targetline->tag = get_tag(pos);
-    // targetline->lru = hit_count;
-    // memcpy(targetline->data, block, sizeof(byte_t));
-    //}
+    return evicted;
 }
 
-/* TODO:
+/*
  * Get a byte from the cache and write it to dest.
  * Preconditon: pos is contained within the cache.
  */
-void get_byte_cache(word_t pos, byte_t *dest)
+void get_byte_cache(cache_t c, word_t pos, byte_t *dest)
 {
-    unsigned long long tag = get_tag(pos);
-    unsigned long long set = get_set(pos);
-    for (int i = 0; i < E; i++)
-    {
-        if (cache.sets[set].lines[i].valid == 1 && cache.sets[set].lines[i].tag == tag)
-        {
-            *dest = cache.sets[set].lines[i].data + b;
-        }
-    }
+    cache_line_t *line = get_line(c, pos);
+    if (line != NULL)
+        *dest = line->data[pos & (c->B - 1)];
 }
 
-/* TODO:
+/*
  * Get 8 bytes from the cache and write it to dest.
  * Preconditon: pos is contained within the cache.
  */
-void get_word_cache(word_t pos, word_t *dest)
+void get_word_cache(cache_t c, word_t pos, word_t *dest)
 {
-    unsigned long long tag = get_tag(pos);
-    unsigned long long set = get_set(pos);
-    word_t val;
-    for (int i = 0; i < E; i++)
-    {
-        if (cache.sets[set].lines[i].valid == 1 && cache.sets[set].lines[i].tag == tag)
-        {
-            word_t *word = cache.sets[set].lines[i].data + b;
-            for (int j = 0; j < 8; j++)
-            {
-                word_t b = word + i;
-                val = val | (b << (8 * i));
-            }
-            *dest = val;
-        }
-    }
+    cache_line_t *line = get_line(c, pos);
+    word_t val = 0;
+    int i;
+    if (line == NULL)
+        return;
+    for (i = 7; i >= 0; i--)
+        val = (val << 8) | line->data[(pos + i) & (c->B - 1)];
+    *dest = val;
 }
 
-/* TODO:
+/*
  * Set 1 byte in the cache to val at pos.
  * Preconditon: pos is contained within the cache.
  */
-void set_byte_cache(word_t pos, byte_t val)
+void set_byte_cache(cache_t c, word_t pos, byte_t val)
 {
-    unsigned long long tag = get_tag(pos);
-    unsigned long long set = get_set(pos);
-    for (int i = 0; i < E; i++)
-    {
-        if (cache.sets[set].lines[i].valid == 1 && cache.sets[set].lines[i].tag == tag)
-        {
-            byte_t *word = cache.sets[set].lines[i].data + b;
-            word = val;
-        }
-    }
+    cache_line_t *line = get_line(c, pos);
+    if (line != NULL)
+        line->data[pos & (c->B - 1)] = val;
 }
 
-/* TODO:
+/*
  * Set 8 bytes in the cache to val at pos.
  * Preconditon: pos is contained within the cache.
  */
-void set_word_cache(word_t pos, word_t val)
+void set_word_cache(cache_t c, word_t pos, word_t val)
 {
-    unsigned long long tag = get_tag(pos);
-    unsigned long long set = get_set(pos);
-    for (int i = 0; i < E; i++)
+    cache_line_t *line = get_line(c, pos);
+    int i;
+    if (line == NULL)
+        return;
+    for (i = 0; i < 8; i++)
     {
-        if (cache.sets[set].lines[i].valid == 1 && cache.sets[set].lines[i].tag == tag)
-        {
-            byte_t *word = cache.sets[set].lines[i].data + b;
-            for (int j = 0; j < 8; j++)
-            {
-                word = val;
-                word = << 8;
-                val >>= 8;
-            }
-        }
+        line->data[(pos + i) & (c->B - 1)] = (byte_t)val;
+        val >>= 8;
     }
 }
 
@@ -337,8 +311,8 @@ void set_word_cache(word_t pos, word_t val)
  * Called by csim; no need to modify it if you implement
  * check_hit() and handle_miss()
  */
-void accessData(mem_addr_t addr)
+void accessData(cache_t c, mem_addr_t addr)
 {
-    if (!check_hit(addr))
-        handle_miss(addr, NULL, NULL, NULL);
+    if (!check_hit(c, addr))
+        handle_miss(c, addr, NULL, NULL, NULL);
 }
\ No newline at end of file
@@ -129,90 +129,274 @@ instr_ptr bad_instr()
 }
 
 
-mem_t init_mem(int len)
+/* Unaligned little-endian word access */
+static word_t load_word(byte_t *p)
+{
+    word_t val;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    int i;
+    val = 0;
+    for (i = 7; i >= 0; i--)
+	val = (val << 8) | p[i];
+#else
+    memcpy(&val, p, 8);
+#endif
+    return val;
+}
+
+static void store_word(byte_t *p, word_t val)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    int i;
+    for (i = 0; i < 8; i++) {
+	p[i] = (byte_t) val & 0xFF;
+	val >>= 8;
+    }
+#else
+    memcpy(p, &val, 8);
+#endif
+}
+
+/* Can word at pos be accessed?  Negative addresses compare as huge */
+#define WORD_OK(m, pos) ((unsigned long long) (pos) < (unsigned long long) (m)->wend)
+/* Is byte at pos in range? */
+#define BYTE_OK(m, pos) ((unsigned long long) (pos) < (unsigned long long) (m)->len)
+
+/* Find page, checking TLB first */
+#define GET_PAGE(m, vpn, alloc) \
+    ((m)->tlb_vpn == (vpn) ? (m)->tlb_page : find_page((m), (vpn), (alloc)))
+
+/* Initial number of buckets in page table.  Must be power of 2 */
+#define PAGE_HASH 64
+
+mem_t init_mem(word_t len)
 {
 
     mem_t result = (mem_t) malloc(sizeof(mem_rec));
     len = ((len+BPL-1)/BPL)*BPL;
     result->len = len;
-    result->contents = (byte_t *) calloc(len, 1);
+    result->wend = len >= 8 ? len - 7 : 0;
+    result->nbuckets = PAGE_HASH;
+    result->table = (page_t *) calloc(PAGE_HASH, sizeof(page_t));
+    result->npages = 0;
+    result->tlb_vpn = -1;
+    result->tlb_page = NULL;
+    result->cache = NULL;
+    result->inflight = FALSE;
+    result->inflight_cycles = 0;
+    result->inflight_pos = 0;
     return result;
 }
 
+/* Double number of buckets in page table */
+static void grow_table(mem_t m)
+{
+    int nb = 2 * m->nbuckets;
+    page_t *table = (page_t *) calloc(nb, sizeof(page_t));
+    int i;
+    for (i = 0; i < m->nbuckets; i++) {
+	page_t p = m->table[i];
+	while (p) {
+	    page_t next = p->next;
+	    p->next = table[p->vpn & (nb-1)];
+	    table[p->vpn & (nb-1)] = p;
+	    p = next;
+	}
+    }
+    free((void *) m->table);
+    m->table = table;
+    m->nbuckets = nb;
+}
+
+page_t find_page(mem_t m, word_t vpn, bool_t alloc)
+{
+    page_t p;
+    for (p = m->table[vpn & (m->nbuckets-1)]; p; p = p->next)
+	if (p->vpn == vpn)
+	    break;
+    if (!p) {
+	if (!alloc)
+	    return NULL;
+	if (m->npages >= 2 * m->nbuckets)
+	    grow_table(m);
+	p = (page_t) malloc(sizeof(page_rec));
+	p->vpn = vpn;
+	p->data = (byte_t *) calloc(MEM_PAGE_SIZE, 1);
+	p->next = m->table[vpn & (m->nbuckets-1)];
+	m->table[vpn & (m->nbuckets-1)] = p;
+	m->npages++;
+    }
+    m->tlb_vpn = vpn;
+    m->tlb_page = p;
+    return p;
+}
+
+/* Free all pages */
+static void free_pages(mem_t m)
+{
+    int i;
+    for (i = 0; i < m->nbuckets; i++) {
+	page_t p = m->table[i];
+	while (p) {
+	    page_t next = p->next;
+	    free((void *) p->data);
+	    free((void *) p);
+	    p = next;
+	}
+	m->table[i] = NULL;
+    }
+    m->npages = 0;
+    m->tlb_vpn = -1;
+    m->tlb_page = NULL;
+}
+
 void clear_mem(mem_t m)
 {
-    memset(m->contents, 0, m->len);
+    free_pages(m);
 }
 
 void free_mem(mem_t m)
 {
-    free((void *) m->contents);
+    free_pages(m);
+    free((void *) m->table);
     free((void *) m);
 }
 
 mem_t copy_mem(mem_t oldm)
 {
     mem_t newm = init_mem(oldm->len);
-    memcpy(newm->contents, oldm->contents, oldm->len);
+    int i;
+    for (i = 0; i < oldm->nbuckets; i++) {
+	page_t p;
+	for (p = oldm->table[i]; p; p = p->next)
+	    memcpy(find_page(newm, p->vpn, TRUE)->data, p->data,
+		   MEM_PAGE_SIZE);
+    }
     return newm;
 }
 
 static bool_t get_byte_val(mem_t m, word_t pos, byte_t *dest)
 {
-    if (pos < 0 || pos >= m->len)
+    page_t p;
+    if (!BYTE_OK(m, pos))
+	return FALSE;
+    p = GET_PAGE(m, pos >> MEM_PAGE_BITS, FALSE);
+    *dest = p ? p->data[pos & MEM_PAGE_MASK] : 0;
+    return TRUE;
+}
+
+static bool_t set_byte_val(mem_t m, word_t pos, byte_t val)
+{
+    if (!BYTE_OK(m, pos))
 	return FALSE;
-    *dest = m->contents[pos];
+    GET_PAGE(m, pos >> MEM_PAGE_BITS, TRUE)->data[pos & MEM_PAGE_MASK] = val;
     return TRUE;
 }
 
 static bool_t get_word_val(mem_t m, word_t pos, word_t *dest)
 {
-    int i;
-    word_t val;
-    if (pos < 0 || pos + 8 > m->len)
+    word_t off = pos & MEM_PAGE_MASK;
+    page_t p;
+    if (!WORD_OK(m, pos))
 	return FALSE;
-    val = 0;
-    for (i = 0; i < 8; i++) {
-	word_t b =  m->contents[pos+i] & 0xFF;
-	val = val | (b <<(8*i));
+    if (off > MEM_PAGE_SIZE - 8) {
+	/* Word spans two pages */
+	int i;
+	word_t val = 0;
+	for (i = 7; i >= 0; i--) {
+	    byte_t b = 0;
+	    get_byte_val(m, pos+i, &b);
+	    val = (val << 8) | b;
+	}
+	*dest = val;
+	return TRUE;
     }
-    *dest = val;
+    p = GET_PAGE(m, pos >> MEM_PAGE_BITS, FALSE);
+    *dest = p ? load_word(p->data + off) : 0;
     return TRUE;
 }
 
 static bool_t set_word_val(mem_t m, word_t pos, word_t val)
 {
-    int i;
-    if (pos < 0 || pos + 8 > m->len)
+    word_t off = pos & MEM_PAGE_MASK;
+    if (!WORD_OK(m, pos))
 	return FALSE;
-    for (i = 0; i < 8; i++) {
-	m->contents[pos+i] = (byte_t) val & 0xFF;
-	val >>= 8;
+    if (off > MEM_PAGE_SIZE - 8) {
+	/* Word spans two pages */
+	int i;
+	for (i = 0; i < 8; i++) {
+	    set_byte_val(m, pos+i, (byte_t) val & 0xFF);
+	    val >>= 8;
+	}
+	return TRUE;
     }
+    store_word(GET_PAGE(m, pos >> MEM_PAGE_BITS, TRUE)->data + off, val);
     return TRUE;
 }
 
+static int vpn_compare(const void *a, const void *b)
+{
+    word_t va = *(const word_t *) a;
+    word_t vb = *(const word_t *) b;
+    return va < vb ? -1 : va > vb;
+}
+
+/* Get sorted list of pages allocated in either memory.
+   Set *np to number of pages.  Caller must free list */
+static word_t *union_pages(mem_t oldm, mem_t newm, int *np)
+{
+    word_t *vpns = (word_t *) malloc((oldm->npages + newm->npages + 1)
+				     * sizeof(word_t));
+    int n = 0;
+    int i, j;
+    for (i = 0; i < oldm->nbuckets; i++) {
+	page_t p;
+	for (p = oldm->table[i]; p; p = p->next)
+	    vpns[n++] = p->vpn;
+    }
+    for (i = 0; i < newm->nbuckets; i++) {
+	page_t p;
+	for (p = newm->table[i]; p; p = p->next)
+	    vpns[n++] = p->vpn;
+    }
+    qsort(vpns, n, sizeof(word_t), vpn_compare);
+    /* Remove duplicates */
+    for (i = 0, j = 0; i < n; i++)
+	if (j == 0 || vpns[j-1] != vpns[i])
+	    vpns[j++] = vpns[i];
+    *np = j;
+    return vpns;
+}
+
 bool_t diff_mem(mem_t oldm, mem_t newm, FILE *outfile)
 {
     word_t pos;
-    int len = oldm->len;
+    word_t len = oldm->len;
     bool_t diff = FALSE;
+    word_t *vpns;
+    int n, i;
     if (newm->len < len)
 	len = newm->len;
-    for (pos = 0; (!diff || outfile) && pos < len; pos += 8) {
-        word_t ov = 0;  word_t nv = 0;
-		if(check_hit(pos)) {
-			get_word_cache(pos, &nv);
-		} else {
-			get_word_val(newm, pos, &nv);
-		}
-	get_word_val(oldm, pos, &ov);
-	if (nv != ov) {
-	    diff = TRUE;
-	    if (outfile)
-		fprintf(outfile, "0x%.4llx:\t0x%.16llx\t0x%.16llx\n", pos, ov, nv);
+    /* Only allocated pages can differ.  Every cached block has a page */
+    vpns = union_pages(oldm, newm, &n);
+    for (i = 0; (!diff || outfile) && i < n; i++) {
+	page_t op = find_page(oldm, vpns[i], FALSE);
+	page_t np = find_page(newm, vpns[i], FALSE);
+	word_t base = vpns[i] << MEM_PAGE_BITS;
+	for (pos = base; (!diff || outfile) &&
+		 pos < base + MEM_PAGE_SIZE && pos < len; pos += 8) {
+	    word_t ov = op ? load_word(op->data + (pos - base)) : 0;
+	    word_t nv = np ? load_word(np->data + (pos - base)) : 0;
+	    if (newm->cache && check_hit(newm->cache, pos))
+		get_word_cache(newm->cache, pos, &nv);
+	    if (nv != ov) {
+		diff = TRUE;
+		if (outfile)
+		    fprintf(outfile, "0x%.4llx:\t0x%.16llx\t0x%.16llx\n", pos, ov, nv);
+	    }
 	}
     }
+    free((void *) vpns);
     return diff;
 }
 
@@ -274,7 +458,7 @@ int load_mem(mem_t m, FILE *infile, int report_error)
 	while (isxdigit((int)(ch=buf[cpos++])) && 
 	       isxdigit((int)(cl=buf[cpos++]))) {
 	    byte_t byte = 0;
-	    if (bytepos >= m->len) {
+	    if (!BYTE_OK(m, bytepos)) {
 		if (report_error) {
 		    fprintf(stderr,
 			    "Error reading file. Invalid address. 0x%llx\n",
@@ -284,7 +468,9 @@ int load_mem(mem_t m, FILE *infile, int report_error)
 		return 0;
 	    }
 	    byte = hex2dig(ch)*16+hex2dig(cl);
-	    m->contents[bytepos++] = byte;
+	    GET_PAGE(m, bytepos >> MEM_PAGE_BITS, TRUE)->
+		data[bytepos & MEM_PAGE_MASK] = byte;
+	    bytepos++;
 	    byte_cnt++;
 	}
     }
@@ -296,75 +482,60 @@ int load_mem(mem_t m, FILE *infile, int report_error)
 
 bool_t get_byte_val_I(mem_t m, word_t pos, byte_t *dest)
 {
-    if (pos < 0 || pos >= m->len)
-	return FALSE;
-    *dest = m->contents[pos];
-    return TRUE;
+    return get_byte_val(m, pos, dest);
 }
 
 bool_t get_word_val_I(mem_t m, word_t pos, word_t *dest)
 {
-    int i;
-    word_t val;
-    if (pos < 0 || pos + 8 > m->len)
-	return FALSE;
-    val = 0;
-    for (i = 0; i < 8; i++) {
-	word_t b =  m->contents[pos+i] & 0xFF;
-	val = val | (b <<(8*i));
-    }
-    *dest = val;
-    return TRUE;
+    return get_word_val(m, pos, dest);
 }
 
 // Read and Write Cache blocks to memory.
 
 static void write_block(mem_t m, word_t pos, void *block) {
 	char *block_c = (char*) block;
-	for(int i = 0; i < get_block_size(); i++) {
-		m->contents[pos + i] = block_c[i];
+	for(int i = 0; i < get_block_size(m->cache); i++) {
+		set_byte_val(m, pos + i, block_c[i]);
 	}
 }
 
 static void read_block(mem_t m, word_t pos, void *block) {
 	char *block_c = (char*) block;
-	for(int i = 0; i < get_block_size(); i++) {
-		block_c[i] = m->contents[pos + i];
+	/* Allocate page, so that diff_mem sees all cached blocks */
+	find_page(m, pos >> MEM_PAGE_BITS, TRUE);
+	for(int i = 0; i < get_block_size(m->cache); i++) {
+		get_byte_val(m, pos + i, (byte_t *) &block_c[i]);
 	}
 }
 
-bool_t inflight = FALSE;
-size_t inflight_cycles = 0;
-word_t inflight_pos = 0;
-
 // Accesses Memory. Memory has a five cycle delay unless a cache hit occurs.
 
 static mem_status_t access_memory(mem_t m, word_t pos) {
 	
-	word_t block_address = get_block_address(pos); 
-	if(check_hit(block_address)) {
+	word_t block_address = get_block_address(m->cache, pos); 
+	if(check_hit(m->cache, block_address)) {
 		return READY;
 	}
 
-	if(inflight_pos != block_address || !inflight) {
-		inflight_pos = block_address;
-		inflight_cycles = 5;
-		inflight = TRUE;
+	if(m->inflight_pos != block_address || !m->inflight) {
+		m->inflight_pos = block_address;
+		m->inflight_cycles = 5;
+		m->inflight = TRUE;
 	}
 
-	inflight_cycles--;
-	if(inflight_cycles > 0) {
+	m->inflight_cycles--;
+	if(m->inflight_cycles > 0) {
 		return IN_FLIGHT;
 	}
 
-	inflight = FALSE;
+	m->inflight = FALSE;
 
-	void *block = calloc(get_block_size(), 1);
-	void *evicted_block = calloc(get_block_size(), 1);
+	void *block = calloc(get_block_size(m->cache), 1);
+	void *evicted_block = calloc(get_block_size(m->cache), 1);
 	read_block(m, block_address, block);
 
 	word_t evicted_pos = 0;
-	bool_t evicted = handle_miss(block_address, block, &evicted_pos, evicted_block);
+	bool_t evicted = handle_miss(m->cache, block_address, block, &evicted_pos, evicted_block);
 
 	if (evicted) {
 		write_block(m, evicted_pos, evicted_block);
@@ -380,74 +551,52 @@ static mem_status_t access_memory(mem_t m, word_t pos) {
 
 mem_status_t get_word_val_D(mem_t m, word_t pos, word_t *dest)
 {
-	if (pos < 0 || pos + 8 > m->len)
+	if (!WORD_OK(m, pos))
 		return ERROR;
 
     mem_status_t status = access_memory(m, pos);
 	if(status == READY) {
-		get_word_cache(pos, dest);
+		get_word_cache(m->cache, pos, dest);
 	}
     return status;
 }
 
 mem_status_t set_byte_val_D(mem_t m, word_t pos, byte_t val)
 {
-    if (pos < 0 || pos >= m->len)
+    if (!BYTE_OK(m, pos))
 		return ERROR;
 
     mem_status_t status = access_memory(m, pos);
 	if(status == READY) {
-		set_byte_cache(pos, val);
+		set_byte_cache(m->cache, pos, val);
 	}
 	return status;
 }
 
 mem_status_t set_word_val_D(mem_t m, word_t pos, word_t val)
 {
-    if (pos < 0 || pos + 8 > m->len)
+    if (!WORD_OK(m, pos))
 		return ERROR;
 
 	mem_status_t status = access_memory(m, pos);
 	if(status == READY) {
-		set_word_cache(pos, val);
+		set_word_cache(m->cache, pos, val);
 	}
 	return status;
 }
 
 mem_status_t get_byte_val_D(mem_t m, word_t pos, byte_t *dest)
 {
-    if (pos < 0 || pos >= m->len)
+    if (!BYTE_OK(m, pos))
 		return ERROR;
 
 	mem_status_t status = access_memory(m, pos);
 	if(status == READY) {
-		get_byte_cache(pos, dest);
+		get_byte_cache(m->cache, pos, dest);
 	}
 	return status;
 }
 
-bool_t diff_reg(mem_t oldr, mem_t newr, FILE *outfile)
-{
-    word_t pos;
-    int len = oldr->len;
-    bool_t diff = FALSE;
-    if (newr->len < len)
-	len = newr->len;
-    for (pos = 0; (!diff || outfile) && pos < len; pos += 8) {
-        word_t ov = 0;
-        word_t nv = 0;
-	get_word_val(oldr, pos, &ov);
-	get_word_val(newr, pos, &nv);
-	if (nv != ov) {
-	    diff = TRUE;
-	    if (outfile)
-		fprintf(outfile, "%s:\t0x%.16llx\t0x%.16llx\n",
-			reg_table[pos/8].name, ov, nv);
-	}
-    }
-    return diff;
-}
-
 void dump_memory(FILE *outfile, mem_t m, word_t pos, int len)
 {
     int i, j;
@@ -471,47 +620,66 @@ void dump_memory(FILE *outfile, mem_t m, word_t pos, int len)
     }
 }
 
-mem_t init_reg()
+regfile_t init_reg()
+{
+    return (regfile_t) calloc(1, sizeof(regfile_rec));
+}
+
+void free_reg(regfile_t r)
+{
+    free((void *) r);
+}
+
+void clear_reg(regfile_t r)
 {
-    return init_mem(128);
+    memset(r->regs, 0, sizeof(r->regs));
 }
 
-void free_reg(mem_t r)
+regfile_t copy_reg(regfile_t oldr)
 {
-    free_mem(r);
+    regfile_t newr = init_reg();
+    memcpy(newr->regs, oldr->regs, sizeof(oldr->regs));
+    return newr;
 }
 
-mem_t copy_reg(mem_t oldr)
+bool_t diff_reg(regfile_t oldr, regfile_t newr, FILE *outfile)
 {
-    return copy_mem(oldr);
+    reg_id_t id;
+    bool_t diff = FALSE;
+    for (id = 0; (!diff || outfile) && id < REG_NONE; id++) {
+        word_t ov = oldr->regs[id];
+        word_t nv = newr->regs[id];
+	if (nv != ov) {
+	    diff = TRUE;
+	    if (outfile)
+		fprintf(outfile, "%s:\t0x%.16llx\t0x%.16llx\n",
+			reg_table[id].name, ov, nv);
+	}
+    }
+    return diff;
 }
 
-word_t get_reg_val(mem_t r, reg_id_t id)
+word_t get_reg_val(regfile_t r, reg_id_t id)
 {
-    word_t val = 0;
     if (id >= REG_NONE)
 	return 0;
-    get_word_val(r,id*8, &val);
-    return val;
+    return r->regs[id];
 }
 
-void set_reg_val(mem_t r, reg_id_t id, word_t val)
+void set_reg_val(regfile_t r, reg_id_t id, word_t val)
 {
-    if (id < REG_NONE) {
-		set_word_val(r,id*8,val);
-    }
+    if (id < REG_NONE)
+	r->regs[id] = val;
 }
      
-void dump_reg(FILE *outfile, mem_t r) {
+void dump_reg(FILE *outfile, regfile_t r) {
     reg_id_t id;
     for (id = 0; reg_valid(id); id++) {
 	fprintf(outfile, "   %s  ", reg_table[id].name);
     }
     fprintf(outfile, "\n");
     for (id = 0; reg_valid(id); id++) {
-	word_t val = 0;
-	get_word_val(r, id*8, &val);
-	fprintf(outfile, " %llx", val);
+	fprintf(outfile, " %llx", r->regs[id]);
     }
     fprintf(outfile, "\n");
 }
@@ -616,7 +784,7 @@ char *stat_name(stat_t e)
 
 /**************** Implementation of ISA model ************************/
 
-state_ptr new_state(int memlen)
+state_ptr new_state(word_t memlen)
 {
     state_ptr result = (state_ptr) malloc(sizeof(state_rec));
     result->pc = 0;
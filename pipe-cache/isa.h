@@ -95,17 +95,45 @@ typedef unsigned char byte_t;
 typedef long long int word_t;
 typedef long long unsigned uword_t;
 
-/* Represent a memory as an array of bytes */
+/* Memory is stored as pages that are allocated when first written */
+#define MEM_PAGE_BITS 12
+#define MEM_PAGE_SIZE (1<<MEM_PAGE_BITS)
+#define MEM_PAGE_MASK (MEM_PAGE_SIZE-1)
+
+typedef struct page_rec {
+  word_t vpn;               /* Page number: address >> MEM_PAGE_BITS */
+  struct page_rec *next;    /* Next page in hash bucket */
+  byte_t *data;             /* MEM_PAGE_SIZE bytes */
+} page_rec, *page_t;
+
+/* Represent a memory as a sparse set of pages.  Bytes in pages that
+   have not been allocated read as 0 */
 typedef struct {
-  int len;
+  word_t len;        /* Addresses 0 .. len-1 are valid */
   word_t maxaddr;
-  byte_t *contents;
+  word_t wend;       /* Words can be accessed at addresses below wend */
+  page_t *table;     /* Hash table of allocated pages, indexed by vpn */
+  int nbuckets;      /* Size of table.  Power of 2 */
+  int npages;        /* Number of allocated pages */
+  /* Single-entry TLB: most recently used page */
+  word_t tlb_vpn;
+  page_t tlb_page;
+  /* Data cache in front of memory, or NULL */
+  struct cache_rec *cache;
+  /* Block being fetched from memory after a cache miss */
+  bool_t inflight;
+  size_t inflight_cycles;
+  word_t inflight_pos;
 } mem_rec, *mem_t;
 
 /* Create a memory with len bytes */
-mem_t init_mem(int len);
+mem_t init_mem(word_t len);
 void free_mem(mem_t m);
 
+/* Find page number vpn.  If it has not been allocated, allocate it
+   when alloc is set and otherwise return NULL */
+page_t find_page(mem_t m, word_t vpn, bool_t alloc);
+
 /* Set contents of memory to 0 */
 void clear_mem(mem_t m);
 
@@ -115,7 +143,10 @@ mem_t copy_mem(mem_t oldm);
 bool_t diff_mem(mem_t oldm, mem_t newm, FILE *outfile);
 
 /* How big should the memory be? */
-#ifdef BIG_MEM
+#if defined(FULL_MEM)
+/* All nonnegative addresses */
+#define MEM_SIZE 0x7fffffffffffffe0LL
+#elif defined(BIG_MEM)
 #define MEM_SIZE (1<<16)
 #else
 #define MEM_SIZE (1<<13)
@@ -151,18 +182,25 @@ void dump_memory(FILE *outfile, mem_t m, word_t pos, int cnt);
 
 /********** Implementation of Register File *************/
 
-mem_t init_reg();
-void free_reg();
+/* Register file, indexed by register ID.  regs[REG_NONE] always holds 0 */
+typedef struct {
+  word_t regs[REG_NONE+1];
+} regfile_rec, *regfile_t;
+
+regfile_t init_reg();
+void free_reg(regfile_t r);
+/* Set all registers to 0 */
+void clear_reg(regfile_t r);
 
 /* Make a copy of a register file */
-mem_t copy_reg(mem_t oldr);
+regfile_t copy_reg(regfile_t oldr);
 /* Print the differences between two register files */
-bool_t diff_reg(mem_t oldr, mem_t newr, FILE *outfile);
+bool_t diff_reg(regfile_t oldr, regfile_t newr, FILE *outfile);
 
 
-word_t get_reg_val(mem_t r, reg_id_t id);
-void set_reg_val(mem_t r, reg_id_t id, word_t val);
-void dump_reg(FILE *outfile, mem_t r);
+word_t get_reg_val(regfile_t r, reg_id_t id);
+void set_reg_val(regfile_t r, reg_id_t id, word_t val);
+void dump_reg(FILE *outfile, regfile_t r);
 
 
 
@@ -199,12 +237,12 @@ char *stat_name(stat_t e);
 
 typedef struct {
   word_t pc;
-  mem_t r;
+  regfile_t r;
   mem_t m;
   cc_t cc;
 } state_rec, *state_ptr;
 
-state_ptr new_state(int memlen);
+state_ptr new_state(word_t memlen);
 void free_state(state_ptr s);
 
 state_ptr copy_state(state_ptr s);
@@ -38,8 +38,7 @@ FILE *object_file;          /* Input file handle */
 bool_t verbosity = 2;       /* Verbosity level [TTY only] (-v) */
 word_t instr_limit = 10000; /* Instruction limit [TTY only] (-l) */
 bool_t do_check = FALSE;    /* Test with ISA simulator? [TTY only] (-t) */
-
-extern int verbosity_cache;
+bool_t do_cpi_stack = FALSE; /* Report cycles lost by cause? [TTY only] (-C) */
 
 /************* 
  * End Globals 
@@ -49,9 +48,9 @@ extern int verbosity_cache;
  * Begin function prototypes 
  ***************************/
 
-word_t sim_run_pipe(word_t max_instr, word_t max_cycle, byte_t *statusp, cc_t *ccp);
+word_t sim_run_pipe(sim_t sim, word_t max_instr, word_t max_cycle, byte_t *statusp, cc_t *ccp);
 static void usage(char *name); /* Print helpful usage message */
-static void run_tty_sim();     /* Run simulator in TTY mode */
+static void run_tty_sim(int s, int b, int E); /* Run simulator in TTY mode */
 
 /*************************
  * End function prototypes
@@ -79,7 +78,7 @@ int sim_main(int argc, char **argv)
     int b = -1;
 
     /* Parse the command line arguments */
-    while ((c = getopt(argc, argv, "htl:v:")) != -1)
+    while ((c = getopt(argc, argv, "htCl:v:s:b:E:")) != -1)
     {
         switch (c)
         {
@@ -100,6 +99,18 @@ int sim_main(int argc, char **argv)
         case 't':
             do_check = TRUE;
             break;
+        case 'C':
+            do_cpi_stack = TRUE;
+            break;
+        case 's':
+            s = atoi(optarg);
+            break;
+        case 'b':
+            b = atoi(optarg);
+            break;
+        case 'E':
+            E = atoi(optarg);
+            break;
         default:
             printf("Invalid option '%c'\n", c);
             usage(argv[0]);
@@ -136,9 +147,14 @@ int sim_main(int argc, char **argv)
         fprintf(stderr, "Missing flags for InitCache\n");
         exit(1);
     }
+    /* A block must hold at least one word */
+    if (s < 0 || E < 1 || b < 3)
+    {
+        fprintf(stderr, "Invalid cache parameters s=%d, E=%d, b=%d\n", s, E, b);
+        exit(1);
+    }
 
-    initCache(s, b, E);
-    run_tty_sim();
+    run_tty_sim(s, b, E);
 
     exit(0);
 }
@@ -148,14 +164,16 @@ int main(int argc, char *argv[]) { return sim_main(argc, argv); }
 /* 
  * run_tty_sim - Run the simulator in TTY mode
  */
-static void run_tty_sim()
+static void run_tty_sim(int s, int b, int E)
 {
     word_t icount = 0;
     byte_t run_status = STAT_AOK;
     cc_t result_cc = 0;
     word_t byte_cnt = 0;
-    mem_t mem0, reg0;
+    mem_t mem0;
+    regfile_t reg0;
     state_ptr isa_state = NULL;
+    sim_t sim;
 
     /* In TTY mode, the default object file comes from stdin */
     if (!object_file)
@@ -163,18 +181,18 @@ static void run_tty_sim()
         object_file = stdin;
     }
 
+    sim = sim_init(s, b, E);
     if (verbosity >= 2)
-        sim_set_dumpfile(stdout);
-    sim_init();
-
-    if (verbosity >= 2)
-        verbosity_cache = 1;
+    {
+        sim_set_dumpfile(sim, stdout);
+        setCacheVerbosity(sim->mem->cache, 1);
+    }
 
     /* Emit simulator name */
     if (verbosity >= 2)
         printf("%s\n", simname);
 
-    byte_cnt = load_mem(mem, object_file, 1);
+    byte_cnt = load_mem(sim->mem, object_file, 1);
     if (byte_cnt == 0)
     {
         fprintf(stderr, "No lines of code found\n");
@@ -188,27 +206,27 @@ static void run_tty_sim()
     if (do_check)
     {
         isa_state = new_state(0);
-        free_mem(isa_state->r);
+        free_reg(isa_state->r);
         free_mem(isa_state->m);
-        isa_state->m = copy_mem(mem);
-        isa_state->r = copy_mem(reg);
-        isa_state->cc = cc;
+        isa_state->m = copy_mem(sim->mem);
+        isa_state->r = copy_reg(sim->reg);
+        isa_state->cc = sim->cc;
     }
 
-    mem0 = copy_mem(mem);
-    reg0 = copy_mem(reg);
+    mem0 = copy_mem(sim->mem);
+    reg0 = copy_reg(sim->reg);
 
-    icount = sim_run_pipe(instr_limit, 5 * instr_limit, &run_status, &result_cc);
-    verbosity_cache = 0;
+    icount = sim_run_pipe(sim, instr_limit, 5 * instr_limit, &run_status, &result_cc);
+    setCacheVerbosity(sim->mem->cache, 0);
     if (verbosity > 0)
     {
         printf("%lld instructions executed\n", icount);
         printf("Status = %s\n", stat_name(run_status));
         printf("Condition Codes: %s\n", cc_name(result_cc));
         printf("Changed Register State:\n");
-        diff_reg(reg0, reg, stdout);
+        diff_reg(reg0, sim->reg, stdout);
         printf("Changed Memory State:\n");
-        diff_mem(mem0, mem, stdout);
+        diff_mem(mem0, sim->mem, stdout);
     }
     if (do_check)
     {
@@ -220,22 +238,22 @@ static void run_tty_sim()
             e = step_state(isa_state, stdout);
         }
 
-        if (diff_reg(isa_state->r, reg, NULL))
+        if (diff_reg(isa_state->r, sim->reg, NULL))
         {
             match = FALSE;
             if (verbosity > 0)
             {
                 printf("ISA Register != Pipeline Register File\n");
-                diff_reg(isa_state->r, reg, stdout);
+                diff_reg(isa_state->r, sim->reg, stdout);
             }
         }
-        if (diff_mem(isa_state->m, mem, NULL))
+        if (diff_mem(isa_state->m, sim->mem, NULL))
         {
             match = FALSE;
             if (verbosity > 0)
             {
                 printf("ISA Memory != Pipeline Memory\n");
-                diff_mem(isa_state->m, mem, stdout);
+                diff_mem(isa_state->m, sim->mem, stdout);
             }
         }
         if (isa_state->cc != result_cc)
@@ -259,9 +277,19 @@ static void run_tty_sim()
 
     /* Emit CPI statistics */
     {
-        double cpi = instructions > 0 ? (double)cycles / instructions : 1.0;
+        double cpi = sim->instructions > 0 ? (double)sim->cycles / sim->instructions : 1.0;
         printf("CPI: %lld cycles/%lld instructions = %.2f\n",
-               cycles, instructions, cpi);
+               sim->cycles, sim->instructions, cpi);
+        if (do_cpi_stack && sim->instructions > 0)
+        {
+            static char *names[STALL_NCAUSES] = {
+                "Load/use", "Mispredict", "Return", "D-cache", "Drain"};
+            int c;
+            printf("  %-10s %.2f\n", "Base", 1.0);
+            for (c = 0; c < STALL_NCAUSES; c++)
+                printf("  %-10s %.2f  (%lld cycles)\n", names[c],
+                       (double)sim->lost[c] / sim->instructions, sim->lost[c]);
+        }
     }
 }
 
@@ -270,11 +298,15 @@ static void run_tty_sim()
  */
 static void usage(char *name)
 {
-    printf("Usage: %s [-htg] [-l m] [-v n] file.yo\n", name);
+    printf("Usage: %s [-htC] [-l m] [-v n] -s s -E E -b b file.yo\n", name);
     printf("   -h     Print this message\n");
     printf("   -l m   Set instruction limit to m [TTY mode only] (default %lld)\n", instr_limit);
     printf("   -v n   Set verbosity level to 0 <= n <= 2 [TTY mode only] (default %d)\n", verbosity);
     printf("   -t     Test result against ISA simulator [TTY mode only]\n");
+    printf("   -C     Report cycles lost to each kind of stall [TTY mode only]\n");
+    printf("   -s s   Set number of data cache set index bits (S = 2^s)\n");
+    printf("   -E E   Set data cache associativity (lines per set)\n");
+    printf("   -b b   Set number of data cache block bits (B = 2^b)\n");
     exit(0);
 }
 
@@ -283,222 +315,232 @@ static void usage(char *name)
  * You only need to modify function sim_step_pipe()
  *********************************************************/
 
-/*****************
- *  Part 2 Globals
- *****************/
-
-/* Performance monitoring */
-/* How many cycles have been simulated? */
-word_t cycles = 0;
-/* How many instructions have passed through the WB stage? */
-word_t instructions = 0;
-
-/* Has simulator gotten past initial bubbles? */
-static int starting_up = 1;
-
-/* Both instruction and data memory */
-mem_t mem;
-word_t minAddr = 0;
-word_t memCnt = 0;
-
-/* Register file */
-mem_t reg;
-/* Condition code register */
-cc_t cc;
-/* Status code */
-stat_t status;
-
-/* Pending updates to state */
-word_t cc_in = DEFAULT_CC;
-word_t wb_destE = REG_NONE;
-word_t wb_valE = 0;
-word_t wb_destM = REG_NONE;
-word_t wb_valM = 0;
-word_t mem_addr = 0;
-word_t mem_data = 0;
-bool_t mem_write = FALSE;
-
-/* EX Operand sources */
-mux_source_t amux = MUX_NONE;
-mux_source_t bmux = MUX_NONE;
-
-/* Current and next states of all pipeline registers */
-pc_ptr pc_curr;
-if_id_ptr if_id_curr;
-id_ex_ptr id_ex_curr;
-ex_mem_ptr ex_mem_curr;
-mem_wb_ptr mem_wb_curr;
-
-pc_ptr pc_next;
-if_id_ptr if_id_next;
-id_ex_ptr id_ex_next;
-ex_mem_ptr ex_mem_next;
-mem_wb_ptr mem_wb_next;
-
-/* Intermediate values */
-word_t f_pc;
-byte_t imem_icode;
-byte_t imem_ifun;
-bool_t imem_error;
-bool_t instr_valid;
-word_t d_regvala;
-word_t d_regvalb;
-word_t e_vala;
-word_t e_valb;
-bool_t e_bcond;
-mem_status_t dmem_status;
-
-/* The pipeline state */
-pipe_ptr pc_state, if_id_state, id_ex_state, ex_mem_state, mem_wb_state;
-
-/* Simulator operating mode */
-sim_mode_t sim_mode = S_FORWARD;
-/* Log file */
-FILE *dumpfile = NULL;
-
 /*****************************************************************************
  * pipeline control
  * These functions can be used to handle hazards
  *****************************************************************************/
 
 /* bubble stage (has effect at next update) */
-void sim_bubble_stage(stage_id_t stage)
+void sim_bubble_stage(sim_t sim, stage_id_t stage)
 {
     switch (stage)
     {
     case IF_STAGE:
-        pc_state->op = P_BUBBLE;
+        sim->pc_state->op = P_BUBBLE;
         break;
     case ID_STAGE:
-        if_id_state->op = P_BUBBLE;
+        sim->if_id_state->op = P_BUBBLE;
         break;
     case EX_STAGE:
-        id_ex_state->op = P_BUBBLE;
+        sim->id_ex_state->op = P_BUBBLE;
         break;
     case MEM_STAGE:
-        ex_mem_state->op = P_BUBBLE;
+        sim->ex_mem_state->op = P_BUBBLE;
         break;
     case WB_STAGE:
-        mem_wb_state->op = P_BUBBLE;
+        sim->mem_wb_state->op = P_BUBBLE;
         break;
     }
 }
 
 /* stall stage (has effect at next update) */
-void sim_stall_stage(stage_id_t stage)
+void sim_stall_stage(sim_t sim, stage_id_t stage)
 {
     switch (stage)
     {
     case IF_STAGE:
-        pc_state->op = P_STALL;
+        sim->pc_state->op = P_STALL;
         break;
     case ID_STAGE:
-        if_id_state->op = P_STALL;
+        sim->if_id_state->op = P_STALL;
         break;
     case EX_STAGE:
-        id_ex_state->op = P_STALL;
+        sim->id_ex_state->op = P_STALL;
         break;
     case MEM_STAGE:
-        ex_mem_state->op = P_STALL;
+        sim->ex_mem_state->op = P_STALL;
         break;
     case WB_STAGE:
-        mem_wb_state->op = P_STALL;
+        sim->mem_wb_state->op = P_STALL;
         break;
     }
 }
 
-static int initialized = 0;
-
-void sim_init()
+/* Connect pipe registers to the pipeline stages.  Needed whenever
+   the pipes are updated, since that swaps their buffers */
+static void connect_pipes(sim_t sim)
 {
-    /* Create memory and register files */
-    initialized = 1;
-    mem = init_mem(MEM_SIZE);
-    reg = init_reg();
+    sim->pc_next = sim->pc_state->next;
+    sim->pc_curr = sim->pc_state->current;
 
-    /* create 5 pipe registers */
-    pc_state = new_pipe(sizeof(pc_ele), (void *)&bubble_pc);
-    if_id_state = new_pipe(sizeof(if_id_ele), (void *)&bubble_if_id);
-    id_ex_state = new_pipe(sizeof(id_ex_ele), (void *)&bubble_id_ex);
-    ex_mem_state = new_pipe(sizeof(ex_mem_ele), (void *)&bubble_ex_mem);
-    mem_wb_state = new_pipe(sizeof(mem_wb_ele), (void *)&bubble_mem_wb);
+    sim->if_id_next = sim->if_id_state->next;
+    sim->if_id_curr = sim->if_id_state->current;
 
-    /* connect them to the pipeline stages */
-    pc_next = pc_state->next;
-    pc_curr = pc_state->current;
+    sim->id_ex_next = sim->id_ex_state->next;
+    sim->id_ex_curr = sim->id_ex_state->current;
 
-    if_id_next = if_id_state->next;
-    if_id_curr = if_id_state->current;
+    sim->ex_mem_next = sim->ex_mem_state->next;
+    sim->ex_mem_curr = sim->ex_mem_state->current;
 
-    id_ex_next = id_ex_state->next;
-    id_ex_curr = id_ex_state->current;
+    sim->mem_wb_next = sim->mem_wb_state->next;
+    sim->mem_wb_curr = sim->mem_wb_state->current;
+}
 
-    ex_mem_next = ex_mem_state->next;
-    ex_mem_curr = ex_mem_state->current;
+sim_t sim_init(int s, int b, int E)
+{
+    sim_t sim = (sim_t)calloc(1, sizeof(sim_rec));
 
-    mem_wb_next = mem_wb_state->next;
-    mem_wb_curr = mem_wb_state->current;
+    /* Create memory, with data cache, and register files */
+    sim->mem = init_mem(MEM_SIZE);
+    sim->mem->cache = initCache(s, b, E);
+    sim->reg = init_reg();
 
-    sim_reset();
-    clear_mem(mem);
+    /* create 5 pipe registers */
+    sim->pc_state = new_pipe(&sim->pipeline, sizeof(pc_ele), (void *)&bubble_pc);
+    sim->if_id_state = new_pipe(&sim->pipeline, sizeof(if_id_ele), (void *)&bubble_if_id);
+    sim->id_ex_state = new_pipe(&sim->pipeline, sizeof(id_ex_ele), (void *)&bubble_id_ex);
+    sim->ex_mem_state = new_pipe(&sim->pipeline, sizeof(ex_mem_ele), (void *)&bubble_ex_mem);
+    sim->mem_wb_state = new_pipe(&sim->pipeline, sizeof(mem_wb_ele), (void *)&bubble_mem_wb);
+
+    sim->sim_mode = S_FORWARD;
+    sim_reset(sim);
+    clear_mem(sim->mem);
+    return sim;
 }
 
-void sim_reset()
+void sim_free(sim_t sim)
 {
-    if (!initialized)
-        sim_init();
-    clear_pipes();
-    clear_mem(reg);
-    minAddr = 0;
-    memCnt = 0;
-    starting_up = 1;
-    cycles = instructions = 0;
-    cc = DEFAULT_CC;
-    status = STAT_AOK;
-
-    amux = bmux = MUX_NONE;
-    cc = cc_in = DEFAULT_CC;
-    wb_destE = REG_NONE;
-    wb_valE = 0;
-    wb_destM = REG_NONE;
-    wb_valM = 0;
-    mem_addr = 0;
-    mem_data = 0;
-    mem_write = FALSE;
+    free_pipes(&sim->pipeline);
+    freeCache(sim->mem->cache);
+    free_mem(sim->mem);
+    free_reg(sim->reg);
+    free((void *)sim);
+}
+
+void sim_reset(sim_t sim)
+{
+    int s;
+    clear_pipes(&sim->pipeline);
+    connect_pipes(sim);
+    clear_reg(sim->reg);
+    sim->minAddr = 0;
+    sim->memCnt = 0;
+    sim->starting_up = 1;
+    sim->cycles = sim->instructions = 0;
+    for (s = IF_STAGE; s <= WB_STAGE; s++)
+        sim->blame[s].cause = STALL_NONE;
+    memset(sim->lost, 0, sizeof(sim->lost));
+    sim->cc = DEFAULT_CC;
+    sim->status = STAT_AOK;
+
+    sim->amux = sim->bmux = MUX_NONE;
+    sim->cc = sim->cc_in = DEFAULT_CC;
+    sim->wb_destE = REG_NONE;
+    sim->wb_valE = 0;
+    sim->wb_destM = REG_NONE;
+    sim->wb_valM = 0;
+    sim->mem_addr = 0;
+    sim->mem_data = 0;
+    sim->mem_write = FALSE;
 }
 
 /* Text representation of status */
-void tty_report(word_t cyc)
+void tty_report(sim_t sim, word_t cyc)
+{
+    sim_log(sim, "\nCycle %lld. CC=%s, Stat=%s\n", cyc, cc_name(sim->cc), stat_name(sim->status));
+
+    sim_log(sim, "F: predPC = 0x%llx\n", sim->pc_curr->pc);
+
+    sim_log(sim, "D: instr = %s, rA = %s, rB = %s, valC = 0x%llx, valP = 0x%llx, Stat = %s\n",
+            iname(HPACK(sim->if_id_curr->icode, sim->if_id_curr->ifun)),
+            reg_name(sim->if_id_curr->ra), reg_name(sim->if_id_curr->rb),
+            sim->if_id_curr->valc, sim->if_id_curr->valp,
+            stat_name(sim->if_id_curr->status));
+
+    sim_log(sim, "E: instr = %s, valC = 0x%llx, valA = 0x%llx, valB = 0x%llx\n   srcA = %s, srcB = %s, dstE = %s, dstM = %s, Stat = %s\n",
+            iname(HPACK(sim->id_ex_curr->icode, sim->id_ex_curr->ifun)),
+            sim->id_ex_curr->valc, sim->id_ex_curr->vala, sim->id_ex_curr->valb,
+            reg_name(sim->id_ex_curr->srca), reg_name(sim->id_ex_curr->srcb),
+            reg_name(sim->id_ex_curr->deste), reg_name(sim->id_ex_curr->destm),
+            stat_name(sim->id_ex_curr->status));
+
+    sim_log(sim, "M: instr = %s, Cnd = %d, valE = 0x%llx, valA = 0x%llx\n   dstE = %s, dstM = %s, Stat = %s\n",
+            iname(HPACK(sim->ex_mem_curr->icode, sim->ex_mem_curr->ifun)),
+            sim->ex_mem_curr->takebranch,
+            sim->ex_mem_curr->vale, sim->ex_mem_curr->vala,
+            reg_name(sim->ex_mem_curr->deste), reg_name(sim->ex_mem_curr->destm),
+            stat_name(sim->ex_mem_curr->status));
+
+    sim_log(sim, "W: instr = %s, valE = 0x%llx, valM = 0x%llx, dstE = %s, dstM = %s, Stat = %s\n",
+            iname(HPACK(sim->mem_wb_curr->icode, sim->mem_wb_curr->ifun)),
+            sim->mem_wb_curr->vale, sim->mem_wb_curr->valm,
+            reg_name(sim->mem_wb_curr->deste), reg_name(sim->mem_wb_curr->destm),
+            stat_name(sim->mem_wb_curr->status));
+}
+
+/* Carry the cause of each bubble down the pipe with it, as
+   update_pipes is about to */
+static void move_blame(sim_t sim)
+{
+    int s;
+    for (s = WB_STAGE; s >= IF_STAGE; s--)
+    {
+        switch (sim->pipeline.pipes[s]->op)
+        {
+        case P_LOAD:
+            if (s > IF_STAGE)
+                sim->blame[s] = sim->blame[s - 1];
+            else
+                sim->blame[s].cause = STALL_NONE;
+            break;
+        case P_BUBBLE:
+        case P_ERROR:
+            sim->blame[s] = sim->new_blame[s];
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static void set_blame(blame_ptr b, int cause, word_t pc)
 {
-    sim_log("\nCycle %lld. CC=%s, Stat=%s\n", cyc, cc_name(cc), stat_name(status));
-
-    sim_log("F: predPC = 0x%llx\n", pc_curr->pc);
-
-    sim_log("D: instr = %s, rA = %s, rB = %s, valC = 0x%llx, valP = 0x%llx, Stat = %s\n",
-            iname(HPACK(if_id_curr->icode, if_id_curr->ifun)),
-            reg_name(if_id_curr->ra), reg_name(if_id_curr->rb),
-            if_id_curr->valc, if_id_curr->valp,
-            stat_name(if_id_curr->status));
-
-    sim_log("E: instr = %s, valC = 0x%llx, valA = 0x%llx, valB = 0x%llx\n   srcA = %s, srcB = %s, dstE = %s, dstM = %s, Stat = %s\n",
-            iname(HPACK(id_ex_curr->icode, id_ex_curr->ifun)),
-            id_ex_curr->valc, id_ex_curr->vala, id_ex_curr->valb,
-            reg_name(id_ex_curr->srca), reg_name(id_ex_curr->srcb),
-            reg_name(id_ex_curr->deste), reg_name(id_ex_curr->destm),
-            stat_name(id_ex_curr->status));
-
-    sim_log("M: instr = %s, Cnd = %d, valE = 0x%llx, valA = 0x%llx\n   dstE = %s, dstM = %s, Stat = %s\n",
-            iname(HPACK(ex_mem_curr->icode, ex_mem_curr->ifun)),
-            ex_mem_curr->takebranch,
-            ex_mem_curr->vale, ex_mem_curr->vala,
-            reg_name(ex_mem_curr->deste), reg_name(ex_mem_curr->destm),
-            stat_name(ex_mem_curr->status));
-
-    sim_log("W: instr = %s, valE = 0x%llx, valM = 0x%llx, dstE = %s, dstM = %s, Stat = %s\n",
-            iname(HPACK(mem_wb_curr->icode, mem_wb_curr->ifun)),
-            mem_wb_curr->vale, mem_wb_curr->valm,
-            reg_name(mem_wb_curr->deste), reg_name(mem_wb_curr->destm),
-            stat_name(mem_wb_curr->status));
+    b->cause = cause;
+    b->pc = pc;
+}
+
+/* Work out why do_stall_check would bubble each stage, using the same
+   conditions.  Only the stages it did bubble keep their blame */
+static void find_blame(sim_t sim)
+{
+    bool_t mispredict = sim->id_ex_curr->icode == I_JMP &&
+                        !sim->ex_mem_next->takebranch;
+    bool_t load_use = (sim->id_ex_curr->icode == I_MRMOVQ ||
+                       sim->id_ex_curr->icode == I_POPQ) &&
+                      (sim->id_ex_curr->destm == sim->id_ex_next->srca ||
+                       sim->id_ex_curr->destm == sim->id_ex_next->srcb);
+
+    /* Mispredicted jump, or load, in EX */
+    set_blame(&sim->new_blame[EX_STAGE],
+              mispredict ? STALL_MISPREDICT : STALL_LOAD_USE,
+              sim->id_ex_curr->stage_pc);
+    if (mispredict || load_use)
+        sim->new_blame[ID_STAGE] = sim->new_blame[EX_STAGE];
+    else if (sim->ex_mem_curr->icode == I_RET)
+        set_blame(&sim->new_blame[ID_STAGE], STALL_RET, sim->ex_mem_curr->stage_pc);
+    else if (sim->id_ex_curr->icode == I_RET)
+        set_blame(&sim->new_blame[ID_STAGE], STALL_RET, sim->id_ex_curr->stage_pc);
+    else
+        set_blame(&sim->new_blame[ID_STAGE], STALL_RET, sim->if_id_curr->stage_pc);
+    /* Instruction that raised the exception, in WB or about to be */
+    if (sim->mem_wb_curr->status == STAT_ADR ||
+        sim->mem_wb_curr->status == STAT_INS ||
+        sim->mem_wb_curr->status == STAT_HLT)
+        set_blame(&sim->new_blame[MEM_STAGE], STALL_DRAIN, sim->mem_wb_curr->stage_pc);
+    else
+        set_blame(&sim->new_blame[MEM_STAGE], STALL_DRAIN, sim->ex_mem_curr->stage_pc);
+    /* Access waiting on the data cache in M */
+    set_blame(&sim->new_blame[WB_STAGE], STALL_DCACHE, sim->ex_mem_curr->stage_pc);
 }
 
 /******************************************************************
@@ -515,23 +557,26 @@ void tty_report(word_t cyc)
 /* Return status of processor */
 /* Max_instr indicates maximum number of instructions that
    want to complete during this simulation run.  */
-static byte_t sim_step_pipe(word_t max_instr, word_t ccount)
+static byte_t sim_step_pipe(sim_t sim, word_t max_instr, word_t ccount)
 {
     /* Update pipe registers */
-    update_pipes();
+    move_blame(sim);
+    update_pipes(&sim->pipeline);
+    connect_pipes(sim);
     /* print status report in TTY mode */
-    tty_report(ccount);
+    if (sim_logging(sim))
+        tty_report(sim, ccount);
     /* error checking */
-    if (pc_state->op == P_ERROR)
-        pc_curr->status = STAT_PIP;
-    if (if_id_state->op == P_ERROR)
-        if_id_curr->status = STAT_PIP;
-    if (id_ex_state->op == P_ERROR)
-        id_ex_curr->status = STAT_PIP;
-    if (ex_mem_state->op == P_ERROR)
-        ex_mem_curr->status = STAT_PIP;
-    if (mem_wb_state->op == P_ERROR)
-        mem_wb_curr->status = STAT_PIP;
+    if (sim->pc_state->op == P_ERROR)
+        sim->pc_curr->status = STAT_PIP;
+    if (sim->if_id_state->op == P_ERROR)
+        sim->if_id_curr->status = STAT_PIP;
+    if (sim->id_ex_state->op == P_ERROR)
+        sim->id_ex_curr->status = STAT_PIP;
+    if (sim->ex_mem_state->op == P_ERROR)
+        sim->ex_mem_curr->status = STAT_PIP;
+    if (sim->mem_wb_state->op == P_ERROR)
+        sim->mem_wb_curr->status = STAT_PIP;
 
     /****************** Stage implementations ******************
      * TODO: implement the following functions to simulate the 
@@ -545,28 +590,34 @@ static byte_t sim_step_pipe(word_t max_instr, word_t ccount)
      * values properly.
      ***********************************************************/
 
-    do_wb_stage();
-    do_mem_stage();
-    do_ex_stage();
-    do_id_stage();
-    do_if_stage();
+    do_wb_stage(sim);
+    do_mem_stage(sim);
+    do_ex_stage(sim);
+    do_id_stage(sim);
+    do_if_stage(sim);
 
-    do_stall_check();
+    do_stall_check(sim);
+    find_blame(sim);
 
     /* Performance monitoring. Do not change anything below */
-    if (mem_wb_curr->status != STAT_BUB && mem_wb_curr->icode != I_POP2)
+    if (sim->mem_wb_curr->status != STAT_BUB && sim->mem_wb_curr->icode != I_POP2)
     {
-        starting_up = 0;
-        instructions++;
-        cycles++;
+        sim->starting_up = 0;
+        sim->instructions++;
+        sim->cycles++;
     }
     else
     {
-        if (!starting_up)
-            cycles++;
+        if (!sim->starting_up)
+            sim->cycles++;
     }
 
-    return status;
+    /* Charge a cycle in which WB held a bubble to whatever caused it */
+    if (sim->mem_wb_curr->status == STAT_BUB && !sim->starting_up &&
+        sim->blame[WB_STAGE].cause != STALL_NONE)
+        sim->lost[sim->blame[WB_STAGE].cause]++;
+
+    return sim->status;
 }
 
 /*************************** Fetch stage ***************************
@@ -577,53 +628,53 @@ static byte_t sim_step_pipe(word_t max_instr, word_t ccount)
  * imem_error is defined for logging purpose, you can use it to help
  * with your design, but it's also fine to neglect it 
  *******************************************************************/
-void do_if_stage()
+void do_if_stage(sim_t sim)
 {
     byte_t instr = HPACK(I_NOP, F_NONE);
     byte_t registers = HPACK(REG_NONE, REG_NONE);
     word_t valc = 0;
     //what address should instruction be fetched at
-    f_pc = ((((ex_mem_curr->icode) == (I_JMP)) & !(ex_mem_curr->takebranch)) ? (ex_mem_curr->vala) : ((mem_wb_curr->icode) == (I_RET)) ? (mem_wb_curr->valm) : (pc_curr->pc));
-    word_t valp = f_pc;
+    sim->f_pc = ((((sim->ex_mem_curr->icode) == (I_JMP)) & !(sim->ex_mem_curr->takebranch)) ? (sim->ex_mem_curr->vala) : ((sim->mem_wb_curr->icode) == (I_RET)) ? (sim->mem_wb_curr->valm) : (sim->pc_curr->pc));
+    word_t valp = sim->f_pc;
     /*Fetch register byte and immediate word*/
-    imem_error = !get_byte_val(mem, valp, &instr);
-    imem_icode = GET_ICODE(instr);
-    imem_ifun = GET_FUN(instr);
-    if_id_next->icode = imem_icode;
-    if_id_next->ifun = imem_ifun;
+    sim->imem_error = !get_byte_val_I(sim->mem, valp, &instr);
+    sim->imem_icode = GET_ICODE(instr);
+    sim->imem_ifun = GET_FUN(instr);
+    sim->if_id_next->icode = sim->imem_icode;
+    sim->if_id_next->ifun = sim->imem_ifun;
     //is instruction valid
-    instr_valid = ((if_id_next->icode) == (I_NOP) || (if_id_next->icode) == (I_HALT) || (if_id_next->icode) == (I_RRMOVQ) || (if_id_next->icode) == (I_IRMOVQ) ||
-                   (if_id_next->icode) == (I_RMMOVQ) || (if_id_next->icode) == (I_MRMOVQ) || (if_id_next->icode) == (I_ALU) || (if_id_next->icode) == (I_JMP) ||
-                   (if_id_next->icode) == (I_CALL) || (if_id_next->icode) == (I_RET) || (if_id_next->icode) == (I_PUSHQ) || (if_id_next->icode) == (I_POPQ));
-    if_id_next->status = ((imem_error) ? (STAT_ADR) : !(instr_valid) ? (STAT_INS) : ((if_id_next->icode) == (I_HALT)) ? (STAT_HLT) : (STAT_AOK));
+    sim->instr_valid = ((sim->if_id_next->icode) == (I_NOP) || (sim->if_id_next->icode) == (I_HALT) || (sim->if_id_next->icode) == (I_RRMOVQ) || (sim->if_id_next->icode) == (I_IRMOVQ) ||
+                   (sim->if_id_next->icode) == (I_RMMOVQ) || (sim->if_id_next->icode) == (I_MRMOVQ) || (sim->if_id_next->icode) == (I_ALU) || (sim->if_id_next->icode) == (I_JMP) ||
+                   (sim->if_id_next->icode) == (I_CALL) || (sim->if_id_next->icode) == (I_RET) || (sim->if_id_next->icode) == (I_PUSHQ) || (sim->if_id_next->icode) == (I_POPQ));
+    sim->if_id_next->status = ((sim->imem_error) ? (STAT_ADR) : !(sim->instr_valid) ? (STAT_INS) : ((sim->if_id_next->icode) == (I_HALT)) ? (STAT_HLT) : (STAT_AOK));
     valp++;
     //register byte
-    if (((if_id_next->icode) == (I_RRMOVQ) || (if_id_next->icode) == (I_ALU) || (if_id_next->icode) == (I_PUSHQ) || (if_id_next->icode) == (I_POPQ) ||
-         (if_id_next->icode) == (I_IRMOVQ) || (if_id_next->icode) == (I_RMMOVQ) || (if_id_next->icode) == (I_MRMOVQ)))
+    if (((sim->if_id_next->icode) == (I_RRMOVQ) || (sim->if_id_next->icode) == (I_ALU) || (sim->if_id_next->icode) == (I_PUSHQ) || (sim->if_id_next->icode) == (I_POPQ) ||
+         (sim->if_id_next->icode) == (I_IRMOVQ) || (sim->if_id_next->icode) == (I_RMMOVQ) || (sim->if_id_next->icode) == (I_MRMOVQ)))
     {
-        get_byte_val_I(mem, valp, &registers);
+        get_byte_val_I(sim->mem, valp, &registers);
         valp++;
     }
     //constant word
-    if (((if_id_next->icode) == (I_IRMOVQ) || (if_id_next->icode) == (I_RMMOVQ) || (if_id_next->icode) == (I_MRMOVQ) || (if_id_next->icode) == (I_JMP) || (if_id_next->icode) == (I_CALL)))
+    if (((sim->if_id_next->icode) == (I_IRMOVQ) || (sim->if_id_next->icode) == (I_RMMOVQ) || (sim->if_id_next->icode) == (I_MRMOVQ) || (sim->if_id_next->icode) == (I_JMP) || (sim->if_id_next->icode) == (I_CALL)))
     {
-        get_word_val_I(mem, valp, &valc);
+        get_word_val_I(sim->mem, valp, &valc);
         valp += 8;
     }
-    if_id_next->ra = HI4(registers);
-    if_id_next->rb = LO4(registers);
-    if_id_next->valp = valp;
-    if_id_next->valc = valc;
+    sim->if_id_next->ra = HI4(registers);
+    sim->if_id_next->rb = LO4(registers);
+    sim->if_id_next->valp = valp;
+    sim->if_id_next->valc = valc;
     //next PC prediction
-    pc_next->pc = ((if_id_next->icode == I_JMP || if_id_next->icode == I_CALL) ? (if_id_next->valc) : (if_id_next->valp));
+    sim->pc_next->pc = ((sim->if_id_next->icode == I_JMP || sim->if_id_next->icode == I_CALL) ? (sim->if_id_next->valc) : (sim->if_id_next->valp));
     //status code for next instruction
-    pc_next->status = (if_id_next->status == STAT_AOK) ? STAT_AOK : STAT_BUB;
-    if_id_next->stage_pc = f_pc;
+    sim->pc_next->status = (sim->if_id_next->status == STAT_AOK) ? STAT_AOK : STAT_BUB;
+    sim->if_id_next->stage_pc = sim->f_pc;
     /* logging function, do not change this */
-    if (!imem_error)
+    if (!sim->imem_error)
     {
-        sim_log("\tFetch: f_pc = 0x%llx, f_instr = %s\n",
-                f_pc, iname(HPACK(if_id_next->icode, if_id_next->ifun)));
+        SIM_LOG(sim, "\tFetch: f_pc = 0x%llx, f_instr = %s\n",
+                sim->f_pc, iname(HPACK(sim->if_id_next->icode, sim->if_id_next->ifun)));
     }
 }
 
@@ -632,29 +683,29 @@ void do_if_stage()
  * you may find these functions useful:
  * get_reg_val()
  *******************************************************************/
-void do_id_stage()
+void do_id_stage(sim_t sim)
 {
     /* Update processor status */
-    status = (((mem_wb_curr->status) == (STAT_BUB)) ? (STAT_AOK) : (mem_wb_curr->status));
+    sim->status = (((sim->mem_wb_curr->status) == (STAT_BUB)) ? (STAT_AOK) : (sim->mem_wb_curr->status));
     //register for A source
-    id_ex_next->srca = (((if_id_curr->icode) == (I_RRMOVQ) || (if_id_curr->icode) == (I_RMMOVQ) || (if_id_curr->icode) == (I_ALU) || (if_id_curr->icode) == (I_PUSHQ)) ? (if_id_curr->ra) : ((if_id_curr->icode) == (I_POPQ) || (if_id_curr->icode) == (I_RET)) ? (REG_RSP) : (REG_NONE));
+    sim->id_ex_next->srca = (((sim->if_id_curr->icode) == (I_RRMOVQ) || (sim->if_id_curr->icode) == (I_RMMOVQ) || (sim->if_id_curr->icode) == (I_ALU) || (sim->if_id_curr->icode) == (I_PUSHQ)) ? (sim->if_id_curr->ra) : ((sim->if_id_curr->icode) == (I_POPQ) || (sim->if_id_curr->icode) == (I_RET)) ? (REG_RSP) : (REG_NONE));
     //register for B source
-    id_ex_next->srcb = (((if_id_curr->icode) == (I_ALU) || (if_id_curr->icode) == (I_RMMOVQ) || (if_id_curr->icode) == (I_MRMOVQ)) ? (if_id_curr->rb) : ((if_id_curr->icode) == (I_PUSHQ) || (if_id_curr->icode) == (I_POPQ) || (if_id_curr->icode) == (I_CALL) || (if_id_curr->icode) == (I_RET)) ? (REG_RSP) : (REG_NONE));
+    sim->id_ex_next->srcb = (((sim->if_id_curr->icode) == (I_ALU) || (sim->if_id_curr->icode) == (I_RMMOVQ) || (sim->if_id_curr->icode) == (I_MRMOVQ)) ? (sim->if_id_curr->rb) : ((sim->if_id_curr->icode) == (I_PUSHQ) || (sim->if_id_curr->icode) == (I_POPQ) || (sim->if_id_curr->icode) == (I_CALL) || (sim->if_id_curr->icode) == (I_RET)) ? (REG_RSP) : (REG_NONE));
     //register for E destination
-    id_ex_next->deste = (((if_id_curr->icode) == (I_RRMOVQ) || (if_id_curr->icode) == (I_IRMOVQ) || (if_id_curr->icode) == (I_ALU)) ? (if_id_curr->rb) : ((if_id_curr->icode) == (I_PUSHQ) || (if_id_curr->icode) == (I_POPQ) || (if_id_curr->icode) == (I_CALL) || (if_id_curr->icode) == (I_RET)) ? (REG_RSP) : (REG_NONE));
+    sim->id_ex_next->deste = (((sim->if_id_curr->icode) == (I_RRMOVQ) || (sim->if_id_curr->icode) == (I_IRMOVQ) || (sim->if_id_curr->icode) == (I_ALU)) ? (sim->if_id_curr->rb) : ((sim->if_id_curr->icode) == (I_PUSHQ) || (sim->if_id_curr->icode) == (I_POPQ) || (sim->if_id_curr->icode) == (I_CALL) || (sim->if_id_curr->icode) == (I_RET)) ? (REG_RSP) : (REG_NONE));
     //register for M destination
-    id_ex_next->destm = (((if_id_curr->icode) == (I_MRMOVQ) || (if_id_curr->icode) == (I_POPQ)) ? (if_id_curr->ra) : (REG_NONE));
+    sim->id_ex_next->destm = (((sim->if_id_curr->icode) == (I_MRMOVQ) || (sim->if_id_curr->icode) == (I_POPQ)) ? (sim->if_id_curr->ra) : (REG_NONE));
     /* Read the registers */
-    d_regvala = get_reg_val(reg, id_ex_next->srca);
-    d_regvalb = get_reg_val(reg, id_ex_next->srcb);
+    sim->d_regvala = get_reg_val(sim->reg, sim->id_ex_next->srca);
+    sim->d_regvalb = get_reg_val(sim->reg, sim->id_ex_next->srcb);
     /* Do forwarding and valA selection */
-    id_ex_next->vala = (((if_id_curr->icode) == (I_CALL) || (if_id_curr->icode) == (I_JMP)) ? (if_id_curr->valp) : ((id_ex_next->srca) == (ex_mem_next->deste)) ? (ex_mem_next->vale) : ((id_ex_next->srca) == (ex_mem_curr->destm)) ? (mem_wb_next->valm) : ((id_ex_next->srca) == (ex_mem_curr->deste)) ? (ex_mem_curr->vale) : ((id_ex_next->srca) == (mem_wb_curr->destm)) ? (mem_wb_curr->valm) : ((id_ex_next->srca) == (mem_wb_curr->deste)) ? (mem_wb_curr->vale) : (d_regvala));
-    id_ex_next->valb = (((id_ex_next->srcb) == (ex_mem_next->deste)) ? (ex_mem_next->vale) : ((id_ex_next->srcb) == (ex_mem_curr->destm)) ? (mem_wb_next->valm) : ((id_ex_next->srcb) == (ex_mem_curr->deste)) ? (ex_mem_curr->vale) : ((id_ex_next->srcb) == (mem_wb_curr->destm)) ? (mem_wb_curr->valm) : ((id_ex_next->srcb) == (mem_wb_curr->deste)) ? (mem_wb_curr->vale) : (d_regvalb));
-    id_ex_next->icode = if_id_curr->icode;
-    id_ex_next->ifun = if_id_curr->ifun;
-    id_ex_next->valc = if_id_curr->valc;
-    id_ex_next->stage_pc = if_id_curr->stage_pc;
-    id_ex_next->status = if_id_curr->status;
+    sim->id_ex_next->vala = (((sim->if_id_curr->icode) == (I_CALL) || (sim->if_id_curr->icode) == (I_JMP)) ? (sim->if_id_curr->valp) : ((sim->id_ex_next->srca) == (sim->ex_mem_next->deste)) ? (sim->ex_mem_next->vale) : ((sim->id_ex_next->srca) == (sim->ex_mem_curr->destm)) ? (sim->mem_wb_next->valm) : ((sim->id_ex_next->srca) == (sim->ex_mem_curr->deste)) ? (sim->ex_mem_curr->vale) : ((sim->id_ex_next->srca) == (sim->mem_wb_curr->destm)) ? (sim->mem_wb_curr->valm) : ((sim->id_ex_next->srca) == (sim->mem_wb_curr->deste)) ? (sim->mem_wb_curr->vale) : (sim->d_regvala));
+    sim->id_ex_next->valb = (((sim->id_ex_next->srcb) == (sim->ex_mem_next->deste)) ? (sim->ex_mem_next->vale) : ((sim->id_ex_next->srcb) == (sim->ex_mem_curr->destm)) ? (sim->mem_wb_next->valm) : ((sim->id_ex_next->srcb) == (sim->ex_mem_curr->deste)) ? (sim->ex_mem_curr->vale) : ((sim->id_ex_next->srcb) == (sim->mem_wb_curr->destm)) ? (sim->mem_wb_curr->valm) : ((sim->id_ex_next->srcb) == (sim->mem_wb_curr->deste)) ? (sim->mem_wb_curr->vale) : (sim->d_regvalb));
+    sim->id_ex_next->icode = sim->if_id_curr->icode;
+    sim->id_ex_next->ifun = sim->if_id_curr->ifun;
+    sim->id_ex_next->valc = sim->if_id_curr->valc;
+    sim->id_ex_next->stage_pc = sim->if_id_curr->stage_pc;
+    sim->id_ex_next->status = sim->if_id_curr->status;
 }
 
 /******************** Decode & Writeback stage *********************
@@ -665,24 +716,24 @@ void do_id_stage()
  * you don't perform the operation to really write to memory here
  * the pending writeback updates will occur in update_state()
  *******************************************************************/
-void do_wb_stage()
+void do_wb_stage(sim_t sim)
 {
-    wb_destE = mem_wb_curr->deste;
-    wb_valE = mem_wb_curr->vale;
-    wb_destM = mem_wb_curr->destm;
-    wb_valM = mem_wb_curr->valm;
+    sim->wb_destE = sim->mem_wb_curr->deste;
+    sim->wb_valE = sim->mem_wb_curr->vale;
+    sim->wb_destM = sim->mem_wb_curr->destm;
+    sim->wb_valM = sim->mem_wb_curr->valm;
 
-    if (wb_destE != REG_NONE)
+    if (sim->wb_destE != REG_NONE)
     {
-        sim_log("\tWriteback: Wrote 0x%llx to register %s\n",
-                wb_valE, reg_name(wb_destE));
-        set_reg_val(reg, wb_destE, wb_valE);
+        SIM_LOG(sim, "\tWriteback: Wrote 0x%llx to register %s\n",
+                sim->wb_valE, reg_name(sim->wb_destE));
+        set_reg_val(sim->reg, sim->wb_destE, sim->wb_valE);
     }
-    if (wb_destM != REG_NONE)
+    if (sim->wb_destM != REG_NONE)
     {
-        sim_log("\tWriteback: Wrote 0x%llx to register %s\n",
-                wb_valM, reg_name(wb_destM));
-        set_reg_val(reg, wb_destM, wb_valM);
+        SIM_LOG(sim, "\tWriteback: Wrote 0x%llx to register %s\n",
+                sim->wb_valM, reg_name(sim->wb_destM));
+        set_reg_val(sim->reg, sim->wb_destM, sim->wb_valM);
     }
 }
 
@@ -691,47 +742,47 @@ void do_wb_stage()
  * you may find these functions useful: 
  * cond_holds(), compute_alu(), compute_cc()
  *******************************************************************/
-void do_ex_stage()
+void do_ex_stage(sim_t sim)
 {
-    cc_in = DEFAULT_CC; /* should not overwrite original cc */
+    sim->cc_in = DEFAULT_CC; /* should not overwrite original cc */
     word_t alua, alub;
     //select input A and B to ALU
-    alua = (((id_ex_curr->icode) == (I_RRMOVQ) || (id_ex_curr->icode) == (I_ALU)) ? (id_ex_curr->vala) : ((id_ex_curr->icode) == (I_IRMOVQ) || (id_ex_curr->icode) == (I_RMMOVQ) || (id_ex_curr->icode) == (I_MRMOVQ)) ? (id_ex_curr->valc) : ((id_ex_curr->icode) == (I_POPQ) || (id_ex_curr->icode) == (I_RET)) ? 8 : ((id_ex_curr->icode) == (I_PUSHQ) || (id_ex_curr->icode) == (I_CALL)) ? -8 : 0);
-    alub = (((id_ex_curr->icode) == (I_RMMOVQ) || (id_ex_curr->icode) == (I_MRMOVQ) || (id_ex_curr->icode) == (I_ALU) || (id_ex_curr->icode) == (I_CALL) || (id_ex_curr->icode) == (I_PUSHQ) || (id_ex_curr->icode) == (I_RET) || (id_ex_curr->icode) == (I_POPQ)) ? (id_ex_curr->valb) : ((id_ex_curr->icode) == (I_RRMOVQ) || (id_ex_curr->icode) == (I_IRMOVQ)) ? 0 : 0);
+    alua = (((sim->id_ex_curr->icode) == (I_RRMOVQ) || (sim->id_ex_curr->icode) == (I_ALU)) ? (sim->id_ex_curr->vala) : ((sim->id_ex_curr->icode) == (I_IRMOVQ) || (sim->id_ex_curr->icode) == (I_RMMOVQ) || (sim->id_ex_curr->icode) == (I_MRMOVQ)) ? (sim->id_ex_curr->valc) : ((sim->id_ex_curr->icode) == (I_POPQ) || (sim->id_ex_curr->icode) == (I_RET)) ? 8 : ((sim->id_ex_curr->icode) == (I_PUSHQ) || (sim->id_ex_curr->icode) == (I_CALL)) ? -8 : 0);
+    alub = (((sim->id_ex_curr->icode) == (I_RMMOVQ) || (sim->id_ex_curr->icode) == (I_MRMOVQ) || (sim->id_ex_curr->icode) == (I_ALU) || (sim->id_ex_curr->icode) == (I_CALL) || (sim->id_ex_curr->icode) == (I_PUSHQ) || (sim->id_ex_curr->icode) == (I_RET) || (sim->id_ex_curr->icode) == (I_POPQ)) ? (sim->id_ex_curr->valb) : ((sim->id_ex_curr->icode) == (I_RRMOVQ) || (sim->id_ex_curr->icode) == (I_IRMOVQ)) ? 0 : 0);
     //set ALU function
-    alu_t alufun = (((id_ex_curr->icode) == (I_ALU)) ? (id_ex_curr->ifun) : (A_ADD));
+    alu_t alufun = (((sim->id_ex_curr->icode) == (I_ALU)) ? (sim->id_ex_curr->ifun) : (A_ADD));
     //update condition codes?
-    bool_t setcc = ((((id_ex_curr->icode) == (I_ALU)) & !((mem_wb_next->status) == (STAT_ADR) || (mem_wb_next->status) == (STAT_INS) || (mem_wb_next->status) == (STAT_HLT))) & !((mem_wb_curr->status) == (STAT_ADR) || (mem_wb_curr->status) == (STAT_INS) || (mem_wb_curr->status) == (STAT_HLT)));
-    e_bcond = cond_holds(cc, id_ex_curr->ifun);
-    ex_mem_next->takebranch = e_bcond;
+    bool_t setcc = ((((sim->id_ex_curr->icode) == (I_ALU)) & !((sim->mem_wb_next->status) == (STAT_ADR) || (sim->mem_wb_next->status) == (STAT_INS) || (sim->mem_wb_next->status) == (STAT_HLT))) & !((sim->mem_wb_curr->status) == (STAT_ADR) || (sim->mem_wb_curr->status) == (STAT_INS) || (sim->mem_wb_curr->status) == (STAT_HLT)));
+    sim->e_bcond = cond_holds(sim->cc, sim->id_ex_curr->ifun);
+    sim->ex_mem_next->takebranch = sim->e_bcond;
     /* Perform the ALU operation */
     word_t aluout = compute_alu(alufun, alua, alub);
-    ex_mem_next->vale = aluout;
+    sim->ex_mem_next->vale = aluout;
     //set condition coes
-    cc_in = compute_cc(alufun, alua, alub);
-    ex_mem_next->icode = id_ex_curr->icode;
-    ex_mem_next->ifun = id_ex_curr->ifun;
-    ex_mem_next->vala = id_ex_curr->vala;
+    sim->cc_in = compute_cc(alufun, alua, alub);
+    sim->ex_mem_next->icode = sim->id_ex_curr->icode;
+    sim->ex_mem_next->ifun = sim->id_ex_curr->ifun;
+    sim->ex_mem_next->vala = sim->id_ex_curr->vala;
     //Set dstE to RNONE in event of not-taken conditional move
-    ex_mem_next->deste = ((((id_ex_curr->icode) == (I_RRMOVQ)) & !(ex_mem_next->takebranch)) ? (REG_NONE) : (id_ex_curr->deste));
-    ex_mem_next->destm = id_ex_curr->destm;
-    ex_mem_next->srca = id_ex_curr->srca;
-    ex_mem_next->status = id_ex_curr->status;
-    ex_mem_next->stage_pc = id_ex_curr->stage_pc;
+    sim->ex_mem_next->deste = ((((sim->id_ex_curr->icode) == (I_RRMOVQ)) & !(sim->ex_mem_next->takebranch)) ? (REG_NONE) : (sim->id_ex_curr->deste));
+    sim->ex_mem_next->destm = sim->id_ex_curr->destm;
+    sim->ex_mem_next->srca = sim->id_ex_curr->srca;
+    sim->ex_mem_next->status = sim->id_ex_curr->status;
+    sim->ex_mem_next->stage_pc = sim->id_ex_curr->stage_pc;
     /* logging functions, do not change these */
-    if (id_ex_curr->icode == I_JMP)
+    if (sim->id_ex_curr->icode == I_JMP)
     {
-        sim_log("\tExecute: instr = %s, cc = %s, branch %staken\n",
-                iname(HPACK(id_ex_curr->icode, id_ex_curr->ifun)),
-                cc_name(cc),
-                ex_mem_next->takebranch ? "" : "not ");
+        SIM_LOG(sim, "\tExecute: instr = %s, cc = %s, branch %staken\n",
+                iname(HPACK(sim->id_ex_curr->icode, sim->id_ex_curr->ifun)),
+                cc_name(sim->cc),
+                sim->ex_mem_next->takebranch ? "" : "not ");
     }
-    sim_log("\tExecute: ALU: %c 0x%llx 0x%llx --> 0x%llx\n",
-            op_name(alufun), alua, alub, ex_mem_next->vale);
+    SIM_LOG(sim, "\tExecute: ALU: %c 0x%llx 0x%llx --> 0x%llx\n",
+            op_name(alufun), alua, alub, sim->ex_mem_next->vale);
     if (setcc)
     {
-        cc = cc_in;
-        sim_log("\tExecute: New cc=%s\n", cc_name(cc_in));
+        sim->cc = sim->cc_in;
+        SIM_LOG(sim, "\tExecute: New cc=%s\n", cc_name(sim->cc_in));
     }
 }
 
@@ -742,59 +793,63 @@ void do_ex_stage()
  * 
  * The pending writeback updates will occur in update_state()
  *******************************************************************/
-void do_mem_stage()
+void do_mem_stage(sim_t sim)
 {
     word_t valm = 0;
     //select memory address
-    mem_addr = (((ex_mem_curr->icode) == (I_RMMOVQ) || (ex_mem_curr->icode) == (I_PUSHQ) || (ex_mem_curr->icode) == (I_CALL) || (ex_mem_curr->icode) == (I_MRMOVQ)) ? (ex_mem_curr->vale) : ((ex_mem_curr->icode) == (I_POPQ) || (ex_mem_curr->icode) == (I_RET)) ? (ex_mem_curr->vala) : 0);
-    mem_data = ex_mem_curr->vala;
+    sim->mem_addr = (((sim->ex_mem_curr->icode) == (I_RMMOVQ) || (sim->ex_mem_curr->icode) == (I_PUSHQ) || (sim->ex_mem_curr->icode) == (I_CALL) || (sim->ex_mem_curr->icode) == (I_MRMOVQ)) ? (sim->ex_mem_curr->vale) : ((sim->ex_mem_curr->icode) == (I_POPQ) || (sim->ex_mem_curr->icode) == (I_RET)) ? (sim->ex_mem_curr->vala) : 0);
+    sim->mem_data = sim->ex_mem_curr->vala;
     //Set write control signal
-    mem_write = ((ex_mem_curr->icode) == (I_RMMOVQ) || (ex_mem_curr->icode) == (I_PUSHQ) || (ex_mem_curr->icode) == (I_CALL));
+    sim->mem_write = ((sim->ex_mem_curr->icode) == (I_RMMOVQ) || (sim->ex_mem_curr->icode) == (I_PUSHQ) || (sim->ex_mem_curr->icode) == (I_CALL));
     //Set read control signal
-    bool_t read = ((ex_mem_curr->icode) == (I_MRMOVQ) || (ex_mem_curr->icode) == (I_POPQ) || (ex_mem_curr->icode) == (I_RET));
-    dmem_error = FALSE;
+    bool_t read = ((sim->ex_mem_curr->icode) == (I_MRMOVQ) || (sim->ex_mem_curr->icode) == (I_POPQ) || (sim->ex_mem_curr->icode) == (I_RET));
+    /* An access that misses the data cache stays IN_FLIGHT, holding
+       the instruction in M, until its block arrives */
+    sim->dmem_status = READY;
     if (read)
     {
-        dmem_error = dmem_error || !get_word_val_D(mem, mem_addr, &valm);
+        sim->dmem_status = get_word_val_D(sim->mem, sim->mem_addr, &valm);
     }
-    mem_wb_next->icode = ex_mem_curr->icode;
-    mem_wb_next->ifun = ex_mem_curr->ifun;
-    mem_wb_next->vale = ex_mem_curr->vale;
-    mem_wb_next->valm = valm;
-    mem_wb_next->deste = ex_mem_curr->deste;
-    mem_wb_next->destm = ex_mem_curr->destm;
-    //Update the status
-    mem_wb_next->status = ((dmem_error) ? (STAT_ADR) : (ex_mem_curr->status));
-    mem_wb_next->stage_pc = ex_mem_curr->stage_pc;
-    //Update processor status
-    status = (((mem_wb_curr->status) == (STAT_BUB)) ? (STAT_AOK) : (mem_wb_curr->status));
-    if (mem_write)
+    if (sim->mem_write)
     {
-        if (!set_word_val_D(mem, mem_addr, mem_data))
+        sim->dmem_status = set_word_val_D(sim->mem, sim->mem_addr, sim->mem_data);
+        if (sim->dmem_status == ERROR)
         {
-            sim_log("\tCouldn't write to address 0x%llx\n", mem_addr);
+            SIM_LOG(sim, "\tCouldn't write to address 0x%llx\n", sim->mem_addr);
         }
-        else
+        else if (sim->dmem_status == READY)
         {
-            sim_log("\tWrote 0x%llx to address 0x%llx\n", mem_data, mem_addr);
+            SIM_LOG(sim, "\tWrote 0x%llx to address 0x%llx\n", sim->mem_data, sim->mem_addr);
         }
     }
+    sim->dmem_error = sim->dmem_status == ERROR;
+    sim->mem_wb_next->icode = sim->ex_mem_curr->icode;
+    sim->mem_wb_next->ifun = sim->ex_mem_curr->ifun;
+    sim->mem_wb_next->vale = sim->ex_mem_curr->vale;
+    sim->mem_wb_next->valm = valm;
+    sim->mem_wb_next->deste = sim->ex_mem_curr->deste;
+    sim->mem_wb_next->destm = sim->ex_mem_curr->destm;
+    //Update the status
+    sim->mem_wb_next->status = ((sim->dmem_error) ? (STAT_ADR) : (sim->ex_mem_curr->status));
+    sim->mem_wb_next->stage_pc = sim->ex_mem_curr->stage_pc;
+    //Update processor status
+    sim->status = (((sim->mem_wb_curr->status) == (STAT_BUB)) ? (STAT_AOK) : (sim->mem_wb_curr->status));
     /* logging function, do not change this */
-    if (read && !dmem_error)
+    if (read && sim->dmem_status == READY)
     {
-        sim_log("\tMemory: Read 0x%llx from 0x%llx\n",
-                mem_wb_next->valm, mem_addr);
+        SIM_LOG(sim, "\tMemory: Read 0x%llx from 0x%llx\n",
+                sim->mem_wb_next->valm, sim->mem_addr);
     }
 }
 
 /* given stall and bubble flag, return the correct control operation */
-p_stat_t pipe_cntl(char *name, word_t stall, word_t bubble)
+p_stat_t pipe_cntl(sim_t sim, char *name, word_t stall, word_t bubble)
 {
     if (stall)
     {
         if (bubble)
         {
-            sim_log("%s: Conflicting control signals for pipe register\n",
+            SIM_LOG(sim, "%s: Conflicting control signals for pipe register\n",
                     name);
             return P_ERROR;
         }
@@ -815,23 +870,26 @@ p_stat_t pipe_cntl(char *name, word_t stall, word_t bubble)
  * update_pipes() will handle the real control behavior later
  * make sure you have a working PIPE before implementing this
  *******************************************************************/
-void do_stall_check()
+void do_stall_check(sim_t sim)
 {
+    /* While M waits on the data cache, hold everything behind it and
+       send bubbles on to WB */
+    word_t mwait = sim->dmem_status == IN_FLIGHT;
     word_t fbubble = 0;
-    word_t fstall = ((((id_ex_curr->icode) == (I_MRMOVQ) || (id_ex_curr->icode) == (I_POPQ)) & ((id_ex_curr->destm) == (id_ex_next->srca) || (id_ex_curr->destm) == (id_ex_next->srcb))) | ((I_RET) == (if_id_curr->icode) || (I_RET) == (id_ex_curr->icode) || (I_RET) == (ex_mem_curr->icode)));
-    word_t dstall = (((id_ex_curr->icode) == (I_MRMOVQ) || (id_ex_curr->icode) == (I_POPQ)) & ((id_ex_curr->destm) == (id_ex_next->srca) || (id_ex_curr->destm) == (id_ex_next->srcb)));
-    word_t dbubble = ((((id_ex_curr->icode) == (I_JMP)) & !(ex_mem_next->takebranch)) | (!(((id_ex_curr->icode) == (I_MRMOVQ) || (id_ex_curr->icode) == (I_POPQ)) & ((id_ex_curr->destm) == (id_ex_next->srca) || (id_ex_curr->destm) == (id_ex_next->srcb))) & ((I_RET) == (if_id_curr->icode) || (I_RET) == (id_ex_curr->icode) || (I_RET) == (ex_mem_curr->icode))));
-    word_t estall = 0;
-    word_t ebubble = ((((id_ex_curr->icode) == (I_JMP)) & !(ex_mem_next->takebranch)) | (((id_ex_curr->icode) == (I_MRMOVQ) || (id_ex_curr->icode) == (I_POPQ)) & ((id_ex_curr->destm) == (id_ex_next->srca) || (id_ex_curr->destm) == (id_ex_next->srcb))));
-    word_t mstall = (dmem_status == IN_FLIGHT) || (dmem_status == ERROR);
-    word_t mbubble = (((mem_wb_next->status) == (STAT_ADR) || (mem_wb_next->status) == (STAT_INS) || (mem_wb_next->status) == (STAT_HLT)) | ((mem_wb_curr->status) == (STAT_ADR) || (mem_wb_curr->status) == (STAT_INS) || (mem_wb_curr->status) == (STAT_HLT)));
-    word_t wstall = ((mem_wb_curr->status) == (STAT_ADR) || (mem_wb_curr->status) == (STAT_INS) || (mem_wb_curr->status) == (STAT_HLT));
-    word_t wbubble = 0;
-    pc_state->op = pipe_cntl("PC", fstall, fbubble);
-    if_id_state->op = pipe_cntl("ID", dstall, dbubble);
-    id_ex_state->op = pipe_cntl("EX", estall, ebubble);
-    ex_mem_state->op = pipe_cntl("MEM", mstall, mbubble);
-    mem_wb_state->op = pipe_cntl("WB", wstall, wbubble);
+    word_t fstall = mwait | ((((sim->id_ex_curr->icode) == (I_MRMOVQ) || (sim->id_ex_curr->icode) == (I_POPQ)) & ((sim->id_ex_curr->destm) == (sim->id_ex_next->srca) || (sim->id_ex_curr->destm) == (sim->id_ex_next->srcb))) | ((I_RET) == (sim->if_id_curr->icode) || (I_RET) == (sim->id_ex_curr->icode) || (I_RET) == (sim->ex_mem_curr->icode)));
+    word_t dstall = mwait | (((sim->id_ex_curr->icode) == (I_MRMOVQ) || (sim->id_ex_curr->icode) == (I_POPQ)) & ((sim->id_ex_curr->destm) == (sim->id_ex_next->srca) || (sim->id_ex_curr->destm) == (sim->id_ex_next->srcb)));
+    word_t dbubble = (!mwait) & ((((sim->id_ex_curr->icode) == (I_JMP)) & !(sim->ex_mem_next->takebranch)) | (!(((sim->id_ex_curr->icode) == (I_MRMOVQ) || (sim->id_ex_curr->icode) == (I_POPQ)) & ((sim->id_ex_curr->destm) == (sim->id_ex_next->srca) || (sim->id_ex_curr->destm) == (sim->id_ex_next->srcb))) & ((I_RET) == (sim->if_id_curr->icode) || (I_RET) == (sim->id_ex_curr->icode) || (I_RET) == (sim->ex_mem_curr->icode))));
+    word_t estall = mwait;
+    word_t ebubble = (!mwait) & ((((sim->id_ex_curr->icode) == (I_JMP)) & !(sim->ex_mem_next->takebranch)) | (((sim->id_ex_curr->icode) == (I_MRMOVQ) || (sim->id_ex_curr->icode) == (I_POPQ)) & ((sim->id_ex_curr->destm) == (sim->id_ex_next->srca) || (sim->id_ex_curr->destm) == (sim->id_ex_next->srcb))));
+    word_t wstall = ((sim->mem_wb_curr->status) == (STAT_ADR) || (sim->mem_wb_curr->status) == (STAT_INS) || (sim->mem_wb_curr->status) == (STAT_HLT));
+    word_t mstall = mwait && !wstall;
+    word_t mbubble = (((sim->mem_wb_next->status) == (STAT_ADR) || (sim->mem_wb_next->status) == (STAT_INS) || (sim->mem_wb_next->status) == (STAT_HLT)) | ((sim->mem_wb_curr->status) == (STAT_ADR) || (sim->mem_wb_curr->status) == (STAT_INS) || (sim->mem_wb_curr->status) == (STAT_HLT)));
+    word_t wbubble = mwait && !wstall;
+    sim->pc_state->op = pipe_cntl(sim, "PC", fstall, fbubble);
+    sim->if_id_state->op = pipe_cntl(sim, "ID", dstall, dbubble);
+    sim->id_ex_state->op = pipe_cntl(sim, "EX", estall, ebubble);
+    sim->ex_mem_state->op = pipe_cntl(sim, "MEM", mstall, mbubble);
+    sim->mem_wb_state->op = pipe_cntl(sim, "WB", wstall, wbubble);
 }
 
 /*
@@ -843,14 +901,14 @@ void do_stall_check()
   if statusp nonnull, then will be set to status of final instruction
   if ccp nonnull, then will be set to condition codes of final instruction
 */
-word_t sim_run_pipe(word_t max_instr, word_t max_cycle, byte_t *statusp, cc_t *ccp)
+word_t sim_run_pipe(sim_t sim, word_t max_instr, word_t max_cycle, byte_t *statusp, cc_t *ccp)
 {
     word_t icount = 0;
     word_t ccount = 0;
     byte_t run_status = STAT_AOK;
     while (icount < max_instr && ccount < max_cycle)
     {
-        run_status = sim_step_pipe(max_instr - icount, ccount);
+        run_status = sim_step_pipe(sim, max_instr - icount, ccount);
         if (run_status != STAT_BUB)
             icount++;
         if (run_status != STAT_AOK && run_status != STAT_BUB)
@@ -860,27 +918,27 @@ word_t sim_run_pipe(word_t max_instr, word_t max_cycle, byte_t *statusp, cc_t *c
     if (statusp)
         *statusp = run_status;
     if (ccp)
-        *ccp = cc;
+        *ccp = sim->cc;
     return icount;
 }
 
 /* If dumpfile set nonNULL, lots of status info printed out */
-void sim_set_dumpfile(FILE *df)
+void sim_set_dumpfile(sim_t sim, FILE *df)
 {
-    dumpfile = df;
+    sim->dumpfile = df;
 }
 
 /*
  * sim_log dumps a formatted string to the dumpfile, if it exists
  * accepts variable argument list
  */
-void sim_log(const char *format, ...)
+void sim_log(sim_t sim, const char *format, ...)
 {
-    if (dumpfile)
+    if (sim->dumpfile)
     {
         va_list arg;
         va_start(arg, format);
-        vfprintf(dumpfile, format, arg);
+        vfprintf(sim->dumpfile, format, arg);
         va_end(arg);
     }
 }
@@ -890,60 +948,50 @@ void sim_log(const char *format, ...)
  * Do not change any of these
  *************************************************************/
 
-/******************************************************************************
- *	defines
- ******************************************************************************/
-
-#define MAX_STAGE 10
-
-/******************************************************************************
- *	static variables
- ******************************************************************************/
-
-static pipe_ptr pipes[MAX_STAGE];
-static int pipe_count = 0;
-
 /******************************************************************************
  *	function definitions
  ******************************************************************************/
 
 /* Create new pipe with count bytes of state */
 /* bubble_val indicates state corresponding to pipeline bubble */
-pipe_ptr new_pipe(int count, void *bubble_val)
+pipe_ptr new_pipe(pipeline_ptr pl, int count, void *bubble_val)
 {
     pipe_ptr result = (pipe_ptr)malloc(sizeof(pipe_ele));
-    result->current = malloc(count);
-    result->next = malloc(count);
-    memcpy(result->current, bubble_val, count);
-    memcpy(result->next, bubble_val, count);
+    result->buf[0] = malloc(count);
+    result->buf[1] = malloc(count);
+    result->bubble = malloc(count);
+    memcpy(result->bubble, bubble_val, count);
     result->count = count;
-    result->op = P_LOAD;
-    result->bubble_val = bubble_val;
-    pipes[pipe_count++] = result;
+    pl->pipes[pl->count++] = result;
+    clear_pipe(result);
     return result;
 }
 
 /* Update all pipes */
-void update_pipes()
+void update_pipes(pipeline_ptr pl)
 {
     int s;
-    for (s = 0; s < pipe_count; s++)
+    for (s = 0; s < pl->count; s++)
     {
-        pipe_ptr p = pipes[s];
+        pipe_ptr p = pl->pipes[s];
         switch (p->op)
         {
         case P_BUBBLE:
             /* insert a bubble into the next stage */
-            memcpy(p->current, p->bubble_val, p->count);
+            p->current = p->bubble;
             break;
 
         case P_LOAD:
-            /* copy calculated state from previous stage */
-            memcpy(p->current, p->next, p->count);
+            /* calculated state from previous stage becomes current,
+               and the other buffer is free for the next cycle */
+            p->current = p->next;
+            p->next = p->next == p->buf[0] ? p->buf[1] : p->buf[0];
             break;
         case P_ERROR:
-            /* Like a bubble, but insert error condition */
-            memcpy(p->current, p->bubble_val, p->count);
+            /* Like a bubble, but insert error condition, so current
+               must be a copy the caller can change */
+            p->current = p->next == p->buf[0] ? p->buf[1] : p->buf[0];
+            memcpy(p->current, p->bubble, p->count);
             break;
         case P_STALL:
         default:
@@ -955,17 +1003,36 @@ void update_pipes()
     }
 }
 
+/* Set pipe to bubble value */
+void clear_pipe(pipe_ptr p)
+{
+    p->current = p->bubble;
+    p->next = p->buf[0];
+    memcpy(p->next, p->bubble, p->count);
+    p->op = P_LOAD;
+}
+
 /* Set all pipes to bubble values */
-void clear_pipes()
+void clear_pipes(pipeline_ptr pl)
+{
+    int s;
+    for (s = 0; s < pl->count; s++)
+        clear_pipe(pl->pipes[s]);
+}
+
+/* Free all pipes */
+void free_pipes(pipeline_ptr pl)
 {
     int s;
-    for (s = 0; s < pipe_count; s++)
+    for (s = 0; s < pl->count; s++)
     {
-        pipe_ptr p = pipes[s];
-        memcpy(p->current, p->bubble_val, p->count);
-        memcpy(p->next, p->bubble_val, p->count);
-        p->op = P_LOAD;
+        pipe_ptr p = pl->pipes[s];
+        free(p->buf[0]);
+        free(p->buf[1]);
+        free(p->bubble);
+        free(p);
     }
+    pl->count = 0;
 }
 
 /*************** Bubbled version of stages *************/
@@ -18,7 +18,7 @@
  ******************************************************************************/
 
 /* Different control operations for pipeline register */
-/* LOAD:   Copy next state to current   */
+/* LOAD:   Next state becomes current   */
 /* STALL:  Keep current state unchanged */
 /* BUBBLE: Set current state to nop     */
 /* ERROR:  Occurs when both stall & load signals set */
@@ -26,30 +26,49 @@
 typedef enum { P_LOAD, P_STALL, P_BUBBLE, P_ERROR } p_stat_t;
 
 typedef struct {
-    /* Current and next register state */
+    /* Current and next register state.  next is always one of buf, and
+       current is the other one or bubble.  Loading swaps the roles of
+       the buffers rather than copying, so stages must reread current
+       and next after each update, and must write every field of next */
     void *current;
     void *next;
-    /* Contents of register when bubble occurs */
-    void *bubble_val;
+    void *buf[2];
+    /* Contents of register when bubble occurs, written once */
+    void *bubble;
     /* Number of state bytes */
     int count;
     /* How should state be updated next time? */
     p_stat_t op;
 } pipe_ele, *pipe_ptr;
 
+/* Most pipe registers in one pipeline */
+#define MAX_STAGE 10
+
+/* All pipe registers of one pipeline */
+typedef struct {
+    pipe_ptr pipes[MAX_STAGE];
+    int count;
+} pipeline_ele, *pipeline_ptr;
+
 /******************************************************************************
  *	function declarations
  ******************************************************************************/
 
-/* Create new pipe with count bytes of state */
+/* Create new pipe with count bytes of state and add it to pipeline */
 /* bubble_val indicates state corresponding to pipeline bubble */
-pipe_ptr new_pipe(int count, void *bubble_val);
+pipe_ptr new_pipe(pipeline_ptr pl, int count, void *bubble_val);
 
 /* Update all pipes */
-void update_pipes();
+void update_pipes(pipeline_ptr pl);
+
+/* Set pipe to bubble value */
+void clear_pipe(pipe_ptr p);
 
 /* Set all pipes to bubble values */
-void clear_pipes();
+void clear_pipes(pipeline_ptr pl);
+
+/* Free all pipes */
+void free_pipes(pipeline_ptr pl);
 
 /* Utility code */
 
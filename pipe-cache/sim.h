@@ -11,6 +11,24 @@ typedef enum { S_WEDGED, S_STALL, S_FORWARD } sim_mode_t;
 /* Pipeline stage identifiers for stage operation control */
 typedef enum { IF_STAGE, ID_STAGE, EX_STAGE, MEM_STAGE, WB_STAGE } stage_id_t;
 
+/* Causes of cycles in which the pipeline retires no instruction */
+typedef enum {
+    STALL_NONE = -1,
+    STALL_LOAD_USE,    /* Load/use hazard */
+    STALL_MISPREDICT,  /* Mispredicted conditional jump */
+    STALL_RET,         /* Waiting for return address */
+    STALL_DCACHE,      /* Data cache miss */
+    STALL_DRAIN,       /* Draining after an exception */
+    STALL_NCAUSES
+} stall_t;
+
+/* Why a pipe register holds a bubble, and the instruction that caused
+   it */
+typedef struct {
+    int cause;
+    word_t pc;
+} blame_rec, *blame_ptr;
+
 /********** Defines **************/
 
 /* Get ra out of one byte regid field */
@@ -20,91 +38,108 @@ typedef enum { IF_STAGE, ID_STAGE, EX_STAGE, MEM_STAGE, WB_STAGE } stage_id_t;
 #define GET_RB(r) LO4(r)
 
 
-/************ Global state declaration ****************/
-
-/* How many cycles have been simulated? */
-extern word_t cycles;
-/* How many instructions have passed through the EX stage? */
-extern word_t instructions;
-
-/* Both instruction and data memory */
-extern mem_t mem;
-
-/* Keep track of range of addresses that have been written */
-extern word_t minAddr;
-extern word_t memCnt;
-
-/* Register file */
-extern mem_t reg;
-/* Condition code register */
-extern cc_t cc;
-extern stat_t stat;
-
-/* Operand sources in EX (to show forwarding) */
-extern mux_source_t amux, bmux;
-
-/* Provide global access to current states of all pipeline registers */
-pipe_ptr pc_state, if_id_state, id_ex_state, ex_mem_state, mem_wb_state;
-
-/* Current States */
-extern pc_ptr pc_curr;
-extern if_id_ptr if_id_curr;
-extern id_ex_ptr id_ex_curr;
-extern ex_mem_ptr ex_mem_curr;
-extern mem_wb_ptr mem_wb_curr;
-
-/* Next States */
-extern pc_ptr pc_next;
-extern if_id_ptr if_id_next;
-extern id_ex_ptr id_ex_next;
-extern ex_mem_ptr ex_mem_next;
-extern mem_wb_ptr mem_wb_next;
-
-/* Pending updates to state */
-extern word_t cc_in;
-extern word_t wb_destE;
-extern word_t wb_valE;
-extern word_t wb_destM;
-extern word_t wb_valM;
-extern word_t mem_addr;
-extern word_t mem_data;
-extern bool_t mem_write;
-
-
-/* Intermdiate stage values that must be used by control functions */
-extern word_t f_pc;
-extern byte_t imem_icode;
-extern byte_t imem_ifun;
-extern bool_t imem_error;
-extern bool_t instr_valid;
-extern word_t d_regvala;
-extern word_t d_regvalb;
-extern word_t e_vala;
-extern word_t e_valb;
-extern bool_t e_bcond;
-extern bool_t dmem_error;
-
-/* Simulator operating mode */
-extern sim_mode_t sim_mode;
-/* Log file */
-extern FILE *dumpfile;
+/************ Simulator state ****************/
+
+/* Everything one simulation changes lives here, so several simulations
+   can run at once in different threads of one process */
+struct sim_rec {
+    /* How many cycles have been simulated? */
+    word_t cycles;
+    /* How many instructions have passed through the WB stage? */
+    word_t instructions;
+    /* Has simulator gotten past initial bubbles? */
+    int starting_up;
+
+    /* Both instruction and data memory, with data cache */
+    mem_t mem;
+    /* Keep track of range of addresses that have been written */
+    word_t minAddr;
+    word_t memCnt;
+
+    /* Register file */
+    regfile_t reg;
+    /* Condition code register */
+    cc_t cc;
+    /* Status code */
+    stat_t status;
+
+    /* Operand sources in EX (to show forwarding) */
+    mux_source_t amux, bmux;
+
+    /* All pipeline registers, and the state of each */
+    pipeline_ele pipeline;
+    pipe_ptr pc_state, if_id_state, id_ex_state, ex_mem_state, mem_wb_state;
+
+    /* Current States */
+    pc_ptr pc_curr;
+    if_id_ptr if_id_curr;
+    id_ex_ptr id_ex_curr;
+    ex_mem_ptr ex_mem_curr;
+    mem_wb_ptr mem_wb_curr;
+
+    /* Next States */
+    pc_ptr pc_next;
+    if_id_ptr if_id_next;
+    id_ex_ptr id_ex_next;
+    ex_mem_ptr ex_mem_next;
+    mem_wb_ptr mem_wb_next;
+
+    /* Pending updates to state */
+    word_t cc_in;
+    word_t wb_destE;
+    word_t wb_valE;
+    word_t wb_destM;
+    word_t wb_valM;
+    word_t mem_addr;
+    word_t mem_data;
+    bool_t mem_write;
+
+    /* Intermdiate stage values that must be used by control functions */
+    word_t f_pc;
+    byte_t imem_icode;
+    byte_t imem_ifun;
+    bool_t imem_error;
+    bool_t instr_valid;
+    word_t d_regvala;
+    word_t d_regvalb;
+    word_t e_vala;
+    word_t e_valb;
+    bool_t e_bcond;
+    bool_t dmem_error;
+    mem_status_t dmem_status;
+
+    /* Cause of the contents of each pipe register, and of the bubbles
+       do_stall_check asked for at the next update */
+    blame_rec blame[WB_STAGE+1];
+    blame_rec new_blame[WB_STAGE+1];
+    /* Cycles in which WB held a bubble, by cause */
+    word_t lost[STALL_NCAUSES];
+
+    /* Simulator operating mode */
+    sim_mode_t sim_mode;
+    /* Log file */
+    FILE *dumpfile;
+};
 
 /*************** Simulation Control Functions ***********/
 
 /* Bubble next execution of specified stage */
-void sim_bubble_stage(stage_id_t stage);
+void sim_bubble_stage(sim_t sim, stage_id_t stage);
 
 /* Stall stage (has effect at next update) */
-void sim_stall_stage(stage_id_t stage);
+void sim_stall_stage(sim_t sim, stage_id_t stage);
 
 /* Sets the simulator name (called from main routine in HCL file) */
 void set_simname(char *name);
 
-/* Initialize simulator */
-void sim_init();
+/* Create simulator with cleared memory, registers and pipeline.  Data
+   cache has 2^s sets of E lines, each holding 2^b bytes */
+sim_t sim_init(int s, int b, int E);
+
+void sim_free(sim_t sim);
 
 /* Reset simulator state, including register, instruction, and data memories */
-void sim_reset();
+void sim_reset(sim_t sim);
 
 /*
   Run pipeline until one of following occurs:
@@ -116,14 +151,25 @@ void sim_reset();
   if statusp nonnull, then will be set to status of final instruction
   if ccp nonnull, then will be set to condition codes of final instruction
 */
-word_t sim_run_pipe(word_t max_instr, word_t max_cycle, byte_t *statusp, cc_t *ccp);
+word_t sim_run_pipe(sim_t sim, word_t max_instr, word_t max_cycle, byte_t *statusp, cc_t *ccp);
 
 /* If dumpfile set nonNULL, lots of status info printed out */
-void sim_set_dumpfile(FILE *file);
+void sim_set_dumpfile(sim_t sim, FILE *file);
 
 /*
  * sim_log dumps a formatted string to the dumpfile, if it exists
  * accepts variable argument list
  */
-void sim_log( const char *format, ... );
+void sim_log(sim_t sim, const char *format, ... );
+
+/* Logging is tested before any arguments are evaluated, so quiet runs
+   pay one branch per call.  Building with -DNO_SIM_LOG removes it */
+#ifdef NO_SIM_LOG
+#define sim_logging(sim) 0
+#else
+#define sim_logging(sim) ((sim)->dumpfile != NULL)
+#endif
+
+#define SIM_LOG(sim, ...) \
+    do { if (sim_logging(sim)) sim_log(sim, __VA_ARGS__); } while (0)
 
@@ -78,14 +78,17 @@ extern mem_wb_ele bubble_mem_wb;
 
 /************ Function declarations *******************/
 
+/* Simulator state, defined in sim.h */
+typedef struct sim_rec sim_rec, *sim_t;
+
 /* Stage functions */
-void do_if_stage();
-void do_id_stage();  /* Both ID and WB */
-void do_ex_stage();
-void do_mem_stage();
-void do_wb_stage();  /* Both ID and WB */
+void do_if_stage(sim_t sim);
+void do_id_stage(sim_t sim);  /* Both ID and WB */
+void do_ex_stage(sim_t sim);
+void do_mem_stage(sim_t sim);
+void do_wb_stage(sim_t sim);  /* Both ID and WB */
 
 /* Set stalling conditions for different stages */
-void do_stall_check();
+void do_stall_check(sim_t sim);
 
 
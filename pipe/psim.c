@@ -10,11 +10,23 @@
 #include <stdarg.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "isa.h"
 #include "pipeline.h"
 #include "stages.h"
+#include "prof.h"
 #include "sim.h"
+#include "batch.h"
+#include "trace.h"
+#include "spsc.h"
+#include "asm.h"
+#include "evlog.h"
+#include "pipetrace.h"
+#include "bpred.h"
 
 #define MAXBUF 1024
 #define DEFAULTNAME "Y86-64 Simulator: "
@@ -37,6 +49,18 @@ FILE *object_file;          /* Input file handle */
 bool_t verbosity = 2;       /* Verbosity level [TTY only] (-v) */
 word_t instr_limit = 10000; /* Instruction limit [TTY only] (-l) */
 bool_t do_check = FALSE;    /* Test with ISA simulator? [TTY only] (-t) */
+bool_t do_batch = FALSE;    /* Run many files at once? (-b) */
+bool_t do_cpi_stack = FALSE; /* Report cycles lost by cause? [TTY only] (-C) */
+bool_t do_ckpt_check = FALSE; /* Replay from a checkpoint? [TTY only] (-k) */
+int batch_threads = 0;      /* Threads for batch mode (-T) */
+FILE *prof_file = NULL;     /* Profile listing [TTY only] (-P) */
+FILE *folded_file = NULL;   /* Folded call stacks [TTY only] (-F) */
+FILE *event_file = NULL;    /* Binary log of last events [TTY only] (-E) */
+FILE *ptrace_file = NULL;   /* Pipeline trace [TTY only] (-x) */
+char *bpred_spec = NULL;    /* Branch predictor (-B) */
+
+/* Events kept for -E */
+#define EVLOG_EVENTS 65536
 
 /************* 
  * End Globals 
@@ -46,9 +70,11 @@ bool_t do_check = FALSE;    /* Test with ISA simulator? [TTY only] (-t) */
  * Begin function prototypes 
  ***************************/
 
-word_t sim_run_pipe(word_t max_instr, word_t max_cycle, byte_t *statusp, cc_t *ccp);
+word_t sim_run_pipe(sim_t sim, word_t max_instr, word_t max_cycle, byte_t *statusp, cc_t *ccp);
 static void usage(char *name); /* Print helpful usage message */
 static void run_tty_sim();     /* Run simulator in TTY mode */
+static bool_t checkpoint_check(sim_t sim); /* Replay run from checkpoint (-k) */
+static void run_batch_sim(int nnames, char *names[]); /* Run batch (-b) */
 
 /*************************
  * End function prototypes
@@ -72,7 +98,7 @@ int sim_main(int argc, char **argv)
     int c;
 
     /* Parse the command line arguments */
-    while ((c = getopt(argc, argv, "htl:v:")) != -1)
+    while ((c = getopt(argc, argv, "hbtCkl:v:T:P:F:E:x:B:")) != -1)
     {
         switch (c)
         {
@@ -93,6 +119,62 @@ int sim_main(int argc, char **argv)
         case 't':
             do_check = TRUE;
             break;
+        case 'b':
+            do_batch = TRUE;
+            break;
+        case 'C':
+            do_cpi_stack = TRUE;
+            break;
+        case 'k':
+            do_ckpt_check = TRUE;
+            break;
+        case 'T':
+            batch_threads = atoi(optarg);
+            break;
+        case 'P':
+            prof_file = fopen(optarg, "w");
+            if (!prof_file)
+            {
+                fprintf(stderr, "Couldn't open profile file %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'F':
+            folded_file = fopen(optarg, "w");
+            if (!folded_file)
+            {
+                fprintf(stderr, "Couldn't open profile file %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'E':
+            event_file = fopen(optarg, "wb");
+            if (!event_file)
+            {
+                fprintf(stderr, "Couldn't open event file %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'x':
+            ptrace_file = fopen(optarg, "wb");
+            if (!ptrace_file)
+            {
+                fprintf(stderr, "Couldn't open trace file %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'B':
+        {
+            bpred_t bp = new_bpred(optarg);
+            if (!bp)
+            {
+                printf("Invalid branch predictor '%s'\n", optarg);
+                usage(argv[0]);
+            }
+            free_bpred(bp);
+            bpred_spec = optarg;
+            break;
+        }
         default:
             printf("Invalid option '%c'\n", c);
             usage(argv[0]);
@@ -100,6 +182,12 @@ int sim_main(int argc, char **argv)
         }
     }
 
+    if (do_batch)
+    {
+        run_batch_sim(argc - optind, argv + optind);
+        exit(0);
+    }
+
     /* Do we have too many arguments? */
     if (optind < argc - 1)
     {
@@ -132,6 +220,160 @@ int sim_main(int argc, char **argv)
 
 int main(int argc, char *argv[]) { return sim_main(argc, argv); }
 
+/*******************************************************************
+ * ISA checking (-t).  The ISA simulator runs on its own thread.  WB
+ * passes it each instruction as it retires, through a lock-free
+ * queue, and it stops both simulators at the first instruction whose
+ * results differ.
+ *******************************************************************/
+
+/* Retired instructions the checker may fall behind by */
+#define CHECK_QUEUE 4096
+
+typedef struct check_rec {
+    state_ptr isa;
+    spsc_t queue;
+    atomic_int failed;     /* Set at first divergence */
+    regfile_t reg;         /* Registers as written by WB */
+    cc_t cc;               /* Condition codes as set by EX */
+    word_t count;          /* Instructions that matched */
+    stat_t status;         /* Status of last ISA step */
+    retire_rec pipe_r;     /* First mismatching instruction, */
+    retire_rec isa_r;      /*   as run by each simulator */
+    FILE *errors;          /* ISA error messages, printed at end */
+    char *error_buf;
+    size_t error_len;
+    pthread_t thread;
+} check_rec, *check_t;
+
+/* Called by WB for each retired instruction */
+static void check_put(check_t c, mem_wb_ptr wb)
+{
+    retire_rec r;
+    r.pc = wb->stage_pc;
+    r.len = 0;
+    r.status = wb->status;
+    r.nregs = 0;
+    if (wb->deste != REG_NONE)
+    {
+        r.reg_id[r.nregs] = (reg_id_t)wb->deste;
+        r.reg_val[r.nregs++] = wb->vale;
+    }
+    if (wb->destm != REG_NONE)
+    {
+        r.reg_id[r.nregs] = (reg_id_t)wb->destm;
+        r.reg_val[r.nregs++] = wb->valm;
+    }
+    r.mem_write = wb->mem_write;
+    r.mem_addr = wb->mem_addr;
+    r.mem_val = wb->mem_data;
+    r.cc_changed = wb->icode == I_ALU;
+    r.cc = r.cc_changed ? lazy_cc_get(&wb->cc) : 0;
+    while (!spsc_put(c->queue, &r))
+    {
+        if (atomic_load_explicit(&c->failed, memory_order_relaxed))
+            return;
+        sched_yield();
+    }
+}
+
+static bool_t check_failed(check_t c)
+{
+    return atomic_load_explicit(&c->failed, memory_order_acquire);
+}
+
+/* Does ISA step r match pipeline instruction p?  Registers and
+   condition codes are compared in full, since the pipeline reports
+   what it wrote and the ISA simulator reports what changed */
+static bool_t check_match(check_t c, retire_ptr p, retire_ptr r)
+{
+    if (p->pc != r->pc || p->status != r->status)
+        return FALSE;
+    if (p->mem_write != r->mem_write ||
+        (p->mem_write && (p->mem_addr != r->mem_addr ||
+                          p->mem_val != r->mem_val)))
+        return FALSE;
+    if (c->cc != r->cc)
+        return FALSE;
+    return !diff_reg(c->isa->r, c->reg, NULL);
+}
+
+static void *check_thread(void *arg)
+{
+    check_t c = (check_t)arg;
+    retire_rec p, r;
+    int i;
+
+    for (;;)
+    {
+        if (!spsc_get(c->queue, &p))
+        {
+            if (spsc_done(c->queue))
+                break;
+            sched_yield();
+            continue;
+        }
+        c->status = step_retire(c->isa, &r, c->errors);
+        for (i = 0; i < p.nregs; i++)
+            set_reg_val(c->reg, p.reg_id[i], p.reg_val[i]);
+        if (p.cc_changed)
+            c->cc = p.cc;
+        if (!check_match(c, &p, &r))
+        {
+            if (p.pc == r.pc)
+            {
+                p.len = r.len;
+                memcpy(p.instr, r.instr, r.len);
+            }
+            /* Show condition codes only if they changed, as for ISA */
+            p.cc_changed = p.cc_changed && p.cc != r.cc_old;
+            c->pipe_r = p;
+            c->isa_r = r;
+            atomic_store_explicit(&c->failed, 1, memory_order_release);
+            break;
+        }
+        c->count++;
+    }
+    return NULL;
+}
+
+/* Start checking sim against isa, which must hold the same state */
+static check_t check_start(sim_t sim, state_ptr isa)
+{
+    check_t c = (check_t)malloc(sizeof(check_rec));
+    c->isa = isa;
+    c->queue = new_spsc(sizeof(retire_rec), CHECK_QUEUE);
+    atomic_init(&c->failed, 0);
+    c->reg = copy_reg(sim->reg);
+    c->cc = lazy_cc_get(&sim->cc);
+    c->count = 0;
+    c->status = STAT_AOK;
+    c->error_buf = NULL;
+    c->errors = open_memstream(&c->error_buf, &c->error_len);
+    sim->check = c;
+    pthread_create(&c->thread, NULL, check_thread, (void *)c);
+    return c;
+}
+
+/* Wait for checker to reach end of pipeline run */
+static void check_finish(sim_t sim)
+{
+    check_t c = sim->check;
+    spsc_close(c->queue);
+    pthread_join(c->thread, NULL);
+    sim->check = NULL;
+    fclose(c->errors);
+    fputs(c->error_buf, stdout);
+}
+
+static void check_free(check_t c)
+{
+    free_spsc(c->queue);
+    free_reg(c->reg);
+    free((void *)c->error_buf);
+    free((void *)c);
+}
+
 /* 
  * run_tty_sim - Run the simulator in TTY mode
  */
@@ -141,8 +383,14 @@ static void run_tty_sim()
     byte_t run_status = STAT_AOK;
     cc_t result_cc = 0;
     word_t byte_cnt = 0;
-    mem_t mem0, reg0;
+    mem_t mem0;
+    regfile_t reg0;
     state_ptr isa_state = NULL;
+    check_t check = NULL;
+    bool_t ckpt_match = TRUE;
+    image_rec img;
+    prof_t prof = NULL;
+    sim_t sim;
 
     /* In TTY mode, the default object file comes from stdin */
     if (!object_file)
@@ -150,15 +398,15 @@ static void run_tty_sim()
         object_file = stdin;
     }
 
+    sim = sim_init();
     if (verbosity >= 2)
-        sim_set_dumpfile(stdout);
-    sim_init();
+        sim_set_dumpfile(sim, stdout);
 
     /* Emit simulator name */
     if (verbosity >= 2)
         printf("%s\n", simname);
 
-    byte_cnt = load_mem(mem, object_file, 1);
+    byte_cnt = load_program(sim->mem, object_file, object_filename, &img, 1);
     if (byte_cnt == 0)
     {
         fprintf(stderr, "No lines of code found\n");
@@ -169,66 +417,106 @@ static void run_tty_sim()
         printf("%lld bytes of code read\n", byte_cnt);
     }
     fclose(object_file);
+    if (bpred_spec)
+        sim->bpred = new_bpred(bpred_spec);
+    /* Before anything is attached to watch the run */
+    if (do_ckpt_check)
+        ckpt_match = checkpoint_check(sim);
     if (do_check)
     {
+        /* The ISA simulator runs on another thread, so it must not
+           share memory pages with the pipeline */
         isa_state = new_state(0);
-        free_mem(isa_state->r);
+        free_reg(isa_state->r);
         free_mem(isa_state->m);
-        isa_state->m = copy_mem(mem);
-        isa_state->r = copy_mem(reg);
-        isa_state->cc = cc;
+        isa_state->m = clone_mem(sim->mem);
+        isa_state->r = copy_reg(sim->reg);
+        isa_state->cc = sim->cc;
+        check = check_start(sim, isa_state);
+    }
+
+    if (prof_file || folded_file || do_cpi_stack)
+    {
+        /* Symbols name the functions */
+        prof = new_prof(&img);
+        sim->prof = prof;
     }
+    if (event_file)
+        sim->events = new_evlog(EVLOG_EVENTS);
+    if (ptrace_file)
+        sim->ptrace = new_pipetrace(ptrace_file);
 
-    mem0 = copy_mem(mem);
-    reg0 = copy_mem(reg);
+    mem0 = copy_mem(sim->mem);
+    reg0 = copy_reg(sim->reg);
 
-    icount = sim_run_pipe(instr_limit, 5 * instr_limit, &run_status, &result_cc);
+    icount = sim_run_pipe(sim, instr_limit, 5 * instr_limit, &run_status, &result_cc);
+    if (check)
+        check_finish(sim);
     if (verbosity > 0)
     {
         printf("%lld instructions executed\n", icount);
         printf("Status = %s\n", stat_name(run_status));
         printf("Condition Codes: %s\n", cc_name(result_cc));
         printf("Changed Register State:\n");
-        diff_reg(reg0, reg, stdout);
+        diff_reg(reg0, sim->reg, stdout);
         printf("Changed Memory State:\n");
-        diff_mem(mem0, mem, stdout);
+        diff_mem(mem0, sim->mem, stdout);
     }
-    if (do_check)
+    if (check && check_failed(check))
     {
-        byte_t e = STAT_AOK;
+        /* Always name the instruction, since tests run quietly */
+        printf("ISA divergence at instruction %lld\n", check->count + 1);
+        printf("Pipeline: ");
+        print_retire(stdout, &check->pipe_r);
+        printf("ISA:      ");
+        print_retire(stdout, &check->isa_r);
+        if (verbosity > 0)
+        {
+            if (diff_reg(isa_state->r, check->reg, NULL))
+            {
+                printf("ISA Register != Pipeline Register File\n");
+                diff_reg(isa_state->r, check->reg, stdout);
+            }
+        }
+        printf("ISA Check Fails\n");
+    }
+    else if (check)
+    {
+        byte_t e = check->status;
         word_t step;
         bool_t match = TRUE;
 
-        for (step = 0; step < instr_limit && e == STAT_AOK; step++)
+        /* Finish run if pipeline stopped early */
+        for (step = check->count; step < instr_limit && e == STAT_AOK; step++)
         {
             e = step_state(isa_state, stdout);
         }
 
-        if (diff_reg(isa_state->r, reg, NULL))
+        if (diff_reg(isa_state->r, sim->reg, NULL))
         {
             match = FALSE;
             if (verbosity > 0)
             {
                 printf("ISA Register != Pipeline Register File\n");
-                diff_reg(isa_state->r, reg, stdout);
+                diff_reg(isa_state->r, sim->reg, stdout);
             }
         }
-        if (diff_mem(isa_state->m, mem, NULL))
+        if (diff_mem(isa_state->m, sim->mem, NULL))
         {
             match = FALSE;
             if (verbosity > 0)
             {
                 printf("ISA Memory != Pipeline Memory\n");
-                diff_mem(isa_state->m, mem, stdout);
+                diff_mem(isa_state->m, sim->mem, stdout);
             }
         }
-        if (isa_state->cc != result_cc)
+        if (lazy_cc_get(&isa_state->cc) != result_cc)
         {
             match = FALSE;
             if (verbosity > 0)
             {
                 printf("ISA Cond. Codes (%s) != Pipeline Cond. Codes (%s)\n",
-                       cc_name(isa_state->cc), cc_name(result_cc));
+                       cc_name(lazy_cc_get(&isa_state->cc)), cc_name(result_cc));
             }
         }
         if (match)
@@ -240,25 +528,205 @@ static void run_tty_sim()
             printf("ISA Check Fails\n");
         }
     }
+    if (check)
+        check_free(check);
+    if (do_ckpt_check)
+    {
+        if (ckpt_match)
+        {
+            printf("Checkpoint Check Succeeds\n");
+        }
+        else
+        {
+            printf("Checkpoint Check Fails\n");
+        }
+    }
+    if (sim->ptrace)
+    {
+        free_pipetrace(sim->ptrace);
+        fclose(ptrace_file);
+        sim->ptrace = NULL;
+    }
+    if (sim->events)
+    {
+        evlog_write(sim->events, event_file);
+        fclose(event_file);
+        free_evlog(sim->events);
+        sim->events = NULL;
+    }
 
     /* Emit CPI statistics */
     {
-        double cpi = instructions > 0 ? (double)cycles / instructions : 1.0;
+        double cpi = sim->instructions > 0 ? (double)sim->cycles / sim->instructions : 1.0;
         printf("CPI: %lld cycles/%lld instructions = %.2f\n",
-               cycles, instructions, cpi);
+               sim->cycles, sim->instructions, cpi);
+        if (do_cpi_stack && sim->instructions > 0)
+        {
+            int c;
+            printf("  %-10s %.2f\n", "Base", 1.0);
+            for (c = 0; c < STALL_NCAUSES; c++)
+                printf("  %-10s %.2f  (%lld cycles)\n", stall_name(c),
+                       (double)sim->lost[c] / sim->instructions, sim->lost[c]);
+        }
+    }
+    /* Then the same lost cycles by instruction address */
+    if (prof)
+    {
+        if (prof_file)
+        {
+            prof_listing(prof, mem0, prof_file);
+            fclose(prof_file);
+        }
+        if (folded_file)
+        {
+            prof_folded(prof, folded_file);
+            fclose(folded_file);
+        }
+        if (do_cpi_stack)
+        {
+            printf("Lost cycles by instruction:\n");
+            prof_cpi_stack(prof, mem0, stdout);
+        }
+        sim->prof = NULL;
+        free_prof(prof);
+    }
+    free_image(&img);
+    if (sim->bpred)
+    {
+        bpred_report(sim->bpred, stdout);
+        printf("Mispredictions cost %lld cycles, CPI %.2f\n",
+               sim->lost[STALL_MISPREDICT], sim->instructions > 0 ?
+               (double)sim->lost[STALL_MISPREDICT] / sim->instructions : 0.0);
+        free_bpred(sim->bpred);
+        sim->bpred = NULL;
     }
 }
 
+/*
+ * checkpoint_check - Run the program straight through, then run to
+ * halfway, checkpoint, finish, restore the checkpoint and finish
+ * again.  Return whether both finishes match the straight run.  The
+ * simulator is left as it started
+ */
+static bool_t checkpoint_check(sim_t sim)
+{
+    sim_checkpoint_t start = sim_save_checkpoint(sim);
+    sim_checkpoint_t cp;
+    FILE *dumpfile = sim->dumpfile;
+    byte_t status0, status;
+    cc_t cc0, cc;
+    mem_t mem0;
+    regfile_t reg0;
+    word_t cycles0, instructions0, f_seq0, mispredicts0;
+    word_t lost0[STALL_NCAUSES];
+    word_t half, icount;
+    bool_t match = TRUE;
+    int pass;
+
+    sim->dumpfile = NULL;
+    sim_run_pipe(sim, instr_limit, 5 * instr_limit, &status0, &cc0);
+    mem0 = copy_mem(sim->mem);
+    reg0 = copy_reg(sim->reg);
+    cycles0 = sim->cycles;
+    instructions0 = sim->instructions;
+    f_seq0 = sim->f_seq;
+    mispredicts0 = sim->bpred ? bpred_mispredicts(sim->bpred) : 0;
+    memcpy(lost0, sim->lost, sizeof(lost0));
+
+    sim_restore_checkpoint(sim, start);
+    half = cycles0 / 2;
+    icount = sim_run_pipe(sim, instr_limit, half, &status, &cc);
+    cp = sim_save_checkpoint(sim);
+    for (pass = 0; pass < 2; pass++)
+    {
+        if (pass > 0)
+            sim_restore_checkpoint(sim, cp);
+        sim_run_pipe(sim, instr_limit - icount, 5 * instr_limit - half,
+                     &status, &cc);
+        if (status != status0 || cc != cc0 ||
+            sim->cycles != cycles0 || sim->instructions != instructions0 ||
+            sim->f_seq != f_seq0 ||
+            memcmp(sim->lost, lost0, sizeof(lost0)) != 0 ||
+            (sim->bpred && bpred_mispredicts(sim->bpred) != mispredicts0) ||
+            diff_reg(reg0, sim->reg, NULL) || diff_mem(mem0, sim->mem, NULL))
+            match = FALSE;
+    }
+
+    sim_restore_checkpoint(sim, start);
+    sim->dumpfile = dumpfile;
+    sim_free_checkpoint(start);
+    sim_free_checkpoint(cp);
+    free_mem(mem0);
+    free_reg(reg0);
+    return match;
+}
+
+/* Simulate one program of a batch */
+static void run_batch_job(batch_job_t job, void *arg)
+{
+    sim_t sim = sim_init();
+    FILE *file = fopen(job->name, "r");
+    byte_t run_status = STAT_AOK;
+
+    if (bpred_spec)
+        sim->bpred = new_bpred(bpred_spec);
+
+    job->loaded = file && load_program(sim->mem, file, job->name, NULL, 0) > 0;
+    if (file)
+        fclose(file);
+    if (job->loaded)
+    {
+        sim_run_pipe(sim, instr_limit, 5 * instr_limit, &run_status, NULL);
+        job->status = (stat_t)run_status;
+        job->instructions = sim->instructions;
+        job->cycles = sim->cycles;
+    }
+    if (sim->bpred)
+        free_bpred(sim->bpred);
+    sim_free(sim);
+}
+
+/*
+ * run_batch_sim - Run each named file, or each object file in named
+ * directories, on a pool of threads and print table of results
+ */
+static void run_batch_sim(int nnames, char *names[])
+{
+    batch_job_t jobs;
+    int njobs = batch_collect(nnames, names, &jobs);
+    struct timespec start, finish;
+
+    if (batch_threads <= 0)
+        batch_threads = batch_default_threads();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    batch_run(jobs, njobs, batch_threads, run_batch_job, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    batch_report(stdout, jobs, njobs, (finish.tv_sec - start.tv_sec) +
+                 (finish.tv_nsec - start.tv_nsec) / 1e9);
+    batch_free(jobs, njobs);
+}
+
 /*
  * usage - print helpful diagnostic information
  */
 static void usage(char *name)
 {
-    printf("Usage: %s [-htg] [-l m] [-v n] file.yo\n", name);
+    printf("Usage: %s [-htgCk] [-l m] [-v n] [-P f] [-F f] [-E f] [-x f] [-B p] file.yo|file.ys\n", name);
+    printf("       %s -b [-T n] [-l m] [-B p] file|dir ...\n", name);
     printf("   -h     Print this message\n");
     printf("   -l m   Set instruction limit to m [TTY mode only] (default %lld)\n", instr_limit);
     printf("   -v n   Set verbosity level to 0 <= n <= 2 [TTY mode only] (default %d)\n", verbosity);
     printf("   -t     Test result against ISA simulator [TTY mode only]\n");
+    printf("   -k     Check that a run replayed from a checkpoint matches [TTY mode only]\n");
+    printf("   -C     Report cycles lost to each kind of stall, per run and per instruction [TTY mode only]\n");
+    printf("   -P f   Write profile to f: count and cycles per instruction [TTY mode only]\n");
+    printf("   -F f   Write call stacks to f in folded format, for flame graphs [TTY mode only]\n");
+    printf("   -E f   Write last %d events to f in binary, for yevlog [TTY mode only]\n", EVLOG_EVENTS);
+    printf("   -x f   Write cycles of each instruction in each stage to f, for ypipetrace [TTY mode only]\n");
+    printf("   -B p   Predict jumps with p[:bits]: taken (default), btfn, bimodal, gshare or\n");
+    printf("          tournament, with 2^bits table entries (default %d)\n", BPRED_BITS);
+    printf("   -b     Batch: run many files, or all in directories, on all cores\n");
+    printf("   -T n   Number of threads for batch mode (default one per CPU)\n");
     exit(0);
 }
 
@@ -267,222 +735,274 @@ static void usage(char *name)
  * You only need to modify function sim_step_pipe()
  *********************************************************/
 
-/*****************
- *  Part 2 Globals
- *****************/
-
-/* Performance monitoring */
-/* How many cycles have been simulated? */
-word_t cycles = 0;
-/* How many instructions have passed through the WB stage? */
-word_t instructions = 0;
-
-/* Has simulator gotten past initial bubbles? */
-static int starting_up = 1;
-
-/* Both instruction and data memory */
-mem_t mem;
-word_t minAddr = 0;
-word_t memCnt = 0;
-
-/* Register file */
-mem_t reg;
-/* Condition code register */
-cc_t cc;
-/* Status code */
-stat_t status;
-
-/* Pending updates to state */
-word_t cc_in = DEFAULT_CC;
-word_t wb_destE = REG_NONE;
-word_t wb_valE = 0;
-word_t wb_destM = REG_NONE;
-word_t wb_valM = 0;
-word_t mem_addr = 0;
-word_t mem_data = 0;
-bool_t mem_write = FALSE;
-
-/* EX Operand sources */
-mux_source_t amux = MUX_NONE;
-mux_source_t bmux = MUX_NONE;
-
-/* Current and next states of all pipeline registers */
-pc_ptr pc_curr;
-if_id_ptr if_id_curr;
-id_ex_ptr id_ex_curr;
-ex_mem_ptr ex_mem_curr;
-mem_wb_ptr mem_wb_curr;
-
-pc_ptr pc_next;
-if_id_ptr if_id_next;
-id_ex_ptr id_ex_next;
-ex_mem_ptr ex_mem_next;
-mem_wb_ptr mem_wb_next;
-
-/* Intermediate values */
-word_t f_pc;
-byte_t imem_icode;
-byte_t imem_ifun;
-bool_t imem_error;
-bool_t instr_valid;
-word_t d_regvala;
-word_t d_regvalb;
-word_t e_vala;
-word_t e_valb;
-bool_t e_bcond;
-bool_t dmem_error;
-
-/* The pipeline state */
-pipe_ptr pc_state, if_id_state, id_ex_state, ex_mem_state, mem_wb_state;
-
-/* Simulator operating mode */
-sim_mode_t sim_mode = S_FORWARD;
-/* Log file */
-FILE *dumpfile = NULL;
-
 /*****************************************************************************
  * pipeline control
  * These functions can be used to handle hazards
  *****************************************************************************/
 
 /* bubble stage (has effect at next update) */
-void sim_bubble_stage(stage_id_t stage)
+void sim_bubble_stage(sim_t sim, stage_id_t stage)
 {
     switch (stage)
     {
     case IF_STAGE:
-        pc_state->op = P_BUBBLE;
+        sim->pc_state->op = P_BUBBLE;
         break;
     case ID_STAGE:
-        if_id_state->op = P_BUBBLE;
+        sim->if_id_state->op = P_BUBBLE;
         break;
     case EX_STAGE:
-        id_ex_state->op = P_BUBBLE;
+        sim->id_ex_state->op = P_BUBBLE;
         break;
     case MEM_STAGE:
-        ex_mem_state->op = P_BUBBLE;
+        sim->ex_mem_state->op = P_BUBBLE;
         break;
     case WB_STAGE:
-        mem_wb_state->op = P_BUBBLE;
+        sim->mem_wb_state->op = P_BUBBLE;
         break;
     }
 }
 
 /* stall stage (has effect at next update) */
-void sim_stall_stage(stage_id_t stage)
+void sim_stall_stage(sim_t sim, stage_id_t stage)
 {
     switch (stage)
     {
     case IF_STAGE:
-        pc_state->op = P_STALL;
+        sim->pc_state->op = P_STALL;
         break;
     case ID_STAGE:
-        if_id_state->op = P_STALL;
+        sim->if_id_state->op = P_STALL;
         break;
     case EX_STAGE:
-        id_ex_state->op = P_STALL;
+        sim->id_ex_state->op = P_STALL;
         break;
     case MEM_STAGE:
-        ex_mem_state->op = P_STALL;
+        sim->ex_mem_state->op = P_STALL;
         break;
     case WB_STAGE:
-        mem_wb_state->op = P_STALL;
+        sim->mem_wb_state->op = P_STALL;
         break;
     }
 }
 
-static int initialized = 0;
-
-void sim_init()
+/* Connect pipe registers to the pipeline stages.  Needed whenever
+   the pipes are updated, since that swaps their buffers */
+static void connect_pipes(sim_t sim)
 {
-    /* Create memory and register files */
-    initialized = 1;
-    mem = init_mem(MEM_SIZE);
-    reg = init_reg();
+    sim->pc_next = sim->pc_state->next;
+    sim->pc_curr = sim->pc_state->current;
 
-    /* create 5 pipe registers */
-    pc_state = new_pipe(sizeof(pc_ele), (void *)&bubble_pc);
-    if_id_state = new_pipe(sizeof(if_id_ele), (void *)&bubble_if_id);
-    id_ex_state = new_pipe(sizeof(id_ex_ele), (void *)&bubble_id_ex);
-    ex_mem_state = new_pipe(sizeof(ex_mem_ele), (void *)&bubble_ex_mem);
-    mem_wb_state = new_pipe(sizeof(mem_wb_ele), (void *)&bubble_mem_wb);
+    sim->if_id_next = sim->if_id_state->next;
+    sim->if_id_curr = sim->if_id_state->current;
 
-    /* connect them to the pipeline stages */
-    pc_next = pc_state->next;
-    pc_curr = pc_state->current;
+    sim->id_ex_next = sim->id_ex_state->next;
+    sim->id_ex_curr = sim->id_ex_state->current;
 
-    if_id_next = if_id_state->next;
-    if_id_curr = if_id_state->current;
+    sim->ex_mem_next = sim->ex_mem_state->next;
+    sim->ex_mem_curr = sim->ex_mem_state->current;
 
-    id_ex_next = id_ex_state->next;
-    id_ex_curr = id_ex_state->current;
+    sim->mem_wb_next = sim->mem_wb_state->next;
+    sim->mem_wb_curr = sim->mem_wb_state->current;
+}
 
-    ex_mem_next = ex_mem_state->next;
-    ex_mem_curr = ex_mem_state->current;
+sim_t sim_init()
+{
+    sim_t sim = (sim_t)calloc(1, sizeof(sim_rec));
 
-    mem_wb_next = mem_wb_state->next;
-    mem_wb_curr = mem_wb_state->current;
+    /* Create memory and register files */
+    sim->mem = init_mem(MEM_SIZE);
+    sim->reg = init_reg();
 
-    sim_reset();
-    clear_mem(mem);
+    /* create 5 pipe registers */
+    sim->pc_state = new_pipe(&sim->pipeline, sizeof(pc_ele), (void *)&bubble_pc);
+    sim->if_id_state = new_pipe(&sim->pipeline, sizeof(if_id_ele), (void *)&bubble_if_id);
+    sim->id_ex_state = new_pipe(&sim->pipeline, sizeof(id_ex_ele), (void *)&bubble_id_ex);
+    sim->ex_mem_state = new_pipe(&sim->pipeline, sizeof(ex_mem_ele), (void *)&bubble_ex_mem);
+    sim->mem_wb_state = new_pipe(&sim->pipeline, sizeof(mem_wb_ele), (void *)&bubble_mem_wb);
+
+    sim->sim_mode = S_FORWARD;
+    sim_reset(sim);
+    clear_mem(sim->mem);
+    return sim;
 }
 
-void sim_reset()
+void sim_free(sim_t sim)
 {
-    if (!initialized)
-        sim_init();
-    clear_pipes();
-    clear_mem(reg);
-    minAddr = 0;
-    memCnt = 0;
-    starting_up = 1;
-    cycles = instructions = 0;
-    cc = DEFAULT_CC;
-    status = STAT_AOK;
+    free_pipes(&sim->pipeline);
+    free_mem(sim->mem);
+    free_reg(sim->reg);
+    free((void *)sim);
+}
 
-    amux = bmux = MUX_NONE;
-    cc = cc_in = DEFAULT_CC;
-    wb_destE = REG_NONE;
-    wb_valE = 0;
-    wb_destM = REG_NONE;
-    wb_valM = 0;
-    mem_addr = 0;
-    mem_data = 0;
-    mem_write = FALSE;
+void sim_reset(sim_t sim)
+{
+    int s;
+    clear_pipes(&sim->pipeline);
+    connect_pipes(sim);
+    clear_reg(sim->reg);
+    sim->minAddr = 0;
+    sim->memCnt = 0;
+    sim->starting_up = 1;
+    sim->cycles = sim->instructions = 0;
+    sim->f_seq = sim->last_seq = 1;
+    for (s = IF_STAGE; s <= WB_STAGE; s++)
+        sim->blame[s].cause = STALL_NONE;
+    memset(sim->lost, 0, sizeof(sim->lost));
+    lazy_cc_load(&sim->cc, DEFAULT_CC);
+    sim->status = STAT_AOK;
+
+    sim->amux = sim->bmux = MUX_NONE;
+    lazy_cc_load(&sim->cc, DEFAULT_CC);
+    sim->cc_in = sim->cc;
+    sim->wb_destE = REG_NONE;
+    sim->wb_valE = 0;
+    sim->wb_destM = REG_NONE;
+    sim->wb_valM = 0;
+    sim->mem_addr = 0;
+    sim->mem_data = 0;
+    sim->mem_write = FALSE;
 }
 
 /* Text representation of status */
-void tty_report(word_t cyc)
+void tty_report(sim_t sim, word_t cyc)
 {
-    sim_log("\nCycle %lld. CC=%s, Stat=%s\n", cyc, cc_name(cc), stat_name(status));
+    if (sim_recording(sim))
+    {
+        event_rec e = {cyc, lazy_cc_get(&sim->cc), 0, EV_CYCLE, sim->status};
+        evlog_put(sim->events, &e);
+    }
+    if (!sim_logging(sim))
+        return;
+    sim_log(sim, "\nCycle %lld. CC=%s, Stat=%s\n", cyc, cc_name(lazy_cc_get(&sim->cc)), stat_name(sim->status));
+
+    sim_log(sim, "F: predPC = 0x%llx\n", sim->pc_curr->pc);
+
+    sim_log(sim, "D: instr = %s, rA = %s, rB = %s, valC = 0x%llx, valP = 0x%llx, Stat = %s\n",
+            iname(HPACK(sim->if_id_curr->icode, sim->if_id_curr->ifun)),
+            reg_name(sim->if_id_curr->ra), reg_name(sim->if_id_curr->rb),
+            sim->if_id_curr->valc, sim->if_id_curr->valp,
+            stat_name(sim->if_id_curr->status));
+
+    sim_log(sim, "E: instr = %s, valC = 0x%llx, valA = 0x%llx, valB = 0x%llx\n   srcA = %s, srcB = %s, dstE = %s, dstM = %s, Stat = %s\n",
+            iname(HPACK(sim->id_ex_curr->icode, sim->id_ex_curr->ifun)),
+            sim->id_ex_curr->valc, sim->id_ex_curr->vala, sim->id_ex_curr->valb,
+            reg_name(sim->id_ex_curr->srca), reg_name(sim->id_ex_curr->srcb),
+            reg_name(sim->id_ex_curr->deste), reg_name(sim->id_ex_curr->destm),
+            stat_name(sim->id_ex_curr->status));
+
+    sim_log(sim, "M: instr = %s, Cnd = %d, valE = 0x%llx, valA = 0x%llx\n   dstE = %s, dstM = %s, Stat = %s\n",
+            iname(HPACK(sim->ex_mem_curr->icode, sim->ex_mem_curr->ifun)),
+            sim->ex_mem_curr->takebranch,
+            sim->ex_mem_curr->vale, sim->ex_mem_curr->vala,
+            reg_name(sim->ex_mem_curr->deste), reg_name(sim->ex_mem_curr->destm),
+            stat_name(sim->ex_mem_curr->status));
+
+    sim_log(sim, "W: instr = %s, valE = 0x%llx, valM = 0x%llx, dstE = %s, dstM = %s, Stat = %s\n",
+            iname(HPACK(sim->mem_wb_curr->icode, sim->mem_wb_curr->ifun)),
+            sim->mem_wb_curr->vale, sim->mem_wb_curr->valm,
+            reg_name(sim->mem_wb_curr->deste), reg_name(sim->mem_wb_curr->destm),
+            stat_name(sim->mem_wb_curr->status));
+}
 
-    sim_log("F: predPC = 0x%llx\n", pc_curr->pc);
+/* Record which instruction each stage held this cycle */
+static void trace_pipe(sim_t sim, word_t ccount)
+{
+    word_t seq[PT_STAGES];
+    seq[0] = sim->f_seq;
+    seq[1] = sim->if_id_curr->seq;
+    seq[2] = sim->id_ex_curr->seq;
+    seq[3] = sim->ex_mem_curr->seq;
+    seq[4] = sim->mem_wb_curr->seq;
+    pipetrace_cycle(sim->ptrace, ccount, seq, sim->f_pc,
+                    HPACK(sim->if_id_next->icode, sim->if_id_next->ifun));
+    /* Unless IF/ID stalls, the instruction fetched moves on to decode
+       or is discarded, and the next cycle fetches a new one */
+    if (sim->if_id_state->op != P_STALL)
+        sim->f_seq = ++sim->last_seq;
+}
 
-    sim_log("D: instr = %s, rA = %s, rB = %s, valC = 0x%llx, valP = 0x%llx, Stat = %s\n",
-            iname(HPACK(if_id_curr->icode, if_id_curr->ifun)),
-            reg_name(if_id_curr->ra), reg_name(if_id_curr->rb),
-            if_id_curr->valc, if_id_curr->valp,
-            stat_name(if_id_curr->status));
+/* Carry the cause of each bubble down the pipe with it, as
+   update_pipes is about to */
+static void move_blame(sim_t sim)
+{
+    int s;
+    for (s = WB_STAGE; s >= IF_STAGE; s--)
+    {
+        switch (sim->pipeline.pipes[s]->op)
+        {
+        case P_LOAD:
+            if (s > IF_STAGE)
+                sim->blame[s] = sim->blame[s - 1];
+            else
+                sim->blame[s].cause = STALL_NONE;
+            break;
+        case P_BUBBLE:
+        case P_ERROR:
+            sim->blame[s] = sim->new_blame[s];
+            break;
+        default:
+            break;
+        }
+    }
+}
 
-    sim_log("E: instr = %s, valC = 0x%llx, valA = 0x%llx, valB = 0x%llx\n   srcA = %s, srcB = %s, dstE = %s, dstM = %s, Stat = %s\n",
-            iname(HPACK(id_ex_curr->icode, id_ex_curr->ifun)),
-            id_ex_curr->valc, id_ex_curr->vala, id_ex_curr->valb,
-            reg_name(id_ex_curr->srca), reg_name(id_ex_curr->srcb),
-            reg_name(id_ex_curr->deste), reg_name(id_ex_curr->destm),
-            stat_name(id_ex_curr->status));
+static void set_blame(blame_ptr b, int cause, word_t pc, int icode, int ifun)
+{
+    b->cause = cause;
+    b->pc = pc;
+    b->instr = HPACK(icode, ifun);
+}
 
-    sim_log("M: instr = %s, Cnd = %d, valE = 0x%llx, valA = 0x%llx\n   dstE = %s, dstM = %s, Stat = %s\n",
-            iname(HPACK(ex_mem_curr->icode, ex_mem_curr->ifun)),
-            ex_mem_curr->takebranch,
-            ex_mem_curr->vale, ex_mem_curr->vala,
-            reg_name(ex_mem_curr->deste), reg_name(ex_mem_curr->destm),
-            stat_name(ex_mem_curr->status));
+/* Work out why do_stall_check would bubble each stage, using the same
+   conditions.  Only the stages it did bubble keep their blame */
+static void find_blame(sim_t sim)
+{
+    bool_t mispredict = sim->id_ex_curr->icode == I_JMP &&
+                        sim->ex_mem_next->takebranch != sim->id_ex_curr->predtaken;
+    bool_t load_use = (sim->id_ex_curr->icode == I_MRMOVQ ||
+                       sim->id_ex_curr->icode == I_POPQ) &&
+                      (sim->id_ex_curr->destm == sim->id_ex_next->srca ||
+                       sim->id_ex_curr->destm == sim->id_ex_next->srcb);
+
+    /* Mispredicted jump, or load, in EX */
+    set_blame(&sim->new_blame[EX_STAGE],
+              mispredict ? STALL_MISPREDICT : STALL_LOAD_USE,
+              sim->id_ex_curr->stage_pc, sim->id_ex_curr->icode,
+              sim->id_ex_curr->ifun);
+    if (mispredict || load_use)
+        sim->new_blame[ID_STAGE] = sim->new_blame[EX_STAGE];
+    else if (sim->ex_mem_curr->icode == I_RET)
+        set_blame(&sim->new_blame[ID_STAGE], STALL_RET,
+                  sim->ex_mem_curr->stage_pc, I_RET, F_NONE);
+    else if (sim->id_ex_curr->icode == I_RET)
+        set_blame(&sim->new_blame[ID_STAGE], STALL_RET,
+                  sim->id_ex_curr->stage_pc, I_RET, F_NONE);
+    else
+        set_blame(&sim->new_blame[ID_STAGE], STALL_RET,
+                  sim->if_id_curr->stage_pc, I_RET, F_NONE);
+    /* Instruction that raised the exception, in WB or about to be */
+    if (sim->mem_wb_curr->status == STAT_ADR ||
+        sim->mem_wb_curr->status == STAT_INS ||
+        sim->mem_wb_curr->status == STAT_HLT)
+        set_blame(&sim->new_blame[MEM_STAGE], STALL_DRAIN,
+                  sim->mem_wb_curr->stage_pc, sim->mem_wb_curr->icode,
+                  sim->mem_wb_curr->ifun);
+    else
+        set_blame(&sim->new_blame[MEM_STAGE], STALL_DRAIN,
+                  sim->ex_mem_curr->stage_pc, sim->ex_mem_curr->icode,
+                  sim->ex_mem_curr->ifun);
+}
 
-    sim_log("W: instr = %s, valE = 0x%llx, valM = 0x%llx, dstE = %s, dstM = %s, Stat = %s\n",
-            iname(HPACK(mem_wb_curr->icode, mem_wb_curr->ifun)),
-            mem_wb_curr->vale, mem_wb_curr->valm,
-            reg_name(mem_wb_curr->deste), reg_name(mem_wb_curr->destm),
-            stat_name(mem_wb_curr->status));
+/* Charge a cycle in which WB held a bubble to whatever caused it */
+static void charge_bubble(sim_t sim)
+{
+    blame_ptr b = &sim->blame[WB_STAGE];
+    if (b->cause == STALL_NONE)
+        return;
+    sim->lost[b->cause]++;
+    if (sim->prof)
+        prof_stall(sim->prof, b->pc, b->instr, b->cause);
 }
 
 /******************************************************************
@@ -499,23 +1019,26 @@ void tty_report(word_t cyc)
 /* Return status of processor */
 /* Max_instr indicates maximum number of instructions that
    want to complete during this simulation run.  */
-static byte_t sim_step_pipe(word_t max_instr, word_t ccount)
+static byte_t sim_step_pipe(sim_t sim, word_t max_instr, word_t ccount)
 {
     /* Update pipe registers */
-    update_pipes();
+    move_blame(sim);
+    update_pipes(&sim->pipeline);
+    connect_pipes(sim);
     /* print status report in TTY mode */
-    tty_report(ccount);
+    if (sim_logging(sim) || sim_recording(sim))
+        tty_report(sim, ccount);
     /* error checking */
-    if (pc_state->op == P_ERROR)
-        pc_curr->status = STAT_PIP;
-    if (if_id_state->op == P_ERROR)
-        if_id_curr->status = STAT_PIP;
-    if (id_ex_state->op == P_ERROR)
-        id_ex_curr->status = STAT_PIP;
-    if (ex_mem_state->op == P_ERROR)
-        ex_mem_curr->status = STAT_PIP;
-    if (mem_wb_state->op == P_ERROR)
-        mem_wb_curr->status = STAT_PIP;
+    if (sim->pc_state->op == P_ERROR)
+        sim->pc_curr->status = STAT_PIP;
+    if (sim->if_id_state->op == P_ERROR)
+        sim->if_id_curr->status = STAT_PIP;
+    if (sim->id_ex_state->op == P_ERROR)
+        sim->id_ex_curr->status = STAT_PIP;
+    if (sim->ex_mem_state->op == P_ERROR)
+        sim->ex_mem_curr->status = STAT_PIP;
+    if (sim->mem_wb_state->op == P_ERROR)
+        sim->mem_wb_curr->status = STAT_PIP;
 
     /****************** Stage implementations ******************
      * TODO: implement the following functions to simulate the 
@@ -529,28 +1052,41 @@ static byte_t sim_step_pipe(word_t max_instr, word_t ccount)
      * values properly.
      ***********************************************************/
 
-    do_wb_stage();
-    do_mem_stage();
-    do_ex_stage();
-    do_id_stage();
-    do_if_stage();
+    do_wb_stage(sim);
+    do_mem_stage(sim);
+    do_ex_stage(sim);
+    do_id_stage(sim);
+    do_if_stage(sim);
+
+    do_stall_check(sim);
+    find_blame(sim);
 
-    do_stall_check();
+    if (sim->ptrace)
+        trace_pipe(sim, ccount);
 
     /* Performance monitoring. Do not change anything below */
-    if (mem_wb_curr->status != STAT_BUB && mem_wb_curr->icode != I_POP2)
+    if (sim->mem_wb_curr->status != STAT_BUB && sim->mem_wb_curr->icode != I_POP2)
     {
-        starting_up = 0;
-        instructions++;
-        cycles++;
+        sim->starting_up = 0;
+        sim->instructions++;
+        sim->cycles++;
     }
     else
     {
-        if (!starting_up)
-            cycles++;
+        if (!sim->starting_up)
+            sim->cycles++;
     }
 
-    return status;
+    /* Charge retiring instruction with the cycles since the last one */
+    if (sim->prof && sim->mem_wb_curr->status != STAT_BUB &&
+        sim->mem_wb_curr->icode != I_POP2)
+        prof_retire(sim->prof, sim->mem_wb_curr->stage_pc,
+                    HPACK(sim->mem_wb_curr->icode, sim->mem_wb_curr->ifun),
+                    sim->cycles);
+    if (sim->mem_wb_curr->status == STAT_BUB && !sim->starting_up)
+        charge_bubble(sim);
+
+    return sim->status;
 }
 
 /*************************** Fetch stage ***************************
@@ -561,53 +1097,56 @@ static byte_t sim_step_pipe(word_t max_instr, word_t ccount)
  * imem_error is defined for logging purpose, you can use it to help
  * with your design, but it's also fine to neglect it 
  *******************************************************************/
-void do_if_stage()
+void do_if_stage(sim_t sim)
 {
     byte_t instr = HPACK(I_NOP, F_NONE);
     byte_t registers = HPACK(REG_NONE, REG_NONE);
     word_t valc = 0;
+    const opcode_rec *op;
     //what address should instruction be fetched at
-    f_pc = ((((ex_mem_curr->icode) == (I_JMP)) & !(ex_mem_curr->takebranch)) ? (ex_mem_curr->vala) : ((mem_wb_curr->icode) == (I_RET)) ? (mem_wb_curr->valm) : (pc_curr->pc));
-    word_t valp = f_pc;
+    sim->f_pc = ((((sim->ex_mem_curr->icode) == (I_JMP)) & ((sim->ex_mem_curr->takebranch) != (sim->ex_mem_curr->predtaken))) ? (sim->ex_mem_curr->vala) : ((sim->mem_wb_curr->icode) == (I_RET)) ? (sim->mem_wb_curr->valm) : (sim->pc_curr->pc));
+    word_t valp = sim->f_pc;
     /*Fetch register byte and immediate word*/
-    imem_error = !get_byte_val(mem, valp, &instr);
-    imem_icode = GET_ICODE(instr);
-    imem_ifun = GET_FUN(instr);
-    if_id_next->icode = imem_icode;
-    if_id_next->ifun = imem_ifun;
-    //is instruction valid
-    instr_valid = ((if_id_next->icode) == (I_NOP) || (if_id_next->icode) == (I_HALT) || (if_id_next->icode) == (I_RRMOVQ) || (if_id_next->icode) == (I_IRMOVQ) ||
-                   (if_id_next->icode) == (I_RMMOVQ) || (if_id_next->icode) == (I_MRMOVQ) || (if_id_next->icode) == (I_ALU) || (if_id_next->icode) == (I_JMP) ||
-                   (if_id_next->icode) == (I_CALL) || (if_id_next->icode) == (I_RET) || (if_id_next->icode) == (I_PUSHQ) || (if_id_next->icode) == (I_POPQ));
-    if_id_next->status = ((imem_error) ? (STAT_ADR) : !(instr_valid) ? (STAT_INS) : ((if_id_next->icode) == (I_HALT)) ? (STAT_HLT) : (STAT_AOK));
+    sim->imem_error = !get_byte_val(sim->mem, valp, &instr);
+    op = &opcode_table[instr];
+    sim->imem_icode = op->icode;
+    sim->imem_ifun = op->ifun;
+    sim->if_id_next->icode = sim->imem_icode;
+    sim->if_id_next->ifun = sim->imem_ifun;
+    //is instruction valid (PIPE does not implement iaddq)
+    sim->instr_valid = op->valid && op->icode != I_IADDQ;
+    sim->if_id_next->status = ((sim->imem_error) ? (STAT_ADR) : !(sim->instr_valid) ? (STAT_INS) : ((sim->if_id_next->icode) == (I_HALT)) ? (STAT_HLT) : (STAT_AOK));
     valp++;
     //register byte
-    if (((if_id_next->icode) == (I_RRMOVQ) || (if_id_next->icode) == (I_ALU) || (if_id_next->icode) == (I_PUSHQ) || (if_id_next->icode) == (I_POPQ) ||
-         (if_id_next->icode) == (I_IRMOVQ) || (if_id_next->icode) == (I_RMMOVQ) || (if_id_next->icode) == (I_MRMOVQ)))
+    if (sim->instr_valid && op->regids)
     {
-        get_byte_val(mem, valp, &registers);
+        get_byte_val(sim->mem, valp, &registers);
         valp++;
     }
     //constant word
-    if (((if_id_next->icode) == (I_IRMOVQ) || (if_id_next->icode) == (I_RMMOVQ) || (if_id_next->icode) == (I_MRMOVQ) || (if_id_next->icode) == (I_JMP) || (if_id_next->icode) == (I_CALL)))
+    if (sim->instr_valid && op->valc)
     {
-        get_word_val(mem, valp, &valc);
+        get_word_val(sim->mem, valp, &valc);
         valp += 8;
     }
-    if_id_next->ra = HI4(registers);
-    if_id_next->rb = LO4(registers);
-    if_id_next->valp = valp;
-    if_id_next->valc = valc;
+    sim->if_id_next->ra = HI4(registers);
+    sim->if_id_next->rb = LO4(registers);
+    sim->if_id_next->valp = valp;
+    sim->if_id_next->valc = valc;
     //next PC prediction
-    pc_next->pc = ((if_id_next->icode == I_JMP || if_id_next->icode == I_CALL) ? (if_id_next->valc) : (if_id_next->valp));
+    sim->if_id_next->predtaken = TRUE;
+    sim->if_id_next->predhist = 0;
+    if (sim->bpred && sim->if_id_next->icode == I_JMP && sim->if_id_next->ifun != C_YES)
+        sim->if_id_next->predtaken = bpred_predict(sim->bpred, sim->f_pc, valc, &sim->if_id_next->predhist);
+    sim->pc_next->pc = (((sim->if_id_next->icode == I_JMP && sim->if_id_next->predtaken) || sim->if_id_next->icode == I_CALL) ? (sim->if_id_next->valc) : (sim->if_id_next->valp));
     //status code for next instruction
-    pc_next->status = (if_id_next->status == STAT_AOK) ? STAT_AOK : STAT_BUB;
-    if_id_next->stage_pc = f_pc;
+    sim->pc_next->status = (sim->if_id_next->status == STAT_AOK) ? STAT_AOK : STAT_BUB;
+    sim->if_id_next->stage_pc = sim->f_pc;
+    sim->if_id_next->seq = sim->f_seq;
     /* logging function, do not change this */
-    if (!imem_error)
+    if (!sim->imem_error)
     {
-        sim_log("\tFetch: f_pc = 0x%llx, f_instr = %s\n",
-                f_pc, iname(HPACK(if_id_next->icode, if_id_next->ifun)));
+        SIM_EVENT(sim, EV_FETCH, instr, sim->f_pc, 0, 0);
     }
 }
 
@@ -616,29 +1155,35 @@ void do_if_stage()
  * you may find these functions useful:
  * get_reg_val()
  *******************************************************************/
-void do_id_stage()
+void do_id_stage(sim_t sim)
 {
+    const opcode_rec *op = &opcode_table[HPACK(sim->if_id_curr->icode, sim->if_id_curr->ifun)];
+    byte_t ra = sim->if_id_curr->ra;
+    byte_t rb = sim->if_id_curr->rb;
     /* Update processor status */
-    status = (((mem_wb_curr->status) == (STAT_BUB)) ? (STAT_AOK) : (mem_wb_curr->status));
+    sim->status = (((sim->mem_wb_curr->status) == (STAT_BUB)) ? (STAT_AOK) : (sim->mem_wb_curr->status));
     //register for A source
-    id_ex_next->srca = (((if_id_curr->icode) == (I_RRMOVQ) || (if_id_curr->icode) == (I_RMMOVQ) || (if_id_curr->icode) == (I_ALU) || (if_id_curr->icode) == (I_PUSHQ)) ? (if_id_curr->ra) : ((if_id_curr->icode) == (I_POPQ) || (if_id_curr->icode) == (I_RET)) ? (REG_RSP) : (REG_NONE));
+    sim->id_ex_next->srca = OP_REG(op->srca, ra, rb);
     //register for B source
-    id_ex_next->srcb = (((if_id_curr->icode) == (I_ALU) || (if_id_curr->icode) == (I_RMMOVQ) || (if_id_curr->icode) == (I_MRMOVQ)) ? (if_id_curr->rb) : ((if_id_curr->icode) == (I_PUSHQ) || (if_id_curr->icode) == (I_POPQ) || (if_id_curr->icode) == (I_CALL) || (if_id_curr->icode) == (I_RET)) ? (REG_RSP) : (REG_NONE));
+    sim->id_ex_next->srcb = OP_REG(op->srcb, ra, rb);
     //register for E destination
-    id_ex_next->deste = (((if_id_curr->icode) == (I_RRMOVQ) || (if_id_curr->icode) == (I_IRMOVQ) || (if_id_curr->icode) == (I_ALU)) ? (if_id_curr->rb) : ((if_id_curr->icode) == (I_PUSHQ) || (if_id_curr->icode) == (I_POPQ) || (if_id_curr->icode) == (I_CALL) || (if_id_curr->icode) == (I_RET)) ? (REG_RSP) : (REG_NONE));
+    sim->id_ex_next->deste = OP_REG(op->deste, ra, rb);
     //register for M destination
-    id_ex_next->destm = (((if_id_curr->icode) == (I_MRMOVQ) || (if_id_curr->icode) == (I_POPQ)) ? (if_id_curr->ra) : (REG_NONE));
+    sim->id_ex_next->destm = OP_REG(op->destm, ra, rb);
     /* Read the registers */
-    d_regvala = get_reg_val(reg, id_ex_next->srca);
-    d_regvalb = get_reg_val(reg, id_ex_next->srcb);
+    sim->d_regvala = get_reg_val(sim->reg, sim->id_ex_next->srca);
+    sim->d_regvalb = get_reg_val(sim->reg, sim->id_ex_next->srcb);
     /* Do forwarding and valA selection */
-    id_ex_next->vala = (((if_id_curr->icode) == (I_CALL) || (if_id_curr->icode) == (I_JMP)) ? (if_id_curr->valp) : ((id_ex_next->srca) == (ex_mem_next->deste)) ? (ex_mem_next->vale) : ((id_ex_next->srca) == (ex_mem_curr->destm)) ? (mem_wb_next->valm) : ((id_ex_next->srca) == (ex_mem_curr->deste)) ? (ex_mem_curr->vale) : ((id_ex_next->srca) == (mem_wb_curr->destm)) ? (mem_wb_curr->valm) : ((id_ex_next->srca) == (mem_wb_curr->deste)) ? (mem_wb_curr->vale) : (d_regvala));
-    id_ex_next->valb = (((id_ex_next->srcb) == (ex_mem_next->deste)) ? (ex_mem_next->vale) : ((id_ex_next->srcb) == (ex_mem_curr->destm)) ? (mem_wb_next->valm) : ((id_ex_next->srcb) == (ex_mem_curr->deste)) ? (ex_mem_curr->vale) : ((id_ex_next->srcb) == (mem_wb_curr->destm)) ? (mem_wb_curr->valm) : ((id_ex_next->srcb) == (mem_wb_curr->deste)) ? (mem_wb_curr->vale) : (d_regvalb));
-    id_ex_next->icode = if_id_curr->icode;
-    id_ex_next->ifun = if_id_curr->ifun;
-    id_ex_next->valc = if_id_curr->valc;
-    id_ex_next->stage_pc = if_id_curr->stage_pc;
-    id_ex_next->status = if_id_curr->status;
+    sim->id_ex_next->vala = (((sim->if_id_curr->icode) == (I_CALL) || (((sim->if_id_curr->icode) == (I_JMP)) & (sim->if_id_curr->predtaken))) ? (sim->if_id_curr->valp) : ((sim->if_id_curr->icode) == (I_JMP)) ? (sim->if_id_curr->valc) : ((sim->id_ex_next->srca) == (sim->ex_mem_next->deste)) ? (sim->ex_mem_next->vale) : ((sim->id_ex_next->srca) == (sim->ex_mem_curr->destm)) ? (sim->mem_wb_next->valm) : ((sim->id_ex_next->srca) == (sim->ex_mem_curr->deste)) ? (sim->ex_mem_curr->vale) : ((sim->id_ex_next->srca) == (sim->mem_wb_curr->destm)) ? (sim->mem_wb_curr->valm) : ((sim->id_ex_next->srca) == (sim->mem_wb_curr->deste)) ? (sim->mem_wb_curr->vale) : (sim->d_regvala));
+    sim->id_ex_next->valb = (((sim->id_ex_next->srcb) == (sim->ex_mem_next->deste)) ? (sim->ex_mem_next->vale) : ((sim->id_ex_next->srcb) == (sim->ex_mem_curr->destm)) ? (sim->mem_wb_next->valm) : ((sim->id_ex_next->srcb) == (sim->ex_mem_curr->deste)) ? (sim->ex_mem_curr->vale) : ((sim->id_ex_next->srcb) == (sim->mem_wb_curr->destm)) ? (sim->mem_wb_curr->valm) : ((sim->id_ex_next->srcb) == (sim->mem_wb_curr->deste)) ? (sim->mem_wb_curr->vale) : (sim->d_regvalb));
+    sim->id_ex_next->icode = sim->if_id_curr->icode;
+    sim->id_ex_next->ifun = sim->if_id_curr->ifun;
+    sim->id_ex_next->valc = sim->if_id_curr->valc;
+    sim->id_ex_next->stage_pc = sim->if_id_curr->stage_pc;
+    sim->id_ex_next->seq = sim->if_id_curr->seq;
+    sim->id_ex_next->predtaken = sim->if_id_curr->predtaken;
+    sim->id_ex_next->predhist = sim->if_id_curr->predhist;
+    sim->id_ex_next->status = sim->if_id_curr->status;
 }
 
 /************************** Execute stage **************************
@@ -646,47 +1191,54 @@ void do_id_stage()
  * you may find these functions useful: 
  * cond_holds(), compute_alu(), compute_cc()
  *******************************************************************/
-void do_ex_stage()
+void do_ex_stage(sim_t sim)
 {
-    cc_in = DEFAULT_CC; /* should not overwrite original cc */
+    lazy_cc_load(&sim->cc_in, DEFAULT_CC); /* should not overwrite original cc */
     word_t alua, alub;
     //select input A and B to ALU
-    alua = (((id_ex_curr->icode) == (I_RRMOVQ) || (id_ex_curr->icode) == (I_ALU)) ? (id_ex_curr->vala) : ((id_ex_curr->icode) == (I_IRMOVQ) || (id_ex_curr->icode) == (I_RMMOVQ) || (id_ex_curr->icode) == (I_MRMOVQ)) ? (id_ex_curr->valc) : ((id_ex_curr->icode) == (I_POPQ) || (id_ex_curr->icode) == (I_RET)) ? 8 : ((id_ex_curr->icode) == (I_PUSHQ) || (id_ex_curr->icode) == (I_CALL)) ? -8 : 0);
-    alub = (((id_ex_curr->icode) == (I_RMMOVQ) || (id_ex_curr->icode) == (I_MRMOVQ) || (id_ex_curr->icode) == (I_ALU) || (id_ex_curr->icode) == (I_CALL) || (id_ex_curr->icode) == (I_PUSHQ) || (id_ex_curr->icode) == (I_RET) || (id_ex_curr->icode) == (I_POPQ)) ? (id_ex_curr->valb) : ((id_ex_curr->icode) == (I_RRMOVQ) || (id_ex_curr->icode) == (I_IRMOVQ)) ? 0 : 0);
+    alua = (((sim->id_ex_curr->icode) == (I_RRMOVQ) || (sim->id_ex_curr->icode) == (I_ALU)) ? (sim->id_ex_curr->vala) : ((sim->id_ex_curr->icode) == (I_IRMOVQ) || (sim->id_ex_curr->icode) == (I_RMMOVQ) || (sim->id_ex_curr->icode) == (I_MRMOVQ)) ? (sim->id_ex_curr->valc) : ((sim->id_ex_curr->icode) == (I_POPQ) || (sim->id_ex_curr->icode) == (I_RET)) ? 8 : ((sim->id_ex_curr->icode) == (I_PUSHQ) || (sim->id_ex_curr->icode) == (I_CALL)) ? -8 : 0);
+    alub = (((sim->id_ex_curr->icode) == (I_RMMOVQ) || (sim->id_ex_curr->icode) == (I_MRMOVQ) || (sim->id_ex_curr->icode) == (I_ALU) || (sim->id_ex_curr->icode) == (I_CALL) || (sim->id_ex_curr->icode) == (I_PUSHQ) || (sim->id_ex_curr->icode) == (I_RET) || (sim->id_ex_curr->icode) == (I_POPQ)) ? (sim->id_ex_curr->valb) : ((sim->id_ex_curr->icode) == (I_RRMOVQ) || (sim->id_ex_curr->icode) == (I_IRMOVQ)) ? 0 : 0);
     //set ALU function
-    alu_t alufun = (((id_ex_curr->icode) == (I_ALU)) ? (id_ex_curr->ifun) : (A_ADD));
+    alu_t alufun = (((sim->id_ex_curr->icode) == (I_ALU)) ? (sim->id_ex_curr->ifun) : (A_ADD));
     //update condition codes?
-    bool_t setcc = ((((id_ex_curr->icode) == (I_ALU)) & !((mem_wb_next->status) == (STAT_ADR) || (mem_wb_next->status) == (STAT_INS) || (mem_wb_next->status) == (STAT_HLT))) & !((mem_wb_curr->status) == (STAT_ADR) || (mem_wb_curr->status) == (STAT_INS) || (mem_wb_curr->status) == (STAT_HLT)));
-    e_bcond = cond_holds(cc, id_ex_curr->ifun);
-    ex_mem_next->takebranch = e_bcond;
+    bool_t setcc = ((((sim->id_ex_curr->icode) == (I_ALU)) & !((sim->mem_wb_next->status) == (STAT_ADR) || (sim->mem_wb_next->status) == (STAT_INS) || (sim->mem_wb_next->status) == (STAT_HLT))) & !((sim->mem_wb_curr->status) == (STAT_ADR) || (sim->mem_wb_curr->status) == (STAT_INS) || (sim->mem_wb_curr->status) == (STAT_HLT)));
+    sim->e_bcond = lazy_cond_holds(&sim->cc, sim->id_ex_curr->ifun);
+    sim->ex_mem_next->takebranch = sim->e_bcond;
     /* Perform the ALU operation */
     word_t aluout = compute_alu(alufun, alua, alub);
-    ex_mem_next->vale = aluout;
+    sim->ex_mem_next->vale = aluout;
     //set condition coes
-    cc_in = compute_cc(alufun, alua, alub);
-    ex_mem_next->icode = id_ex_curr->icode;
-    ex_mem_next->ifun = id_ex_curr->ifun;
-    ex_mem_next->vala = id_ex_curr->vala;
+    lazy_cc_set(&sim->cc_in, alufun, alua, alub);
+    sim->ex_mem_next->icode = sim->id_ex_curr->icode;
+    sim->ex_mem_next->ifun = sim->id_ex_curr->ifun;
+    sim->ex_mem_next->vala = sim->id_ex_curr->vala;
     //Set dstE to RNONE in event of not-taken conditional move
-    ex_mem_next->deste = ((((id_ex_curr->icode) == (I_RRMOVQ)) & !(ex_mem_next->takebranch)) ? (REG_NONE) : (id_ex_curr->deste));
-    ex_mem_next->destm = id_ex_curr->destm;
-    ex_mem_next->srca = id_ex_curr->srca;
-    ex_mem_next->status = id_ex_curr->status;
-    ex_mem_next->stage_pc = id_ex_curr->stage_pc;
+    sim->ex_mem_next->deste = ((((sim->id_ex_curr->icode) == (I_RRMOVQ)) & !(sim->ex_mem_next->takebranch)) ? (REG_NONE) : (sim->id_ex_curr->deste));
+    sim->ex_mem_next->destm = sim->id_ex_curr->destm;
+    sim->ex_mem_next->srca = sim->id_ex_curr->srca;
+    sim->ex_mem_next->status = sim->id_ex_curr->status;
+    sim->ex_mem_next->stage_pc = sim->id_ex_curr->stage_pc;
+    sim->ex_mem_next->seq = sim->id_ex_curr->seq;
+    sim->ex_mem_next->predtaken = sim->id_ex_curr->predtaken;
+    sim->ex_mem_next->predhist = sim->id_ex_curr->predhist;
+    sim->ex_mem_next->cc = sim->cc_in;
+    //train predictor with outcome of conditional jump
+    if (sim->bpred && sim->id_ex_curr->icode == I_JMP && sim->id_ex_curr->ifun != C_YES)
+        bpred_update(sim->bpred, sim->id_ex_curr->stage_pc, sim->id_ex_curr->valc,
+                     sim->id_ex_curr->predhist, sim->id_ex_curr->predtaken,
+                     sim->ex_mem_next->takebranch);
     /* logging functions, do not change these */
-    if (id_ex_curr->icode == I_JMP)
+    if (sim->id_ex_curr->icode == I_JMP)
     {
-        sim_log("\tExecute: instr = %s, cc = %s, branch %staken\n",
-                iname(HPACK(id_ex_curr->icode, id_ex_curr->ifun)),
-                cc_name(cc),
-                ex_mem_next->takebranch ? "" : "not ");
+        SIM_EVENT(sim, EV_BRANCH,
+                  HPACK(sim->id_ex_curr->icode, sim->id_ex_curr->ifun),
+                  lazy_cc_get(&sim->cc), sim->ex_mem_next->takebranch, 0);
     }
-    sim_log("\tExecute: ALU: %c 0x%llx 0x%llx --> 0x%llx\n",
-            op_name(alufun), alua, alub, ex_mem_next->vale);
+    SIM_EVENT(sim, EV_ALU, op_name(alufun), alua, alub, sim->ex_mem_next->vale);
     if (setcc)
     {
-        cc = cc_in;
-        sim_log("\tExecute: New cc=%s\n", cc_name(cc_in));
+        sim->cc = sim->cc_in;
+        SIM_EVENT(sim, EV_CC, 0, lazy_cc_get(&sim->cc), 0, 0);
     }
 }
 
@@ -697,48 +1249,55 @@ void do_ex_stage()
  * 
  * The pending writeback updates will occur in update_state()
  *******************************************************************/
-void do_mem_stage()
+void do_mem_stage(sim_t sim)
 {
     word_t valm = 0;
     //select memory address
-    mem_addr = (((ex_mem_curr->icode) == (I_RMMOVQ) || (ex_mem_curr->icode) == (I_PUSHQ) || (ex_mem_curr->icode) == (I_CALL) || (ex_mem_curr->icode) == (I_MRMOVQ)) ? (ex_mem_curr->vale) : ((ex_mem_curr->icode) == (I_POPQ) || (ex_mem_curr->icode) == (I_RET)) ? (ex_mem_curr->vala) : 0);
-    mem_data = ex_mem_curr->vala;
+    sim->mem_addr = (((sim->ex_mem_curr->icode) == (I_RMMOVQ) || (sim->ex_mem_curr->icode) == (I_PUSHQ) || (sim->ex_mem_curr->icode) == (I_CALL) || (sim->ex_mem_curr->icode) == (I_MRMOVQ)) ? (sim->ex_mem_curr->vale) : ((sim->ex_mem_curr->icode) == (I_POPQ) || (sim->ex_mem_curr->icode) == (I_RET)) ? (sim->ex_mem_curr->vala) : 0);
+    sim->mem_data = sim->ex_mem_curr->vala;
     //Set write control signal
-    mem_write = ((ex_mem_curr->icode) == (I_RMMOVQ) || (ex_mem_curr->icode) == (I_PUSHQ) || (ex_mem_curr->icode) == (I_CALL));
+    sim->mem_write = ((sim->ex_mem_curr->icode) == (I_RMMOVQ) || (sim->ex_mem_curr->icode) == (I_PUSHQ) || (sim->ex_mem_curr->icode) == (I_CALL));
     //Set read control signal
-    bool_t read = ((ex_mem_curr->icode) == (I_MRMOVQ) || (ex_mem_curr->icode) == (I_POPQ) || (ex_mem_curr->icode) == (I_RET));
-    dmem_error = FALSE;
+    bool_t read = ((sim->ex_mem_curr->icode) == (I_MRMOVQ) || (sim->ex_mem_curr->icode) == (I_POPQ) || (sim->ex_mem_curr->icode) == (I_RET));
+    sim->dmem_error = FALSE;
     if (read)
     {
-        dmem_error = dmem_error || !get_word_val(mem, mem_addr, &valm);
+        sim->dmem_error = sim->dmem_error || !get_word_val(sim->mem, sim->mem_addr, &valm);
     }
-    mem_wb_next->icode = ex_mem_curr->icode;
-    mem_wb_next->ifun = ex_mem_curr->ifun;
-    mem_wb_next->vale = ex_mem_curr->vale;
-    mem_wb_next->valm = valm;
-    mem_wb_next->deste = ex_mem_curr->deste;
-    mem_wb_next->destm = ex_mem_curr->destm;
-    //Update the status
-    mem_wb_next->status = ((dmem_error) ? (STAT_ADR) : (ex_mem_curr->status));
-    mem_wb_next->stage_pc = ex_mem_curr->stage_pc;
-    //Update processor status
-    status = (((mem_wb_curr->status) == (STAT_BUB)) ? (STAT_AOK) : (mem_wb_curr->status));
-    if (mem_write)
+    //a failed write is a memory error too
+    sim->mem_wb_next->mem_write = FALSE;
+    if (sim->mem_write)
     {
-        if (!set_word_val(mem, mem_addr, mem_data))
+        if (!set_word_val(sim->mem, sim->mem_addr, sim->mem_data))
         {
-            sim_log("\tCouldn't write to address 0x%llx\n", mem_addr);
+            sim->dmem_error = TRUE;
+            SIM_EVENT(sim, EV_MEM_ERROR, 0, 0, sim->mem_addr, 0);
         }
         else
         {
-            sim_log("\tWrote 0x%llx to address 0x%llx\n", mem_data, mem_addr);
+            sim->mem_wb_next->mem_write = TRUE;
+            SIM_EVENT(sim, EV_MEM_WRITE, 0, sim->mem_data, sim->mem_addr, 0);
         }
     }
+    sim->mem_wb_next->icode = sim->ex_mem_curr->icode;
+    sim->mem_wb_next->ifun = sim->ex_mem_curr->ifun;
+    sim->mem_wb_next->vale = sim->ex_mem_curr->vale;
+    sim->mem_wb_next->valm = valm;
+    sim->mem_wb_next->deste = sim->ex_mem_curr->deste;
+    sim->mem_wb_next->destm = sim->ex_mem_curr->destm;
+    //Update the status
+    sim->mem_wb_next->status = ((sim->dmem_error) ? (STAT_ADR) : (sim->ex_mem_curr->status));
+    sim->mem_wb_next->stage_pc = sim->ex_mem_curr->stage_pc;
+    sim->mem_wb_next->seq = sim->ex_mem_curr->seq;
+    sim->mem_wb_next->cc = sim->ex_mem_curr->cc;
+    sim->mem_wb_next->mem_addr = sim->mem_addr;
+    sim->mem_wb_next->mem_data = sim->mem_data;
+    //Update processor status
+    sim->status = (((sim->mem_wb_curr->status) == (STAT_BUB)) ? (STAT_AOK) : (sim->mem_wb_curr->status));
     /* logging function, do not change this */
-    if (read && !dmem_error)
+    if (read && !sim->dmem_error)
     {
-        sim_log("\tMemory: Read 0x%llx from 0x%llx\n",
-                mem_wb_next->valm, mem_addr);
+        SIM_EVENT(sim, EV_MEM_READ, 0, sim->mem_wb_next->valm, sim->mem_addr, 0);
     }
 }
 
@@ -750,34 +1309,35 @@ void do_mem_stage()
  * you don't perform the operation to really write to memory here
  * the pending writeback updates will occur in update_state()
  *******************************************************************/
-void do_wb_stage()
+void do_wb_stage(sim_t sim)
 {
-    wb_destE = mem_wb_curr->deste;
-    wb_valE = mem_wb_curr->vale;
-    wb_destM = mem_wb_curr->destm;
-    wb_valM = mem_wb_curr->valm;
-    if (wb_destE != REG_NONE)
+    sim->wb_destE = sim->mem_wb_curr->deste;
+    sim->wb_valE = sim->mem_wb_curr->vale;
+    sim->wb_destM = sim->mem_wb_curr->destm;
+    sim->wb_valM = sim->mem_wb_curr->valm;
+    if (sim->wb_destE != REG_NONE)
     {
-        sim_log("\tWriteback: Wrote 0x%llx to register %s\n",
-                wb_valE, reg_name(wb_destE));
-        set_reg_val(reg, wb_destE, wb_valE);
+        SIM_EVENT(sim, EV_REG_WRITE, sim->wb_destE, sim->wb_valE, 0, 0);
+        set_reg_val(sim->reg, sim->wb_destE, sim->wb_valE);
     }
-    if (wb_destM != REG_NONE)
+    if (sim->wb_destM != REG_NONE)
     {
-        sim_log("\tWriteback: Wrote 0x%llx to register %s\n",
-                wb_valM, reg_name(wb_destM));
-        set_reg_val(reg, wb_destM, wb_valM);
+        SIM_EVENT(sim, EV_REG_WRITE, sim->wb_destM, sim->wb_valM, 0, 0);
+        set_reg_val(sim->reg, sim->wb_destM, sim->wb_valM);
     }
+    if (sim->check && sim->mem_wb_curr->status != STAT_BUB &&
+        sim->mem_wb_curr->icode != I_POP2)
+        check_put(sim->check, sim->mem_wb_curr);
 }
 
 /* given stall and bubble flag, return the correct control operation */
-p_stat_t pipe_cntl(char *name, word_t stall, word_t bubble)
+p_stat_t pipe_cntl(sim_t sim, char *name, word_t stall, word_t bubble)
 {
     if (stall)
     {
         if (bubble)
         {
-            sim_log("%s: Conflicting control signals for pipe register\n",
+            SIM_LOG(sim, "%s: Conflicting control signals for pipe register\n",
                     name);
             return P_ERROR;
         }
@@ -798,24 +1358,24 @@ p_stat_t pipe_cntl(char *name, word_t stall, word_t bubble)
  * update_pipes() will handle the real control behavior later
  * make sure you have a working PIPE before implementing this
  *******************************************************************/
-void do_stall_check()
+void do_stall_check(sim_t sim)
 {
     /* dummy placeholders to show the usage of pipe_cntl() */
     word_t fbubble = 0;
-    word_t fstall = ((((id_ex_curr->icode) == (I_MRMOVQ) || (id_ex_curr->icode) == (I_POPQ)) & ((id_ex_curr->destm) == (id_ex_next->srca) || (id_ex_curr->destm) == (id_ex_next->srcb))) | ((I_RET) == (if_id_curr->icode) || (I_RET) == (id_ex_curr->icode) || (I_RET) == (ex_mem_curr->icode)));
-    word_t dstall = (((id_ex_curr->icode) == (I_MRMOVQ) || (id_ex_curr->icode) == (I_POPQ)) & ((id_ex_curr->destm) == (id_ex_next->srca) || (id_ex_curr->destm) == (id_ex_next->srcb)));
-    word_t dbubble = ((((id_ex_curr->icode) == (I_JMP)) & !(ex_mem_next->takebranch)) | (!(((id_ex_curr->icode) == (I_MRMOVQ) || (id_ex_curr->icode) == (I_POPQ)) & ((id_ex_curr->destm) == (id_ex_next->srca) || (id_ex_curr->destm) == (id_ex_next->srcb))) & ((I_RET) == (if_id_curr->icode) || (I_RET) == (id_ex_curr->icode) || (I_RET) == (ex_mem_curr->icode))));
+    word_t fstall = ((((sim->id_ex_curr->icode) == (I_MRMOVQ) || (sim->id_ex_curr->icode) == (I_POPQ)) & ((sim->id_ex_curr->destm) == (sim->id_ex_next->srca) || (sim->id_ex_curr->destm) == (sim->id_ex_next->srcb))) | ((I_RET) == (sim->if_id_curr->icode) || (I_RET) == (sim->id_ex_curr->icode) || (I_RET) == (sim->ex_mem_curr->icode)));
+    word_t dstall = (((sim->id_ex_curr->icode) == (I_MRMOVQ) || (sim->id_ex_curr->icode) == (I_POPQ)) & ((sim->id_ex_curr->destm) == (sim->id_ex_next->srca) || (sim->id_ex_curr->destm) == (sim->id_ex_next->srcb)));
+    word_t dbubble = ((((sim->id_ex_curr->icode) == (I_JMP)) & ((sim->ex_mem_next->takebranch) != (sim->id_ex_curr->predtaken))) | (!(((sim->id_ex_curr->icode) == (I_MRMOVQ) || (sim->id_ex_curr->icode) == (I_POPQ)) & ((sim->id_ex_curr->destm) == (sim->id_ex_next->srca) || (sim->id_ex_curr->destm) == (sim->id_ex_next->srcb))) & ((I_RET) == (sim->if_id_curr->icode) || (I_RET) == (sim->id_ex_curr->icode) || (I_RET) == (sim->ex_mem_curr->icode))));
     word_t estall = 0;
-    word_t ebubble = ((((id_ex_curr->icode) == (I_JMP)) & !(ex_mem_next->takebranch)) | (((id_ex_curr->icode) == (I_MRMOVQ) || (id_ex_curr->icode) == (I_POPQ)) & ((id_ex_curr->destm) == (id_ex_next->srca) || (id_ex_curr->destm) == (id_ex_next->srcb))));
+    word_t ebubble = ((((sim->id_ex_curr->icode) == (I_JMP)) & ((sim->ex_mem_next->takebranch) != (sim->id_ex_curr->predtaken))) | (((sim->id_ex_curr->icode) == (I_MRMOVQ) || (sim->id_ex_curr->icode) == (I_POPQ)) & ((sim->id_ex_curr->destm) == (sim->id_ex_next->srca) || (sim->id_ex_curr->destm) == (sim->id_ex_next->srcb))));
     word_t mstall = 0;
-    word_t mbubble = (((mem_wb_next->status) == (STAT_ADR) || (mem_wb_next->status) == (STAT_INS) || (mem_wb_next->status) == (STAT_HLT)) | ((mem_wb_curr->status) == (STAT_ADR) || (mem_wb_curr->status) == (STAT_INS) || (mem_wb_curr->status) == (STAT_HLT)));
-    word_t wstall = ((mem_wb_curr->status) == (STAT_ADR) || (mem_wb_curr->status) == (STAT_INS) || (mem_wb_curr->status) == (STAT_HLT));
+    word_t mbubble = (((sim->mem_wb_next->status) == (STAT_ADR) || (sim->mem_wb_next->status) == (STAT_INS) || (sim->mem_wb_next->status) == (STAT_HLT)) | ((sim->mem_wb_curr->status) == (STAT_ADR) || (sim->mem_wb_curr->status) == (STAT_INS) || (sim->mem_wb_curr->status) == (STAT_HLT)));
+    word_t wstall = ((sim->mem_wb_curr->status) == (STAT_ADR) || (sim->mem_wb_curr->status) == (STAT_INS) || (sim->mem_wb_curr->status) == (STAT_HLT));
     word_t wbubble = 0;
-    pc_state->op = pipe_cntl("PC", fstall, fbubble);
-    if_id_state->op = pipe_cntl("ID", dstall, dbubble);
-    id_ex_state->op = pipe_cntl("EX", estall, ebubble);
-    ex_mem_state->op = pipe_cntl("MEM", mstall, mbubble);
-    mem_wb_state->op = pipe_cntl("WB", wstall, wbubble);
+    sim->pc_state->op = pipe_cntl(sim, "PC", fstall, fbubble);
+    sim->if_id_state->op = pipe_cntl(sim, "ID", dstall, dbubble);
+    sim->id_ex_state->op = pipe_cntl(sim, "EX", estall, ebubble);
+    sim->ex_mem_state->op = pipe_cntl(sim, "MEM", mstall, mbubble);
+    sim->mem_wb_state->op = pipe_cntl(sim, "WB", wstall, wbubble);
 }
 
 /*
@@ -827,44 +1387,56 @@ void do_stall_check()
   if statusp nonnull, then will be set to status of final instruction
   if ccp nonnull, then will be set to condition codes of final instruction
 */
-word_t sim_run_pipe(word_t max_instr, word_t max_cycle, byte_t *statusp, cc_t *ccp)
+word_t sim_run_pipe(sim_t sim, word_t max_instr, word_t max_cycle, byte_t *statusp, cc_t *ccp)
 {
     word_t icount = 0;
     word_t ccount = 0;
     byte_t run_status = STAT_AOK;
     while (icount < max_instr && ccount < max_cycle)
     {
-        run_status = sim_step_pipe(max_instr - icount, ccount);
+        run_status = sim_step_pipe(sim, max_instr - icount, ccount);
         if (run_status != STAT_BUB)
             icount++;
         if (run_status != STAT_AOK && run_status != STAT_BUB)
             break;
+        if (sim->check && check_failed(sim->check))
+            break;
         ccount++;
     }
     if (statusp)
         *statusp = run_status;
     if (ccp)
-        *ccp = cc;
+        *ccp = lazy_cc_get(&sim->cc);
     return icount;
 }
 
 /* If dumpfile set nonNULL, lots of status info printed out */
-void sim_set_dumpfile(FILE *df)
+void sim_set_dumpfile(sim_t sim, FILE *df)
+{
+    sim->dumpfile = df;
+}
+
+/* Record event, and print it if logging text */
+void sim_event(sim_t sim, int kind, int arg, word_t a, word_t b, word_t c)
 {
-    dumpfile = df;
+    event_rec e = {a, b, c, kind, arg};
+    if (sim->events)
+        evlog_put(sim->events, &e);
+    if (sim->dumpfile)
+        print_event(sim->dumpfile, &e);
 }
 
 /*
  * sim_log dumps a formatted string to the dumpfile, if it exists
  * accepts variable argument list
  */
-void sim_log(const char *format, ...)
+void sim_log(sim_t sim, const char *format, ...)
 {
-    if (dumpfile)
+    if (sim->dumpfile)
     {
         va_list arg;
         va_start(arg, format);
-        vfprintf(dumpfile, format, arg);
+        vfprintf(sim->dumpfile, format, arg);
         va_end(arg);
     }
 }
@@ -874,60 +1446,50 @@ void sim_log(const char *format, ...)
  * Do not change any of these
  *************************************************************/
 
-/******************************************************************************
- *	defines
- ******************************************************************************/
-
-#define MAX_STAGE 10
-
-/******************************************************************************
- *	static variables
- ******************************************************************************/
-
-static pipe_ptr pipes[MAX_STAGE];
-static int pipe_count = 0;
-
 /******************************************************************************
  *	function definitions
  ******************************************************************************/
 
 /* Create new pipe with count bytes of state */
 /* bubble_val indicates state corresponding to pipeline bubble */
-pipe_ptr new_pipe(int count, void *bubble_val)
+pipe_ptr new_pipe(pipeline_ptr pl, int count, void *bubble_val)
 {
     pipe_ptr result = (pipe_ptr)malloc(sizeof(pipe_ele));
-    result->current = malloc(count);
-    result->next = malloc(count);
-    memcpy(result->current, bubble_val, count);
-    memcpy(result->next, bubble_val, count);
+    result->buf[0] = malloc(count);
+    result->buf[1] = malloc(count);
+    result->bubble = malloc(count);
+    memcpy(result->bubble, bubble_val, count);
     result->count = count;
-    result->op = P_LOAD;
-    result->bubble_val = bubble_val;
-    pipes[pipe_count++] = result;
+    pl->pipes[pl->count++] = result;
+    clear_pipe(result);
     return result;
 }
 
 /* Update all pipes */
-void update_pipes()
+void update_pipes(pipeline_ptr pl)
 {
     int s;
-    for (s = 0; s < pipe_count; s++)
+    for (s = 0; s < pl->count; s++)
     {
-        pipe_ptr p = pipes[s];
+        pipe_ptr p = pl->pipes[s];
         switch (p->op)
         {
         case P_BUBBLE:
             /* insert a bubble into the next stage */
-            memcpy(p->current, p->bubble_val, p->count);
+            p->current = p->bubble;
             break;
 
         case P_LOAD:
-            /* copy calculated state from previous stage */
-            memcpy(p->current, p->next, p->count);
+            /* calculated state from previous stage becomes current,
+               and the other buffer is free for the next cycle */
+            p->current = p->next;
+            p->next = p->next == p->buf[0] ? p->buf[1] : p->buf[0];
             break;
         case P_ERROR:
-            /* Like a bubble, but insert error condition */
-            memcpy(p->current, p->bubble_val, p->count);
+            /* Like a bubble, but insert error condition, so current
+               must be a copy the caller can change */
+            p->current = p->next == p->buf[0] ? p->buf[1] : p->buf[0];
+            memcpy(p->current, p->bubble, p->count);
             break;
         case P_STALL:
         default:
@@ -939,17 +1501,121 @@ void update_pipes()
     }
 }
 
+/* Set pipe to bubble value */
+void clear_pipe(pipe_ptr p)
+{
+    p->current = p->bubble;
+    p->next = p->buf[0];
+    memcpy(p->next, p->bubble, p->count);
+    p->op = P_LOAD;
+}
+
 /* Set all pipes to bubble values */
-void clear_pipes()
+void clear_pipes(pipeline_ptr pl)
+{
+    int s;
+    for (s = 0; s < pl->count; s++)
+        clear_pipe(pl->pipes[s]);
+}
+
+/* Free all pipes */
+void free_pipes(pipeline_ptr pl)
+{
+    int s;
+    for (s = 0; s < pl->count; s++)
+    {
+        pipe_ptr p = pl->pipes[s];
+        free(p->buf[0]);
+        free(p->buf[1]);
+        free(p->bubble);
+        free(p);
+    }
+    pl->count = 0;
+}
+
+/* Processor state: a copy of the simulator record, with copies of the
+   pipe registers, memory, registers and branch predictor it points to */
+struct sim_checkpoint_rec
+{
+    sim_rec sim;
+    void *current[MAX_STAGE];
+    void *next[MAX_STAGE];
+    p_stat_t op[MAX_STAGE];
+};
+
+sim_checkpoint_t sim_save_checkpoint(sim_t sim)
+{
+    sim_checkpoint_t cp =
+        (sim_checkpoint_t)malloc(sizeof(struct sim_checkpoint_rec));
+    int s;
+    cp->sim = *sim;
+    for (s = 0; s < sim->pipeline.count; s++)
+    {
+        pipe_ptr p = sim->pipeline.pipes[s];
+        cp->current[s] = malloc(p->count);
+        cp->next[s] = malloc(p->count);
+        memcpy(cp->current[s], p->current, p->count);
+        memcpy(cp->next[s], p->next, p->count);
+        cp->op[s] = p->op;
+    }
+    cp->sim.mem = copy_mem(sim->mem);
+    cp->sim.reg = copy_reg(sim->reg);
+    cp->sim.bpred = sim->bpred ? copy_bpred(sim->bpred) : NULL;
+    return cp;
+}
+
+void sim_restore_checkpoint(sim_t sim, sim_checkpoint_t cp)
+{
+    sim_rec keep = *sim;
+    int s;
+
+    *sim = cp->sim;
+    /* Simulator keeps its own pipes, memory, registers and predictor,
+       and whatever is watching it */
+    sim->pipeline = keep.pipeline;
+    sim->pc_state = keep.pc_state;
+    sim->if_id_state = keep.if_id_state;
+    sim->id_ex_state = keep.id_ex_state;
+    sim->ex_mem_state = keep.ex_mem_state;
+    sim->mem_wb_state = keep.mem_wb_state;
+    sim->check = keep.check;
+    sim->prof = keep.prof;
+    sim->dumpfile = keep.dumpfile;
+    sim->events = keep.events;
+    sim->ptrace = keep.ptrace;
+
+    for (s = 0; s < sim->pipeline.count; s++)
+    {
+        pipe_ptr p = sim->pipeline.pipes[s];
+        p->current = p->buf[1];
+        p->next = p->buf[0];
+        memcpy(p->current, cp->current[s], p->count);
+        memcpy(p->next, cp->next[s], p->count);
+        p->op = cp->op[s];
+    }
+    connect_pipes(sim);
+    free_mem(keep.mem);
+    sim->mem = copy_mem(cp->sim.mem);
+    sim->reg = keep.reg;
+    memcpy(sim->reg->regs, cp->sim.reg->regs, sizeof(sim->reg->regs));
+    if (keep.bpred)
+        free_bpred(keep.bpred);
+    sim->bpred = cp->sim.bpred ? copy_bpred(cp->sim.bpred) : NULL;
+}
+
+void sim_free_checkpoint(sim_checkpoint_t cp)
 {
     int s;
-    for (s = 0; s < pipe_count; s++)
+    for (s = 0; s < cp->sim.pipeline.count; s++)
     {
-        pipe_ptr p = pipes[s];
-        memcpy(p->current, p->bubble_val, p->count);
-        memcpy(p->next, p->bubble_val, p->count);
-        p->op = P_LOAD;
+        free(cp->current[s]);
+        free(cp->next[s]);
     }
+    free_mem(cp->sim.mem);
+    free_reg(cp->sim.reg);
+    if (cp->sim.bpred)
+        free_bpred(cp->sim.bpred);
+    free((void *)cp);
 }
 
 /*************** Bubbled version of stages *************/
@@ -962,7 +1628,9 @@ id_ex_ele bubble_id_ex = {I_NOP, 0, 0, 0, 0,
                           STAT_BUB, 0};
 
 ex_mem_ele bubble_ex_mem = {I_NOP, 0, FALSE, 0, 0,
-                            REG_NONE, REG_NONE, STAT_BUB, 0};
+                            REG_NONE, REG_NONE, REG_NONE, STAT_BUB, 0,
+                            LAZY_CC(DEFAULT_CC)};
 
 mem_wb_ele bubble_mem_wb = {I_NOP, 0, 0, 0, REG_NONE, REG_NONE,
-                            STAT_BUB, 0};
\ No newline at end of file
+                            STAT_BUB, 0, LAZY_CC(DEFAULT_CC),
+                            FALSE, 0, 0};
\ No newline at end of file
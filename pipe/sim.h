@@ -11,6 +11,14 @@ typedef enum { S_WEDGED, S_STALL, S_FORWARD } sim_mode_t;
 /* Pipeline stage identifiers for stage operation control */
 typedef enum { IF_STAGE, ID_STAGE, EX_STAGE, MEM_STAGE, WB_STAGE } stage_id_t;
 
+/* Why a pipe register holds a bubble: a stall_t, or STALL_NONE for an
+   instruction, and the instruction that caused it */
+typedef struct {
+    int cause;
+    word_t pc;
+    byte_t instr;
+} blame_rec, *blame_ptr;
+
 /********** Defines **************/
 
 /* Get ra out of one byte regid field */
@@ -20,91 +28,133 @@ typedef enum { IF_STAGE, ID_STAGE, EX_STAGE, MEM_STAGE, WB_STAGE } stage_id_t;
 #define GET_RB(r) LO4(r)
 
 
-/************ Global state declaration ****************/
-
-/* How many cycles have been simulated? */
-extern word_t cycles;
-/* How many instructions have passed through the EX stage? */
-extern word_t instructions;
-
-/* Both instruction and data memory */
-extern mem_t mem;
-
-/* Keep track of range of addresses that have been written */
-extern word_t minAddr;
-extern word_t memCnt;
-
-/* Register file */
-extern mem_t reg;
-/* Condition code register */
-extern cc_t cc;
-extern stat_t stat;
-
-/* Operand sources in EX (to show forwarding) */
-extern mux_source_t amux, bmux;
-
-/* Provide global access to current states of all pipeline registers */
-pipe_ptr pc_state, if_id_state, id_ex_state, ex_mem_state, mem_wb_state;
-
-/* Current States */
-extern pc_ptr pc_curr;
-extern if_id_ptr if_id_curr;
-extern id_ex_ptr id_ex_curr;
-extern ex_mem_ptr ex_mem_curr;
-extern mem_wb_ptr mem_wb_curr;
-
-/* Next States */
-extern pc_ptr pc_next;
-extern if_id_ptr if_id_next;
-extern id_ex_ptr id_ex_next;
-extern ex_mem_ptr ex_mem_next;
-extern mem_wb_ptr mem_wb_next;
-
-/* Pending updates to state */
-extern word_t cc_in;
-extern word_t wb_destE;
-extern word_t wb_valE;
-extern word_t wb_destM;
-extern word_t wb_valM;
-extern word_t mem_addr;
-extern word_t mem_data;
-extern bool_t mem_write;
-
-
-/* Intermdiate stage values that must be used by control functions */
-extern word_t f_pc;
-extern byte_t imem_icode;
-extern byte_t imem_ifun;
-extern bool_t imem_error;
-extern bool_t instr_valid;
-extern word_t d_regvala;
-extern word_t d_regvalb;
-extern word_t e_vala;
-extern word_t e_valb;
-extern bool_t e_bcond;
-extern bool_t dmem_error;
-
-/* Simulator operating mode */
-extern sim_mode_t sim_mode;
-/* Log file */
-extern FILE *dumpfile;
+/************ Simulator state ****************/
+
+/* Everything one simulation changes lives here, so several simulations
+   can run at once in different threads of one process */
+struct sim_rec {
+    /* How many cycles have been simulated? */
+    word_t cycles;
+    /* How many instructions have passed through the WB stage? */
+    word_t instructions;
+    /* Has simulator gotten past initial bubbles? */
+    int starting_up;
+
+    /* Both instruction and data memory */
+    mem_t mem;
+    /* Keep track of range of addresses that have been written */
+    word_t minAddr;
+    word_t memCnt;
+
+    /* Register file */
+    regfile_t reg;
+    /* Condition code register */
+    lazy_cc_rec cc;
+    /* Status code */
+    stat_t status;
+
+    /* Operand sources in EX (to show forwarding) */
+    mux_source_t amux, bmux;
+
+    /* All pipeline registers, and the state of each */
+    pipeline_ele pipeline;
+    pipe_ptr pc_state, if_id_state, id_ex_state, ex_mem_state, mem_wb_state;
+
+    /* Current States */
+    pc_ptr pc_curr;
+    if_id_ptr if_id_curr;
+    id_ex_ptr id_ex_curr;
+    ex_mem_ptr ex_mem_curr;
+    mem_wb_ptr mem_wb_curr;
+
+    /* Next States */
+    pc_ptr pc_next;
+    if_id_ptr if_id_next;
+    id_ex_ptr id_ex_next;
+    ex_mem_ptr ex_mem_next;
+    mem_wb_ptr mem_wb_next;
+
+    /* Pending updates to state */
+    lazy_cc_rec cc_in;
+    word_t wb_destE;
+    word_t wb_valE;
+    word_t wb_destM;
+    word_t wb_valM;
+    word_t mem_addr;
+    word_t mem_data;
+    bool_t mem_write;
+
+    /* Intermdiate stage values that must be used by control functions */
+    word_t f_pc;
+    byte_t imem_icode;
+    byte_t imem_ifun;
+    bool_t imem_error;
+    bool_t instr_valid;
+    word_t d_regvala;
+    word_t d_regvalb;
+    word_t e_vala;
+    word_t e_valb;
+    bool_t e_bcond;
+    bool_t dmem_error;
+
+    /* ISA simulator checking each instruction retired by WB, or NULL */
+    struct check_rec *check;
+    /* Profile of instructions retired by WB, or NULL */
+    struct prof_rec *prof;
+    /* Branch predictor, or NULL to predict every jump taken */
+    struct bpred_rec *bpred;
+    /* Cause of the contents of each pipe register, and of the bubbles
+       do_stall_check asked for at the next update */
+    blame_rec blame[WB_STAGE+1];
+    blame_rec new_blame[WB_STAGE+1];
+    /* Cycles in which WB held a bubble, by cause */
+    word_t lost[STALL_NCAUSES];
+
+    /* Simulator operating mode */
+    sim_mode_t sim_mode;
+    /* Log file */
+    FILE *dumpfile;
+    /* Binary log of recent events, or NULL */
+    struct evlog_rec *events;
+    /* Pipeline trace, or NULL */
+    struct pipetrace_rec *ptrace;
+    /* Number of instruction in fetch stage, and of last one fetched */
+    word_t f_seq;
+    word_t last_seq;
+};
 
 /*************** Simulation Control Functions ***********/
 
 /* Bubble next execution of specified stage */
-void sim_bubble_stage(stage_id_t stage);
+void sim_bubble_stage(sim_t sim, stage_id_t stage);
 
 /* Stall stage (has effect at next update) */
-void sim_stall_stage(stage_id_t stage);
+void sim_stall_stage(sim_t sim, stage_id_t stage);
 
 /* Sets the simulator name (called from main routine in HCL file) */
 void set_simname(char *name);
 
-/* Initialize simulator */
-void sim_init();
+/* Create simulator with cleared memory, registers and pipeline */
+sim_t sim_init();
+
+void sim_free(sim_t sim);
 
 /* Reset simulator state, including register, instruction, and data memories */
-void sim_reset();
+void sim_reset(sim_t sim);
+
+/* Saved simulator state.  Memory is shared with the simulator, page by
+   page, until one of them writes it, so checkpoints are cheap */
+typedef struct sim_checkpoint_rec *sim_checkpoint_t;
+
+/* Save state of simulator */
+sim_checkpoint_t sim_save_checkpoint(sim_t sim);
+
+/* Return simulator to saved state.  Checkpoint can be restored again.
+   The checker, profile, logs and trace attached to the simulator stay
+   attached, and are not rewound */
+void sim_restore_checkpoint(sim_t sim, sim_checkpoint_t cp);
+
+void sim_free_checkpoint(sim_checkpoint_t cp);
 
 /*
   Run pipeline until one of following occurs:
@@ -116,14 +166,33 @@ void sim_reset();
   if statusp nonnull, then will be set to status of final instruction
   if ccp nonnull, then will be set to condition codes of final instruction
 */
-word_t sim_run_pipe(word_t max_instr, word_t max_cycle, byte_t *statusp, cc_t *ccp);
+word_t sim_run_pipe(sim_t sim, word_t max_instr, word_t max_cycle, byte_t *statusp, cc_t *ccp);
 
 /* If dumpfile set nonNULL, lots of status info printed out */
-void sim_set_dumpfile(FILE *file);
+void sim_set_dumpfile(sim_t sim, FILE *file);
 
 /*
  * sim_log dumps a formatted string to the dumpfile, if it exists
  * accepts variable argument list
  */
-void sim_log( const char *format, ... );
+void sim_log(sim_t sim, const char *format, ... );
+
+/* Record event in the event log and print it to the dumpfile */
+void sim_event(sim_t sim, int kind, int arg, word_t a, word_t b, word_t c);
+
+/* Logging is tested before any arguments are evaluated, so quiet runs
+   pay one branch per call.  Building with -DNO_SIM_LOG removes it */
+#ifdef NO_SIM_LOG
+#define sim_logging(sim) 0
+#define sim_recording(sim) 0
+#else
+#define sim_logging(sim) ((sim)->dumpfile != NULL)
+#define sim_recording(sim) ((sim)->events != NULL)
+#endif
+
+#define SIM_LOG(sim, ...) \
+    do { if (sim_logging(sim)) sim_log(sim, __VA_ARGS__); } while (0)
+#define SIM_EVENT(sim, kind, arg, a, b, c) \
+    do { if (sim_logging(sim) || sim_recording(sim)) \
+	     sim_event(sim, kind, arg, a, b, c); } while (0)
 
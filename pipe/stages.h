@@ -22,6 +22,11 @@ typedef struct {
     stat_t status;
     /* The following is included for debugging */
     word_t stage_pc;
+    /* The following is included for pipeline traces */
+    word_t seq;         /* Number of instruction in fetch order, 0 for bubble */
+    /* The following is included for branch prediction */
+    bool_t predtaken;   /* Was conditional jump predicted taken? */
+    word_t predhist;    /* Predictor history it was predicted with */
 } if_id_ele, *if_id_ptr;
 
 /* ID/EX Pipe Register */
@@ -38,6 +43,11 @@ typedef struct {
     stat_t status;
     /* The following is included for debugging */
     word_t stage_pc;
+    /* The following is included for pipeline traces */
+    word_t seq;         /* Number of instruction in fetch order, 0 for bubble */
+    /* The following is included for branch prediction */
+    bool_t predtaken;   /* Was conditional jump predicted taken? */
+    word_t predhist;    /* Predictor history it was predicted with */
 } id_ex_ele, *id_ex_ptr;
 
 /* EX/MEM Pipe Register */
@@ -53,6 +63,13 @@ typedef struct {
     stat_t status;
     /* The following is included for debugging */
     word_t stage_pc;
+    /* The following is included for ISA checking */
+    lazy_cc_rec cc;     /* Condition codes set by OPq */
+    /* The following is included for pipeline traces */
+    word_t seq;         /* Number of instruction in fetch order, 0 for bubble */
+    /* The following is included for branch prediction */
+    bool_t predtaken;   /* Was conditional jump predicted taken? */
+    word_t predhist;    /* Predictor history it was predicted with */
 } ex_mem_ele, *ex_mem_ptr;
 
 /* Mem/WB Pipe Register */
@@ -66,6 +83,13 @@ typedef struct {
     stat_t status;
     /* The following is included for debugging */
     word_t stage_pc;
+    /* The following is included for ISA checking */
+    lazy_cc_rec cc;     /* Condition codes set by OPq */
+    bool_t mem_write;   /* Did MEM stage write memory? */
+    word_t mem_addr;
+    word_t mem_data;
+    /* The following is included for pipeline traces */
+    word_t seq;         /* Number of instruction in fetch order, 0 for bubble */
 } mem_wb_ele, *mem_wb_ptr;
 
 /************ Global Declarations ********************/
@@ -78,14 +102,17 @@ extern mem_wb_ele bubble_mem_wb;
 
 /************ Function declarations *******************/
 
+/* Simulator state, defined in sim.h */
+typedef struct sim_rec sim_rec, *sim_t;
+
 /* Stage functions */
-void do_if_stage();
-void do_id_stage();  /* Both ID and WB */
-void do_ex_stage();
-void do_mem_stage();
-void do_wb_stage();  /* Both ID and WB */
+void do_if_stage(sim_t sim);
+void do_id_stage(sim_t sim);  /* Both ID and WB */
+void do_ex_stage(sim_t sim);
+void do_mem_stage(sim_t sim);
+void do_wb_stage(sim_t sim);  /* Both ID and WB */
 
 /* Set stalling conditions for different stages */
-void do_stall_check();
+void do_stall_check(sim_t sim);
 
 
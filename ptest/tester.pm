@@ -5,6 +5,9 @@
 # Where's the assembler?
 $yas = "../misc/yas";
 
+# Converts .yo or .ys files to binary images with the assembler library
+$yo2bin = "../misc/yo2bin";
+
 # Which simulator is being tested?
 $sim = "../pipe/psim";
 
@@ -36,6 +39,8 @@ $testcache = 0;
 $tcount = 0;
 $ecount = 0;
 $pecount = 0;
+$acount = 0;
+$aecount = 0;
 
 sub run_test
 {
@@ -53,15 +58,26 @@ sub run_sim_test
 {
     local ($tname) = @_;
     local ($cache) = $_[1];
-    system "$yas $tname.ys" || die "Can't open file $tname.ys\n";
+    # Simulators assemble .ys files themselves, except pcsim
+    local $obj = "$tname.ys";
+    if ($testcache) {
+	system "$yas $tname.ys" || die "Can't open file $tname.ys\n";
+	$obj = "$tname.yo";
+    }
     local $result = ``;
     if (testcache) {
-        $result = `$sim -v 0 -t $cache $tname.yo`;
+        $result = `$sim -v 0 -t $cache $obj`;
     } else {
-        $result = `$sim -v 0 -t $tname.yo`;
+        $result = `$sim -v 0 -t $obj`;
+    }
+    if (!$testcache) {
+	&check_asm($tname);
     }
-    if (!($result =~ "Succeed")) {
+    if (!($result =~ "Succeed") || $result =~ "Check Fails") {
 	print "Test $tname $cache failed\n";
+	# Show where the simulator left the ISA
+	print grep(/^(ISA divergence|Pipeline:|ISA:|Checkpoint)/,
+		   split(/^/m, $result));
 	$ecount++;
 	if (!($outputdir eq ".")) {
 	  system "mv $tname.ys $outputdir";
@@ -90,7 +106,25 @@ sub run_sim_test
 	}
     }
     $tcount++;
-    system "rm $tname.yo";
+    if ($testcache) {
+	system "rm $tname.yo";
+    }
+}
+
+# The simulators assemble .ys files with the assembler library.  Check
+# that it gives the same image as yas
+sub check_asm
+{
+    local ($tname) = @_;
+    system "$yas $tname.ys";
+    system "$yo2bin -o $tname-yas.ybo $tname.yo > /dev/null";
+    system "$yo2bin -o $tname-asm.ybo $tname.ys > /dev/null";
+    $acount++;
+    if (system("cmp -s $tname-yas.ybo $tname-asm.ybo") != 0) {
+	print "Test $tname: assembled image differs from yas\n";
+	$aecount++;
+    }
+    system "rm -f $tname.yo $tname-yas.ybo $tname-asm.ybo";
 }
 
 sub run_vlog_test
@@ -131,6 +165,13 @@ sub test_stat
     } else {
 	print "  $ecount/$tcount ISA Checks Failed\n";
     }
+    if ($acount > 0) {
+	if ($aecount == 0) {
+	    print "  All $acount Assembler Checks Succeed\n";
+	} else {
+	    print "  $aecount/$acount Assembler Checks Failed\n";
+	}
+    }
     if ($check_perf) {
 	if ($pecount == 0) {
 	    print "  All $tcount Performance Checks Succeed\n";
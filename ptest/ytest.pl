@@ -0,0 +1,79 @@
+#!/usr/bin/perl 
+#!/usr/local/bin/perl 
+# Test yis against itself on the example programs:
+#   -o  the binary trace, printed by ytrace, lists the same
+#       instructions as -v 1
+#   -r  stepping back n of the s steps run leaves the state
+#       after s-n steps
+#   -p  running back to the entry point leaves the initial state
+
+use Getopt::Std;
+use lib ".";
+use tester;
+
+$sim = "../misc/yis";
+cmdline();
+
+$ytrace = "../misc/ytrace";
+
+@progs = (glob("../y86-code/*.ys"), glob("./memory/*.ys"));
+
+foreach $p (@progs) {
+    &trace_test($p);
+    &undo_test($p);
+}
+
+&test_stat();
+
+# Retired instruction lines of -v 1 output
+sub retired
+{
+    local ($result) = @_;
+    return join("", grep(/^0x[0-9a-f]+: /, split(/^/m, $result)));
+}
+
+sub trace_test
+{
+    local ($p) = @_;
+    local $result = `$sim -v 1 -o ytest.trc $p`;
+    local $v1 = &retired($result);
+    local $tr = `$ytrace ytest.trc`;
+    if ($v1 eq "" || $v1 ne $tr) {
+	print "Test $p -o failed\n";
+	$ecount++;
+    }
+    system "rm -f ytest.trc";
+    $tcount++;
+}
+
+# Final state report, without the line saying how far yis stepped back
+sub final_state
+{
+    local ($result) = @_;
+    return join("", grep(!/^Stepped back/, split(/^/m, $result)));
+}
+
+sub undo_check
+{
+    local ($p, $flags, $steps) = @_;
+    local $back = `$sim -v 0 $flags $p`;
+    local $fwd = `$sim -v 0 $p $steps`;
+    if (&final_state($back) ne $fwd) {
+	print "Test $p $flags failed\n";
+	$ecount++;
+    }
+    $tcount++;
+}
+
+sub undo_test
+{
+    local ($p) = @_;
+    local $result = `$sim -v 0 $p`;
+    $result =~ /Stopped in ([0-9]+) steps/;
+    local $steps = $1;
+    local $n;
+    foreach $n (1, int($steps / 2), $steps) {
+	&undo_check($p, "-r $n", $steps - $n);
+    }
+    &undo_check($p, "-p 0", 0);
+}
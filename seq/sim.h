@@ -8,54 +8,86 @@
 #define GET_RB(r) LO4(r)
 
 
-/************ Global state declaration ****************/
-
-/* Both instruction and data memory */
-extern mem_t mem;
-
-/* Keep track of range of addresses that have been written */
-extern word_t minAddr;
-extern word_t memCnt;
-
-/* Register file */
-extern mem_t reg;
-/* Condition code register */
-extern cc_t cc;
-/* Program counter */
-extern word_t pc;
-
-/* Intermdiate stage values that must be used by control functions */
-extern byte_t imem_icode;
-extern byte_t imem_ifun;
-extern byte_t icode;
-extern word_t ifun;
-extern word_t ra;
-extern word_t rb;
-extern word_t valc;
-extern word_t valp;
-extern bool_t imem_error;
-extern bool_t instr_valid;
-extern word_t vala;
-extern word_t valb;
-extern word_t vale;
-extern bool_t bcond;
-extern bool_t cond;
-extern word_t valm;
-extern bool_t dmem_error;
-extern byte_t status;
-
-/* Log file */
-extern FILE *dumpfile;
+/************ Simulator state ****************/
+
+/* Everything one simulation changes lives here, so several simulations
+   can run at once in different threads of one process */
+typedef struct sim_rec {
+    /* Both instruction and data memory */
+    mem_t mem;
+    /* Keep track of range of addresses that have been written */
+    word_t minAddr;
+    word_t memCnt;
+
+    /* Register file */
+    regfile_t reg;
+    /* Condition code register, and input to it */
+    lazy_cc_rec cc;
+    lazy_cc_rec cc_in;
+    /* Program counter, and input to it */
+    word_t pc;
+    word_t pc_in;
+
+    /* Intermdiate stage values that must be used by control functions */
+    byte_t imem_icode;
+    byte_t imem_ifun;
+    byte_t icode;
+    word_t ifun;
+    byte_t instr;
+    word_t ra;
+    word_t rb;
+    word_t valc;
+    word_t valp;
+    bool_t imem_error;
+    bool_t instr_valid;
+    word_t srcA;
+    word_t srcB;
+    word_t destE;
+    word_t destM;
+    word_t vala;
+    word_t valb;
+    word_t vale;
+    bool_t bcond;
+    bool_t cond;
+    word_t valm;
+    bool_t dmem_error;
+    bool_t mem_write;
+    word_t mem_addr;
+    word_t mem_data;
+    byte_t status;
+
+    /* Log file */
+    FILE *dumpfile;
+    /* Copy of initial mem and reg for per-step diff display */
+    mem_t mem0;
+    regfile_t reg0;
+    /* Profile of executed instructions, or NULL */
+    struct prof_rec *prof;
+} sim_rec, *sim_t;
 
 
 /* Sets the simulator name (called from main routine in HCL file) */
 void set_simname(char *name);
 
-/* Initialize simulator */
-void sim_init();
+/* Create simulator with cleared memory and registers */
+sim_t sim_init();
+
+void sim_free(sim_t sim);
 
 /* Reset simulator state, including register, instruction, and data memories */
-void sim_reset();
+void sim_reset(sim_t sim);
+
+/* Saved simulator state.  Memory is shared with the simulator, page by
+   page, until one of them writes it, so checkpoints are cheap */
+typedef struct sim_checkpoint_rec *sim_checkpoint_t;
+
+/* Save state of simulator */
+sim_checkpoint_t sim_save_checkpoint(sim_t sim);
+
+/* Return simulator to saved state.  Checkpoint can be restored again */
+void sim_restore_checkpoint(sim_t sim, sim_checkpoint_t cp);
+
+void sim_free_checkpoint(sim_checkpoint_t cp);
 
 /*
   Run processor until one of following occurs:
@@ -66,15 +98,26 @@ void sim_reset();
   if statusp nonnull, then will be set to status of final instruction
   if ccp nonnull, then will be set to condition codes of final instruction
 */
-word_t sim_run(word_t max_instr, byte_t *statusp, cc_t *ccp);
+word_t sim_run(sim_t sim, word_t max_instr, byte_t *statusp, cc_t *ccp);
 
 /* If dumpfile set nonNULL, lots of status info printed out */
-void sim_set_dumpfile(FILE *file);
+void sim_set_dumpfile(sim_t sim, FILE *file);
 
 /*
  * sim_log dumps a formatted string to the dumpfile, if it exists
  * accepts variable argument list
  */
-void sim_log( const char *format, ... );
+void sim_log(sim_t sim, const char *format, ... );
+
+/* Logging is tested before any arguments are evaluated, so quiet runs
+   pay one branch per call.  Building with -DNO_SIM_LOG removes it */
+#ifdef NO_SIM_LOG
+#define sim_logging(sim) 0
+#else
+#define sim_logging(sim) ((sim)->dumpfile != NULL)
+#endif
+
+#define SIM_LOG(sim, ...) \
+    do { if (sim_logging(sim)) sim_log(sim, __VA_ARGS__); } while (0)
 
 								       
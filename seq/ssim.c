@@ -13,6 +13,8 @@
 #include <string.h>
 #include "isa.h"
 #include "sim.h"
+#include "asm.h"
+#include "prof.h"
 
 #define MAXBUF 1024
 
@@ -34,9 +36,9 @@ FILE *object_file;       /* Input file handle */
 bool_t verbosity = 2;    /* Verbosity level [TTY only] (-v) */ 
 word_t instr_limit = 10000; /* Instruction limit [TTY only] (-l) */
 bool_t do_check = FALSE; /* Test with YIS? [TTY only] (-t) */
-
-/* keep a copy of mem and reg for diff display */
-mem_t mem0, reg0;
+bool_t do_ckpt_check = FALSE; /* Replay from a checkpoint? [TTY only] (-k) */
+FILE *prof_file = NULL;  /* Profile listing [TTY only] (-P) */
+FILE *folded_file = NULL; /* Folded call stacks [TTY only] (-F) */
 
 /************* 
  * End Globals 
@@ -49,6 +51,7 @@ mem_t mem0, reg0;
 
 static void usage(char *name);           /* Print helpful usage message */
 static void run_tty_sim();               /* Run simulator in TTY mode */
+static bool_t checkpoint_check(sim_t sim); /* Replay run from checkpoint (-k) */
 
 /*************************
  * End function prototypes
@@ -73,7 +76,7 @@ int sim_main(int argc, char **argv)
     int c;
     
     /* Parse the command line arguments */
-    while ((c = getopt(argc, argv, "htl:v:")) != -1) {
+    while ((c = getopt(argc, argv, "htkl:v:P:F:")) != -1) {
 	switch(c) {
 	case 'h':
 	    usage(argv[0]);
@@ -91,6 +94,23 @@ int sim_main(int argc, char **argv)
 	case 't':
 	    do_check = TRUE;
 	    break;
+	case 'k':
+	    do_ckpt_check = TRUE;
+	    break;
+	case 'P':
+	    prof_file = fopen(optarg, "w");
+	    if (!prof_file) {
+		fprintf(stderr, "Couldn't open profile file %s\n", optarg);
+		exit(1);
+	    }
+	    break;
+	case 'F':
+	    folded_file = fopen(optarg, "w");
+	    if (!folded_file) {
+		fprintf(stderr, "Couldn't open profile file %s\n", optarg);
+		exit(1);
+	    }
+	    break;
 	default:
 	    printf("Invalid option '%c'\n", c);
 	    usage(argv[0]);
@@ -137,10 +157,12 @@ int main(int argc, char *argv[]) {return sim_main(argc,argv);}
 static void run_tty_sim() 
 {
     word_t icount = 0;
-    status = STAT_AOK;
     cc_t result_cc = 0;
     word_t byte_cnt = 0;
     state_ptr isa_state = NULL;
+    bool_t ckpt_match = TRUE;
+    image_rec img;
+    sim_t sim;
 
 
     /* In TTY mode, the default object file comes from stdin */
@@ -149,14 +171,14 @@ static void run_tty_sim()
     }
 
     /* Initializations */
+    sim = sim_init();
     if (verbosity >= 2)
-	sim_set_dumpfile(stdout);
-    sim_init();
+	sim_set_dumpfile(sim, stdout);
 
     /* Emit simulator name */
     printf("%s\n", simname);
 
-    byte_cnt = load_mem(mem, object_file, 1);
+    byte_cnt = load_program(sim->mem, object_file, object_filename, &img, 1);
     if (byte_cnt == 0) {
 	fprintf(stderr, "No lines of code found\n");
 	exit(1);
@@ -164,28 +186,35 @@ static void run_tty_sim()
 	printf("%lld bytes of code read\n", byte_cnt);
     }
     fclose(object_file);
+    /* Before anything is attached to watch the run */
+    if (do_ckpt_check)
+	ckpt_match = checkpoint_check(sim);
     if (do_check) {
 	isa_state = new_state(0);
-	free_mem(isa_state->r);
+	free_reg(isa_state->r);
 	free_mem(isa_state->m);
-	isa_state->m = copy_mem(mem);
-	isa_state->r = copy_mem(reg);
-	isa_state->cc = cc;
+	isa_state->m = copy_mem(sim->mem);
+	isa_state->r = copy_reg(sim->reg);
+	isa_state->cc = sim->cc;
     }
 
-    mem0 = copy_mem(mem);
-    reg0 = copy_mem(reg);
+    if (prof_file || folded_file)
+	/* Symbols name the functions */
+	sim->prof = new_prof(&img);
+
+    sim->mem0 = copy_mem(sim->mem);
+    sim->reg0 = copy_reg(sim->reg);
     
 
-    icount = sim_run(instr_limit, &status, &result_cc);
+    icount = sim_run(sim, instr_limit, &sim->status, &result_cc);
     if (verbosity > 0) {
 	printf("%lld instructions executed\n", icount);
-	printf("Status = %s\n", stat_name(status));
+	printf("Status = %s\n", stat_name(sim->status));
 	printf("Condition Codes: %s\n", cc_name(result_cc));
 	printf("Changed Register State:\n");
-	diff_reg(reg0, reg, stdout);
+	diff_reg(sim->reg0, sim->reg, stdout);
 	printf("Changed Memory State:\n");
-	diff_mem(mem0, mem, stdout);
+	diff_mem(sim->mem0, sim->mem, stdout);
     }
     if (do_check) {
 	byte_t e = STAT_AOK;
@@ -196,25 +225,25 @@ static void run_tty_sim()
 	    e = step_state(isa_state, stdout);
 	}
 
-	if (diff_reg(isa_state->r, reg, NULL)) {
+	if (diff_reg(isa_state->r, sim->reg, NULL)) {
 	    match = FALSE;
 	    if (verbosity > 0) {
 		printf("ISA Register != Pipeline Register File\n");
-		diff_reg(isa_state->r, reg, stdout);
+		diff_reg(isa_state->r, sim->reg, stdout);
 	    }
 	}
-	if (diff_mem(isa_state->m, mem, NULL)) {
+	if (diff_mem(isa_state->m, sim->mem, NULL)) {
 	    match = FALSE;
 	    if (verbosity > 0) {
 		printf("ISA Memory != Pipeline Memory\n");
-		diff_mem(isa_state->m, mem, stdout);
+		diff_mem(isa_state->m, sim->mem, stdout);
 	    }
 	}
-	if (isa_state->cc != result_cc) {
+	if (lazy_cc_get(&isa_state->cc) != result_cc) {
 	    match = FALSE;
 	    if (verbosity > 0) {
 		printf("ISA Cond. Codes (%s) != Pipeline Cond. Codes (%s)\n",
-		       cc_name(isa_state->cc), cc_name(result_cc));
+		       cc_name(lazy_cc_get(&isa_state->cc)), cc_name(result_cc));
 	    }
 	}
 	if (match) {
@@ -223,20 +252,93 @@ static void run_tty_sim()
 	    printf("ISA Check Fails\n");
 	}
     }
+    if (do_ckpt_check) {
+	if (ckpt_match) {
+	    printf("Checkpoint Check Succeeds\n");
+	} else {
+	    printf("Checkpoint Check Fails\n");
+	}
+    }
+    if (sim->prof) {
+	if (prof_file) {
+	    prof_listing(sim->prof, sim->mem0, prof_file);
+	    fclose(prof_file);
+	}
+	if (folded_file) {
+	    prof_folded(sim->prof, folded_file);
+	    fclose(folded_file);
+	}
+	free_prof(sim->prof);
+	sim->prof = NULL;
+    }
+    free_image(&img);
 }
 
 
+/*
+ * checkpoint_check - Run the program straight through, then run to
+ * halfway, checkpoint, finish, restore the checkpoint and finish
+ * again.  Return whether both finishes match the straight run.  The
+ * simulator is left as it started
+ */
+static bool_t checkpoint_check(sim_t sim)
+{
+    sim_checkpoint_t start = sim_save_checkpoint(sim);
+    sim_checkpoint_t cp;
+    FILE *dumpfile = sim->dumpfile;
+    bool_t v = verbosity;
+    byte_t status0, status;
+    cc_t cc0, cc;
+    mem_t mem0;
+    regfile_t reg0;
+    word_t icount0, icount, half;
+    bool_t match = TRUE;
+    int pass;
+
+    /* Replays are not shown */
+    sim->dumpfile = NULL;
+    verbosity = 0;
+    icount0 = sim_run(sim, instr_limit, &status0, &cc0);
+    mem0 = copy_mem(sim->mem);
+    reg0 = copy_reg(sim->reg);
+
+    sim_restore_checkpoint(sim, start);
+    half = icount0 / 2;
+    sim_run(sim, half, &status, &cc);
+    cp = sim_save_checkpoint(sim);
+    for (pass = 0; pass < 2; pass++) {
+	if (pass > 0)
+	    sim_restore_checkpoint(sim, cp);
+	icount = half + sim_run(sim, instr_limit - half, &status, &cc);
+	if (icount != icount0 || status != status0 || cc != cc0 ||
+	    diff_reg(reg0, sim->reg, NULL) || diff_mem(mem0, sim->mem, NULL))
+	    match = FALSE;
+    }
+
+    sim_restore_checkpoint(sim, start);
+    sim->dumpfile = dumpfile;
+    verbosity = v;
+    sim_free_checkpoint(start);
+    sim_free_checkpoint(cp);
+    free_mem(mem0);
+    free_reg(reg0);
+    return match;
+}
+
 
 /*
  * usage - print helpful diagnostic information
  */
 static void usage(char *name)
 {
-    printf("Usage: %s [-htg] [-l m] [-v n] file.yo\n", name);
+    printf("Usage: %s [-htgk] [-l m] [-v n] [-P f] [-F f] file.yo|file.ys\n", name);
     printf("   -h     Print this message\n");
     printf("   -l m   Set instruction limit to m [TTY mode only] (default %lld)\n", instr_limit);
     printf("   -v n   Set verbosity level to 0 <= n <= 3 [TTY mode only] (default %d)\n", verbosity);
     printf("   -t     Test result against ISA simulator (yis) [TTY mode only]\n");
+    printf("   -k     Check that a run replayed from a checkpoint matches [TTY mode only]\n");
+    printf("   -P f   Write profile to f: count per instruction and branch outcomes [TTY mode only]\n");
+    printf("   -F f   Write call stacks to f in folded format, for flame graphs [TTY mode only]\n");
     exit(0);
 }
 
@@ -247,132 +349,126 @@ static void usage(char *name)
  * You only need to modify function sim_step()
  *********************************************************/
 
-/**********************
- * Begin Part 2 Globals
- **********************/
-
-/*
- * Variables related to hardware units in the processor
- */
-mem_t mem;  /* Instruction and data memory */
-word_t minAddr = 0;
-word_t memCnt = 0;
-
-/* Other processor state */
-mem_t reg;               /* Register file */
-cc_t cc = DEFAULT_CC;    /* Condition code register */
-cc_t cc_in = DEFAULT_CC; /* Input to condition code register */
-
-/* Program Counter */
-word_t pc = 0; /* Program counter value */
-word_t pc_in = 0;/* Input to program counter */
-
-/* Intermediate values */
-byte_t imem_icode = I_NOP;
-byte_t imem_ifun = F_NONE;
-byte_t icode = I_NOP;
-word_t ifun = 0;
-byte_t instr = HPACK(I_NOP, F_NONE);
-word_t ra = REG_NONE;
-word_t rb = REG_NONE;
-word_t valc = 0;
-word_t valp = 0;
-bool_t imem_error;
-bool_t instr_valid;
-
-word_t srcA = REG_NONE;
-word_t srcB = REG_NONE;
-word_t destE = REG_NONE;
-word_t destM = REG_NONE;
-word_t vala = 0;
-word_t valb = 0;
-word_t vale = 0;
-
-bool_t bcond = FALSE;
-bool_t cond = FALSE;
-word_t valm = 0;
-bool_t dmem_error;
-
-bool_t mem_write = FALSE;
-word_t mem_addr = 0;
-word_t mem_data = 0;
-byte_t status = STAT_AOK;
-
-/* Log file */
-FILE *dumpfile = NULL;
-
-
-/********************
- * End Part 2 Globals
- ********************/
-
-
-static int initialized = 0;
-void sim_init()
+sim_t sim_init()
 {
+    sim_t sim = (sim_t) calloc(1, sizeof(sim_rec));
 
     /* Create memory and register files */
-    initialized = 1;
-    mem = init_mem(MEM_SIZE);
-    reg = init_reg();
-    sim_reset();
-    clear_mem(mem);
+    sim->mem = init_mem(MEM_SIZE);
+    sim->reg = init_reg();
+    sim->pc = 0;
+    sim->imem_icode = I_NOP;
+    sim->imem_ifun = F_NONE;
+    sim->status = STAT_AOK;
+    sim_reset(sim);
+    clear_mem(sim->mem);
+    return sim;
+}
+
+void sim_free(sim_t sim)
+{
+    free_mem(sim->mem);
+    free_reg(sim->reg);
+    if (sim->mem0)
+	free_mem(sim->mem0);
+    if (sim->reg0)
+	free_reg(sim->reg0);
+    free((void *) sim);
 }
 
-void sim_reset()
+void sim_reset(sim_t sim)
 {
-    if (!initialized)
-	sim_init();
-    clear_mem(reg);
-    minAddr = 0;
-    memCnt = 0;
-
-	pc_in = 0;
-    cc = DEFAULT_CC;
-    cc_in = DEFAULT_CC;
-    destE = REG_NONE;
-    destM = REG_NONE;
-    mem_write = FALSE;
-    mem_addr = 0;
-    mem_data = 0;
+    clear_reg(sim->reg);
+    sim->minAddr = 0;
+    sim->memCnt = 0;
+
+	sim->pc_in = 0;
+    lazy_cc_load(&sim->cc, DEFAULT_CC);
+    lazy_cc_load(&sim->cc_in, DEFAULT_CC);
+    sim->destE = REG_NONE;
+    sim->destM = REG_NONE;
+    sim->mem_write = FALSE;
+    sim->mem_addr = 0;
+    sim->mem_data = 0;
 
     /* Reset intermediate values to clear display */
-    icode = I_NOP;
-    ifun = 0;
-    instr = HPACK(I_NOP, F_NONE);
-    ra = REG_NONE;
-    rb = REG_NONE;
-    valc = 0;
-    valp = 0;
-
-    srcA = REG_NONE;
-    srcB = REG_NONE;
-    destE = REG_NONE;
-    destM = REG_NONE;
-    vala = 0;
-    valb = 0;
-    vale = 0;
-
-    cond = FALSE;
-    bcond = FALSE;
-    valm = 0;
+    sim->icode = I_NOP;
+    sim->ifun = 0;
+    sim->instr = HPACK(I_NOP, F_NONE);
+    sim->ra = REG_NONE;
+    sim->rb = REG_NONE;
+    sim->valc = 0;
+    sim->valp = 0;
+
+    sim->srcA = REG_NONE;
+    sim->srcB = REG_NONE;
+    sim->destE = REG_NONE;
+    sim->destM = REG_NONE;
+    sim->vala = 0;
+    sim->valb = 0;
+    sim->vale = 0;
+
+    sim->cond = FALSE;
+    sim->bcond = FALSE;
+    sim->valm = 0;
+}
+
+/* Processor state: a copy of the simulator record, with copies of the
+   memory and registers it points to */
+struct sim_checkpoint_rec {
+    sim_rec sim;
+};
+
+sim_checkpoint_t sim_save_checkpoint(sim_t sim)
+{
+    sim_checkpoint_t cp =
+	(sim_checkpoint_t) malloc(sizeof(struct sim_checkpoint_rec));
+    cp->sim = *sim;
+    cp->sim.mem = copy_mem(sim->mem);
+    cp->sim.reg = copy_reg(sim->reg);
+    return cp;
+}
+
+void sim_restore_checkpoint(sim_t sim, sim_checkpoint_t cp)
+{
+    sim_rec keep = *sim;
+
+    *sim = cp->sim;
+    /* Simulator keeps its own memory and registers, and whatever is
+       watching it */
+    sim->dumpfile = keep.dumpfile;
+    sim->mem0 = keep.mem0;
+    sim->reg0 = keep.reg0;
+    sim->prof = keep.prof;
+
+    free_mem(keep.mem);
+    sim->mem = copy_mem(cp->sim.mem);
+    sim->reg = keep.reg;
+    memcpy(sim->reg->regs, cp->sim.reg->regs, sizeof(sim->reg->regs));
+}
+
+void sim_free_checkpoint(sim_checkpoint_t cp)
+{
+    free_mem(cp->sim.mem);
+    free_reg(cp->sim.reg);
+    free((void *) cp);
 }
 
 /* Update the processor state */
-static void update_state()
+static void update_state(sim_t sim)
 {
-	pc = pc_in;
-    cc = cc_in;
+	sim->pc = sim->pc_in;
+    sim->cc = sim->cc_in;
     /* Writeback */
-    if (destE != REG_NONE)
-	set_reg_val(reg, destE, vale);
-    if (destM != REG_NONE)
-	set_reg_val(reg, destM, valm);
+    if (sim->destE != REG_NONE)
+	set_reg_val(sim->reg, sim->destE, sim->vale);
+    if (sim->destM != REG_NONE)
+	set_reg_val(sim->reg, sim->destM, sim->valm);
 
-    if (mem_write) {
+    if (sim->mem_write) {
       /* Should have already tested this address */
-        set_word_val(mem, mem_addr, mem_data);
-	    sim_log("Wrote 0x%llx to address 0x%llx\n", mem_data, mem_addr);
+        set_word_val(sim->mem, sim->mem_addr, sim->mem_data);
+	    SIM_LOG(sim, "Wrote 0x%llx to address 0x%llx\n", sim->mem_data, sim->mem_addr);
     }
 }
 
@@ -385,12 +481,12 @@ static void update_state()
  * and then return the correct status.
  *****************************************************************/
 
-static byte_t sim_step()
+static byte_t sim_step(sim_t sim)
 {
-    status = STAT_AOK;
-    imem_error = dmem_error = FALSE;
+    sim->status = STAT_AOK;
+    sim->imem_error = sim->dmem_error = FALSE;
 
-    update_state(); /* Update state from last cycle */
+    update_state(sim); /* Update state from last cycle */
 
     /*********************** Fetch stage ************************
      * TODO: update [icode, ifun, instr, ra, rb, valc, valp, status]
@@ -399,111 +495,37 @@ static byte_t sim_step()
      ************************************************************/
 
     /* dummy placeholders, replace them with your implementation */
-		byte_t tempB;
-		dmem_error |= !get_byte_val(mem, pc, &instr);
-		icode = HI4(instr);
-    ifun = LO4(instr);
-		ra = REG_NONE;
-		rb = REG_NONE;
-		valc = 0;
-
-		switch (instr) {
-			case HPACK(I_NOP, F_NONE):
-				valp = pc + 1;
-				break;
-			case HPACK(I_HALT, F_NONE):
-				valp = pc + 1;
-				break;
-
-			case HPACK(I_RRMOVQ, F_NONE): 
-			case HPACK(I_RRMOVQ, C_LE): 
-			case HPACK(I_RRMOVQ, C_L): 
-			case HPACK(I_RRMOVQ, C_E): 
-			case HPACK(I_RRMOVQ, C_NE): 
-			case HPACK(I_RRMOVQ, C_GE): 
-			case HPACK(I_RRMOVQ, C_G): 
-				dmem_error |= !get_byte_val(mem, pc + 1, &tempB);
-				ra = HI4(tempB);
-				rb = LO4(tempB);
-				valp = pc + 2;
-				break;
-
-			case HPACK(I_IRMOVQ, F_NONE):
-				dmem_error |= !get_byte_val(mem, pc + 1, &tempB);
-				rb = LO4(tempB);
-				dmem_error |= !get_word_val(mem, pc + 2, &valc);
-				valp = pc + 10;
-				break;
-
-			case HPACK(I_RMMOVQ, F_NONE): 
-				dmem_error |= !get_byte_val(mem, pc + 1, &tempB);
-				ra = HI4(tempB);
-				rb = LO4(tempB);
-				dmem_error |= !get_word_val(mem, pc + 2, &valc);
-				valp = pc + 10;
-				break;
-
-			case HPACK(I_MRMOVQ, F_NONE): 
-				dmem_error |= !get_byte_val(mem, pc + 1, &tempB);
-				ra = HI4(tempB);
-				rb = LO4(tempB);
-				dmem_error |= !get_word_val(mem, pc + 2, &valc);
-				valp = pc + 10;
-				break;
-
-			case HPACK(I_ALU, A_ADD): 
-			case HPACK(I_ALU, A_SUB): 
-			case HPACK(I_ALU, A_AND): 
-			case HPACK(I_ALU, A_XOR): 
-				dmem_error |= !get_byte_val(mem, pc + 1, &tempB);
-				ra = HI4(tempB);
-				rb = LO4(tempB);
-				valp = pc + 2;
-				break;
-
-			case HPACK(I_JMP, C_YES): 
-			case HPACK(I_JMP, C_LE): 
-			case HPACK(I_JMP, C_L): 
-			case HPACK(I_JMP, C_E): 
-			case HPACK(I_JMP, C_NE): 
-			case HPACK(I_JMP, C_GE): 
-			case HPACK(I_JMP, C_G): 
-				dmem_error |= !get_word_val(mem, pc + 1, &valc);
-				valp = pc + 9;
-				break;
-
-			case HPACK(I_CALL, F_NONE):
-				dmem_error |= !get_word_val(mem, pc + 1, &valc);
-				valp = pc + 9;
-				break;
-
-			case HPACK(I_RET, F_NONE):
-				valp = pc + 1;
-				break;
-
-			case HPACK(I_PUSHQ, F_NONE): 
-				dmem_error |= !get_byte_val(mem, pc + 1, &tempB);
-				ra = HI4(tempB);
-				rb = LO4(tempB);
-				valp = pc + 2;
-				break;
-
-			case HPACK(I_POPQ, F_NONE):
-				dmem_error |= !get_byte_val(mem, pc + 1, &tempB);
-				ra = HI4(tempB);
-				rb = LO4(tempB);
-				valp = pc + 2;
-				break;
-				
-			default:
-				imem_error = TRUE;
-				printf("Invalid instruction\n");
-				break;
-		}
+    {
+	const opcode_rec *op;
+	byte_t regids = HPACK(REG_NONE, REG_NONE);
+	sim->dmem_error |= !get_byte_val(sim->mem, sim->pc, &sim->instr);
+	op = &opcode_table[sim->instr];
+	sim->icode = op->icode;
+	sim->ifun = op->ifun;
+	sim->valc = 0;
+	sim->valp = sim->pc + 1;
+	/* SEQ does not implement iaddq, and rejects undefined
+	   function codes */
+	if (!op->ifun_valid || op->icode == I_IADDQ) {
+	    sim->imem_error = TRUE;
+	    printf("Invalid instruction\n");
+	} else {
+	    if (op->regids) {
+		sim->dmem_error |= !get_byte_val(sim->mem, sim->valp, &regids);
+		sim->valp++;
+	    }
+	    if (op->valc) {
+		sim->dmem_error |= !get_word_val(sim->mem, sim->valp, &sim->valc);
+		sim->valp += 8;
+	    }
+	}
+	sim->ra = HI4(regids);
+	sim->rb = LO4(regids);
+    }
 
     /* logging function, do not change this */
-    sim_log("IF: Fetched %s at 0x%llx.  ra=%s, rb=%s, valC = 0x%llx\n",
-	    iname(HPACK(icode,ifun)), pc, reg_name(ra), reg_name(rb), valc);
+    SIM_LOG(sim, "IF: Fetched %s at 0x%llx.  ra=%s, rb=%s, valC = 0x%llx\n",
+	    iname(HPACK(sim->icode,sim->ifun)), sim->pc, reg_name(sim->ra), reg_name(sim->rb), sim->valc);
     
     /*********************** Decode stage ************************
      * TODO: update [srcA, srcB, destE, destM, vala, valb]
@@ -512,75 +534,27 @@ static byte_t sim_step()
      *************************************************************/
 
     /* dummy placeholders, replace them with your implementation */
-    srcA = REG_NONE;
-    srcB = REG_NONE;
-    destE = REG_NONE;
-    destM = REG_NONE;
-    vala = 0;
-    valb = 0;
-		switch (icode) {
-			case I_HALT: break;
-
-			case I_NOP: break;
-		
-			case I_RRMOVQ: // aka CMOVQ
-				srcA = ra;
-				destE = rb;
-				break;
-
-			case I_IRMOVQ:
-				destE = rb;
-				break;
-				
-			case I_RMMOVQ:
-				srcA = ra;
-				srcB = rb;
-				break;
-				
-			case I_MRMOVQ:
-				srcB = rb;
-				destM = ra;
-				break;
-
-			case I_ALU:
-				srcA = ra;
-				srcB = rb;
-				destE = rb;
-				break;
-
-			case I_JMP: break;
-
-			case I_CALL:
-				srcB = REG_RSP;
-				destE = REG_RSP;
-				break;
-				
-			case I_RET:
-				srcA = REG_RSP;
-				srcB = REG_RSP;
-				destE = REG_RSP;
-				break;
-
-			case I_PUSHQ:
-				srcA = ra;
-				srcB = REG_RSP;
-				destE = REG_RSP;
-				break;
-				
-			case I_POPQ:
-				srcA = REG_RSP;
-				srcB = REG_RSP;
-				destE = REG_RSP;
-				destM = ra;
-				break;
-
-			default:
-				printf("icode is not valid (%d)", icode);
-				break;
-		}
+    sim->srcA = REG_NONE;
+    sim->srcB = REG_NONE;
+    sim->destE = REG_NONE;
+    sim->destM = REG_NONE;
+    sim->vala = 0;
+    sim->valb = 0;
+    {
+	const opcode_rec *op = &opcode_table[sim->instr];
+	/* Same instructions as fetch accepts */
+	if (op->ifun_valid && op->icode != I_IADDQ) {
+	    sim->srcA = OP_REG(op->srca, sim->ra, sim->rb);
+	    sim->srcB = OP_REG(op->srcb, sim->ra, sim->rb);
+	    sim->destE = OP_REG(op->deste, sim->ra, sim->rb);
+	    sim->destM = OP_REG(op->destm, sim->ra, sim->rb);
+	} else {
+	    printf("icode is not valid (%d)", sim->icode);
+	}
+    }
 
-		vala = get_reg_val(reg, srcA);
-		valb = get_reg_val(reg, srcB);
+		sim->vala = get_reg_val(sim->reg, sim->srcA);
+		sim->valb = get_reg_val(sim->reg, sim->srcB);
 
     /*********************** Execute stage **********************
      * TODO: update [vale, cc_in]
@@ -589,58 +563,58 @@ static byte_t sim_step()
      ************************************************************/
 
     /* dummy placeholders, replace them with your implementation */
-    vale = 0;
-    cc_in = cc;
+    sim->vale = 0;
+    sim->cc_in = sim->cc;
 		bool_t cnd = FALSE;
 
-		switch (icode) {
+		switch (sim->icode) {
 			case I_HALT: break;
 
 			case I_NOP: break;
 		
 			case I_RRMOVQ: // aka CMOVQ
-				vale = vala;
+				sim->vale = sim->vala;
 				break;
 
 			case I_IRMOVQ:
-				vale = valc;
+				sim->vale = sim->valc;
 				break;
 				
 			case I_RMMOVQ:
-				vale = valb + valc;
+				sim->vale = sim->valb + sim->valc;
 				break;
 				
 			case I_MRMOVQ:
-				vale = valb + vala;
+				sim->vale = sim->valb + sim->vala;
 				break;
 
 			case I_ALU:
-				vale = compute_alu(ifun, vala, valb);
-				cc_in = compute_cc(ifun, vala, valb);
+				sim->vale = compute_alu(sim->ifun, sim->vala, sim->valb);
+				lazy_cc_set(&sim->cc_in, sim->ifun, sim->vala, sim->valb);
 				break;
 
 			case I_JMP:
-				cnd = cond_holds(cc, ifun);
+				cnd = lazy_cond_holds(&sim->cc, sim->ifun);
 				break;
 
 			case I_CALL:
-				vale = valb - 8;
+				sim->vale = sim->valb - 8;
 				break;
 				
 			case I_RET:
-				vale = valb + 8;
+				sim->vale = sim->valb + 8;
 				break;
 
 			case I_PUSHQ:
-				vale = valb - 8;
+				sim->vale = sim->valb - 8;
 				break;
 				
 			case I_POPQ:
-				vale = valb + 8;
+				sim->vale = sim->valb + 8;
 				break;
 
 			default:
-				printf("icode is not valid (%d)", icode);
+				printf("icode is not valid (%d)", sim->icode);
 				break;
 		}
 
@@ -651,15 +625,15 @@ static byte_t sim_step()
      ************************************************************/
 
     /* dummy placeholders, replace them with your implementation */
-    valm = 0;
-    mem_write = FALSE;
-    mem_addr = 0;
-    mem_data = 0;
-    status = STAT_AOK;
+    sim->valm = 0;
+    sim->mem_write = FALSE;
+    sim->mem_addr = 0;
+    sim->mem_data = 0;
+    sim->status = STAT_AOK;
 
-		switch (icode) {
+		switch (sim->icode) {
 			case I_HALT:
-				status = STAT_HLT;
+				sim->status = STAT_HLT;
 				break;
 
 			case I_NOP: break;
@@ -669,13 +643,13 @@ static byte_t sim_step()
 			case I_IRMOVQ: break;
 				
 			case I_RMMOVQ:
-				mem_write = TRUE;
-				mem_addr = vale;
-				mem_data = vala;
+				sim->mem_write = TRUE;
+				sim->mem_addr = sim->vale;
+				sim->mem_data = sim->vala;
 				break;
 				
 			case I_MRMOVQ:
-				dmem_error |= !get_word_val(mem, vale, &valm);
+				sim->dmem_error |= !get_word_val(sim->mem, sim->vale, &sim->valm);
 				break;
 
 			case I_ALU: break;
@@ -683,100 +657,100 @@ static byte_t sim_step()
 			case I_JMP: break;
 
 			case I_CALL:
-				mem_write = TRUE;
-				mem_addr = vale;
-				mem_data = valp;
+				sim->mem_write = TRUE;
+				sim->mem_addr = sim->vale;
+				sim->mem_data = sim->valp;
 				break;
 				
 			case I_RET:
-				dmem_error |= !get_word_val(mem, vala, &valm);
+				sim->dmem_error |= !get_word_val(sim->mem, sim->vala, &sim->valm);
 				break;
 
 			case I_PUSHQ:
-				mem_write = TRUE;
-				mem_addr = vale;
-				mem_data = vala;
+				sim->mem_write = TRUE;
+				sim->mem_addr = sim->vale;
+				sim->mem_data = sim->vala;
 				break;
 				
 			case I_POPQ:
-				dmem_error |= !get_word_val(mem, vala, &valm);
+				sim->dmem_error |= !get_word_val(sim->mem, sim->vala, &sim->valm);
 				break;
 
 			default:
-				printf("icode is not valid (%d)", icode);
+				printf("icode is not valid (%d)", sim->icode);
 				break;
 		}
 		
-		if (mem_write)
-			dmem_error |= !set_word_val(mem, mem_addr, mem_data);
+		if (sim->mem_write)
+			sim->dmem_error |= !set_word_val(sim->mem, sim->mem_addr, sim->mem_data);
 
     /****************** Program Counter Update ******************
      * TODO: update [pc_in]
      ************************************************************/
 
 	   /* dummy placeholders, replace them with your implementation */
-    pc_in = 0; /* should not overwrite original pc */
+    sim->pc_in = 0; /* should not overwrite original pc */
 	
-		switch (icode) {
+		switch (sim->icode) {
 			case I_HALT:
-				pc_in = valp;
+				sim->pc_in = sim->valp;
 				break;
 
 			case I_NOP:
-				pc_in = valp;
+				sim->pc_in = sim->valp;
 				break;
 		
 			case I_RRMOVQ: // aka CMOVQ
-				pc_in = valp;
+				sim->pc_in = sim->valp;
 				break;
 
 			case I_IRMOVQ:
-				pc_in = valp;
+				sim->pc_in = sim->valp;
 				break;
 				
 			case I_RMMOVQ:
-				pc_in = valp;
+				sim->pc_in = sim->valp;
 				break;
 				
 			case I_MRMOVQ:
-				pc_in = valp;
+				sim->pc_in = sim->valp;
 				break;
 
 			case I_ALU:
-				pc_in = valp;
+				sim->pc_in = sim->valp;
 				break;
 
 			case I_JMP:
-				pc_in = cnd ? valc : valp;
+				sim->pc_in = cnd ? sim->valc : sim->valp;
 				break;
 
 			case I_CALL:
-				pc_in = valc;
+				sim->pc_in = sim->valc;
 				break;
 				
 			case I_RET:
-				pc_in = valm;
+				sim->pc_in = sim->valm;
 				break;
 
 			case I_PUSHQ:
-				pc_in = valp;
+				sim->pc_in = sim->valp;
 				break;
 				
 			case I_POPQ:
-				pc_in = valp;
+				sim->pc_in = sim->valp;
 				break;
 
 			default:
-				printf("icode is not valid (%d)", icode);
+				printf("icode is not valid (%d)", sim->icode);
 				break;
 
 		}
 
-    return imem_error 
+    return sim->imem_error 
 			? STAT_INS
-			: dmem_error 
+			: sim->dmem_error 
 			? STAT_ADR 
-			: status;
+			: sim->status;
 }
 
 /*
@@ -788,25 +762,28 @@ static byte_t sim_step()
   if statusp nonnull, then will be set to status of final instruction
   if ccp nonnull, then will be set to condition codes of final instruction
 */
-word_t sim_run(word_t max_instr, byte_t *statusp, cc_t *ccp)
+word_t sim_run(sim_t sim, word_t max_instr, byte_t *statusp, cc_t *ccp)
 {
     word_t icount = 0;
     byte_t run_status = STAT_AOK;
     while (icount < max_instr) {
         if (verbosity == 3) {
-            sim_log("-------- Step %d --------\n", icount + 1);
+            sim_log(sim, "-------- Step %d --------\n", icount + 1);
         }
-        run_status = sim_step();
+        run_status = sim_step(sim);
         icount++;
+        /* Each instruction takes one cycle */
+        if (sim->prof)
+            prof_retire(sim->prof, sim->pc, sim->instr, icount);
 
         /* print step-wise diff if verbosity = 3 */
         if (verbosity == 3) {
-            sim_log("Status '%s', CC %s\n", stat_name(status), cc_name(cc_in));
-            sim_log("Changes to registers:\n");
-            diff_reg(reg0, reg, stdout);
+            sim_log(sim, "Status '%s', CC %s\n", stat_name(sim->status), cc_name(lazy_cc_get(&sim->cc_in)));
+            sim_log(sim, "Changes to registers:\n");
+            diff_reg(sim->reg0, sim->reg, stdout);
 
             printf("\nChanges to memory:\n");
-            diff_mem(mem0, mem, stdout);
+            diff_mem(sim->mem0, sim->mem, stdout);
             printf("\n");
         }
 
@@ -816,25 +793,25 @@ word_t sim_run(word_t max_instr, byte_t *statusp, cc_t *ccp)
     if (statusp)
 	*statusp = run_status;
     if (ccp)
-	*ccp = cc;
+	*ccp = lazy_cc_get(&sim->cc);
     return icount;
 }
 
 /* If dumpfile set nonNULL, lots of status info printed out */
-void sim_set_dumpfile(FILE *df)
+void sim_set_dumpfile(sim_t sim, FILE *df)
 {
-    dumpfile = df;
+    sim->dumpfile = df;
 }
 
 /*
  * sim_log dumps a formatted string to the dumpfile, if it exists
  * accepts variable argument list
  */
-void sim_log( const char *format, ... ) {
-    if (dumpfile) {
+void sim_log(sim_t sim, const char *format, ... ) {
+    if (sim->dumpfile) {
 	va_list arg;
 	va_start( arg, format );
-	vfprintf( dumpfile, format, arg );
+	vfprintf( sim->dumpfile, format, arg );
 	va_end( arg );
     }
 }
\ No newline at end of file